@@ -36,9 +36,19 @@ namespace Helper {
 	template<> struct Index<true, true> {
 		using Type = uint8_t;
 	};
+
+	template<size_t S> struct IsPowerOfTwo {
+		static constexpr bool value = S != 0 && (S & (S - 1)) == 0;
+	};
 }
 
-template<typename T, size_t S, typename IT = typename Helper::Index<(S <= UINT8_MAX), (S <= UINT16_MAX)>::Type> class CircularBuffer {
+/**
+ * Pass `true` as `P2` (for a capacity that's a power of two) to get the specialization below, which indexes with
+ * a mask instead.
+ */
+template<typename T, size_t S,
+		typename IT = typename Helper::Index<(S <= UINT8_MAX), (S <= UINT16_MAX)>::Type,
+		bool P2 = false> class CircularBuffer {
 public:
 	/**
 	 * The buffer capacity: read only as it cannot ever change.
@@ -86,6 +96,17 @@ public:
 	 */
 	T pop();
 
+	/**
+	 * Adds `n` elements to the end of the buffer, in order: returns `false` if the additions caused overwriting
+	 * existing elements (or each other, if `n` is greater than the capacity).
+	 */
+	bool pushN(const T* values, IT n);
+
+	/**
+	 * Removes up to `n` elements from the beginning of the buffer, into `values`. Returns how many.
+	 */
+	IT shiftN(T* values, IT n);
+
 	/**
 	 * Returns the element at the beginning of the buffer.
 	 */
@@ -128,6 +149,42 @@ public:
 	 */
 	void inline clear();
 
+	/**
+	 * A contiguous run of elements in the buffer's storage, returned by `read()`.
+	 */
+	struct Span {
+		const T* data;
+		IT size;
+	};
+
+	/**
+	 * A consumer's uncommitted read position: how many of the oldest elements it has `read()` but not yet
+	 * removed. It's plain data (a count, not a pointer), so it can be kept in retained memory next to a
+	 * retained buffer. Zero-initialize it (or `rollback()` it) before first use.
+	 */
+	struct Cursor {
+		IT pending;
+	};
+
+	/**
+	 * Views the next (up to) `n` elements after the cursor's pending ones, in place, as one or two contiguous
+	 * spans (`second` is empty unless they wrap around the end of the storage), and adds them to the cursor's
+	 * pending elements. Returns the number of elements (less than `n` if there aren't that many).
+	 * The spans stay valid until elements are removed, or pushed into a full buffer.
+	 */
+	IT read(Cursor& cursor, IT n, Span& first, Span& second) const;
+
+	/**
+	 * Removes the cursor's pending elements (as if by `shift()`ing each of them), and empties the cursor.
+	 * *WARNING* If `push()` has since overwritten any of them, more than those are removed.
+	 */
+	void commit(Cursor& cursor);
+
+	/**
+	 * Empties the cursor without removing its pending elements, so the next `read()` starts over at _head_.
+	 */
+	void inline rollback(Cursor& cursor) const;
+
 	#ifdef CIRCULAR_BUFFER_DEBUG
 	void inline debug(Print* out);
 	void inline debugFn(Print* out, void (*printFunction)(Print*, T));
@@ -144,5 +201,70 @@ private:
 #endif
 };
 
+/**
+ * Specialization for capacities that are a power of two, selected with `P2`: locates elements with indexes and a
+ * mask, rather than pointers (and modulo for indexed access), and copies runs of elements in bulk. It has the
+ * general buffer's interface and behaviour (down to what the unpredictable operations on an empty buffer return),
+ * and is smaller. Holding no pointers, it survives being relocated (e.g., in retained memory across firmware
+ * updates).
+ */
+template<typename T, size_t S, typename IT> class CircularBuffer<T, S, IT, true> {
+	static_assert(Helper::IsPowerOfTwo<S>::value, "P2 needs a capacity that is a power of two");
+
+public:
+	static constexpr IT capacity = static_cast<IT>(S);
+	using index_t = IT;
+
+	constexpr CircularBuffer();
+
+	CircularBuffer(const CircularBuffer&) = delete;
+	CircularBuffer(CircularBuffer&&) = delete;
+	CircularBuffer& operator=(const CircularBuffer&) = delete;
+	CircularBuffer& operator=(CircularBuffer&&) = delete;
+
+	bool unshift(T value);
+	bool push(T value);
+	T shift();
+	T pop();
+	bool pushN(const T* values, IT n);
+	IT shiftN(T* values, IT n);
+	T inline first() const;
+	T inline last() const;
+	T operator [] (IT index) const;
+	IT inline size() const;
+	IT inline available() const;
+	bool inline isEmpty() const;
+	bool inline isFull() const;
+	void inline clear();
+
+	struct Span {
+		const T* data;
+		IT size;
+	};
+	struct Cursor {
+		IT pending;
+	};
+	IT read(Cursor& cursor, IT n, Span& first, Span& second) const;
+	void commit(Cursor& cursor);
+	void inline rollback(Cursor& cursor) const;
+
+	#ifdef CIRCULAR_BUFFER_DEBUG
+	void inline debug(Print* out);
+	void inline debugFn(Print* out, void (*printFunction)(Print*, T));
+	#endif
+
+private:
+	static constexpr size_t MASK = S - 1;
+
+	T buffer[S];
+	IT head; // (indexes into buffer, where the general template has pointers)
+	IT tail;
+#ifndef CIRCULAR_BUFFER_INT_SAFE
+	IT count;
+#else
+	volatile IT count;
+#endif
+};
+
 #include <CircularBuffer.tpp>
 #endif
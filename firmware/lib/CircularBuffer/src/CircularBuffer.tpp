@@ -16,13 +16,13 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-template<typename T, size_t S, typename IT>
-constexpr CircularBuffer<T,S,IT>::CircularBuffer() :
+template<typename T, size_t S, typename IT, bool P2>
+constexpr CircularBuffer<T,S,IT,P2>::CircularBuffer() :
 		head(buffer), tail(buffer), count(0) {
 }
 
-template<typename T, size_t S, typename IT>
-bool CircularBuffer<T,S,IT>::unshift(T value) {
+template<typename T, size_t S, typename IT, bool P2>
+bool CircularBuffer<T,S,IT,P2>::unshift(T value) {
 	if (head == buffer) {
 		head = buffer + capacity;
 	}
@@ -40,8 +40,8 @@ bool CircularBuffer<T,S,IT>::unshift(T value) {
 	}
 }
 
-template<typename T, size_t S, typename IT>
-bool CircularBuffer<T,S,IT>::push(T value) {
+template<typename T, size_t S, typename IT, bool P2>
+bool CircularBuffer<T,S,IT,P2>::push(T value) {
 	if (++tail == buffer + capacity) {
 		tail = buffer;
 	}
@@ -59,8 +59,8 @@ bool CircularBuffer<T,S,IT>::push(T value) {
 	}
 }
 
-template<typename T, size_t S, typename IT>
-T CircularBuffer<T,S,IT>::shift() {
+template<typename T, size_t S, typename IT, bool P2>
+T CircularBuffer<T,S,IT,P2>::shift() {
 	if (count == 0) return *head;
 	T result = *head++;
 	if (head >= buffer + capacity) {
@@ -70,8 +70,8 @@ T CircularBuffer<T,S,IT>::shift() {
 	return result;
 }
 
-template<typename T, size_t S, typename IT>
-T CircularBuffer<T,S,IT>::pop() {
+template<typename T, size_t S, typename IT, bool P2>
+T CircularBuffer<T,S,IT,P2>::pop() {
 	if (count == 0) return *tail;
 	T result = *tail--;
 	if (tail < buffer) {
@@ -81,52 +81,284 @@ T CircularBuffer<T,S,IT>::pop() {
 	return result;
 }
 
-template<typename T, size_t S, typename IT>
-T inline CircularBuffer<T,S,IT>::first() const {
+template<typename T, size_t S, typename IT, bool P2>
+bool CircularBuffer<T,S,IT,P2>::pushN(const T* values, IT n) {
+	bool kept = true;
+	for (IT i = 0; i < n; i++) {
+		kept = push(values[i]) && kept;
+	}
+	return kept;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+IT CircularBuffer<T,S,IT,P2>::shiftN(T* values, IT n) {
+	if (n > count) {
+		n = count;
+	}
+	for (IT i = 0; i < n; i++) {
+		values[i] = shift();
+	}
+	return n;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+T inline CircularBuffer<T,S,IT,P2>::first() const {
 	return *head;
 }
 
-template<typename T, size_t S, typename IT>
-T inline CircularBuffer<T,S,IT>::last() const {
+template<typename T, size_t S, typename IT, bool P2>
+T inline CircularBuffer<T,S,IT,P2>::last() const {
 	return *tail;
 }
 
-template<typename T, size_t S, typename IT>
-T CircularBuffer<T,S,IT>::operator [](IT index) const {
+template<typename T, size_t S, typename IT, bool P2>
+T CircularBuffer<T,S,IT,P2>::operator [](IT index) const {
 	if (index >= count) return *tail;
 	return *(buffer + ((head - buffer + index) % capacity));
 }
 
+template<typename T, size_t S, typename IT, bool P2>
+IT inline CircularBuffer<T,S,IT,P2>::size() const {
+	return count;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+IT inline CircularBuffer<T,S,IT,P2>::available() const {
+	return capacity - count;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+bool inline CircularBuffer<T,S,IT,P2>::isEmpty() const {
+	return count == 0;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+bool inline CircularBuffer<T,S,IT,P2>::isFull() const {
+	return count == capacity;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+void inline CircularBuffer<T,S,IT,P2>::clear() {
+	head = tail = buffer;
+	count = 0;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+IT CircularBuffer<T,S,IT,P2>::read(Cursor& cursor, IT n, Span& first, Span& second) const {
+	IT skip = cursor.pending < count ? cursor.pending : count;
+	if (n > count - skip) {
+		n = count - skip;
+	}
+	IT start = static_cast<IT>((head - buffer + skip) % capacity);
+	IT untilWrap = capacity - start;
+	first.data = buffer + start;
+	first.size = n < untilWrap ? n : untilWrap;
+	second.data = buffer;
+	second.size = n - first.size;
+	cursor.pending = skip + n;
+	return n;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+void CircularBuffer<T,S,IT,P2>::commit(Cursor& cursor) {
+	IT n = cursor.pending < count ? cursor.pending : count;
+	head = buffer + ((head - buffer + n) % capacity);
+	count -= n;
+	if (count == 0) {
+		head = tail = buffer;
+	}
+	cursor.pending = 0;
+}
+
+template<typename T, size_t S, typename IT, bool P2>
+void inline CircularBuffer<T,S,IT,P2>::rollback(Cursor& cursor) const {
+	cursor.pending = 0;
+}
+
+template<typename T, size_t S, typename IT>
+constexpr CircularBuffer<T,S,IT,true>::CircularBuffer() :
+		buffer(), head(0), tail(0), count(0) {
+}
+
 template<typename T, size_t S, typename IT>
-IT inline CircularBuffer<T,S,IT>::size() const {
+bool CircularBuffer<T,S,IT,true>::unshift(T value) {
+	head = static_cast<IT>((head - 1) & MASK);
+	buffer[head] = value;
+	if (count == capacity) {
+		tail = static_cast<IT>((tail - 1) & MASK);
+		return false;
+	} else {
+		if (count++ == 0) {
+			tail = head;
+		}
+		return true;
+	}
+}
+
+template<typename T, size_t S, typename IT>
+bool CircularBuffer<T,S,IT,true>::push(T value) {
+	tail = static_cast<IT>((tail + 1) & MASK);
+	buffer[tail] = value;
+	if (count == capacity) {
+		head = static_cast<IT>((head + 1) & MASK);
+		return false;
+	} else {
+		if (count++ == 0) {
+			head = tail;
+		}
+		return true;
+	}
+}
+
+template<typename T, size_t S, typename IT>
+T CircularBuffer<T,S,IT,true>::shift() {
+	if (count == 0) return buffer[head];
+	T result = buffer[head];
+	head = static_cast<IT>((head + 1) & MASK);
+	count--;
+	return result;
+}
+
+template<typename T, size_t S, typename IT>
+T CircularBuffer<T,S,IT,true>::pop() {
+	if (count == 0) return buffer[tail];
+	T result = buffer[tail];
+	tail = static_cast<IT>((tail - 1) & MASK);
+	count--;
+	return result;
+}
+
+template<typename T, size_t S, typename IT>
+bool CircularBuffer<T,S,IT,true>::pushN(const T* values, IT n) {
+	if (n == 0) {
+		return true;
+	}
+	// (where push() would put each of them)
+	IT start = static_cast<IT>((tail + 1) & MASK);
+	bool kept = n <= capacity - count;
+	if (kept && count == 0) {
+		head = start;
+	}
+	tail = static_cast<IT>((tail + n) & MASK);
+	if (n > capacity) {
+		// (only the last ones would survive)
+		start = static_cast<IT>((start + n - capacity) & MASK);
+		values += n - capacity;
+		n = capacity;
+	}
+	IT untilWrap = static_cast<IT>(capacity - start);
+	IT firstRun = n < untilWrap ? n : untilWrap;
+	for (IT i = 0; i < firstRun; i++) {
+		buffer[start + i] = values[i];
+	}
+	for (IT i = firstRun; i < n; i++) {
+		buffer[i - firstRun] = values[i];
+	}
+	if (kept) {
+		count += n;
+	} else {
+		head = static_cast<IT>((tail + 1) & MASK);
+		count = capacity;
+	}
+	return kept;
+}
+
+template<typename T, size_t S, typename IT>
+IT CircularBuffer<T,S,IT,true>::shiftN(T* values, IT n) {
+	if (n > count) {
+		n = count;
+	}
+	IT untilWrap = static_cast<IT>(capacity - head);
+	IT firstRun = n < untilWrap ? n : untilWrap;
+	for (IT i = 0; i < firstRun; i++) {
+		values[i] = buffer[head + i];
+	}
+	for (IT i = firstRun; i < n; i++) {
+		values[i] = buffer[i - firstRun];
+	}
+	head = static_cast<IT>((head + n) & MASK);
+	count -= n;
+	return n;
+}
+
+template<typename T, size_t S, typename IT>
+T inline CircularBuffer<T,S,IT,true>::first() const {
+	return buffer[head];
+}
+
+template<typename T, size_t S, typename IT>
+T inline CircularBuffer<T,S,IT,true>::last() const {
+	return buffer[tail];
+}
+
+template<typename T, size_t S, typename IT>
+T CircularBuffer<T,S,IT,true>::operator [](IT index) const {
+	if (index >= count) return buffer[tail];
+	return buffer[(head + index) & MASK];
+}
+
+template<typename T, size_t S, typename IT>
+IT inline CircularBuffer<T,S,IT,true>::size() const {
 	return count;
 }
 
 template<typename T, size_t S, typename IT>
-IT inline CircularBuffer<T,S,IT>::available() const {
+IT inline CircularBuffer<T,S,IT,true>::available() const {
 	return capacity - count;
 }
 
 template<typename T, size_t S, typename IT>
-bool inline CircularBuffer<T,S,IT>::isEmpty() const {
+bool inline CircularBuffer<T,S,IT,true>::isEmpty() const {
 	return count == 0;
 }
 
 template<typename T, size_t S, typename IT>
-bool inline CircularBuffer<T,S,IT>::isFull() const {
+bool inline CircularBuffer<T,S,IT,true>::isFull() const {
 	return count == capacity;
 }
 
 template<typename T, size_t S, typename IT>
-void inline CircularBuffer<T,S,IT>::clear() {
-	head = tail = buffer;
+void inline CircularBuffer<T,S,IT,true>::clear() {
+	head = tail = 0;
 	count = 0;
 }
 
+template<typename T, size_t S, typename IT>
+IT CircularBuffer<T,S,IT,true>::read(Cursor& cursor, IT n, Span& first, Span& second) const {
+	IT skip = cursor.pending < count ? cursor.pending : count;
+	if (n > count - skip) {
+		n = count - skip;
+	}
+	IT start = static_cast<IT>((head + skip) & MASK);
+	IT untilWrap = static_cast<IT>(capacity - start);
+	first.data = buffer + start;
+	first.size = n < untilWrap ? n : untilWrap;
+	second.data = buffer;
+	second.size = n - first.size;
+	cursor.pending = skip + n;
+	return n;
+}
+
+template<typename T, size_t S, typename IT>
+void CircularBuffer<T,S,IT,true>::commit(Cursor& cursor) {
+	IT n = cursor.pending < count ? cursor.pending : count;
+	head = static_cast<IT>((head + n) & MASK);
+	count -= n;
+	if (count == 0) {
+		head = tail = 0;
+	}
+	cursor.pending = 0;
+}
+
+template<typename T, size_t S, typename IT>
+void inline CircularBuffer<T,S,IT,true>::rollback(Cursor& cursor) const {
+	cursor.pending = 0;
+}
+
 #ifdef CIRCULAR_BUFFER_DEBUG
 #include <string.h>
-template<typename T, size_t S, typename IT>
-void inline CircularBuffer<T,S,IT>::debug(Print* out) {
+template<typename T, size_t S, typename IT, bool P2>
+void inline CircularBuffer<T,S,IT,P2>::debug(Print* out) {
 	for (IT i = 0; i < capacity; i++) {
 		int hex = (int)buffer + i;
 		out->print("[");
@@ -143,8 +375,8 @@ void inline CircularBuffer<T,S,IT>::debug(Print* out) {
 	}
 }
 
-template<typename T, size_t S, typename IT>
-void inline CircularBuffer<T,S,IT>::debugFn(Print* out, void (*printFunction)(Print*, T)) {
+template<typename T, size_t S, typename IT, bool P2>
+void inline CircularBuffer<T,S,IT,P2>::debugFn(Print* out, void (*printFunction)(Print*, T)) {
 	for (IT i = 0; i < capacity; i++) {
 		int hex = (int)buffer + i;
 		out->print("[");
@@ -160,4 +392,27 @@ void inline CircularBuffer<T,S,IT>::debugFn(Print* out, void (*printFunction)(Pr
 		out->println();
 	}
 }
+
+template<typename T, size_t S, typename IT>
+void inline CircularBuffer<T,S,IT,true>::debug(Print* out) {
+	debugFn(out, [](Print* out, T value) { out->print(value); });
+}
+
+template<typename T, size_t S, typename IT>
+void inline CircularBuffer<T,S,IT,true>::debugFn(Print* out, void (*printFunction)(Print*, T)) {
+	for (IT i = 0; i < capacity; i++) {
+		int hex = (int)buffer + i;
+		out->print("[");
+		out->print(hex, HEX);
+		out->print("] ");
+		printFunction(out, buffer[i]);
+		if (head == i) {
+			out->print("<-head");
+		} 
+		if (tail == i) {
+			out->print("<-tail");
+		}
+		out->println();
+	}
+}
 #endif
@@ -29,6 +29,8 @@
 #include "PowerShield.h"
 
 PowerShield::PowerShield()
+	: cacheTime(0), reading({0, 0}), readingAt(0), readingValid(false),
+	  config{0, 0}, configAt(0), configValid(false)
 {
 
 }
@@ -39,27 +41,54 @@ bool PowerShield::begin()
 	return 1;
 }
 
-// Read and return the cell voltage
+// Read the cell voltage and state of charge together, in a single
+// (auto-incrementing) I2C transfer of VCELL and SOC. Reuses the last
+// reading if it's less than the cache time old.
+// Returns false (leaving reading unchanged) if the fuel gauge didn't respond.
+bool PowerShield::read(PowerShieldReading &result) {
+
+	if (!isFresh(readingValid, readingAt)) {
+		byte data[4];
+		if (!readRegisters(VCELL_REGISTER, data, sizeof(data))) {
+			readingValid = false;
+			return false;
+		}
+		int value = (data[0] << 4) | (data[1] >> 4);
+		reading.vCell = map(value, 0x000, 0xFFF, 0, 50000) / 10000.0;
+		reading.soC = data[2] + data[3] / 256.0;
+		readingAt = millis();
+		readingValid = true;
+	}
+	result = reading;
+	return true;
+}
+
+// Reuse readings (and the config register) for up to msec
+// (default 0: read the fuel gauge every time)
+void PowerShield::setCacheTime(system_tick_t msec) {
+
+	cacheTime = msec;
+}
+
+// Discard any cached readings
+void PowerShield::invalidate() {
+
+	readingValid = false;
+	configValid = false;
+}
+
+// Read and return the cell voltage (0 if it can't be read)
 float PowerShield::getVCell() {
 
-	byte MSB = 0;
-	byte LSB = 0;
-	
-	readRegister(VCELL_REGISTER, MSB, LSB);
-	int value = (MSB << 4) | (LSB >> 4);
-	return map(value, 0x000, 0xFFF, 0, 50000) / 10000.0;
-	//return value * 0.00125;
+	PowerShieldReading result;
+	return read(result) ? result.vCell : 0;
 }
 
-// Read and return the state of charge of the cell
+// Read and return the state of charge of the cell (0 if it can't be read)
 float PowerShield::getSoC() {
 	
-	byte MSB = 0;
-	byte LSB = 0;
-	
-	readRegister(SOC_REGISTER, MSB, LSB);
-	float decimal = LSB / 256.0;
-	return MSB + decimal;	
+	PowerShieldReading result;
+	return read(result) ? result.soC : 0;
 }
 
 // Return the version number of the chip
@@ -123,35 +152,76 @@ void PowerShield::clearAlert() {
 void PowerShield::reset() {
 	
 	writeRegister(COMMAND_REGISTER, 0x00, 0x54);
+	invalidate();
 }
 
 void PowerShield::quickStart() {
 	
 	writeRegister(MODE_REGISTER, 0x40, 0x00);
+	readingValid = false;
 }
 
 
-void PowerShield::readConfigRegister(byte &MSB, byte &LSB) {
+bool PowerShield::readConfigRegister(byte &MSB, byte &LSB) {
 
-	readRegister(CONFIG_REGISTER, MSB, LSB);
+	if (!isFresh(configValid, configAt)) {
+		configValid = readRegister(CONFIG_REGISTER, config[0], config[1]);
+		configAt = millis();
+	}
+	MSB = config[0];
+	LSB = config[1];
+	return configValid;
 }
 
-void PowerShield::readRegister(byte startAddress, byte &MSB, byte &LSB) {
+// Read length bytes of consecutive registers, starting at startAddress.
+// Returns false if the fuel gauge didn't acknowledge or sent too little.
+bool PowerShield::readRegisters(byte startAddress, byte *data, byte length) {
 
 	Wire.beginTransmission(MAX17043_ADDRESS);
 	Wire.write(startAddress);
-	Wire.endTransmission();
+	if (Wire.endTransmission() != 0) {
+		return false;
+	}
 	
-	Wire.requestFrom(MAX17043_ADDRESS, 2);
-	MSB = Wire.read();
-	LSB = Wire.read();
+	if (Wire.requestFrom(MAX17043_ADDRESS, length) < length) {
+		return false;
+	}
+	for (byte i = 0; i < length; i++) {
+		int value = Wire.read();
+		if (value < 0) {
+			return false;
+		}
+		data[i] = value;
+	}
+	return true;
+}
+
+bool PowerShield::readRegister(byte startAddress, byte &MSB, byte &LSB) {
+
+	byte data[2] = {0, 0};
+	bool ok = readRegisters(startAddress, data, sizeof(data));
+	MSB = data[0];
+	LSB = data[1];
+	return ok;
 }
 
-void PowerShield::writeRegister(byte address, byte MSB, byte LSB) {
+bool PowerShield::writeRegister(byte address, byte MSB, byte LSB) {
 
 	Wire.beginTransmission(MAX17043_ADDRESS);
 	Wire.write(address);
 	Wire.write(MSB);
 	Wire.write(LSB);
-	Wire.endTransmission();
+	bool ok = Wire.endTransmission() == 0;
+	if (address == CONFIG_REGISTER) {
+		config[0] = MSB;
+		config[1] = LSB;
+		configAt = millis();
+		configValid = ok;
+	}
+	return ok;
+}
+
+bool PowerShield::isFresh(bool valid, system_tick_t readAt) {
+
+	return valid && cacheTime > 0 && millis() - readAt < cacheTime;
 }
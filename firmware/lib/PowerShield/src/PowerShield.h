@@ -24,11 +24,20 @@
 #define COMMAND_REGISTER	0xFE
 
 
+// VCELL and SOC, read together
+struct PowerShieldReading {
+	float vCell;	// V
+	float soC;		// %
+};
+
 class PowerShield {
 
 	public:
 	    PowerShield();
 		bool begin();
+		bool read(PowerShieldReading &reading);
+		void setCacheTime(system_tick_t msec);
+		void invalidate();
 		float getVCell();
 		float getSoC();
 		int getVersion();
@@ -42,9 +51,19 @@ class PowerShield {
 	
 	private:
 
-		void readConfigRegister(byte &MSB, byte &LSB);
-		void readRegister(byte startAddress, byte &MSB, byte &LSB);
-		void writeRegister(byte address, byte MSB, byte LSB);
+		bool readConfigRegister(byte &MSB, byte &LSB);
+		bool readRegisters(byte startAddress, byte *data, byte length);
+		bool readRegister(byte startAddress, byte &MSB, byte &LSB);
+		bool writeRegister(byte address, byte MSB, byte LSB);
+		bool isFresh(bool valid, system_tick_t readAt);
+
+		system_tick_t cacheTime;
+		PowerShieldReading reading;
+		system_tick_t readingAt;
+		bool readingValid;
+		byte config[2];
+		system_tick_t configAt;
+		bool configValid;
 };
 
 #endif
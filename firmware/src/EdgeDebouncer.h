@@ -0,0 +1,88 @@
+// ------------
+// Switch debouncing from edge timestamps
+// ------------
+//
+// Debounces a pulse switch using only the times of its edges (e.g., from
+// an interrupt on CHANGE), with no timer: a new level counts once it has
+// lasted a minimum time, which is known when the next edge arrives (or
+// when poll() finds it has already lasted long enough). Contact bounce and
+// noise glitches shorter than the minimum widths are ignored.
+//
+// A pulse is the switch closing (input LOW, with a pullup): edge() or
+// poll() returns true when a LOW level is confirmed. The input must then
+// be confirmed HIGH again before another pulse can count, so bounce when
+// the switch opens can't double-count.
+//
+// Times are microseconds (e.g., micros()), and may wrap around; levels
+// lasting longer than about an hour must be confirmed by poll() before that.
+//
+// Not thread safe: from outside the ISR that calls edge(), use poll()
+// and isSettling() with interrupts disabled.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <Particle.h>
+
+class EdgeDebouncer {
+public:
+    EdgeDebouncer(uint32_t minLowUsec, uint32_t minHighUsec)
+        : minLowUsec_(minLowUsec), minHighUsec_(minHighUsec),
+          stable_(HIGH), pending_(HIGH), sinceUsec_(0), pulseStartUsec_(0) {}
+
+    // Start over, with the input settled at level
+    void reset(int level, uint32_t usec) {
+        stable_ = pending_ = level;
+        sinceUsec_ = usec;
+    }
+
+    // The input changed to level at usec. Returns true if that confirms
+    // a pulse (which started at pulseStartUsec()).
+    // (An edge to the level we already have means the opposite edge came
+    // and went too quickly to see; it's ignored as a glitch.)
+    bool edge(uint32_t usec, int level) {
+        bool pulse = settle(usec);
+        if (level != pending_) {
+            pending_ = level;
+            sinceUsec_ = usec;
+        }
+        return pulse;
+    }
+
+    // Check whether the current level (unchanged since its edge) has lasted
+    // long enough by usec. Returns true if that confirms a pulse.
+    bool poll(uint32_t usec) {
+        return settle(usec);
+    }
+
+    // True while a level change is waiting to be confirmed (or rejected)
+    bool isSettling() const { return pending_ != stable_; }
+
+    // Debounced input level
+    int level() const { return stable_; }
+
+    // Time of the falling edge that started the most recently confirmed pulse
+    uint32_t pulseStartUsec() const { return pulseStartUsec_; }
+
+private:
+    bool settle(uint32_t usec) {
+        uint32_t minUsec = pending_ == LOW ? minLowUsec_ : minHighUsec_;
+        if (pending_ == stable_ || usec - sinceUsec_ < minUsec) {
+            return false;
+        }
+        stable_ = pending_;
+        if (stable_ != LOW) {
+            return false;
+        }
+        pulseStartUsec_ = sinceUsec_;
+        return true;
+    }
+
+    uint32_t minLowUsec_;
+    uint32_t minHighUsec_;
+    int stable_;              // debounced level
+    int pending_;             // level since the latest edge
+    uint32_t sinceUsec_;      // time of that edge
+    uint32_t pulseStartUsec_;
+};
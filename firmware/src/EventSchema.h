@@ -0,0 +1,268 @@
+// ------------
+// Fixed-schema event data
+// ------------
+//
+// An event's fields are declared once, as a constexpr table of EventFields
+// giving each one's key and format, so the longest possible event data is
+// known at compile time:
+//
+//   enum { F_TIME, F_CHARGE, F_VERSION, F_LIST, F_COUNT };
+//   constexpr EventField FIELDS[F_COUNT] = {
+//       numberField("t", 0, UINT32_MAX),
+//       numberField("btp", 0, 256, 2),   // fixed point, to 0.01
+//       stringField("v", 11),
+//       restField("pts"),                // preformatted, gets the room left over
+//   };
+//   const size_t LIST_MAX_LENGTH = MAX_EVENT_DATA_LENGTH - maxObjectLength(FIELDS);
+//
+//   EventWriter writer(FIELDS, buffer, MAX_EVENT_DATA_LENGTH);
+//   writer.integer(F_TIME, now);
+//   writer.fixed(F_CHARGE, charge);
+//   ...
+//   writer.finish();
+//
+// Numbers are clamped to their field's range and written with at most its
+// decimals (dropping trailing zeros), without printf. A field that doesn't
+// fit is left out whole (and overflowed() is set), so the data is always
+// complete JSON; with a rest field kept within the room the table leaves
+// for it, that can't happen.
+//
+// Not thread safe: use each writer from a single thread.
+
+#pragma once
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct EventField {
+    enum Format : uint8_t {
+        NUMBER,  // decimals digits of fraction, clamped to [min, max]
+        STRING,  // up to max chars (which must not need escaping)
+        REST,    // preformatted JSON (e.g., an array), in whatever room is left
+    };
+
+    const char* key;
+    Format format;
+    uint8_t decimals;
+    int64_t min;
+    int64_t max;
+};
+
+constexpr EventField numberField(const char* key, int64_t min, int64_t max, uint8_t decimals = 0) {
+    return {key, EventField::NUMBER, decimals, min, max};
+}
+
+constexpr EventField stringField(const char* key, size_t maxLength) {
+    return {key, EventField::STRING, 0, 0, static_cast<int64_t>(maxLength)};
+}
+
+constexpr EventField restField(const char* key) {
+    return {key, EventField::REST, 0, 0, 0};
+}
+
+namespace event_schema {
+
+constexpr size_t length(const char* s) {
+    size_t n = 0;
+    while (s[n] != '\0') {
+        n++;
+    }
+    return n;
+}
+
+constexpr size_t digits(uint64_t value) {
+    size_t n = 1;
+    while (value >= 10) {
+        value /= 10;
+        n++;
+    }
+    return n;
+}
+
+constexpr uint64_t magnitude(int64_t value) {
+    return value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+}
+
+} // namespace event_schema
+
+// Longest "key":value for field (not counting a rest field's value)
+constexpr size_t maxFieldLength(const EventField& field) {
+    using namespace event_schema;
+    size_t keyLength = length(field.key) + 3;
+    switch (field.format) {
+        case EventField::NUMBER: {
+            uint64_t largest = magnitude(field.min) > magnitude(field.max)
+                ? magnitude(field.min) : magnitude(field.max);
+            return keyLength + (field.min < 0 ? 1 : 0) + digits(largest)
+                + (field.decimals > 0 ? 1 + field.decimals : 0);
+        }
+        case EventField::STRING:
+            return keyLength + 2 + static_cast<size_t>(field.max);
+        default:
+            return keyLength;
+    }
+}
+
+// Longest object with all of fields (not counting rest fields' values)
+template<size_t N>
+constexpr size_t maxObjectLength(const EventField (&fields)[N]) {
+    size_t total = 2 + (N - 1); // braces and commas
+    for (const EventField& field: fields) {
+        total += maxFieldLength(field);
+    }
+    return total;
+}
+
+
+class EventWriter {
+public:
+    // Writes a JSON object of fields into buffer,
+    // which must have room for size chars plus a '\0'
+    EventWriter(const EventField* fields, char* buffer, size_t size)
+        : fields_(fields), buffer_(buffer), size_(size), length_(1), empty_(true), overflowed_(false) {
+        buffer_[0] = '{';
+    }
+
+    void integer(size_t field, int64_t value) {
+        const EventField& f = fields_[field];
+        if (f.format != EventField::NUMBER) {
+            overflowed_ = true;
+            return;
+        }
+        value = value < f.min ? f.min : value > f.max ? f.max : value;
+        char text[24];
+        writeNumber(field, text, formatFixed(text, value, 0));
+    }
+
+    void fixed(size_t field, float value) {
+        const EventField& f = fields_[field];
+        if (f.format != EventField::NUMBER) {
+            overflowed_ = true;
+            return;
+        }
+        // (NaN becomes min)
+        double clamped = !(value >= f.min) ? f.min : value > f.max ? f.max : value;
+        int64_t scaled = llround(clamped * powerOfTen(f.decimals));
+        uint8_t decimals = f.decimals;
+        while (decimals > 0 && scaled % 10 == 0) {
+            scaled /= 10;
+            decimals--;
+        }
+        char text[24];
+        writeNumber(field, text, formatFixed(text, scaled, decimals));
+    }
+
+    void string(size_t field, const char* value) {
+        const EventField& f = fields_[field];
+        size_t length = strlen(value);
+        if (f.format != EventField::STRING || length > static_cast<size_t>(f.max)) {
+            overflowed_ = true;
+            return;
+        }
+        if (beginField(field, length + 2)) {
+            put('"');
+            put(value, length);
+            put('"');
+        }
+    }
+
+    void rest(size_t field, const char* json, size_t length) {
+        if (fields_[field].format != EventField::REST) {
+            overflowed_ = true;
+            return;
+        }
+        if (beginField(field, length)) {
+            put(json, length);
+        }
+    }
+
+    // Close the object (and '\0' terminate it); returns its length
+    size_t finish() {
+        buffer_[length_++] = '}';
+        buffer_[length_] = '\0';
+        return length_;
+    }
+
+    // Whether any field was left out
+    bool overflowed() const { return overflowed_; }
+    size_t dataSize() const { return length_; }
+
+private:
+    static double powerOfTen(uint8_t n) {
+        double power = 1;
+        while (n-- > 0) {
+            power *= 10;
+        }
+        return power;
+    }
+
+    // Format scaled / 10^decimals into text; returns its length
+    static size_t formatFixed(char* text, int64_t scaled, uint8_t decimals) {
+        char reversed[24];
+        size_t n = 0;
+        uint64_t value = event_schema::magnitude(scaled);
+        do {
+            reversed[n++] = '0' + value % 10;
+            value /= 10;
+            if (n == decimals) {
+                // (leading zero before the point, if needed)
+                if (value == 0) {
+                    reversed[n++] = '.';
+                    reversed[n++] = '0';
+                    break;
+                }
+                reversed[n++] = '.';
+            }
+        } while (value > 0 || n < decimals);
+        size_t length = 0;
+        if (scaled < 0) {
+            text[length++] = '-';
+        }
+        while (n > 0) {
+            text[length++] = reversed[--n];
+        }
+        return length;
+    }
+
+    void writeNumber(size_t field, const char* text, size_t length) {
+        if (beginField(field, length)) {
+            put(text, length);
+        }
+    }
+
+    // Start "key": if there's room for it and a valueLength value
+    // (and still close the object)
+    bool beginField(size_t field, size_t valueLength) {
+        const char* key = fields_[field].key;
+        size_t keyLength = strlen(key);
+        size_t needed = (empty_ ? 0 : 1) + keyLength + 3 + valueLength + 1;
+        if (length_ + needed > size_) {
+            overflowed_ = true;
+            return false;
+        }
+        if (!empty_) {
+            put(',');
+        }
+        put('"');
+        put(key, keyLength);
+        put('"');
+        put(':');
+        empty_ = false;
+        return true;
+    }
+
+    void put(char c) { buffer_[length_++] = c; }
+    void put(const char* s, size_t n) {
+        memcpy(buffer_ + length_, s, n);
+        length_ += n;
+    }
+
+    const EventField* fields_;
+    char* buffer_;
+    size_t size_;
+    size_t length_;
+    bool empty_;
+    bool overflowed_;
+};
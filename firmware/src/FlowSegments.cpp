@@ -0,0 +1,140 @@
+// ------------
+// Flow segments: run-length encoding of pulse times
+// ------------
+
+#include <algorithm>
+
+#include "FlowSegments.h"
+
+namespace {
+
+// Longest run we can represent (MAX_COUNT intervals of up to UINT16_MAX msec)
+const int64_t MAX_RUN_MSEC = static_cast<int64_t>(FlowSegment::MAX_COUNT) * UINT16_MAX;
+
+// Division rounding toward -infinity / +infinity (for possibly negative numerators)
+int32_t floorDiv(int32_t num, int32_t den) {
+    return num >= 0 ? num / den : -((-num + den - 1) / den);
+}
+
+int32_t ceilDiv(int32_t num, int32_t den) {
+    return num >= 0 ? (num + den - 1) / den : -(-num / den);
+}
+
+} // namespace
+
+
+FlowSegmentEncoder::FlowSegmentEncoder(FlowSegment* segments, size_t maxSegments,
+                                       int8_t* residuals, size_t maxPulses,
+                                       uint16_t toleranceMsec, uint8_t maxRunLength)
+    : segments_(segments), maxSegments_(maxSegments), residuals_(residuals), maxPulses_(maxPulses),
+      tolerance_(std::min<int32_t>(toleranceMsec, INT8_MAX)), maxRunLength_(maxRunLength),
+      used_(0), pulses_(0) {
+}
+
+bool FlowSegmentEncoder::add(int64_t timeMsec) {
+    if (used_ > 0 && extendRun(timeMsec)) {
+        return true;
+    }
+    if (used_ >= maxSegments_ || pulses_ >= maxPulses_) {
+        return false;
+    }
+    if (used_ > 0) {
+        closeRun();
+    }
+
+    // Start a new run
+    FlowSegment& segment = segments_[used_++];
+    time32_t start = static_cast<time32_t>(timeMsec / 1000);
+    segment.start = start;
+    segment.interval = 0;
+    segment.count = 1;
+    segment.residuals = residuals_ + pulses_++;
+    offsets_[0] = static_cast<int32_t>(timeMsec - static_cast<int64_t>(start) * 1000);
+    segment.phase = offsets_[0];
+    minInterval_ = 0;
+    maxInterval_ = UINT16_MAX;
+    return true;
+}
+
+size_t FlowSegmentEncoder::finish() {
+    if (used_ > 0) {
+        closeRun();
+    }
+    if (used_ < maxSegments_) {
+        segments_[used_].count = 0;
+    }
+    return used_;
+}
+
+void FlowSegmentEncoder::closeRun() {
+    // Settle the run's residuals, now its interval and phase won't change
+    const FlowSegment& segment = segments_[used_ - 1];
+    int8_t* residuals = residuals_ + (segment.residuals - residuals_);
+    for (int32_t i = 0; i < segment.count; i++) {
+        residuals[i] = static_cast<int8_t>(offsets_[i] - (segment.phase + i * segment.interval));
+    }
+}
+
+bool FlowSegmentEncoder::extendRun(int64_t timeMsec) {
+    FlowSegment& segment = segments_[used_ - 1];
+    const int32_t n = segment.count; // index of the new pulse in the run
+    const int64_t longOffset = timeMsec - static_cast<int64_t>(segment.start) * 1000;
+    if (n >= maxRunLength_ || pulses_ >= maxPulses_
+        || longOffset < offsets_[n - 1] || longOffset > MAX_RUN_MSEC) {
+        return false;
+    }
+    const int32_t offset = static_cast<int32_t>(longOffset);
+
+    // Pulse i's time in the run (phase + i * interval) must be within
+    // tolerance of offsets_[i]. Every pair of pulses i < n then bounds
+    // the interval.
+    int32_t minInterval = minInterval_;
+    int32_t maxInterval = maxInterval_;
+    for (int32_t i = 0; i < n; i++) {
+        int32_t span = offset - offsets_[i];
+        minInterval = std::max(minInterval, ceilDiv(span - 2 * tolerance_, n - i));
+        maxInterval = std::min(maxInterval, floorDiv(span + 2 * tolerance_, n - i));
+    }
+    if (minInterval > maxInterval) {
+        return false;
+    }
+
+    offsets_[n] = offset;
+    int32_t actual = segment.phase + n * segment.interval;
+    bool currentFits = offset - tolerance_ <= actual && actual <= offset + tolerance_;
+    if (!currentFits && !solveRun(segment, minInterval, maxInterval)) {
+        return false;
+    }
+    segment.count = n + 1;
+    pulses_ += 1;
+    minInterval_ = minInterval;
+    maxInterval_ = maxInterval;
+    return true;
+}
+
+bool FlowSegmentEncoder::solveRun(FlowSegment& segment, int32_t minInterval, int32_t maxInterval) const {
+    // Look for an interval (working outward from the middle of the feasible
+    // range) that leaves a valid phase for every pulse in the run.
+    const int32_t count = segment.count + 1;
+    const int32_t middle = minInterval + (maxInterval - minInterval) / 2;
+    const int MAX_TRIES = 16;
+    for (int tryNum = 0; tryNum < MAX_TRIES; tryNum++) {
+        int32_t interval = middle + ((tryNum & 1) ? -(tryNum + 1) / 2 : tryNum / 2);
+        if (interval < minInterval || interval > maxInterval) {
+            continue;
+        }
+        int32_t minPhase = 0;
+        int32_t maxPhase = FlowSegment::MAX_PHASE_MSEC;
+        for (int32_t i = 0; i < count && minPhase <= maxPhase; i++) {
+            int32_t phase = offsets_[i] - i * interval;
+            minPhase = std::max(minPhase, phase - tolerance_);
+            maxPhase = std::min(maxPhase, phase + tolerance_);
+        }
+        if (minPhase <= maxPhase) {
+            segment.interval = interval;
+            segment.phase = minPhase;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,89 @@
+// ------------
+// Flow segments: run-length encoding of pulse times
+// ------------
+//
+// A flow segment is a run of `count` pulses at a (nearly) steady rate:
+//
+//   timeMsec(i) = start * 1000 + phase + i * interval + residuals[i]
+//
+// with everything in milliseconds. The steady rate (interval and phase)
+// puts each pulse within the encoder's tolerance of its captured time, and
+// the residual is the rest of the way there; so a segment reproduces every
+// pulse time exactly, and its interval still recovers the flow rate, even
+// for several pulses per second. Where the flow rate varies by more than
+// the tolerance, the encoder starts a new segment. A single pulse is just
+// a segment with count 1 (and a zero residual).
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <Particle.h>
+
+struct FlowSegment {
+    time32_t start;    // second of the first pulse
+    uint16_t phase;    // msec of the first pulse's steady-rate time within that second
+    uint16_t interval; // msec between pulses at the steady rate
+    uint8_t count;     // number of pulses (0 marks the end of a segment list)
+    const int8_t* residuals; // each pulse's msec from its steady-rate time
+
+    static const uint16_t MAX_PHASE_MSEC = 999;
+    static const uint8_t MAX_COUNT = UINT8_MAX;
+
+    // Unix time of pulse i, in msec (exactly as captured)
+    int64_t timeMsecOf(uint32_t i) const {
+        return static_cast<int64_t>(start) * 1000 + phase + i * interval + residuals[i];
+    }
+    // (and in whole seconds)
+    time32_t timeOf(uint32_t i) const {
+        return static_cast<time32_t>(timeMsecOf(i) / 1000);
+    }
+    int64_t lastMsec() const {
+        return timeMsecOf(count - 1);
+    }
+    time32_t last() const {
+        return timeOf(count - 1);
+    }
+};
+
+// Greedily packs a series of (non-decreasing) pulse times into FlowSegments,
+// extending the current segment for as long as some interval and phase
+// still put every pulse time in it within toleranceMsec (at most INT8_MAX,
+// so each residual fits in an int8_t).
+class FlowSegmentEncoder {
+public:
+    // Each segment's residuals go in the next of maxPulses residuals.
+    // With maxRunLength 1, every pulse gets its own segment (no run-length encoding).
+    FlowSegmentEncoder(FlowSegment* segments, size_t maxSegments,
+                       int8_t* residuals, size_t maxPulses, uint16_t toleranceMsec,
+                       uint8_t maxRunLength = FlowSegment::MAX_COUNT);
+
+    // Append the next pulse time (Unix time in msec). Returns false (having
+    // encoded nothing) if the pulse needs a new segment and there's no room
+    // for one, or there's no room for its residual.
+    bool add(int64_t timeMsec);
+
+    // Returns the number of segments used, after marking the end of the
+    // list with a zero-count segment (if there's room).
+    size_t finish();
+
+private:
+    bool extendRun(int64_t timeMsec);
+    bool solveRun(FlowSegment& segment, int32_t minInterval, int32_t maxInterval) const;
+    void closeRun();
+
+    FlowSegment* segments_;
+    size_t maxSegments_;
+    int8_t* residuals_;
+    size_t maxPulses_;
+    int32_t tolerance_;
+    uint8_t maxRunLength_;
+    size_t used_;
+    size_t pulses_;
+
+    // The run in progress (segments_[used_ - 1]):
+    int32_t offsets_[FlowSegment::MAX_COUNT];  // msec from its start second
+    int32_t minInterval_;                      // feasible interval range (msec)
+    int32_t maxInterval_;
+};
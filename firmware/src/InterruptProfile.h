@@ -0,0 +1,53 @@
+// ------------
+// Opt-in interrupt latency probes
+// ------------
+//
+// Build with -DPROFILE_INTERRUPTS=1 to time code that holds off pulse
+// detection (ATOMIC_BLOCKs, the pulse ISR), and the latency from a meter
+// pulse's edge until it's counted, each into its own PhaseStats.
+// Without it, the probes compile to nothing.
+//
+// PROFILE_SCOPE times in usec; PROFILE_SAMPLE adds a value in whatever
+// unit its stats keep (e.g., msec of latency):
+//
+//   ATOMIC_BLOCK() {
+//       PROFILE_SCOPE(profileStats[PROFILE_SOME_SITE]); // usec
+//       ...
+//   }
+//   PROFILE_SAMPLE(profileStats[PROFILE_LATENCY], (micros() - edgeUsec) / 1000); // msec
+//
+// A probe's stats must only be updated with interrupts disabled (or from
+// the ISR itself), and read that way too.
+
+#pragma once
+
+#include <Particle.h>
+
+#include "PhaseStats.h"
+
+#ifndef PROFILE_INTERRUPTS
+#define PROFILE_INTERRUPTS 0
+#endif
+
+#if PROFILE_INTERRUPTS
+
+// Adds the usec from construction to destruction to stats
+class ProfileScope {
+public:
+    explicit ProfileScope(PhaseStats& stats) : stats_(stats), startUsec_(micros()) {}
+    ~ProfileScope() { stats_.add(micros() - startUsec_); }
+
+private:
+    PhaseStats& stats_;
+    uint32_t startUsec_;
+};
+
+#define PROFILE_SCOPE(stats) ProfileScope profileScope_(stats)
+#define PROFILE_SAMPLE(stats, value) (stats).add(value)
+
+#else
+
+#define PROFILE_SCOPE(stats)
+#define PROFILE_SAMPLE(stats, value)
+
+#endif
@@ -0,0 +1,182 @@
+// ------------
+// Packed pulse times: compact binary pts
+// ------------
+//
+// With "ptv":2, a waterbot/data event's pts is a string rather than an
+// array: the same items (pulse deltas and flow segments, in msec), each
+// packed as LEB128 varints, then base64 encoded (standard alphabet, no
+// padding):
+//
+//   delta                             zigzag(delta) << 1
+//   [delta, count, interval,          zigzag(delta) << 1 | 1, count, interval,
+//    residual...]                       zigzag(residual) for each of the count pulses
+//
+// So a pulse within 4 secs of the previous one takes two bytes (2.67
+// chars) instead of five or so, and a flow segment about 6 bytes plus one
+// for each pulse's residual.
+//
+// The server decodes it (server/src/dataCapture.ts); both it and this
+// codec are checked against the vectors in test/packed_pts_vectors.txt.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+struct PtsItem {
+    int32_t delta;      // msec from the previous pulse (to a segment's first steady-rate time)
+    bool segment;       // if not, a single pulse:
+    uint32_t count;     // (flow segment fields; see FlowSegment)
+    uint32_t interval;  // msec
+    const int8_t* residuals; // msec (count of them)
+};
+
+class PackedPulseTimesWriter {
+public:
+    // Packs items into buffer (of size bytes)
+    PackedPulseTimesWriter(uint8_t* buffer, size_t size) : buffer_(buffer), size_(size), used_(0) {}
+
+    // Append an item; returns false (having appended nothing) if it doesn't fit
+    bool add(const PtsItem& item) {
+        size_t start = used_;
+        uint64_t header = static_cast<uint64_t>(zigzag(item.delta)) << 1 | (item.segment ? 1 : 0);
+        bool fits = putVarint(header)
+            && (!item.segment || (putVarint(item.count) && putVarint(item.interval)));
+        for (uint32_t i = 0; fits && item.segment && i < item.count; i++) {
+            fits = putVarint(zigzag(item.residuals[i]));
+        }
+        if (!fits) {
+            used_ = start;
+        }
+        return fits;
+    }
+
+    size_t size() const { return used_; }
+
+    // Base64 encode the packed bytes into out, which must have room for
+    // encodedLength(size()) chars; returns that length
+    size_t encode(char* out) const {
+        static const char ALPHABET[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        size_t length = 0;
+        for (size_t i = 0; i < used_; i += 3) {
+            uint32_t group = buffer_[i] << 16;
+            if (i + 1 < used_) group |= buffer_[i + 1] << 8;
+            if (i + 2 < used_) group |= buffer_[i + 2];
+            size_t chars = i + 2 < used_ ? 4 : i + 1 < used_ ? 3 : 2;
+            for (size_t c = 0; c < chars; c++) {
+                out[length++] = ALPHABET[(group >> (18 - 6 * c)) & 0x3f];
+            }
+        }
+        return length;
+    }
+
+    // Base64 chars for bytes (and the most bytes that fit in chars)
+    static constexpr size_t encodedLength(size_t bytes) { return (bytes * 4 + 2) / 3; }
+    static constexpr size_t maxBytes(size_t chars) { return chars * 3 / 4; }
+
+    static uint32_t zigzag(int32_t value) {
+        return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+    }
+
+private:
+    bool putVarint(uint64_t value) {
+        do {
+            if (used_ >= size_) {
+                return false;
+            }
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            buffer_[used_++] = byte | (value != 0 ? 0x80 : 0);
+        } while (value != 0);
+        return true;
+    }
+
+    uint8_t* buffer_;
+    size_t size_;
+    size_t used_;
+};
+
+// A pts item as decoded (for testing)
+struct DecodedPtsItem {
+    int32_t delta;
+    bool segment;
+    uint32_t count;
+    uint32_t interval;
+    std::vector<int32_t> residuals;
+
+    bool operator==(const DecodedPtsItem& other) const {
+        return delta == other.delta && segment == other.segment
+            && (!segment || (count == other.count && interval == other.interval
+                             && residuals == other.residuals));
+    }
+};
+
+// Reference decoder (for testing); returns false if text is malformed
+inline bool decodePackedPulseTimes(const char* text, size_t length, std::vector<DecodedPtsItem>& items) {
+    std::vector<uint8_t> bytes;
+    uint32_t bits = 0;
+    int pending = 0;
+    for (size_t i = 0; i < length; i++) {
+        char c = text[i];
+        int value = c >= 'A' && c <= 'Z' ? c - 'A'
+            : c >= 'a' && c <= 'z' ? c - 'a' + 26
+            : c >= '0' && c <= '9' ? c - '0' + 52
+            : c == '+' ? 62 : c == '/' ? 63 : -1;
+        if (value < 0) {
+            return false;
+        }
+        bits = (bits << 6) | value;
+        pending += 6;
+        if (pending >= 8) {
+            pending -= 8;
+            bytes.push_back((bits >> pending) & 0xff);
+        }
+    }
+    if (length % 4 == 1) {
+        return false;
+    }
+
+    size_t pos = 0;
+    auto varint = [&](uint64_t& value) {
+        value = 0;
+        for (int shift = 0; pos < bytes.size() && shift < 64; shift += 7) {
+            uint8_t byte = bytes[pos++];
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto unzigzag = [](uint64_t zigzagged) {
+        return static_cast<int32_t>((static_cast<uint32_t>(zigzagged) >> 1)
+                                    ^ (0 - (static_cast<uint32_t>(zigzagged) & 1)));
+    };
+    items.clear();
+    while (pos < bytes.size()) {
+        uint64_t header, count = 0, interval = 0;
+        if (!varint(header)) {
+            return false;
+        }
+        DecodedPtsItem item = {unzigzag(header >> 1), (header & 1) != 0, 0, 0, {}};
+        if (item.segment) {
+            if (!(varint(count) && varint(interval))) {
+                return false;
+            }
+            item.count = static_cast<uint32_t>(count);
+            item.interval = static_cast<uint32_t>(interval);
+            for (uint64_t i = 0; i < count; i++) {
+                uint64_t residual;
+                if (!varint(residual)) {
+                    return false;
+                }
+                item.residuals.push_back(unzigzag(residual));
+            }
+        }
+        items.push_back(item);
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+// ------------
+// Timing statistics for a recurring phase
+// ------------
+//
+// Summarizes the durations of many samples of one phase (e.g., connecting
+// to WiFi) in a fixed 28 bytes: the count, min, max and total (for the
+// mean), and a histogram with log-scale buckets. Bucket 0 counts zero
+// durations, and bucket b counts durations in [2^(b-1), 2^b), except the
+// last one, which counts everything longer. Samples are in whatever unit
+// the caller chooses (msec, usec, secs); 16 buckets cover four decades.
+//
+// Adding a sample is a handful of integer ops, cheap enough to do on
+// every wake. Histogram buckets are small, so when one would overflow,
+// all of them are halved: the histogram keeps its shape (but the buckets
+// no longer add up to the count).
+//
+// Has no constructor (and no pointers), so it can live directly in
+// retained memory. Call clear() to initialize it.
+//
+// Not thread safe: use from a single thread.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+
+struct PhaseStats {
+    static constexpr size_t BUCKETS = 16;
+
+    uint32_t total;         // (saturates)
+    uint16_t count;         // (saturates)
+    uint16_t min;           // (saturates)
+    uint16_t max;           // (saturates)
+    uint8_t histogram[BUCKETS];
+
+    void clear() {
+        total = 0;
+        count = 0;
+        min = max = 0;
+        std::fill_n(histogram, BUCKETS, 0);
+    }
+
+    void add(uint32_t duration) {
+        uint16_t sample = static_cast<uint16_t>(std::min<uint32_t>(duration, UINT16_MAX));
+        min = count == 0 ? sample : std::min(min, sample);
+        max = std::max(max, sample);
+        total = total + duration < total ? UINT32_MAX : total + duration;
+        count += count < UINT16_MAX;
+
+        uint8_t& bucket = histogram[bucketFor(duration)];
+        if (bucket == UINT8_MAX) {
+            for (uint8_t& b: histogram) {
+                b /= 2;
+            }
+        }
+        bucket += 1;
+    }
+
+    // Combine other's samples into these
+    void merge(const PhaseStats& other) {
+        if (other.count == 0) {
+            return;
+        }
+        min = count == 0 ? other.min : std::min(min, other.min);
+        max = std::max(max, other.max);
+        total = total + other.total < total ? UINT32_MAX : total + other.total;
+        count = static_cast<uint16_t>(std::min<uint32_t>(count + other.count, UINT16_MAX));
+        bool overflow = false;
+        for (size_t b = 0; b < BUCKETS; b++) {
+            overflow = overflow || histogram[b] + other.histogram[b] > UINT8_MAX;
+        }
+        for (size_t b = 0; b < BUCKETS; b++) {
+            histogram[b] = overflow
+                ? static_cast<uint8_t>((histogram[b] + other.histogram[b]) / 2)
+                : static_cast<uint8_t>(histogram[b] + other.histogram[b]);
+        }
+    }
+
+    uint32_t mean() const { return count > 0 ? total / count : 0; }
+
+    // Number of histogram buckets through the last non-empty one
+    size_t usedBuckets() const {
+        size_t used = BUCKETS;
+        while (used > 0 && histogram[used - 1] == 0) {
+            used--;
+        }
+        return used;
+    }
+
+    static size_t bucketFor(uint32_t duration) {
+        return duration == 0 ? 0 : std::min<size_t>(32 - __builtin_clz(duration), BUCKETS - 1);
+    }
+};
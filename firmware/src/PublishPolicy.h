@@ -0,0 +1,130 @@
+// ------------
+// Publish scheduling policies
+// ------------
+//
+// A PublishPolicy sets the publish cadence: how long to batch pulses
+// before reporting them (the in-use interval), how often to report when
+// there aren't any (the heartbeat interval), and how many unreported
+// pulse times should trigger a report right away.
+//
+// The firmware tells the policy about each fuel gauge reading and each
+// publish outcome, and asks it for the current cadence when scheduling.
+// It still reports right away when the pulse times buffer is getting
+// full, so no policy can make that overflow.
+//
+// Not thread safe: use from a single thread.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+
+class PublishPolicy {
+public:
+    virtual ~PublishPolicy() {}
+
+    // Fuel gauge reading: charge % (nominally [0, 100], but can read
+    // higher) and cell voltage
+    virtual void updateBattery(float charge, float voltage) {}
+
+    // A report was acked (succeeded), or its publish failed
+    virtual void recordPublish(bool succeeded) {}
+
+    virtual uint32_t inUseSecs() const = 0;
+    virtual uint32_t heartbeatSecs() const = 0;
+    virtual uint32_t maxPulseTimes() const = 0;
+};
+
+
+// The same cadence regardless of conditions
+class FixedPublishPolicy : public PublishPolicy {
+public:
+    FixedPublishPolicy(uint32_t inUseSecs, uint32_t heartbeatSecs, uint32_t maxPulseTimes)
+        : inUseSecs_(inUseSecs), heartbeatSecs_(heartbeatSecs), maxPulseTimes_(maxPulseTimes) {}
+
+    uint32_t inUseSecs() const override { return inUseSecs_; }
+    uint32_t heartbeatSecs() const override { return heartbeatSecs_; }
+    uint32_t maxPulseTimes() const override { return maxPulseTimes_; }
+
+private:
+    uint32_t inUseSecs_;
+    uint32_t heartbeatSecs_;
+    uint32_t maxPulseTimes_;
+};
+
+
+// Stretches a base cadence (all three limits together) by a power of two,
+// trading report latency for fewer wakes with the radio on:
+//   * by battery charge: 1x at fullRateCharge, doubling at even steps
+//     below that, to 2^maxShift at or below minRateCharge (a voltage below
+//     minRateVoltage counts as minRateCharge, in case the gauge is off)
+//   * by publish failures: one more doubling while recent publishes have
+//     been failing, two after several (each success halves the count)
+// Falling charge takes effect immediately, but rising charge only once
+// it's hysteresis above the lowest recent reading, so a noisy gauge
+// doesn't flip the cadence back and forth. Until the first reading, the
+// battery is assumed to be fine.
+class BatteryAwarePublishPolicy : public PublishPolicy {
+public:
+    struct Settings {
+        uint32_t inUseSecs;
+        uint32_t heartbeatSecs;
+        uint32_t maxPulseTimes;
+        uint8_t maxShift;       // stretch up to 2^maxShift
+        float fullRateCharge;   // %
+        float minRateCharge;    // %
+        float minRateVoltage;   // V
+        float hysteresis;       // %
+    };
+
+    explicit BatteryAwarePublishPolicy(const Settings& settings)
+        : settings_(settings), charge_(-1), failures_(0), shift_(0) {}
+
+    void updateBattery(float charge, float voltage) override {
+        if (voltage < settings_.minRateVoltage) {
+            charge = std::min(charge, settings_.minRateCharge);
+        }
+        if (charge_ < 0 || charge < charge_) {
+            charge_ = charge;
+        } else if (charge > charge_ + settings_.hysteresis) {
+            charge_ = charge - settings_.hysteresis;
+        }
+        updateShift();
+    }
+
+    void recordPublish(bool succeeded) override {
+        if (succeeded) {
+            failures_ /= 2;
+        } else if (failures_ < UINT8_MAX) {
+            failures_ += 1;
+        }
+        updateShift();
+    }
+
+    uint32_t inUseSecs() const override { return settings_.inUseSecs << shift_; }
+    uint32_t heartbeatSecs() const override { return settings_.heartbeatSecs << shift_; }
+    uint32_t maxPulseTimes() const override { return settings_.maxPulseTimes << shift_; }
+
+    // Current stretch, as a power of two
+    uint8_t shift() const { return shift_; }
+
+private:
+    void updateShift() {
+        int shift = 0;
+        if (charge_ >= 0 && charge_ <= settings_.minRateCharge) {
+            shift = settings_.maxShift;
+        } else if (charge_ >= 0 && charge_ < settings_.fullRateCharge) {
+            float depth = (settings_.fullRateCharge - charge_)
+                          / (settings_.fullRateCharge - settings_.minRateCharge);
+            shift = static_cast<int>(depth * settings_.maxShift);
+        }
+        shift += failures_ >= 4 ? 2 : failures_ >= 1 ? 1 : 0;
+        shift_ = static_cast<uint8_t>(std::min<int>(shift, settings_.maxShift));
+    }
+
+    Settings settings_;
+    float charge_;      // (with hysteresis; < 0 until the first reading)
+    uint8_t failures_;  // recent publish failures (decaying)
+    uint8_t shift_;
+};
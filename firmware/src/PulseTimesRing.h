@@ -0,0 +1,331 @@
+// ------------
+// Compact FIFO of pulse timestamps
+// ------------
+//
+// Stores a sequence of (non-decreasing) millisecond timestamps, from a
+// monotonic uint32_t clock like millis() (which may wrap around), in a
+// fixed-size byte ring. Each timestamp is varint-encoded (7 bits per byte,
+// low bits first) as whichever is shorter:
+//   * its delta from the previous timestamp (low bit 1), or
+//   * the change from the previous delta, zigzag encoded (low bit 0).
+// During steady flow, consecutive pulse intervals are usually within
+// 31 msec of each other, so each pulse costs a single byte (versus four in
+// a CircularBuffer<time32_t> of whole seconds). Varying flow costs two
+// bytes per pulse, and widely spaced pulses up to five.
+//
+// This is a lock-free single-producer/single-consumer queue: one thread
+// may push() while another uses the consumer methods (shift(), first(),
+// cursor(), etc.), without ATOMIC_BLOCK. Each side owns its own position
+// (the producer's tail, the consumer's head), and publishes it to the
+// other side with a single atomic store after it's done with the bytes.
+// So the producer can't make room by dropping the oldest timestamps
+// (like CircularBuffer::push does): when the ring is full, push() fails,
+// and it's up to the consumer to shift() out old timestamps to keep
+// space free.
+//
+// Has no constructor (and no pointers, just positions), so it can live
+// directly in retained memory, and be kept when that's copied or moved.
+// Call clear() to initialize it. Each side keeps a checksum of its own
+// state (seeded with the format and size), updated along with it, and
+// isValid() checks those and decodes the stored bytes, so it can tell
+// whether retained memory (e.g., after a firmware update, or a reset
+// partway through a push) still holds a usable ring.
+
+#pragma once
+
+#include <atomic>
+#include <initializer_list>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <Particle.h>
+
+template<size_t BYTES>
+class PulseTimesRing {
+    static_assert(BYTES >= 8 && BYTES < UINT16_MAX, "PulseTimesRing size out of range");
+
+public:
+    typedef uint32_t Time; // msec
+
+    // Largest possible encoding of a single timestamp
+    static constexpr size_t MAX_DELTA_BYTES = 5;
+
+    // Reset to empty.
+    // *WARNING* Not thread safe: call only while nothing is pushing
+    // (e.g., when initializing retained data).
+    void clear() {
+        produced_.store(0);
+        consumed_.store(0);
+        last_ = previous_ = 0;
+        lastDelta_ = previousDelta_ = 0;
+        producerCheck_ = checksum(0, last_, lastDelta_);
+        consumerCheck_ = checksum(0, previous_, previousDelta_);
+    }
+
+    // Add offset to every timestamp (e.g., to move them to a new clock).
+    // *WARNING* Not thread safe: call only while nothing is pushing
+    // or shifting.
+    void rebase(uint32_t offset) {
+        last_ += offset;
+        previous_ += offset;
+        producerCheck_ = checksum(produced_.load(), last_, lastDelta_);
+        consumerCheck_ = checksum(consumed_.load(), previous_, previousDelta_);
+    }
+
+    // Remove all but the oldest keep timestamps (e.g., to drop ones that
+    // turned out not to belong).
+    // *WARNING* Not thread safe: call only while nothing is pushing
+    // or shifting.
+    void truncate(uint16_t keep) {
+        uint32_t produced = produced_.load();
+        uint32_t consumed = consumed_.load();
+        if (keep >= static_cast<uint16_t>(count(produced) - count(consumed))) {
+            return;
+        }
+        uint16_t pos = position(consumed);
+        Time time = previous_;
+        uint32_t delta = previousDelta_;
+        for (uint16_t i = 0; i < keep; i++) {
+            delta = decodeDelta(pos, delta);
+            time += delta;
+        }
+        last_ = time;
+        lastDelta_ = delta;
+        produced = pack(pos, count(consumed) + keep);
+        producerCheck_ = checksum(produced, last_, lastDelta_);
+        produced_.store(produced);
+    }
+
+    //
+    // Producer
+    //
+
+    // Add a timestamp at the end. (A timestamp earlier than the previous one
+    // is recorded as equal to it.) Returns false, without adding it,
+    // if there isn't room.
+    bool push(Time time) {
+        uint32_t produced = produced_.load(std::memory_order_relaxed);
+        uint32_t consumed = consumed_.load(std::memory_order_acquire);
+        uint32_t delta = isAfter(time, last_) ? time - last_ : 0;
+        uint64_t encoded = encode(delta, lastDelta_);
+        if (free(produced, consumed) < encodedLength(encoded)) {
+            return false;
+        }
+
+        uint16_t pos = position(produced);
+        for (; encoded >= 0x80; encoded >>= 7) {
+            bytes_[pos] = static_cast<uint8_t>(encoded) | 0x80;
+            pos = wrap(pos + 1);
+        }
+        bytes_[pos] = static_cast<uint8_t>(encoded);
+
+        last_ += delta;
+        lastDelta_ = delta;
+        produced = pack(wrap(pos + 1), count(produced) + 1);
+        producerCheck_ = checksum(produced, last_, lastDelta_);
+        produced_.store(produced, std::memory_order_release);
+        return true;
+    }
+
+    // Newest timestamp (producer side only; unpredictable if empty)
+    Time last() const { return last_; }
+
+    //
+    // Consumer
+    //
+
+    // Remove and return the oldest timestamp.
+    // *WARNING* Calling this on an empty ring has unpredictable results.
+    Time shift() {
+        uint32_t consumed = consumed_.load(std::memory_order_relaxed);
+        uint16_t pos = position(consumed);
+        previousDelta_ = decodeDelta(pos, previousDelta_);
+        previous_ += previousDelta_;
+        consumed = pack(pos, count(consumed) + 1);
+        consumerCheck_ = checksum(consumed, previous_, previousDelta_);
+        consumed_.store(consumed, std::memory_order_release);
+        return previous_;
+    }
+
+    // Oldest timestamp (unpredictable if empty)
+    Time first() const {
+        uint16_t pos = position(consumed_.load(std::memory_order_relaxed));
+        return previous_ + decodeDelta(pos, previousDelta_);
+    }
+
+    // Read-only iteration over the timestamps, oldest first:
+    //   for (auto cursor = ring.cursor(); !cursor.done(); cursor.next()) {
+    //       ... cursor.time() ...
+    //   }
+    // A Cursor covers the timestamps pushed before it was created
+    // (ignoring any pushed later), and is invalidated by shift().
+    class Cursor {
+    public:
+        bool done() const { return remaining_ == 0; }
+        Time time() const { return time_; }
+        uint16_t remaining() const { return remaining_; }
+        void next() {
+            remaining_ -= 1;
+            if (remaining_ > 0) {
+                delta_ = ring_.decodeDelta(pos_, delta_);
+                time_ += delta_;
+            }
+        }
+
+    private:
+        friend class PulseTimesRing;
+        explicit Cursor(const PulseTimesRing& ring) : ring_(ring) {
+            uint32_t produced = ring.produced_.load(std::memory_order_acquire);
+            uint32_t consumed = ring.consumed_.load(std::memory_order_relaxed);
+            pos_ = position(consumed);
+            remaining_ = count(produced) - count(consumed);
+            time_ = ring.previous_;
+            delta_ = ring.previousDelta_;
+            if (remaining_ > 0) {
+                delta_ = ring.decodeDelta(pos_, delta_);
+                time_ += delta_;
+            }
+        }
+
+        const PulseTimesRing& ring_;
+        Time time_;
+        uint32_t delta_;
+        uint16_t pos_;
+        uint16_t remaining_;
+    };
+
+    Cursor cursor() const { return Cursor(*this); }
+
+    // Number of timestamps stored
+    uint16_t size() const {
+        return count(produced_.load(std::memory_order_acquire))
+            - count(consumed_.load(std::memory_order_relaxed));
+    }
+    bool isEmpty() const { return size() == 0; }
+
+    // True if the next push() might fail
+    bool isFull() const { return bytesAvailable() < MAX_DELTA_BYTES; }
+
+    // Bytes of encoded deltas stored, and still available
+    size_t bytesUsed() const { return BYTES - 1 - bytesAvailable(); }
+    size_t bytesAvailable() const {
+        return free(produced_.load(std::memory_order_acquire), consumed_.load(std::memory_order_acquire));
+    }
+
+    // Sanity check the internal state (e.g., after a firmware update
+    // may have relocated retained memory): both checksums, and that the
+    // stored bytes decode to exactly the pushed timestamps.
+    // *WARNING* Not thread safe: call only while nothing is pushing
+    // or shifting.
+    bool isValid() const {
+        uint32_t produced = produced_.load();
+        uint32_t consumed = consumed_.load();
+        if (producerCheck_ != checksum(produced, last_, lastDelta_)
+            || consumerCheck_ != checksum(consumed, previous_, previousDelta_)
+            || position(produced) >= BYTES || position(consumed) >= BYTES) {
+            return false;
+        }
+        uint16_t deltas = count(produced) - count(consumed);
+        uint32_t used = BYTES - 1 - free(produced, consumed);
+        if (deltas > used || used > deltas * MAX_DELTA_BYTES) {
+            return false;
+        }
+        uint16_t pos = position(consumed);
+        Time time = previous_;
+        uint32_t delta = previousDelta_;
+        for (uint16_t i = 0; i < deltas; i++) {
+            for (size_t length = 1; bytes_[wrap(pos + length - 1)] & 0x80; length++) {
+                if (length == MAX_DELTA_BYTES) {
+                    return false; // (unterminated varint)
+                }
+            }
+            delta = decodeDelta(pos, delta);
+            time += delta;
+        }
+        return pos == position(produced) && time == last_ && delta == lastDelta_;
+    }
+
+private:
+    // Checksum seed: identifies this encoding (change the constant if it
+    // changes) and size
+    static constexpr uint32_t CHECK_SEED = 0x7c3a5e01 ^ static_cast<uint32_t>(BYTES << 8);
+
+    // Checksum of one side's state (FNV-1a over its words)
+    static uint32_t checksum(uint32_t packed, Time time, uint32_t delta) {
+        uint32_t hash = CHECK_SEED;
+        for (uint32_t word: {packed, time, delta}) {
+            hash = (hash ^ word) * 0x01000193;
+        }
+        return hash;
+    }
+
+    // Each side's state is packed into a single atomic word: its byte position
+    // in the low half, and timestamps pushed/shifted (mod 2^16) in the high half
+    static uint32_t pack(uint16_t position, uint16_t count) {
+        return static_cast<uint32_t>(count) << 16 | position;
+    }
+    static uint16_t position(uint32_t packed) { return static_cast<uint16_t>(packed); }
+    static uint16_t count(uint32_t packed) { return static_cast<uint16_t>(packed >> 16); }
+
+    // Bytes available to push (one is always left unused,
+    // so that head == tail means empty)
+    static size_t free(uint32_t produced, uint32_t consumed) {
+        return BYTES - 1 - wrap(position(produced) + BYTES - position(consumed));
+    }
+
+    // Wraparound-safe comparison of clock times
+    static bool isAfter(Time a, Time b) {
+        return static_cast<int32_t>(a - b) > 0;
+    }
+
+    // The shorter of the tagged delta or change in delta, before varint encoding
+    static uint64_t encode(uint32_t delta, uint32_t previousDelta) {
+        uint64_t asDelta = static_cast<uint64_t>(delta) << 1 | 1;
+        int64_t change = static_cast<int64_t>(delta) - previousDelta;
+        uint64_t zigzag = change < 0 ? (static_cast<uint64_t>(-change) << 1) - 1 : static_cast<uint64_t>(change) << 1;
+        uint64_t asChange = zigzag << 1;
+        return encodedLength(asChange) <= encodedLength(asDelta) ? asChange : asDelta;
+    }
+
+    static uint16_t encodedLength(uint64_t encoded) {
+        uint16_t length = 1;
+        while (encoded >= 0x80) {
+            encoded >>= 7;
+            length += 1;
+        }
+        return length;
+    }
+
+    static uint16_t wrap(size_t pos) {
+        return static_cast<uint16_t>(pos >= BYTES ? pos - BYTES : pos);
+    }
+
+    // Decode the delta at pos (following previousDelta), advancing pos past it
+    uint32_t decodeDelta(uint16_t& pos, uint32_t previousDelta) const {
+        uint64_t encoded = 0;
+        for (uint8_t bits = 0; ; bits += 7) {
+            uint8_t byte = bytes_[pos];
+            pos = wrap(pos + 1);
+            encoded |= static_cast<uint64_t>(byte & 0x7f) << bits;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        if (encoded & 1) {
+            return static_cast<uint32_t>(encoded >> 1);
+        }
+        uint64_t zigzag = encoded >> 1;
+        int64_t change = (zigzag & 1) ? -static_cast<int64_t>((zigzag + 1) >> 1) : static_cast<int64_t>(zigzag >> 1);
+        return static_cast<uint32_t>(previousDelta + change);
+    }
+
+    std::atomic<uint32_t> produced_; // producer's position and count (tail)
+    std::atomic<uint32_t> consumed_; // consumer's position and count (head)
+    Time last_;                      // newest timestamp pushed (producer's)
+    uint32_t lastDelta_;             // and its delta
+    uint32_t producerCheck_;         // checksum of those three
+    Time previous_;                  // newest timestamp shifted (consumer's)
+    uint32_t previousDelta_;         // and its delta
+    uint32_t consumerCheck_;         // checksum of those three
+    uint8_t bytes_[BYTES];
+};
@@ -0,0 +1,165 @@
+// ------------
+// Usage tiers: pulse counts for times that didn't fit
+// ------------
+//
+// When pulseTimes fills up (e.g., during a long network outage), the
+// oldest pulse times are folded into a short FIFO of buckets here, rather
+// than dropped: each bucket is a count of pulses between its first and
+// last pulse time. A bucket takes pulses for up to a minute; once the FIFO
+// is full, the oldest pair of adjacent buckets that would together span at
+// most an hour is merged, or if none would, at most a day, or failing that
+// the oldest pair. So recent usage stays at minute resolution, and older
+// usage degrades to hours, then days, instead of losing its times
+// altogether. (A pulse's time is off by at most its bucket's span.)
+//
+// Buckets already in a sealed report are "frozen": add() never merges the
+// oldest frozen ones, so reports can refer to them by position (like
+// pulseTimesCount for pulseTimes).
+//
+// Times are on the same millis() clock as PulseTimesRing (and rebase the
+// same way). Like it, has no constructor (and no pointers), so it can live
+// directly in retained memory; call clear() to initialize it. Keeps a
+// checksum of its buckets (updated by every change), so isValid() can
+// spot corruption. Not thread safe: use it from a single thread (or with
+// a lock).
+
+#pragma once
+
+#include <initializer_list>
+#include <stddef.h>
+#include <stdint.h>
+
+struct UsageBucket {
+    uint32_t first; // millis() of the first and last pulses
+    uint32_t last;
+    uint32_t count;
+
+    uint32_t spanMsec() const { return last - first; }
+};
+
+template<size_t N>
+class UsageTiers {
+    static_assert(N >= 2 && N <= UINT8_MAX, "UsageTiers size out of range");
+
+public:
+    // Longest span of a bucket in each tier (msec): new pulses go in minute
+    // buckets, and merges prefer the finest tier they fit in
+    static constexpr uint32_t MINUTE_MSEC = 60 * 1000;
+    static constexpr uint32_t HOUR_MSEC = 60 * MINUTE_MSEC;
+    static constexpr uint32_t DAY_MSEC = 24 * HOUR_MSEC;
+
+    void clear() {
+        count_ = 0;
+        check_ = checksum();
+    }
+
+    // Whether this (e.g., retained memory from an earlier firmware)
+    // holds usable buckets
+    bool isValid() const {
+        return count_ <= N && check_ == checksum();
+    }
+
+    // Add a pulse (no earlier than any added before), without changing
+    // the oldest frozen buckets. Returns false (losing its time, but not
+    // its count) if every bucket is frozen.
+    bool add(uint32_t time, size_t frozen) {
+        if (count_ > frozen && count_ > 0) {
+            UsageBucket& newest = buckets_[count_ - 1];
+            if (time - newest.first < MINUTE_MSEC) {
+                newest.last = time;
+                newest.count += 1;
+                check_ = checksum();
+                return true;
+            }
+        }
+        if (count_ == N && !mergeOldest(frozen)) {
+            return false;
+        }
+        buckets_[count_++] = {time, time, 1};
+        check_ = checksum();
+        return true;
+    }
+
+    // Remove the oldest count buckets (once reported)
+    void shift(size_t count) {
+        count = count < count_ ? count : count_;
+        for (size_t i = count; i < count_; i++) {
+            buckets_[i - count] = buckets_[i];
+        }
+        count_ -= count;
+        check_ = checksum();
+    }
+
+    // Remove all but the oldest count buckets
+    void truncate(size_t count) {
+        count_ = count < count_ ? count : count_;
+        check_ = checksum();
+    }
+
+    // Add offset to every time (see PulseTimesRing::rebase)
+    void rebase(uint32_t offset) {
+        for (size_t i = 0; i < count_; i++) {
+            buckets_[i].first += offset;
+            buckets_[i].last += offset;
+        }
+        check_ = checksum();
+    }
+
+    size_t size() const { return count_; }
+    bool isEmpty() const { return count_ == 0; }
+
+    // Oldest first
+    const UsageBucket& operator[](size_t i) const { return buckets_[i]; }
+
+    // Total pulses in buckets [from, to)
+    uint32_t pulseCount(size_t from, size_t to) const {
+        uint32_t total = 0;
+        for (size_t i = from; i < to && i < count_; i++) {
+            total += buckets_[i].count;
+        }
+        return total;
+    }
+
+private:
+    // Checksum seed: identifies this layout and size
+    static constexpr uint32_t CHECK_SEED = 0x3b9e0c71 ^ (N << 8);
+
+    // FNV-1a over count_ and the buckets in use
+    uint32_t checksum() const {
+        uint32_t hash = (CHECK_SEED ^ count_) * 0x01000193;
+        for (size_t i = 0; i < count_ && i < N; i++) {
+            for (uint32_t word: {buckets_[i].first, buckets_[i].last, buckets_[i].count}) {
+                hash = (hash ^ word) * 0x01000193;
+            }
+        }
+        return hash;
+    }
+
+    // Merge the oldest adjacent (unfrozen) pair within the finest tier
+    // they fit; returns false if there isn't a pair
+    bool mergeOldest(size_t frozen) {
+        static constexpr uint32_t SPANS[] = {HOUR_MSEC, DAY_MSEC, UINT32_MAX};
+        for (uint32_t span: SPANS) {
+            for (size_t i = frozen; i + 1 < count_; i++) {
+                if (buckets_[i + 1].last - buckets_[i].first <= span) {
+                    buckets_[i].last = buckets_[i + 1].last;
+                    buckets_[i].count += buckets_[i + 1].count;
+                    shiftDown(i + 1);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void shiftDown(size_t removed) {
+        for (size_t i = removed + 1; i < count_; i++) {
+            buckets_[i - 1] = buckets_[i];
+        }
+        count_ -= 1;
+    }
+
+    uint32_t check_; // checksum(), as of the last change
+    uint8_t count_;
+    UsageBucket buckets_[N];
+};
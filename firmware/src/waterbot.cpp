@@ -2,17 +2,31 @@
 // Pulse counter
 // ------------
 
+#include <array>
+#include <atomic>
+#include <type_traits>
+#include <utility>
+
 #include <Particle.h>
 
-#include <CircularBuffer.h>
 #include <PowerShield.h>
 
+#include "EdgeDebouncer.h"
+#include "EventSchema.h"
+#include "FlowSegments.h"
+#include "InterruptProfile.h"
+#include "PackedPulseTimes.h"
+#include "PhaseStats.h"
+#include "PublishPolicy.h"
+#include "PulseTimesRing.h"
+#include "UsageTiers.h"
+
 STARTUP(System.enableFeature(FEATURE_RETAINED_MEMORY));
 STARTUP(WiFi.selectAntenna(ANT_AUTO));
 SYSTEM_MODE(SEMI_AUTOMATIC);  // wait to connect until we want to
 SYSTEM_THREAD(ENABLED);
 
-const char * const WATERBOT_VERSION = "0.3.9";
+constexpr char WATERBOT_VERSION[] = "0.3.9";
 
 // Behavior constants
 
@@ -21,15 +35,161 @@ const char * const WATERBOT_VERSION = "0.3.9";
 const std::chrono::seconds PUBLISH_IN_USE_INTERVAL = 1min;
 const std::chrono::seconds PUBLISH_HEARTBEAT_INTERVAL = 4h;
 
+// report runs of steady flow in the pts array as a single
+// [delta, count, interval, residual...] flow segment, in msec
+// (rather than one delta per pulse)
+const bool PUBLISH_FLOW_SEGMENTS = true;
+
+// send pts as a base64 string of packed varint items ("ptv":2; see
+// PackedPulseTimes.h), which fits 2-3 times as many pulses in an event as
+// the JSON array ("ptv":1); the server must support it
+const bool PUBLISH_PACKED_PTS = true;
+
 // try to publish immediately if this many pulses
 // accumulate before PUBLISH_IN_USE_INTERVAL is reached
-const uint32_t PUBLISH_MAX_PULSE_TIMES = 20;
+// (flow segments pack steady flow far more tightly than per-pulse deltas)
+const uint32_t PUBLISH_MAX_PULSE_TIMES = PUBLISH_FLOW_SEGMENTS ? 240 : 20;
+
+// as the battery runs down (or publishes keep failing), stretch those
+// three by up to 2^PUBLISH_MAX_STRETCH_SHIFT (8 minutes in use, 32 hours
+// heartbeat); see BatteryAwarePublishPolicy
+const uint8_t PUBLISH_MAX_STRETCH_SHIFT = 3;
+
+// battery charge (%) down to which to publish at the normal intervals,
+// and at or below which to stretch them the most; below the voltage,
+// stretch them the most regardless of the reported charge
+const float PUBLISH_FULL_RATE_CHARGE = 60;
+const float PUBLISH_MIN_RATE_CHARGE = 20;
+const float PUBLISH_MIN_RATE_VOLTAGE = 3.5;
+
+// don't tighten the intervals again until charge has recovered this much
+const float PUBLISH_CHARGE_HYSTERESIS = 5;
+
+// number of meters counted by one device (e.g., -DMETER_CHANNELS=2), each
+// on its own pin (see METER_CHANNEL_CONFIGS), and all reported in the same
+// waterbot/data events: channel 0's fields have the usual keys, and the
+// others' add the channel number ("cur1", "pts1", ...)
+#ifndef METER_CHANNELS
+#define METER_CHANNELS 1
+#endif
+static_assert(METER_CHANNELS >= 1 && METER_CHANNELS <= 3, "METER_CHANNELS must be 1-3");
+const size_t METER_CHANNEL_COUNT = METER_CHANNELS;
+
+// each meter channel's waterbot/data fields, in order (see DataField)
+enum MeterField : uint8_t {
+    METER_READING, METER_LAST_READING, METER_USE, METER_USAGE_BUCKETS, METER_PTS,
+    METER_FIELD_COUNT
+};
+#define METER_FIELDS(suffix) \
+    numberField("cur" suffix, 0, UINT32_MAX),   /* meter reading (pulses) */ \
+    numberField("lst" suffix, 0, UINT32_MAX),   /* previous report's reading */ \
+    numberField("use" suffix, 0, UINT32_MAX), \
+    restField("agg" suffix),                    /* usage buckets (see AggFormatter) */ \
+    restField("pts" suffix)                     /* pulse times (see PtsFormatter) */
+
+// waterbot/data event fields, in order (see publishReport), at the
+// precision the server stores them
+enum DataField : uint8_t {
+    DATA_TIME, DATA_SENT_TIME, DATA_SEQ, DATA_PERIOD, DATA_TRIES,
+    DATA_PTS_PRECISION, DATA_PTS_VERSION,
+    DATA_METERS, // METER_FIELDS for each channel (see meterField)
+    DATA_SIGNAL = DATA_METERS + METER_FIELD_COUNT * METER_CHANNEL_COUNT,
+    DATA_SNR, DATA_STRENGTH, DATA_QUALITY,
+    DATA_BATTERY_VOLTAGE, DATA_BATTERY_CHARGE,
+    DATA_CONNECTS, DATA_CONNECTED_SECS, DATA_UPTIME, DATA_FREE_MEMORY, DATA_VERSION,
+    DATA_FIELD_COUNT
+};
+constexpr EventField DATA_FIELDS[DATA_FIELD_COUNT] = {
+    numberField("t", 0, UINT32_MAX),            // timestamp of meter data capture
+    numberField("at", 0, UINT32_MAX),           // actual now
+    numberField("seq", 0, UINT32_MAX),
+    numberField("per", INT32_MIN, INT32_MAX),   // secs since previous report
+    numberField("try", 0, UINT16_MAX),          // failed publish attempts
+    numberField("ptp", 0, 9),                   // pts precision (decimal digits)
+    numberField("ptv", 1, 2),                   // pts encoding (see PUBLISH_PACKED_PTS)
+    METER_FIELDS(""),
+#if METER_CHANNELS > 1
+    METER_FIELDS("1"),
+#endif
+#if METER_CHANNELS > 2
+    METER_FIELDS("2"),
+#endif
+    numberField("sig", -128, 127),              // WiFi RSSI, whole dBm
+    numberField("snr", -128, 127),              // WiFi SNR, whole dB
+    numberField("sgp", 0, 100, 1),              // WiFi strength, %
+    numberField("sqp", 0, 100, 1),              // WiFi quality, %
+    numberField("btv", 0, 5, 3),                // battery, V (fuel gauge has ~1mV resolution)
+    numberField("btp", 0, 256, 2),              // battery charge, % (can exceed 100)
+    numberField("con", 0, UINT32_MAX),          // cloud sessions since boot
+    numberField("cns", 0, UINT32_MAX),          // secs connected since boot
+    numberField("upt", 0, UINT32_MAX),          // secs since boot
+    numberField("mem", 0, UINT32_MAX),          // free memory, bytes
+    stringField("v", 11),                       // WATERBOT_VERSION
+};
+static_assert(sizeof(WATERBOT_VERSION) - 1 <= DATA_FIELDS[DATA_VERSION].max,
+    "WATERBOT_VERSION is too long for its waterbot/data field");
 
-// how many detailed pulse times we can store
+constexpr DataField meterField(size_t channel, MeterField field) {
+    return static_cast<DataField>(DATA_METERS + METER_FIELD_COUNT * channel + field);
+}
+
+// room for the pts array in a single publish, after the other fields
+// (with every value at its longest; any agg, and the other meter channels'
+// agg and pts, come out of this room, too); pulse times that don't fit are
+// left for a follow-up publish
+const size_t PUBLISH_MAX_PTS_LENGTH =
+    particle::protocol::MAX_EVENT_DATA_LENGTH - maxObjectLength(DATA_FIELDS);
+static_assert(maxObjectLength(DATA_FIELDS) + 100 <= particle::protocol::MAX_EVENT_DATA_LENGTH,
+    "waterbot/data fields leave too little room for pulse times");
+
+// most pts items that can fit (a packed one takes a byte, a JSON one two chars)
+const size_t PUBLISH_MAX_PTS_ITEMS = PUBLISH_PACKED_PTS
+    ? PackedPulseTimesWriter::maxBytes(PUBLISH_MAX_PTS_LENGTH - 2) // (less quotes)
+    : PUBLISH_MAX_PTS_LENGTH / 2;
+
+// shorter flow segments are reported as individual pulse deltas
+// (which take about as much room)
+const uint8_t PUBLISH_MIN_SEGMENT_PULSES = 5;
+
+// flow segments put each pulse within this of their steady rate, and the
+// rest of the way in its residual (so every pulse time is exact); keeping
+// it under 64ms packs each residual in a single byte
+const std::chrono::milliseconds PUBLISH_SEGMENT_TOLERANCE = 50ms;
+
+// longest flow segment: short enough that one always fits in a meter
+// channel's share of the pts room, even with every field at its longest
+// (packed: 10 bytes, plus 2 for each residual; JSON: 26 chars, plus 5 for
+// each), so a report never gets stuck behind a segment it can't hold
+const size_t PUBLISH_MIN_PTS_SHARE = PUBLISH_MAX_PTS_LENGTH / METER_CHANNEL_COUNT;
+const uint8_t PUBLISH_MAX_SEGMENT_PULSES = std::min<size_t>(FlowSegment::MAX_COUNT, PUBLISH_PACKED_PTS
+    ? (PackedPulseTimesWriter::maxBytes(PUBLISH_MIN_PTS_SHARE - 2) - 10) / 2
+    : (PUBLISH_MIN_PTS_SHARE - 26) / 5);
+
+// how much space to use for storing detailed pulse times
 // (without publishing, while cloud connection is unavailable);
+// a pulse takes one byte if its interval is within 31 msec of the previous
+// one's, two if it's within ~8 secs (up to five bytes if not), so this
+// holds roughly 1150-2350 pulses of flow (for each meter channel, if
+// there's only one: they split it, less room for their other retained data);
 // beyond this, the total reading will still be accurate,
-// but older individual pulse times will be lost
-const uint32_t PULSE_TIMES_BUFFER_SIZE = 700;
+// and older pulses are counted in usage buckets instead (USAGE_BUCKETS)
+const uint32_t PULSE_TIMES_BUFFER_BYTES = 2360 / METER_CHANNEL_COUNT - 40 * (METER_CHANNEL_COUNT - 1);
+
+// how many usage buckets to keep (for each meter channel) for pulse times
+// that didn't fit in pulseTimes (see UsageTiers): from a minute's pulses
+// each, merging into hours, then days, as more are needed
+const size_t USAGE_BUCKETS = 24 / METER_CHANNEL_COUNT;
+
+// keep this much of the pulse times buffer free, for pulses that arrive
+// while the main thread is busy (e.g., ~45 secs connecting at ~3 pulses/sec)
+const uint32_t PULSE_TIMES_RESERVE_BYTES = 160;
+
+// pulse times are on the millis() clock, which only places them within
+// ~24 days of a given time (as a signed 32-bit msec offset); so pulses
+// older than this lose their times (but are still counted) before they're
+// sealed in a report (see expirePulseTimes), and every report's pulse
+// times are within this of its own time
+const std::chrono::hours PULSE_TIMES_MAX_AGE = 20 * 24h;
 
 // pressing the reset button will wake up, connect to the cloud,
 // and stay away this long (for setup/diagnostics/updates):
@@ -38,64 +198,269 @@ const std::chrono::seconds RESET_STAY_AWAKE_INTERVAL = 10min;
 // don't bother sleeping for less than this
 const std::chrono::seconds MIN_SLEEP_INTERVAL = 10s;
 
+// while water keeps running, sleep with WiFi in standby (keeping the cloud
+// session) rather than powering it down and reconnecting for the next
+// publish, when that's cheaper. Relative to the current while connecting
+// (~80mA), standby adds about 3mA, and the radio staying on while awake
+// for each pulse adds about 50mA.
+const float NETWORK_STANDBY_COST_RATIO = 0.04;
+const float NETWORK_AWAKE_COST_RATIO = 0.6;
+
+// flow counts as continuing until this many of its recent average pulse
+// intervals pass without a pulse
+const float FLOW_CONTINUES_INTERVALS = 3;
+
 // never publish more often than this (Particle event throttling)
 const std::chrono::seconds PUBLISH_MIN_INTERVAL = 5s;
 
+// except when draining a backlog of pulse times (e.g., after a network
+// outage), chain publishes this closely within a single cloud session
+// (Particle allows a sustained rate of one event per second)
+const std::chrono::seconds PUBLISH_BACKLOG_INTERVAL = 1s;
+
+// the data event carries the device diagnostics we use, so only publish
+// Device OS's full vitals (another blocking round trip) after a reset,
+// then at most this often
+const std::chrono::seconds PUBLISH_VITALS_INTERVAL = 24h;
+
+// how often to publish the summary of phase timings (see Phase)
+const std::chrono::seconds PUBLISH_TIMING_INTERVAL = 24h;
+
+// reuse a fuel gauge reading for reports published within this long
+// (e.g., draining a backlog), rather than going back to the I2C bus
+const std::chrono::milliseconds BATTERY_READING_CACHE_TIME = 10s;
+
+// sealed reports waiting to be published (and acked); they're all
+// published without waiting for earlier acks, so this many can be in flight
+// at once (Particle allows bursts of up to four events)
+const size_t PUBLISH_QUEUE_LENGTH = 4;
+
 // timeouts for connecting to WiFi and cloud
 const std::chrono::seconds NETWORK_CONNECT_TIMEOUT = 15s;
 const std::chrono::seconds CLOUD_CONNECT_TIMEOUT = 30s;
 const std::chrono::seconds CLOUD_DISCONNECT_TIMEOUT = 10s;
 
+// once connected, how long to wait for the cloud to set the clock
+// (when the RTC was lost while powered down)
+const std::chrono::seconds SYNC_TIME_TIMEOUT = 10s;
+
 // retry delays when experiencing network issues
 const std::chrono::seconds NETWORK_PROBLEM_INITIAL_DELAY = 1min;
 const std::chrono::seconds NETWORK_PROBLEM_MAX_DELAY = 1h;
 
+// while awake, loop() waits for something to do (a pulse, a publish result,
+// signalling finished) or its next deadline, but no longer than this;
+// cloud functions only run between loop() calls, so it's shorter while
+// connected to the cloud
+const std::chrono::seconds LOOP_MAX_WAIT = 1min;
+const std::chrono::seconds LOOP_CONNECTED_MAX_WAIT = 1s;
+
+// how often loop() checks on pulse detection while it's debouncing
+const std::chrono::milliseconds LOOP_DEBOUNCE_POLL_INTERVAL = 50ms;
+
+// how often loop() checks for the RTC's first tick once it's set
+// (pulse times are anchored to that tick; see updateClockAnchor)
+const std::chrono::milliseconds LOOP_CLOCK_POLL_INTERVAL = 10ms;
+
 // timing for pulse signalling (on the user LED)
 const std::chrono::milliseconds SIGNAL_MSEC_ON = 350ms;
 const std::chrono::milliseconds SIGNAL_MSEC_OFF = 150ms;
 
+// Pulse detection engine (choose at compile time, e.g. -DPULSE_DETECTION=2):
+//   PULSE_DETECT_TIMER: pulseISR (re)starts a DEBOUNCE_MSEC software timer
+//     on each falling edge, and the pulse counts if the switch is still
+//     closed when it fires (limits flow to a few pulses per second)
+//   PULSE_DETECT_EDGES: pulseISR timestamps every switch edge, and
+//     EdgeDebouncer counts the pulse once the switch has stayed closed for
+//     EDGE_DEBOUNCE_MIN_CLOSED (no timer; for higher-resolution meters)
+#define PULSE_DETECT_TIMER 1
+#define PULSE_DETECT_EDGES 2
+#ifndef PULSE_DETECTION
+#define PULSE_DETECTION PULSE_DETECT_TIMER
+#endif
+
 // reject pulses shorter than this as noise
 // (must be less than meter pulse width at maximum flow)
 const std::chrono::milliseconds DEBOUNCE_MSEC = 300ms;
 
+// with PULSE_DETECT_EDGES, the switch must stay closed this long to count
+// a pulse, then open this long before the next one can count
+// (longer than contact bounce and noise, shorter than half a pulse
+// at maximum flow)
+const std::chrono::microseconds EDGE_DEBOUNCE_MIN_CLOSED = 8ms;
+const std::chrono::microseconds EDGE_DEBOUNCE_MIN_OPEN = 8ms;
+
 
 // Hardware constants
 
-// PIN_PULSE_SWITCH is meter connection:
-//   * must support attachInterrupt
+// PIN_PULSE_SWITCH is meter connection (and each meter channel's, in
+// METER_CHANNEL_CONFIGS):
+//   * must support attachInterrupt, on an EXTI line no other meter pin
+//     shares (on Photon, D2 shares with A0 and A3, D4 with A1)
 //   * must support wake from ultra-low-power sleep
 //   * must not conflict with PowerShield (D0, D1, or D3)
 const pin_t PIN_PULSE_SWITCH = D2; // Meter
 
+// each meter channel's pin and pulse detection timing (see DEBOUNCE_MSEC
+// and EDGE_DEBOUNCE_MIN_*)
+struct MeterChannelConfig {
+    pin_t pin;
+    std::chrono::milliseconds debounce; // (PULSE_DETECT_TIMER)
+    std::chrono::microseconds minClosed; // (PULSE_DETECT_EDGES)
+    std::chrono::microseconds minOpen;
+};
+const MeterChannelConfig METER_CHANNEL_CONFIGS[METER_CHANNEL_COUNT] = {
+    {PIN_PULSE_SWITCH, DEBOUNCE_MSEC, EDGE_DEBOUNCE_MIN_CLOSED, EDGE_DEBOUNCE_MIN_OPEN},
+#if METER_CHANNELS > 1
+    {D4, DEBOUNCE_MSEC, EDGE_DEBOUNCE_MIN_CLOSED, EDGE_DEBOUNCE_MIN_OPEN},
+#endif
+#if METER_CHANNELS > 2
+    {D5, DEBOUNCE_MSEC, EDGE_DEBOUNCE_MIN_CLOSED, EDGE_DEBOUNCE_MIN_OPEN},
+#endif
+};
+
 const pin_t PIN_LED_SIGNAL = D7; // Blink to indicate meter pulses
 
 
 // Cloud messaging constants
 
 const char* const EVENT_DATA = "waterbot/data"; // publish data to cloud
+const char* const EVENT_TIMING = "waterbot/timing"; // phase timing summary
+const char* const EVENT_PROFILE = "waterbot/profile"; // (PROFILE_INTERRUPTS builds)
 
 const char* const FUNC_SET_READING = "setReading"; // reset from cloud
 const char* const FUNC_PUBLISH_NOW = "publishNow";
 const char* const FUNC_SLEEP_NOW = "sleepNow";
 const char* const FUNC_SELECT_ANTENNA = "selectAntenna";
+const char* const FUNC_PUBLISH_PROFILE = "publishProfile"; // (PROFILE_INTERRUPTS builds)
+
+const char* const VAR_STANDBY_SLEEPS = "standbySleep";
+const char* const VAR_POWER_DOWN_SLEEPS = "offSleep";
+
+// FIFO of pulse timestamps (as millis() values), delta-compressed.
+// Populated by recordPulse. Consumed by the main thread (publishData),
+// which also drops the oldest pulse timestamps when it's getting full.
+// (PulseTimesRing is a lock-free single-producer/single-consumer queue,
+// so needs no ATOMIC_BLOCK between those two.)
+typedef PulseTimesRing<PULSE_TIMES_BUFFER_BYTES> PulseTimesBuffer;
 
-// FIFO of pulse timestamps (as Time.now() values).
-// Populated by pulseISR. Consumed by publishData.
-// On overflow, oldest pulse timestamps are lost.
-// (Note that CircularBuffer operations are not thread- or
-// interrupt-safe, so should be wrapped in ATOMIC_BLOCK.)
-typedef CircularBuffer<time32_t, PULSE_TIMES_BUFFER_SIZE> PulseTimesBuffer;
+// Pulse counts (and time spans) for the oldest unreported pulses that
+// pulseTimes had to drop; see makeRoomForPulseTimes. Reported (in "agg")
+// ahead of the pulse times, and then retired with them.
+typedef UsageTiers<USAGE_BUCKETS> UsageTiersBuffer;
 
 // Version of DeviceOS Timer that supports chrono expressions in constructor.
 class MillisecondTimer : public Timer {
 public:
     MillisecondTimer(std::chrono::milliseconds period, timer_callback_fn callback_, bool one_shot=false)
         : Timer(period.count(), callback_, one_shot) {}
+
+    // (Device OS keeps a pointer to the Timer, so it mustn't move)
+    MillisecondTimer(const MillisecondTimer&) = delete;
+    MillisecondTimer(MillisecondTimer&&) = delete;
+    MillisecondTimer& operator=(const MillisecondTimer&) = delete;
+    MillisecondTimer& operator=(MillisecondTimer&&) = delete;
+};
+
+// A binary semaphore (one-item os_queue), for a thread to wait on until
+// there's work for it. signal() is safe from ISRs and timer callbacks.
+class Wakeup {
+public:
+    void begin() {
+        os_queue_create(&queue_, 1, 1, nullptr);
+    }
+    void signal() {
+        uint8_t item = 0;
+        os_queue_put(queue_, &item, 0, nullptr); // (already signalled if full)
+    }
+    // Returns true if signalled, false on timeout
+    bool wait(std::chrono::milliseconds timeout) {
+        uint8_t item;
+        return os_queue_take(queue_, &item, timeout.count(), nullptr) == 0;
+    }
+    void waitForever() {
+        uint8_t item;
+        os_queue_take(queue_, &item, CONCURRENT_WAIT_FOREVER, nullptr);
+    }
+private:
+    os_queue_t queue_ = nullptr;
 };
 
 // Value that is not (and is always less than) Time.now()
 const time32_t INVALID_TIME = 0;
 
+// One meter channel's part of a sealed report
+typedef struct {
+    uint32_t pulseCount;
+    uint16_t pulseTimesCount; // next oldest pulseTimes (after earlier reports')
+    uint8_t usageBucketCount; // next oldest usageTiers (before its pulseTimes)
+} reportMeter_t;
+
+// A sealed report: the metering data for one waterbot/data event.
+// It's published (and retried) until acked, and retired (in order) after
+// that. Its "lst" and "per" come from the report before it in the queue
+// (or lastPublish*, for the oldest). Once sent, its data must not change
+// (a retry is the same event, to the server); see makeRoomForPulseTimes.
+typedef struct {
+    time32_t time; // timestamp of meter data capture
+    uint32_t seq;
+    uint16_t failureCount;
+    bool acked; // (but earlier reports aren't yet)
+    bool sent; // handed to Particle.publish (at least once)
+    reportMeter_t meters[METER_CHANNEL_COUNT];
+} report_t;
+
+// Phases of each wake whose durations are tracked in retainedData.phaseStats,
+// and summarized in waterbot/timing events (under these keys)
+enum Phase : uint8_t {
+    PHASE_AWAKE,        // msec from wake (or boot) until sleep
+    PHASE_ASLEEP,       // secs
+    PHASE_WIFI,         // msec to connect WiFi (when it wasn't)
+    PHASE_CLOUD,        // msec to connect the cloud session (when it wasn't)
+    PHASE_FORMAT,       // usec to format a waterbot/data event
+    PHASE_ACK,          // msec from publishing a waterbot/data event until acked (or failed)
+    PHASE_VITALS,       // msec to publish vitals
+    PHASE_DISCONNECT,   // msec to disconnect and power down WiFi
+    PHASE_COUNT
+};
+const char* const PHASE_KEYS[PHASE_COUNT] = {"awk", "slp", "wfi", "cld", "fmt", "ack", "vit", "dsc"};
+
+#if PROFILE_INTERRUPTS
+// Interrupt profiling probes (see InterruptProfile.h), and their keys
+// in waterbot/profile events
+enum ProfileSite : uint8_t {
+    PROFILE_PULSE_ISR,          // usec in pulseISR
+    PROFILE_PULSE_LATENCY,      // msec a pulse was counted after it could have been
+    PROFILE_POLL_DETECTION,     // usec in ATOMIC_BLOCK in pollPulseDetection
+    PROFILE_REARM_DETECTION,    // usec in ATOMIC_BLOCK in rearmPulseDetection
+    PROFILE_SITE_COUNT
+};
+const char* const PROFILE_KEYS[PROFILE_SITE_COUNT] = {"isr", "lat", "pol", "arm"};
+#endif
+
+// One meter channel's metering state (in retainedData)
+typedef struct {
+    // Current meter reading:
+    std::atomic<uint32_t> currentPulseCount;
+
+    // Updated when a report is retired (after its publish is acked):
+    uint32_t lastPublishPulseCount;
+
+    // Captured, not-yet-reported times for each pulse, on the millis() clock:
+    // (PulseTimesRing has no constructor, so can be retained directly)
+    PulseTimesBuffer pulseTimes;
+
+    // Counts of older unreported pulses, whose times didn't fit in pulseTimes
+    UsageTiersBuffer usageTiers;
+
+    // What the sent (maybe not yet acked) reports hold: the newest one's
+    // reading (else lastPublishPulseCount), and how many of the oldest
+    // pulseTimes and usageTiers they hold (see updateSentReports)
+    uint32_t sentPulseCount;
+    uint16_t sentPulseTimesCount;
+    uint8_t sentUsageBucketCount;
+} meterState_t;
+
 //
 // Retained data (backup RAM / SRAM)
 // So long as the device maintains battery power, this data will survive
@@ -107,73 +472,253 @@ typedef struct {
     // rearranging it in newer versions. (It may still get relocated, which is
     // detected by the magic number.)
     // https://community.particle.io/t/retained-variables-are-reset-after-adding-a-new-one/58847/2
+    // Everything in it is plain data (positions, not pointers), with no
+    // constructors, so it's all initialized in validateRetainedData().
     uint32_t magic;
     uint16_t size;
     uint16_t dataLayoutVersion;
 
-    // Current meter reading:
-    volatile uint32_t currentPulseCount;
+    //
+    // Metering state: kept across firmware updates that only change the
+    // layout of the fields after it, as long as meteringLayout still matches
+    // (so updates don't lose the reading or unreported pulse times).
+    //
+    uint32_t meteringLayout;
 
-    // Updated on successful publish:
+    // Updated when a report is retired (after its publish is acked):
     time32_t lastPublishTime;
-    uint32_t lastPublishPulseCount;
-    uint32_t publishCount; // number of publishes since power up
 
-    // In-progress publish attempt:
-    time32_t pendingPublishTime; // INVALID_TIME if publish not in progress
-    uint32_t pendingPublishPulseCount;
-    uint32_t pendingPublishFailureCount;
-    std::array<time32_t, PUBLISH_MAX_PULSE_TIMES + 2> pendingPublishPulseTimes;
-    // (+2 in case a few pulses sneak in as we're waking and deciding whether to publish)
+    // Wall clock time of the millis() clock: Time.now() was clockAnchorTime
+    // at millis() == clockAnchorMsec (INVALID_TIME if not known yet)
+    time32_t clockAnchorTime;
+    uint32_t clockAnchorMsec;
 
-    // Captured, not-yet-reported times for each pulse:
-    // PulseTimesBuffer pulseTimes; // (doesn't work, because constructor runs on every reset)
-    uint8_t pulseTimesBuf[sizeof(PulseTimesBuffer)]; // workaround
-    PulseTimesBuffer& pulseTimes = reinterpret_cast<PulseTimesBuffer&>(pulseTimesBuf);
+    // Each meter channel's pulses:
+    meterState_t meters[METER_CHANNEL_COUNT];
+
+    // The newest sent report's time (else lastPublishTime)
+    time32_t sentReportTime;
+
+    //
+    // Report queue: kept across firmware updates that only change the
+    // fields after it, as long as reportsLayout still matches (and the
+    // metering state was kept). If not, the sent reports' data counts as
+    // delivered (see validateRetainedData).
+    //
+    uint32_t reportsLayout;
+
+    // Reports not yet retired, oldest first:
+    report_t queuedReports[PUBLISH_QUEUE_LENGTH];
+    uint8_t queuedReportCount;
+    uint32_t reportCount; // number of reports since power up (next seq)
+
+    //
+    // Everything else (reset if dataLayoutVersion changes):
+    //
+
+    // Phase timings since phaseStatsSince (INVALID_TIME until the clock is
+    // set), reset after each waterbot/timing summary
+    PhaseStats phaseStats[PHASE_COUNT];
+    time32_t phaseStatsSince;
 
     // If you add fields, add an initializer to validateRetainedData().
-    // If you rearrange or resize any fields, also increment this:
-    const uint16_t CURRENT_DATA_LAYOUT_VERSION = 4;
+    // If you rearrange or resize any fields, also increment
+    // RETAINED_DATA_LAYOUT_VERSION (and change RETAINED_METERING_LAYOUT or
+    // RETAINED_REPORTS_LAYOUT, for the metering state or report queue).
 
 } retainedData_t;
 
 retained retainedData_t retainedData;
 static_assert(sizeof(retainedData_t) <= 3068,
     "Photon has only 3068 bytes of backup RAM for retainedData.");
+static_assert(std::is_trivially_default_constructible<retainedData_t>::value,
+    "retainedData must not have a constructor (which would reset it at boot).");
 
 // Simplify read access to retainedData members:
-const auto& currentPulseCount = retainedData.currentPulseCount;
 const auto& lastPublishTime = retainedData.lastPublishTime;
-const auto& lastPublishPulseCount = retainedData.lastPublishPulseCount;
-const auto& publishCount = retainedData.publishCount;
-const auto& pendingPublishTime = retainedData.pendingPublishTime;
-const auto& pendingPublishPulseCount = retainedData.pendingPublishPulseCount;
-const auto& pendingPublishFailureCount = retainedData.pendingPublishFailureCount;
-const auto& pendingPublishPulseTimes = retainedData.pendingPublishPulseTimes;
-const auto& pulseTimes = retainedData.pulseTimes;
+const auto& queuedReports = retainedData.queuedReports;
+const auto& queuedReportCount = retainedData.queuedReportCount;
+const auto& reportCount = retainedData.reportCount;
+const auto& clockAnchorTime = retainedData.clockAnchorTime;
+const auto& clockAnchorMsec = retainedData.clockAnchorMsec;
+const auto& meters = retainedData.meters;
+const auto& phaseStatsSince = retainedData.phaseStatsSince;
 
 // Don't change this (or you will invalidate all retainedData).
 // It's just a fixed, randomly-generated, non-zero number.
 const uint32_t RETAINED_DATA_MAGIC = 0x8abfc1b1;
 
+// See retainedData_t. The metering and reports layouts are also fixed,
+// random numbers: change one to another if you rearrange its fields
+// (including report_t, for the reports layout). (They also differ for
+// each number of meter channels.)
+const uint16_t RETAINED_DATA_LAYOUT_VERSION = 17;
+const uint32_t RETAINED_METERING_LAYOUT = 0x6f0a52c8 ^ METER_CHANNEL_COUNT;
+const uint32_t RETAINED_REPORTS_LAYOUT = 0x93e1d7a5 ^ METER_CHANNEL_COUNT;
+
 
 //
 // Non-persistent global data (lost during hibernate or reset)
 //
 
-volatile uint32_t pulsesToSignal = 0;
+std::atomic<uint32_t> pulsesToSignal(0);
+
+// Wake the main loop and pulseSignal threads when there's work for them
+Wakeup loopWakeup;
+Wakeup pulseSignalWakeup;
+
+// Incremented before and after recordPulse updates a meter channel's
+// currentPulseCount and pulseTimes (so odd while an update is in progress);
+// see snapshotPulses()
+std::array<std::atomic<uint32_t>, METER_CHANNEL_COUNT> pulseUpdateSeqs = {};
 volatile bool publishImmediately = false;
 
 time32_t stayAwakeUntilTime = 0; // prevents sleeping when > Time.now()
 time32_t earliestNextPublishTime = 0; // delays publish attempts when > Time.now()
 time32_t networkProblemRetryDelay = 0; // seconds; 0 when no network problems
 
+// Work for the publisher thread (from loop), and its results.
+// (A report whose publish was lost to a reset just gets published again.)
+enum PublishKind : uint8_t {
+    PUBLISH_REPORT, // queuedReports seq
+    PUBLISH_VITALS,
+    PUBLISH_TIMING, // timingSummary
+    PUBLISH_SYNC_TIME, // (just connect, and set the RTC from the cloud)
+};
+struct PublishJob {
+    uint32_t seq;
+    PublishKind kind;
+};
+struct PublishResult {
+    uint32_t seq;
+    PublishKind kind;
+    bool succeeded; // acked (or connection failed)
+    bool unsealed; // (PUBLISH_REPORT) nothing published: see makeRoomForPulseTimes
+    float batteryCharge; // fuel gauge reading when published
+    float batteryVoltage; // (0 if not read)
+    uint32_t phaseTimes[PHASE_COUNT]; // publisher thread phases (or NOT_TIMED)
+};
+const uint32_t NOT_TIMED = UINT32_MAX;
+os_queue_t publishJobs = nullptr;
+os_queue_t publishResults = nullptr;
+
+// Reports (by seq) handed to the publisher thread, still awaiting results
+std::array<uint32_t, PUBLISH_QUEUE_LENGTH> publishingSeqs;
+size_t publishingCount = 0;
+bool publishingVitals = false;
+time32_t lastVitalsTime = INVALID_TIME;
+
+// Setting the clock (main thread; see startClock): until the RTC is valid
+// and pulse times are anchored to it, nothing can be reported. If it isn't
+// valid, the publisher thread is asked to connect and sync it, retrying no
+// sooner than millis() == nextSyncTimeMsec.
+bool clockStarted = false;
+bool syncingTime = false;
+system_tick_t nextSyncTimeMsec = 0;
+
+// The phase timings being published (moved out of retainedData by the main
+// thread; merged back if the publish fails)
+PhaseStats timingSummary[PHASE_COUNT];
+time32_t timingSummarySince = INVALID_TIME;
+bool publishingTiming = false;
+
+// When the current wake (or boot) started (main thread)
+system_tick_t awakeSinceMsec = 0;
+
+// Flow prediction (main thread): when the most recent pulse arrived (as
+// seen by loop), and the recent average interval between pulses
+uint32_t flowSeenPulseCount = 0;
+system_tick_t flowLastPulseMsec = 0;
+float flowAvgIntervalMsec = 0; // 0 if unknown
+
+// Recent average time to connect WiFi and cloud (from the publisher thread)
+std::atomic<uint32_t> avgConnectMsec(0);
+
+// How often a sleep kept the network in standby, or powered it down
+// (when there was a choice; Particle variables)
+int standbySleepCount = 0;
+int powerDownSleepCount = 0;
+
+// Cloud session counters since boot, reported in each data event
+// (so the server can see how long each wake keeps the radio busy)
+std::atomic<uint32_t> cloudConnectCount(0);
+std::atomic<uint32_t> cloudConnectedMsec(0); // in completed sessions
+std::atomic<system_tick_t> cloudSessionStartMsec(0); // 0 if no session
+
+// Guards queuedReports, lastPublish*, the consumer side of pulseTimes,
+// and publishSegments: the publisher thread reads them to format a report.
+Mutex reportsLock;
+
+// pulseTimes for the report being sealed or published, encoded for the pts array
+// (every pulse in it takes at least a byte or two chars), and their residuals
+std::array<FlowSegment, PUBLISH_MAX_PTS_ITEMS> publishSegments;
+std::array<int8_t, PUBLISH_MAX_PTS_ITEMS> publishResiduals;
+
 PowerShield batteryMonitor;
 
+// Sets the publish cadence (used by the main thread only).
+// (FixedPublishPolicy would publish at the base intervals regardless.)
+BatteryAwarePublishPolicy batteryAwarePublishPolicy({
+    static_cast<uint32_t>(PUBLISH_IN_USE_INTERVAL.count()),
+    static_cast<uint32_t>(PUBLISH_HEARTBEAT_INTERVAL.count()),
+    PUBLISH_MAX_PULSE_TIMES,
+    PUBLISH_MAX_STRETCH_SHIFT,
+    PUBLISH_FULL_RATE_CHARGE,
+    PUBLISH_MIN_RATE_CHARGE,
+    PUBLISH_MIN_RATE_VOLTAGE,
+    PUBLISH_CHARGE_HYSTERESIS,
+});
+PublishPolicy* publishPolicy = &batteryAwarePublishPolicy;
+
 Thread *pulseSignalThread = nullptr;
+Thread *publisherThread = nullptr;
+
+#if PROFILE_INTERRUPTS
+// (zero initialized is the same as clear())
+PhaseStats profileStats[PROFILE_SITE_COUNT];
+#endif
+
+// Pulse detection state for each meter channel (from METER_CHANNEL_CONFIGS),
+// and its interrupt handler (attachInterrupt needs a plain function for each)
+void pulseISR(size_t channel);
+template<size_t channel>
+void channelPulseISR() {
+    pulseISR(channel);
+}
+template<size_t... channels>
+constexpr std::array<void (*)(), METER_CHANNEL_COUNT> makePulseISRs(std::index_sequence<channels...>) {
+    return {channelPulseISR<channels>...};
+}
+const auto PULSE_ISRS = makePulseISRs(std::make_index_sequence<METER_CHANNEL_COUNT>());
 
-void pulseTimerCallback(void);
-MillisecondTimer pulseDebounceTimer(DEBOUNCE_MSEC, pulseTimerCallback, true);
+#if PULSE_DETECTION == PULSE_DETECT_EDGES
+template<size_t... channels>
+std::array<EdgeDebouncer, METER_CHANNEL_COUNT> makePulseEdges(std::index_sequence<channels...>) {
+    return {EdgeDebouncer(METER_CHANNEL_CONFIGS[channels].minClosed.count(),
+                          METER_CHANNEL_CONFIGS[channels].minOpen.count())...};
+}
+std::array<EdgeDebouncer, METER_CHANNEL_COUNT> pulseEdges =
+    makePulseEdges(std::make_index_sequence<METER_CHANNEL_COUNT>());
+#else
+void pulseTimerCallback(size_t channel);
+// (each constructed in place: see MillisecondTimer)
+MillisecondTimer pulseDebounceTimers[METER_CHANNEL_COUNT] = {
+    {METER_CHANNEL_CONFIGS[0].debounce, [] { pulseTimerCallback(0); }, true},
+#if METER_CHANNELS > 1
+    {METER_CHANNEL_CONFIGS[1].debounce, [] { pulseTimerCallback(1); }, true},
+#endif
+#if METER_CHANNELS > 2
+    {METER_CHANNEL_CONFIGS[2].debounce, [] { pulseTimerCallback(2); }, true},
+#endif
+};
+#if PROFILE_INTERRUPTS
+// The first edge of the pulse each debounce timer is pending for (the
+// timer callback clears pulseEdgePending). Tracked here, rather than asking
+// the timer, because Timer::isActive isn't safe to call from an ISR.
+volatile uint32_t pulseEdgeUsec[METER_CHANNEL_COUNT] = {};
+volatile bool pulseEdgePending[METER_CHANNEL_COUNT] = {};
+#endif
+#endif
 
 LEDStatus ledSignalNetworkProblem(
     RGB_COLOR_ORANGE, LED_PATTERN_BLINK,
@@ -187,67 +732,318 @@ LEDStatus ledSignalTimeInvalid(
 // Code
 //
 
+uint16_t reportedPulseTimesCount(size_t channel) {
+    // Number of (oldest) pulseTimes included in queuedReports
+    uint32_t count = 0;
+    for (size_t i = 0; i < std::min<size_t>(queuedReportCount, PUBLISH_QUEUE_LENGTH); i++) {
+        count += queuedReports[i].meters[channel].pulseTimesCount;
+    }
+    return std::min<uint32_t>(count, UINT16_MAX);
+}
+
+uint8_t reportedUsageBucketCount(size_t channel) {
+    // Number of (oldest) usageTiers buckets included in queuedReports
+    uint32_t count = 0;
+    for (size_t i = 0; i < std::min<size_t>(queuedReportCount, PUBLISH_QUEUE_LENGTH); i++) {
+        count += queuedReports[i].meters[channel].usageBucketCount;
+    }
+    return std::min<uint32_t>(count, UINT8_MAX);
+}
+
+void updateSentReports() {
+    // Note what the sent reports in queuedReports hold, in the metering
+    // state (after a report is sent or retired; see validateRetainedData).
+    // (They're sent in order, so they're the oldest.)
+    // (Call with reportsLock held.)
+    retainedData.sentReportTime = lastPublishTime;
+    for (meterState_t& meter: retainedData.meters) {
+        meter.sentPulseCount = meter.lastPublishPulseCount;
+        meter.sentPulseTimesCount = 0;
+        meter.sentUsageBucketCount = 0;
+    }
+    for (size_t i = 0; i < queuedReportCount && queuedReports[i].sent; i++) {
+        retainedData.sentReportTime = queuedReports[i].time;
+        for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+            const reportMeter_t& reportMeter = queuedReports[i].meters[channel];
+            meterState_t& meter = retainedData.meters[channel];
+            meter.sentPulseCount = reportMeter.pulseCount;
+            meter.sentPulseTimesCount += reportMeter.pulseTimesCount;
+            meter.sentUsageBucketCount += reportMeter.usageBucketCount;
+        }
+    }
+}
+
+void clearPulseTimes(size_t channel) {
+    // Drop the channel's pulseTimes and usageTiers (but not its count),
+    // including any in unsent queuedReports. A sent report's data must not
+    // change (see report_t), so it keeps the oldest ones it holds.
+    // (Call with reportsLock held.)
+    meterState_t& meter = retainedData.meters[channel];
+    uint16_t sentPulseTimes = 0;
+    uint8_t sentBuckets = 0;
+    for (size_t i = 0; i < queuedReportCount; i++) {
+        reportMeter_t& reportMeter = retainedData.queuedReports[i].meters[channel];
+        if (queuedReports[i].sent) {
+            sentPulseTimes += reportMeter.pulseTimesCount;
+            sentBuckets += reportMeter.usageBucketCount;
+        } else {
+            reportMeter.pulseTimesCount = 0;
+            reportMeter.usageBucketCount = 0;
+        }
+    }
+    meter.usageTiers.truncate(sentBuckets);
+    // (That's the producer's end of pulseTimes: do it between recordPulse
+    // calls, with nothing else running.)
+    const std::atomic<uint32_t>& updateSeq = pulseUpdateSeqs[channel];
+    while (true) {
+        ATOMIC_BLOCK() {
+            if ((updateSeq.load(std::memory_order_acquire) & 1) == 0) {
+                meter.pulseTimes.truncate(sentPulseTimes);
+                return;
+            }
+        }
+        os_thread_yield();
+    }
+}
+
 bool validateRetainedData() {
     // Verify retainedData is usable, or initialize if not.
     // Returns false if data needed to be reinitialized.
 
-    if (retainedData.magic == RETAINED_DATA_MAGIC
-        && retainedData.size == sizeof(retainedData)
-        && retainedData.dataLayoutVersion == retainedData.CURRENT_DATA_LAYOUT_VERSION
-    ) {
+    bool meteringValid = retainedData.magic == RETAINED_DATA_MAGIC
+        && retainedData.meteringLayout == RETAINED_METERING_LAYOUT;
+    // (Not comparing the readings: setReading can lower currentPulseCount
+    // below lastPublishPulseCount, and that's no reason to lose the backlog.)
+    for (const meterState_t& meter: retainedData.meters) {
+        meteringValid = meteringValid
+            && meter.pulseTimes.isValid()
+            && meter.usageTiers.isValid();
+    }
+    bool reportsValid = meteringValid
+        && retainedData.reportsLayout == RETAINED_REPORTS_LAYOUT
+        && retainedData.queuedReportCount <= PUBLISH_QUEUE_LENGTH;
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT && reportsValid; channel++) {
+        reportsValid = reportedPulseTimesCount(channel) <= meters[channel].pulseTimes.size()
+            && reportedUsageBucketCount(channel) <= meters[channel].usageTiers.size();
+    }
+    bool othersValid = retainedData.size == sizeof(retainedData)
+        && retainedData.dataLayoutVersion == RETAINED_DATA_LAYOUT_VERSION;
+    if (reportsValid && othersValid) {
         // retainedData is (probably) fine
         return true;
     }
 
-    // Either retainedData has never been initialized,
-    // or its layout has changed (due to a firmware update).
-    // For now, just re-initialize everything.
-    // (Could get fancier with version migrations if needed later.)
-
-    retainedData.currentPulseCount = 0;
-    retainedData.lastPublishTime = INVALID_TIME;
-    retainedData.lastPublishPulseCount = 0;
-    retainedData.publishCount = 0;
-    retainedData.pendingPublishTime = INVALID_TIME;
-    retainedData.pendingPublishPulseCount = 0;
-    retainedData.pendingPublishFailureCount = 0;
-    retainedData.pendingPublishPulseTimes.fill(INVALID_TIME);
-    retainedData.pulseTimes.clear(); // equivalent to CircularBuffer constructor
+    // Either retainedData has never been initialized, or its layout has
+    // changed (due to a firmware update). Keep the metering state and
+    // report queue if their layouts didn't change.
+    if (meteringValid && !reportsValid) {
+        // The sent reports may already be on the server, so count their
+        // data as delivered (sealing it again, under a new seq, would
+        // count it twice). Unsent reports' pulses are still in pulseTimes,
+        // and will be reported again.
+        retainedData.lastPublishTime = retainedData.sentReportTime;
+        for (meterState_t& meter: retainedData.meters) {
+            meter.lastPublishPulseCount = meter.sentPulseCount;
+            for (uint16_t i = 0; i < meter.sentPulseTimesCount && !meter.pulseTimes.isEmpty(); i++) {
+                meter.pulseTimes.shift();
+            }
+            meter.usageTiers.shift(std::min<size_t>(meter.sentUsageBucketCount, meter.usageTiers.size()));
+            meter.sentPulseTimesCount = 0;
+            meter.sentUsageBucketCount = 0;
+        }
+    }
+    if (!meteringValid) {
+        retainedData.lastPublishTime = INVALID_TIME;
+        retainedData.clockAnchorTime = INVALID_TIME;
+        retainedData.clockAnchorMsec = 0;
+        for (meterState_t& meter: retainedData.meters) {
+            meter.currentPulseCount = 0;
+            meter.lastPublishPulseCount = 0;
+            meter.pulseTimes.clear();
+            meter.usageTiers.clear();
+            meter.sentPulseCount = 0;
+            meter.sentPulseTimesCount = 0;
+            meter.sentUsageBucketCount = 0;
+        }
+        retainedData.sentReportTime = INVALID_TIME;
+        retainedData.meteringLayout = RETAINED_METERING_LAYOUT;
+    }
+    if (!reportsValid) {
+        retainedData.queuedReportCount = 0;
+        retainedData.reportCount = 0;
+        retainedData.reportsLayout = RETAINED_REPORTS_LAYOUT;
+    }
+    for (PhaseStats& stats: retainedData.phaseStats) {
+        stats.clear();
+    }
+    retainedData.phaseStatsSince = INVALID_TIME;
 
     // If you add new retained data above, be sure to add
     // an equivalent initializer here.
 
     retainedData.magic = RETAINED_DATA_MAGIC;
     retainedData.size = sizeof(retainedData);
-    retainedData.dataLayoutVersion = retainedData.CURRENT_DATA_LAYOUT_VERSION;
+    retainedData.dataLayoutVersion = RETAINED_DATA_LAYOUT_VERSION;
     return false;
 }
 
 
-void pulseISR() {
-    // Interrupt handler for PIN_PULSE_SWITCH.
+void recordPulse(size_t channel, uint32_t pulseMsec) {
+    // Count a (debounced) pulse on a meter channel, and capture its time (on
+    // the millis() clock, so it doesn't matter whether the RTC is valid yet).
+    // Only one context may call this for each channel (it's the channel's
+    // pulseTimes producer): pulseTimerCallback or pulseISR, depending on
+    // PULSE_DETECTION. (Or another thread with interrupts disabled, for
+    // PULSE_DETECT_EDGES.)
+    std::atomic<uint32_t>& updateSeq = pulseUpdateSeqs[channel];
+    uint32_t seq = updateSeq.load(std::memory_order_relaxed);
+    updateSeq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    retainedData.meters[channel].currentPulseCount += 1;
+    // (If the buffer is full, this pulse's time is lost,
+    // but it's still counted.)
+    retainedData.meters[channel].pulseTimes.push(pulseMsec);
+
+    updateSeq.store(seq + 2, std::memory_order_release);
+    pulsesToSignal += 1;
+    pulseSignalWakeup.signal();
+    loopWakeup.signal();
+}
+
+#if PULSE_DETECTION == PULSE_DETECT_EDGES
+
+uint32_t edgePulseMsec(size_t channel) {
+    // millis() at the start of the pulse pulseEdges[channel] just confirmed
+    const uint32_t startUsec = pulseEdges[channel].pulseStartUsec();
+    PROFILE_SAMPLE(profileStats[PROFILE_PULSE_LATENCY],
+        (micros() - startUsec - METER_CHANNEL_CONFIGS[channel].minClosed.count()) / 1000);
+    return millis() - (micros() - startUsec) / 1000;
+}
+
+void pulseISR(size_t channel) {
+    // Interrupt handler for the channel's pin (on CHANGE).
+    // Timestamp the edge, and record a pulse if it confirms the switch
+    // had stayed closed long enough. Bounces and noise end up back in here
+    // too soon to confirm anything. (A switch that stays closed is
+    // confirmed by pollPulseDetection.)
+    PROFILE_SCOPE(profileStats[PROFILE_PULSE_ISR]);
+    if (pulseEdges[channel].edge(micros(), digitalRead(METER_CHANNEL_CONFIGS[channel].pin))) {
+        recordPulse(channel, edgePulseMsec(channel));
+    }
+}
+
+bool pollPulseDetection() {
+    // Record a pulse on any channel whose switch has now stayed closed long
+    // enough (without another edge). Returns true while still debouncing.
+    bool settling = false;
+    ATOMIC_BLOCK() {
+        PROFILE_SCOPE(profileStats[PROFILE_POLL_DETECTION]);
+        for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+            if (pulseEdges[channel].poll(micros())) {
+                recordPulse(channel, edgePulseMsec(channel));
+            }
+            settling = settling || pulseEdges[channel].isSettling();
+        }
+    }
+    return settling;
+}
+
+void rearmPulseDetection() {
+    // About to sleep, waking on a switch's next closing. (If one's closed
+    // now, it must open before then, but we won't see that edge.)
+    ATOMIC_BLOCK() {
+        PROFILE_SCOPE(profileStats[PROFILE_REARM_DETECTION]);
+        for (EdgeDebouncer& edges: pulseEdges) {
+            edges.reset(HIGH, micros());
+        }
+    }
+}
+
+#else
+
+void pulseISR(size_t channel) {
+    // Interrupt handler for the channel's pin.
     // Start (restart) the debounce timer.
     // For a real pulse, the switch will still be closed when the timer fires.
     // For a bounce, we'll end up back in here (and restart the timer) shortly.
     // For transient noise, the switch will re-open before the timer fires.
-    pulseDebounceTimer.resetFromISR(); // also starts timer if not already running
+    PROFILE_SCOPE(profileStats[PROFILE_PULSE_ISR]);
+#if PROFILE_INTERRUPTS
+    if (!pulseEdgePending[channel]) {
+        // (a bounce restarts the timer, but isn't the start of the pulse)
+        pulseEdgeUsec[channel] = micros();
+        pulseEdgePending[channel] = true;
+    }
+#endif
+    pulseDebounceTimers[channel].resetFromISR(); // also starts timer if not already running
 }
 
-void pulseTimerCallback() {
-    // Callback for debounceTimer.
+void pulseTimerCallback(size_t channel) {
+    // Callback for the channel's debounce timer.
     // If pulse switch has stayed closed, record a pulse.
     // (If switch opened during the timer period, ignore it as noise.)
+    // (Runs on the timer thread, without blocking interrupts or other threads.)
+    const MeterChannelConfig& config = METER_CHANNEL_CONFIGS[channel];
+    const bool closed = digitalRead(config.pin) == LOW;
+    if (closed) {
+        // (the pulse started when the timer did)
+        recordPulse(channel, millis() - config.debounce.count());
+    }
+#if PROFILE_INTERRUPTS
     ATOMIC_BLOCK() {
-        if (digitalRead(PIN_PULSE_SWITCH) == LOW) {
-            retainedData.currentPulseCount += 1;
-            pulsesToSignal += 1;
-            if (Time.isValid()) {
-                retainedData.pulseTimes.push(Time.now());
+        if (closed) {
+            PROFILE_SAMPLE(profileStats[PROFILE_PULSE_LATENCY],
+                (micros() - pulseEdgeUsec[channel]) / 1000 - config.debounce.count());
+        }
+        pulseEdgePending[channel] = false;
+    }
+#endif
+}
+
+bool pollPulseDetection() {
+    // Returns true while still debouncing (any channel)
+    for (const MillisecondTimer& timer: pulseDebounceTimers) {
+        if (timer.isActive()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void rearmPulseDetection() {
+}
+
+#endif
+
+PulseTimesBuffer::Cursor snapshotPulses(size_t channel, uint32_t& pulseCount) {
+    // Returns a cursor over the channel's pulseTimes, and the
+    // currentPulseCount that includes exactly those pulses (and any earlier
+    // ones), without holding up recordPulse. (If a pulse is recorded while
+    // we're looking, just look again.)
+    const std::atomic<uint32_t>& updateSeq = pulseUpdateSeqs[channel];
+    while (true) {
+        uint32_t seq = updateSeq.load(std::memory_order_acquire);
+        if ((seq & 1) == 0) {
+            pulseCount = meters[channel].currentPulseCount.load(std::memory_order_relaxed);
+            auto cursor = meters[channel].pulseTimes.cursor();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (updateSeq.load(std::memory_order_relaxed) == seq) {
+                return cursor;
             }
         }
+        os_thread_yield();
     }
 }
 
+uint32_t totalPulseCount() {
+    // All meter channels' readings, together
+    uint32_t total = 0;
+    for (const meterState_t& meter: meters) {
+        total += meter.currentPulseCount;
+    }
+    return total;
+}
 
 // convert a std::chrono::duration to a time32_t
 // timestamp with the same units as Time.now().
@@ -255,6 +1051,24 @@ inline time32_t asTime32(std::chrono::seconds duration) {
     return duration.count();
 }
 
+// Unix time (in msec) of a pulse captured at millis() == pulseMsec, for a
+// pulse within ~24 days of nearTime (see PULSE_TIMES_MAX_AGE). Only
+// meaningful once clockAnchorTime is valid.
+int64_t pulseTimeMsec(uint32_t pulseMsec, time32_t nearTime = clockAnchorTime) {
+    // (millis() at nearTime, by the anchor, wrapping like millis() does)
+    uint32_t nearMsec = clockAnchorMsec + static_cast<uint32_t>(nearTime - clockAnchorTime) * 1000;
+    return static_cast<int64_t>(nearTime) * 1000 + static_cast<int32_t>(pulseMsec - nearMsec);
+}
+
+inline time32_t pulseTime(uint32_t pulseMsec, time32_t nearTime = clockAnchorTime) {
+    return static_cast<time32_t>(pulseTimeMsec(pulseMsec, nearTime) / 1000);
+}
+
+inline bool isExpiredPulseTime(uint32_t pulseMsec) {
+    const std::chrono::milliseconds maxAge = PULSE_TIMES_MAX_AGE;
+    return millis() - pulseMsec > static_cast<uint32_t>(maxAge.count());
+}
+
 // Return Time.now() without blocking or cloud connection.
 // Enables invalid time LED signal if RTC has gone invalid.
 // (Do not call from ISRs.)
@@ -266,37 +1080,223 @@ time32_t nowTime(time32_t resultIfInvalid = INVALID_TIME) {
     return isValid ? Time.now() : resultIfInvalid;
 }
 
+void updateClockAnchor() {
+    // Keep track of the wall clock time of millis() (which pulseTimes are
+    // captured on) while the RTC is valid. Pulses captured while it isn't
+    // get their times once it is. Time.now() only has 1-second resolution,
+    // so this watches for it to tick over, for better accuracy.
+    static time32_t seenTime = INVALID_TIME;
+    static uint32_t seenMsec = 0;
 
-inline bool hasPendingPublish() {
-    return pendingPublishTime != INVALID_TIME;
+    time32_t now = nowTime();
+    uint32_t msec = millis();
+    if (now == INVALID_TIME) {
+        // (keep the previous anchor: millis() hasn't changed)
+    } else if (clockAnchorTime == INVALID_TIME) {
+        // First valid time (since the RTC or retained data was lost):
+        // anchor at its next tick, which loop() polls for (rather than
+        // waiting here)
+        if (now == seenTime + 1) {
+            retainedData.clockAnchorTime = now;
+            retainedData.clockAnchorMsec = msec;
+        }
+    } else if (now == seenTime + 1) {
+        // It ticked over some time after seenMsec (and by msec).
+        // Nudge the anchor just enough to agree with that. (Tracks drift
+        // between millis() and the RTC, and RTC adjustments.)
+        uint32_t tickMsec = clockAnchorMsec + static_cast<uint32_t>(now - clockAnchorTime) * 1000;
+        if (static_cast<int32_t>(tickMsec - seenMsec) <= 0) {
+            tickMsec = seenMsec + 1;
+        } else if (static_cast<int32_t>(tickMsec - msec) > 0) {
+            tickMsec = msec;
+        }
+        retainedData.clockAnchorTime = now;
+        retainedData.clockAnchorMsec = tickMsec;
+    }
+    seenTime = now;
+    seenMsec = msec;
 }
 
-time32_t calcNextPublishTime() {
-    // Return timestamp for next desired publish, or 0 for publish immediately.
-    time32_t nextPublishTime;
-
-    if (publishImmediately || hasPendingPublish()) {
-        nextPublishTime = 0;
+void rebasePulseTimes() {
+    // millis() restarts at boot, so move pulseTimes captured before then
+    // (on the previous boot's millis) to the current clock. (Call before
+    // pulse detection starts.) That needs a valid RTC now, and a clock
+    // anchor from then; otherwise their times are lost (but not their counts).
+    if (clockAnchorTime != INVALID_TIME && Time.isValid()) {
+        // (Time.now() ticked over sometime in the last second;
+        // updateClockAnchor will refine that)
+        time32_t now = Time.now();
+        uint32_t msec = millis() - 500;
+        uint32_t offset = static_cast<uint32_t>(
+            (static_cast<int64_t>(clockAnchorTime) - now) * 1000 - clockAnchorMsec + msec);
+        for (meterState_t& meter: retainedData.meters) {
+            meter.pulseTimes.rebase(offset);
+            meter.usageTiers.rebase(offset);
+        }
+        retainedData.clockAnchorTime = now;
+        retainedData.clockAnchorMsec = msec;
     } else {
-        // Publish when pulses to report, or at heartbeat if sooner
-        nextPublishTime = lastPublishTime + asTime32(PUBLISH_HEARTBEAT_INTERVAL);
-        ATOMIC_BLOCK() {
-            if (!pulseTimes.isEmpty()) {
-                if (pulseTimes.isFull() || pulseTimes.size() >= PUBLISH_MAX_PULSE_TIMES) {
-                    // Too many pulseTimes; publish immediately
-                    nextPublishTime = 0;
-                } else {
-                    // Publish accumulated data after in-use interval
-                    nextPublishTime = std::min(
-                        pulseTimes.first() + asTime32(PUBLISH_IN_USE_INTERVAL),
-                        nextPublishTime
-                    );
+        for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+            clearPulseTimes(channel);
+        }
+        retainedData.clockAnchorTime = INVALID_TIME;
+    }
+}
+
+
+void skipPulseTimes(PulseTimesBuffer::Cursor& cursor, uint16_t count) {
+    for (uint16_t i = 0; i < count && !cursor.done(); i++) {
+        cursor.next();
+    }
+}
+
+const report_t* lastQueuedReport() {
+    return queuedReportCount > 0 ? &queuedReports[queuedReportCount - 1] : nullptr;
+}
+
+time32_t lastReportTime() {
+    // Timestamp of the newest report (whether or not it's been published)
+    const report_t* last = lastQueuedReport();
+    return last ? last->time : lastPublishTime;
+}
+
+bool isPublishing(uint32_t seq) {
+    for (size_t i = 0; i < publishingCount; i++) {
+        if (publishingSeqs[i] == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int nextUnsentReport() {
+    // Index in queuedReports of the oldest report that needs publishing
+    // (not acked or being published), or -1 if none
+    for (size_t i = 0; i < queuedReportCount; i++) {
+        if (!queuedReports[i].acked && !isPublishing(queuedReports[i].seq)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void unsealReport() {
+    // Return the newest queued report's data to the current meter data
+    // (to be sealed again later, under the same seq). Only for a report
+    // that's never been sent, so the server can't have seen it. (If the
+    // publisher thread has its seq, it publishes whatever's sealed under
+    // that seq by the time it's connected, or nothing.)
+    // (Call with reportsLock held.)
+    retainedData.queuedReportCount -= 1;
+    retainedData.reportCount -= 1;
+}
+
+void makeRoomForPulseTimes() {
+    // recordPulse can't drop old pulseTimes to make room for new
+    // ones, so do it here: keep PULSE_TIMES_RESERVE_BYTES free (in each
+    // channel's), folding the oldest timestamps into usageTiers if needed.
+    // A sealed report's data must not change once it's been sent (a retry
+    // reuses its seq, so the server would count both versions), so this
+    // only folds pulse times not in a queued report. Reports still waiting
+    // on the network (never sent, though maybe handed to the publisher
+    // thread while it connects) are unsealed first, freeing their pulse
+    // times and usage buckets; while a sent one holds the oldest,
+    // recordPulse just counts the pulses it has no room to time, until
+    // that's retired.
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+        meterState_t& meter = retainedData.meters[channel];
+        if (meter.pulseTimes.bytesAvailable() >= PULSE_TIMES_RESERVE_BYTES) {
+            continue;
+        }
+        WITH_LOCK(reportsLock) {
+            while (queuedReportCount > 0 && !lastQueuedReport()->sent) {
+                unsealReport();
+            }
+            const bool sealed = reportedPulseTimesCount(channel) > 0;
+            while (!sealed && meter.pulseTimes.bytesAvailable() < PULSE_TIMES_RESERVE_BYTES
+                   && !meter.pulseTimes.isEmpty()) {
+                uint32_t pulseMsec = meter.pulseTimes.shift();
+                meter.usageTiers.add(pulseMsec, reportedUsageBucketCount(channel));
+            }
+        }
+    }
+}
+
+void expirePulseTimes() {
+    // Drop pulse times and usage buckets older than PULSE_TIMES_MAX_AGE
+    // (keeping their counts), so every one that gets sealed in a report
+    // has a meaningful time. Like makeRoomForPulseTimes, only for those not
+    // in a queued report, after unsealing any reports not yet sent. (A sent
+    // one holds them until it's retired; sealMeter leaves them for then.)
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+        meterState_t& meter = retainedData.meters[channel];
+        bool expired = (!meter.usageTiers.isEmpty() && isExpiredPulseTime(meter.usageTiers[0].first))
+            || (!meter.pulseTimes.isEmpty() && isExpiredPulseTime(meter.pulseTimes.first()));
+        if (!expired) {
+            continue;
+        }
+        WITH_LOCK(reportsLock) {
+            bool held = false;
+            for (size_t i = 0; i < queuedReportCount; i++) {
+                const reportMeter_t& reportMeter = queuedReports[i].meters[channel];
+                held = held || (queuedReports[i].sent
+                                && (reportMeter.pulseTimesCount > 0 || reportMeter.usageBucketCount > 0));
+            }
+            while (!held && queuedReportCount > 0 && !lastQueuedReport()->sent) {
+                unsealReport();
+            }
+            if (reportedUsageBucketCount(channel) == 0) {
+                while (!meter.usageTiers.isEmpty() && isExpiredPulseTime(meter.usageTiers[0].first)) {
+                    meter.usageTiers.shift(1);
+                }
+            }
+            if (reportedPulseTimesCount(channel) == 0) {
+                while (!meter.pulseTimes.isEmpty() && isExpiredPulseTime(meter.pulseTimes.first())) {
+                    meter.pulseTimes.shift();
                 }
             }
         }
     }
+}
+
+time32_t calcNextReportTime() {
+    // Return timestamp for sealing the next report, or 0 for immediately.
+    if (publishImmediately) {
+        return 0;
+    }
+
+    // Report when pulses to report (on any channel), or at heartbeat if sooner
+    time32_t nextReportTime = lastReportTime() + static_cast<time32_t>(publishPolicy->heartbeatSecs());
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+        const meterState_t& meter = meters[channel];
+        // Usage buckets are older than any pulseTimes: report them right away
+        if (meter.usageTiers.size() > reportedUsageBucketCount(channel)) {
+            return 0;
+        }
+
+        auto cursor = meter.pulseTimes.cursor();
+        skipPulseTimes(cursor, reportedPulseTimesCount(channel));
+        if (cursor.done()) {
+            continue;
+        }
+        if (meter.pulseTimes.bytesAvailable() < 2 * PULSE_TIMES_RESERVE_BYTES
+            || cursor.remaining() >= publishPolicy->maxPulseTimes()) {
+            // Too many pulseTimes; report immediately
+            return 0;
+        }
+        // Report accumulated data after in-use interval
+        nextReportTime = std::min(
+            pulseTime(cursor.time()) + static_cast<time32_t>(publishPolicy->inUseSecs()),
+            nextReportTime
+        );
+    }
 
-    return nextPublishTime;
+    return nextReportTime;
+}
+
+time32_t calcNextPublishTime() {
+    // Return timestamp for next desired publish, or 0 for publish immediately.
+    return nextUnsentReport() >= 0 ? 0 : calcNextReportTime();
 }
 
 
@@ -304,165 +1304,876 @@ bool inNetworkProblemDelay() {
     return networkProblemRetryDelay > 0;
 }
 
+time32_t increaseNetworkProblemDelay() {
+    // Increase delay: 1 minute - 4 hours, with exponential backoff on repeated failures.
+    networkProblemRetryDelay = constrain(
+        networkProblemRetryDelay * 2,
+        asTime32(NETWORK_PROBLEM_INITIAL_DELAY),
+        asTime32(NETWORK_PROBLEM_MAX_DELAY));
+    return networkProblemRetryDelay;
+}
+
+bool hasPublishBacklog() {
+    // True if more data is already due for publishing
+    // (e.g., pulseTimes that didn't fit in the previous report)
+    return nextUnsentReport() >= 0 || nowTime() >= calcNextReportTime();
+}
+
 void onPublishSuccess() {
     ledSignalNetworkProblem.setActive(false);
-    retainedData.pendingPublishFailureCount = 0;
+    if (inNetworkProblemDelay()) {
+        // The network is fine after all: retry any failed reports soon
+        earliestNextPublishTime = nowTime() + asTime32(PUBLISH_BACKLOG_INTERVAL);
+    }
     networkProblemRetryDelay = 0;
-    // Publish at most every 5 seconds (e.g., when recovering after network outage)
-    earliestNextPublishTime = nowTime() + asTime32(PUBLISH_MIN_INTERVAL);
 }
 
-void onPublishFailure() {
+void onPublishFailure(size_t index) {
+    // (publishing queuedReports[index])
     ledSignalNetworkProblem.setActive(true);
-    retainedData.pendingPublishFailureCount += 1;
-    // Increase delay: 1 minute - 4 hours, with exponential backoff on repeated failures.
-    networkProblemRetryDelay = constrain(
-        networkProblemRetryDelay * 2,
-        asTime32(NETWORK_PROBLEM_INITIAL_DELAY),
-        asTime32(NETWORK_PROBLEM_MAX_DELAY));
-    earliestNextPublishTime = nowTime() + networkProblemRetryDelay;
+    retainedData.queuedReports[index].failureCount += 1;
+    if (queuedReports[index].failureCount == 1 && Particle.connected()) {
+        // Just a lost ack (the session is fine): retry once without backoff
+        earliestNextPublishTime = std::max(earliestNextPublishTime,
+            nowTime() + asTime32(PUBLISH_BACKLOG_INTERVAL));
+        return;
+    }
+    if (inNetworkProblemDelay() && nowTime() < earliestNextPublishTime) {
+        // (other publishes from the same attempt failed too;
+        // don't compound the backoff for each of them)
+        return;
+    }
+    earliestNextPublishTime = nowTime() + increaseNetworkProblemDelay();
 }
 
+void onSyncTimeResult(bool succeeded) {
+    syncingTime = false;
+    if (succeeded) {
+        onPublishSuccess();
+        return;
+    }
+    ledSignalNetworkProblem.setActive(true);
+    // (on the millis() clock, since the RTC isn't set)
+    nextSyncTimeMsec = millis() + increaseNetworkProblemDelay() * 1000;
+}
 
-void publishData() {
 
-    // Collect metering data (unless previous data still pending)
-    if (!hasPendingPublish()) {
-        // This is the "reliable message delivery" portion of the data.
-        // Once captured, we will keep trying to publish it until successful.
-        // (Other data--like device battery level--is updated on each publish
-        // attempt, because we don't need reliable delivery for it.)
-        ATOMIC_BLOCK() {
-            retainedData.pendingPublishTime = nowTime();
-            retainedData.pendingPublishPulseCount = currentPulseCount;
-            retainedData.pendingPublishFailureCount = 0;
-            // Move pulseTimes for this publish into pendingPublishPulseTimes
-            for (auto& pendingPulseTime: retainedData.pendingPublishPulseTimes) {
-                if (pulseTimes.isEmpty() || pulseTimes.first() > pendingPublishTime) {
-                    pendingPulseTime = INVALID_TIME;
-                    break;
-                }
-                pendingPulseTime = retainedData.pulseTimes.shift();
+size_t encodePublishSegments(PulseTimesBuffer::Cursor cursor, uint16_t maxPulseTimes, time32_t nearTime) {
+    // Encode (up to) maxPulseTimes of the oldest pulseTimes (all within
+    // PULSE_TIMES_MAX_AGE of nearTime) into publishSegments.
+    // Returns number of segments.
+    FlowSegmentEncoder encoder(
+        publishSegments.data(), publishSegments.size(),
+        publishResiduals.data(), publishResiduals.size(),
+        PUBLISH_SEGMENT_TOLERANCE.count(),
+        PUBLISH_FLOW_SEGMENTS ? PUBLISH_MAX_SEGMENT_PULSES : 1);
+    uint16_t count = 0;
+    for (; !cursor.done(); cursor.next()) {
+        if (count >= maxPulseTimes || !encoder.add(pulseTimeMsec(cursor.time(), nearTime))) {
+            break;
+        }
+        count += 1;
+    }
+    return encoder.finish();
+}
+
+// Formats a report's pulse times as its pts value: a JSON array, or a
+// base64 string of packed items (PUBLISH_PACKED_PTS), within maxLength
+// (its meter channel's share of PUBLISH_MAX_PTS_LENGTH, less any agg). Each pulse is a msec delta
+// from the previous one (the first from previousTime), and steady runs are
+// a single [delta, count, interval, residual...] flow segment.
+struct PtsBuffer {
+    std::array<char, PUBLISH_MAX_PTS_LENGTH> text;
+    std::array<uint8_t, PUBLISH_MAX_PTS_ITEMS> packed;
+};
+
+class PtsFormatter {
+public:
+    PtsFormatter(PtsBuffer& buffer, time32_t previousTime, size_t maxLength = PUBLISH_MAX_PTS_LENGTH)
+        : buffer_(buffer), json_(buffer.text.data(), buffer.text.size()),
+          packed_(buffer.packed.data(),
+                  std::min(buffer.packed.size(), PackedPulseTimesWriter::maxBytes(maxLength - 2))),
+          maxLength_(maxLength), previousMsec_(static_cast<int64_t>(previousTime) * 1000), fits_(true) {
+        json_.beginArray();
+    }
+
+    // Add segment's pulse times; returns false if they don't fit
+    // (after which the value is unusable)
+    bool add(const FlowSegment& segment) {
+        if (segment.count < PUBLISH_MIN_SEGMENT_PULSES) {
+            for (uint32_t i = 0; i < segment.count; i++) {
+                addItem({delta(segment.timeMsecOf(i)), false, 0, 0, nullptr});
+                previousMsec_ = segment.timeMsecOf(i);
             }
-            publishImmediately = false;
+        } else {
+            int64_t steadyMsec = static_cast<int64_t>(segment.start) * 1000 + segment.phase;
+            addItem({delta(steadyMsec), true, segment.count, segment.interval, segment.residuals});
+            previousMsec_ = segment.lastMsec();
         }
+        return fits_;
     }
 
-    if (nowTime() < earliestNextPublishTime) {
-        // Try again later. (Delay for burst control or connectivity issues.)
-        return;
+    // Finish the value in buffer.text; returns its length (0 if it didn't fit)
+    size_t finish() {
+        if (!fits_) {
+            return 0;
+        }
+        if (!PUBLISH_PACKED_PTS) {
+            json_.endArray();
+            return json_.dataSize();
+        }
+        char* text = buffer_.text.data();
+        size_t length = 0;
+        text[length++] = '"';
+        length += packed_.encode(text + length);
+        text[length++] = '"';
+        return length;
+    }
+
+private:
+    // (pulses in a report are within PULSE_TIMES_MAX_AGE of each other)
+    int32_t delta(int64_t timeMsec) const {
+        return static_cast<int32_t>(timeMsec - previousMsec_);
+    }
+
+    void addItem(const PtsItem& item) {
+        if (PUBLISH_PACKED_PTS) {
+            fits_ = fits_ && packed_.add(item);
+            return;
+        }
+        if (item.segment) {
+            json_.beginArray();
+            json_.value(item.delta);
+            json_.value(static_cast<unsigned>(item.count));
+            json_.value(static_cast<unsigned>(item.interval));
+            for (uint32_t i = 0; i < item.count; i++) {
+                json_.value(item.residuals[i]);
+            }
+            json_.endArray();
+        } else {
+            json_.value(item.delta);
+        }
+        fits_ = fits_ && json_.dataSize() + 1 <= maxLength_; // (+1 for closing bracket)
+    }
+
+    PtsBuffer& buffer_;
+    JSONBufferWriter json_;
+    PackedPulseTimesWriter packed_;
+    size_t maxLength_;
+    int64_t previousMsec_;
+    bool fits_;
+};
+
+// Formats a report's usage buckets as its agg value: a JSON array of
+// [delta, secs, count], for count pulses from delta secs after the
+// previous bucket's end (the first, after previousTime) through secs
+// after that. Leaves at least room (within maxLength) for an empty pts.
+class AggFormatter {
+public:
+    AggFormatter(std::array<char, PUBLISH_MAX_PTS_LENGTH>& text, time32_t previousTime,
+                 time32_t nearTime, size_t maxLength = PUBLISH_MAX_PTS_LENGTH)
+        : text_(text), json_(text.data(), text.size()), maxLength_(maxLength),
+          nearTime_(nearTime), previousTime_(previousTime), length_(0), count_(0) {
+        json_.beginArray();
+    }
+
+    // Add bucket; returns false if it doesn't fit (and nothing more will)
+    bool add(const UsageBucket& bucket) {
+        time32_t first = pulseTime(bucket.first, nearTime_);
+        time32_t last = pulseTime(bucket.last, nearTime_);
+        json_.beginArray()
+            .value(first - previousTime_)
+            .value(last - first)
+            .value(static_cast<unsigned>(bucket.count))
+            .endArray();
+        if (json_.dataSize() + 1 > maxLength_ - 2) { // (+1 for closing bracket)
+            return false;
+        }
+        length_ = json_.dataSize();
+        count_ += 1;
+        previousTime_ = last;
+        return true;
+    }
+
+    // Time the last bucket added ends (for the pts that follow)
+    time32_t previousTime() const { return previousTime_; }
+    size_t count() const { return count_; }
+
+    // Finish the value in text; returns its length (0 if no buckets)
+    size_t finish() {
+        if (count_ == 0) {
+            return 0;
+        }
+        text_[length_] = ']';
+        return length_ + 1;
+    }
+
+private:
+    std::array<char, PUBLISH_MAX_PTS_LENGTH>& text_;
+    JSONBufferWriter json_;
+    size_t maxLength_;
+    time32_t nearTime_; // (see pulseTimeMsec)
+    time32_t previousTime_;
+    size_t length_;
+    size_t count_;
+};
+
+size_t sealMeter(size_t channel, reportMeter_t& reportMeter, size_t maxLength, time32_t& backlogTime) {
+    // Capture the channel's pulses not yet in queuedReports for a new report
+    // (see sealReport), in at most maxLength chars of agg and pts. If they
+    // won't all fit, reports only the pulses up through the last one that
+    // fits, and lowers backlogTime to that one's time (if earlier).
+    // Returns the chars it used (all of maxLength, if it left a backlog).
+    const meterState_t& meter = meters[channel];
+    uint32_t pulseCount;
+    auto cursor = snapshotPulses(channel, pulseCount);
+    skipPulseTimes(cursor, reportedPulseTimesCount(channel));
+    uint16_t available = cursor.remaining();
+    const time32_t now = nowTime();
+
+    static std::array<char, PUBLISH_MAX_PTS_LENGTH> aggText;
+    AggFormatter agg(aggText, lastReportTime(), now, maxLength);
+    const size_t firstBucket = reportedUsageBucketCount(channel);
+    for (size_t i = firstBucket; i < meter.usageTiers.size(); i++) {
+        if (!agg.add(meter.usageTiers[i])) {
+            break;
+        }
+    }
+    const size_t bucketBacklog = meter.usageTiers.size() - firstBucket - agg.count();
+    uint32_t backlogCount = meter.usageTiers.pulseCount(firstBucket + agg.count(), meter.usageTiers.size());
+    time32_t lastPulseTime = agg.previousTime();
+    size_t length = agg.finish();
+
+    uint16_t pulseTimesCount = 0;
+    // (pulse times too old to place wait for expirePulseTimes)
+    if (bucketBacklog == 0 && !(available > 0 && isExpiredPulseTime(cursor.time()))) {
+        size_t segmentCount = encodePublishSegments(cursor, available, now);
+        static PtsBuffer ptsBuf;
+        PtsFormatter pts(ptsBuf, agg.previousTime(), maxLength - length);
+        for (size_t i = 0; i < segmentCount; i++) {
+            if (!pts.add(publishSegments[i])) {
+                break;
+            }
+            pulseTimesCount += publishSegments[i].count;
+            lastPulseTime = publishSegments[i].last();
+        }
+        length += pts.finish();
+    }
+    backlogCount += available - pulseTimesCount;
+
+    reportMeter.pulseCount = pulseCount - backlogCount;
+    reportMeter.pulseTimesCount = pulseTimesCount;
+    reportMeter.usageBucketCount = agg.count();
+    if (backlogCount == 0) {
+        return length;
+    }
+    backlogTime = std::min(backlogTime, lastPulseTime);
+    return maxLength;
+}
+
+void sealReport() {
+    // Capture the metering data not yet in queuedReports as a new report.
+    // This is the "reliable message delivery" portion of the data.
+    // Once sealed, we will keep trying to publish it until acked.
+    // (Other data--like device battery level--is updated on each publish
+    // attempt, because we don't need reliable delivery for it.)
+    // Its pulseTimes stay in pulseTimes until it's retired.
+    // If they won't all fit in the event, it reports only the pulses
+    // up through the last one that fits, and the rest are left as a
+    // backlog for follow-up reports. Any usage buckets go first (they're
+    // older), and its pulse times only if they all fit. Each meter channel
+    // gets an equal share of the room, plus whatever earlier ones didn't
+    // need; if any leaves a backlog, the report's time is its last pulse's
+    // (and the other channels' pulses after that just count a bit early).
+    // (Call with reportsLock held.)
+    report_t& report = retainedData.queuedReports[queuedReportCount];
+    time32_t reportTime = nowTime();
+    size_t room = PUBLISH_MAX_PTS_LENGTH;
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+        size_t share = room / (METER_CHANNEL_COUNT - channel);
+        room -= sealMeter(channel, report.meters[channel], share, reportTime);
     }
 
+    report.time = reportTime;
+    report.seq = reportCount;
+    report.failureCount = 0;
+    report.acked = false;
+    report.sent = false;
+    retainedData.reportCount += 1;
+    retainedData.queuedReportCount += 1;
+    publishImmediately = false;
+}
+
+void startCloudSession() {
+    // (from either thread, once connected; only the first call counts)
+    system_tick_t none = 0;
+    if (cloudSessionStartMsec.compare_exchange_strong(none, std::max<system_tick_t>(millis(), 1))) {
+        cloudConnectCount += 1;
+    }
+}
+
+void endCloudSession() {
+    system_tick_t start = cloudSessionStartMsec.exchange(0);
+    if (start != 0) {
+        cloudConnectedMsec += millis() - start;
+    }
+}
+
+void updateCloudSession() {
+    // Catch sessions that dropped, or that Device OS reconnected on its own
+    if (Particle.connected()) {
+        startCloudSession();
+    } else {
+        endCloudSession();
+    }
+}
+
+uint32_t cloudConnectedSecs() {
+    system_tick_t start = cloudSessionStartMsec;
+    return (cloudConnectedMsec + (start != 0 ? millis() - start : 0)) / 1000;
+}
+
+void recordConnectCost(system_tick_t startMsec) {
+    // (failed attempts count, too)
+    uint32_t cost = millis() - startMsec;
+    uint32_t avg = avgConnectMsec;
+    avgConnectMsec = avg == 0 ? cost : (3 * avg + cost) / 4;
+}
+
+PublishResult makePublishResult(uint32_t seq, PublishKind kind) {
+    PublishResult result = {seq, kind, false, false, 0, 0, {}};
+    std::fill_n(result.phaseTimes, PHASE_COUNT, NOT_TIMED);
+    return result;
+}
+
+bool connectToCloud(PublishResult& result) {
+    // Fills in the result's PHASE_WIFI and PHASE_CLOUD times
+    // (for whichever it had to connect)
+    if (Particle.connected()) {
+        return true;
+    }
+    const system_tick_t startMsec = millis();
+
     // Connect to network
     if (!WiFi.ready()) {
         WiFi.connect();
         const std::chrono::milliseconds timeout(NETWORK_CONNECT_TIMEOUT);
-        if (!waitFor(WiFi.ready, timeout.count())) {
-            onPublishFailure();
-            return;
+        bool ready = waitFor(WiFi.ready, timeout.count());
+        result.phaseTimes[PHASE_WIFI] = millis() - startMsec;
+        if (!ready) {
+            recordConnectCost(startMsec);
+            return false;
         }
     }
 
     // Connect to cloud
-    if (!Particle.connected()) {
-        Particle.connect();
-        const std::chrono::milliseconds timeout(CLOUD_CONNECT_TIMEOUT);
-        if (!waitFor(Particle.connected, timeout.count())) {
-            onPublishFailure();
-            return;
-        }
+    const system_tick_t cloudStartMsec = millis();
+    Particle.connect();
+    const std::chrono::milliseconds timeout(CLOUD_CONNECT_TIMEOUT);
+    bool connected = waitFor(Particle.connected, timeout.count());
+    result.phaseTimes[PHASE_CLOUD] = millis() - cloudStartMsec;
+    recordConnectCost(startMsec);
+    if (connected) {
+        startCloudSession();
+    }
+    return connected;
+}
+
+bool syncTimeFromCloud() {
+    // (Runs on the publisher thread, once connected.) Device OS usually
+    // sets the RTC while connecting; if it didn't, ask for the time.
+    if (!Time.isValid()) {
+        Particle.syncTime();
+        const std::chrono::milliseconds timeout(SYNC_TIME_TIMEOUT);
+        waitFor(Particle.syncTimeDone, timeout.count());
+    }
+    return Time.isValid();
+}
+
+size_t writeMeterData(EventWriter& writer, size_t index, size_t channel, size_t maxLength) {
+    // Write the channel's fields for queuedReports[index] (see
+    // writeReportData). Returns the chars its agg and pts took.
+    const reportMeter_t& reportMeter = queuedReports[index].meters[channel];
+    const meterState_t& meter = meters[channel];
+    time32_t previousTime = index > 0 ? queuedReports[index - 1].time : lastPublishTime;
+    uint32_t previousPulseCount = index > 0
+        ? queuedReports[index - 1].meters[channel].pulseCount
+        : meter.lastPublishPulseCount;
+    auto cursor = meter.pulseTimes.cursor();
+    size_t firstBucket = 0;
+    for (size_t i = 0; i < index; i++) {
+        skipPulseTimes(cursor, queuedReports[i].meters[channel].pulseTimesCount);
+        firstBucket += queuedReports[i].meters[channel].usageBucketCount;
+    }
+    const time32_t reportTime = queuedReports[index].time;
+    size_t segmentCount = encodePublishSegments(cursor, reportMeter.pulseTimesCount, reportTime);
+
+    writer.integer(meterField(channel, METER_READING), reportMeter.pulseCount);
+    writer.integer(meterField(channel, METER_LAST_READING), previousPulseCount);
+    writer.integer(meterField(channel, METER_USE), reportMeter.pulseCount - previousPulseCount);
+
+    // First usage bucket (or else pulseTime) is encoded as delta from previous report.
+    static std::array<char, PUBLISH_MAX_PTS_LENGTH> aggText;
+    AggFormatter agg(aggText, previousTime, reportTime, maxLength);
+    for (size_t i = 0; i < reportMeter.usageBucketCount; i++) {
+        agg.add(meter.usageTiers[firstBucket + i]);
+    }
+    size_t aggLength = agg.finish();
+    if (aggLength > 0) {
+        writer.rest(meterField(channel, METER_USAGE_BUCKETS), aggText.data(), aggLength);
     }
 
+    static PtsBuffer ptsBuf;
+    PtsFormatter pts(ptsBuf, agg.previousTime(), maxLength - aggLength);
+    for (size_t i = 0; i < segmentCount; i++) {
+        pts.add(publishSegments[i]);
+    }
+    size_t ptsLength = pts.finish();
+    if (ptsLength > 0) { // (sealReport made sure it fits)
+        writer.rest(meterField(channel, METER_PTS), ptsBuf.text.data(), ptsLength);
+    }
+    return aggLength + ptsLength;
+}
+
+void writeReportData(EventWriter& writer, size_t index) {
+    // Write the metering data fields for queuedReports[index]
+    // (with reportsLock held). sealReport() left out any usage buckets
+    // and pulse times that wouldn't fit in PUBLISH_MAX_PTS_LENGTH.
+    const report_t& report = queuedReports[index];
+    time32_t previousTime = index > 0 ? queuedReports[index - 1].time : lastPublishTime;
+    writer.integer(DATA_TIME, report.time);
+    writer.integer(DATA_SENT_TIME, nowTime());
+    writer.integer(DATA_SEQ, report.seq);
+    writer.integer(DATA_PERIOD, report.time - previousTime);
+    writer.integer(DATA_TRIES, report.failureCount);
+    writer.integer(DATA_PTS_PRECISION, 3); // pts times are in msec
+    writer.integer(DATA_PTS_VERSION, PUBLISH_PACKED_PTS ? 2 : 1);
+
+    // (Each channel's agg and pts fit in what sealReport gave it, so also
+    // in whatever the channels before it left.)
+    size_t room = PUBLISH_MAX_PTS_LENGTH;
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+        room -= writeMeterData(writer, index, channel, room);
+    }
+}
+
+bool publishReport(uint32_t seq, PublishResult& result, particle::Future<bool>& ack) {
+    // Publish the queued report seq, without waiting for the ack.
+    // (Runs on the publisher thread, once connected.)
+    // Fills in the result's battery readings and PHASE_FORMAT time.
+    // Returns false if the report was unsealed while connecting.
+    const uint32_t startUsec = micros();
+
     // Capture current device status
     WiFiSignal signal = WiFi.RSSI();  // only valid when WiFi on
     float wifiRSSI = signal.getStrengthValue(); // dBm [-90, 0]
     float wifiSNR = signal.getQualityValue(); // dB [0, 90]
     float wifiStrength = signal.getStrength(); // % [0, 100]
     float wifiQuality = signal.getQuality(); // % [0, 100]
-    float batteryVoltage = batteryMonitor.getVCell(); // V
-    float batteryCharge = batteryMonitor.getSoC(); // % [0, 100] nominally, but can report higher
+    PowerShieldReading battery; // V, and % [0, 100] nominally, but can report higher
+    bool batteryRead = batteryMonitor.read(battery);
+    result.batteryCharge = batteryRead ? battery.soC : 0;
+    result.batteryVoltage = batteryRead ? battery.vCell : 0;
+
+    // Format JSON event data (DATA_FIELDS guarantees it all fits)
+    static std::array<char, particle::protocol::MAX_EVENT_DATA_LENGTH + 1> dataBuf;
+    EventWriter writer(DATA_FIELDS, dataBuf.data(), dataBuf.size() - 1);
+    WITH_LOCK(reportsLock) {
+        size_t index = 0;
+        while (index < queuedReportCount && queuedReports[index].seq != seq) {
+            index++;
+        }
+        if (index == queuedReportCount) {
+            return false;
+        }
+        writeReportData(writer, index);
+        retainedData.queuedReports[index].sent = true;
+        updateSentReports();
+    }
+    writer.fixed(DATA_SIGNAL, wifiRSSI);
+    writer.fixed(DATA_SNR, wifiSNR);
+    writer.fixed(DATA_STRENGTH, wifiStrength);
+    writer.fixed(DATA_QUALITY, wifiQuality);
+    if (batteryRead) { // (else the fuel gauge didn't respond)
+        writer.fixed(DATA_BATTERY_VOLTAGE, battery.vCell);
+        writer.fixed(DATA_BATTERY_CHARGE, battery.soC);
+    }
+    writer.integer(DATA_CONNECTS, cloudConnectCount);
+    writer.integer(DATA_CONNECTED_SECS, cloudConnectedSecs());
+    writer.integer(DATA_UPTIME, System.uptime());
+    writer.integer(DATA_FREE_MEMORY, System.freeMemory());
+    writer.string(DATA_VERSION, WATERBOT_VERSION);
+    writer.finish();
+    result.phaseTimes[PHASE_FORMAT] = micros() - startUsec;
+
+    ack = Particle.publish(EVENT_DATA, dataBuf.data(), WITH_ACK);
+    return true;
+}
 
-    // Format JSON event data
-    static std::array<char, particle::protocol::MAX_EVENT_DATA_LENGTH> dataBuf;
+// Longest possible waterbot/timing event data
+const size_t TIMING_SUMMARY_MAX_LENGTH =
+    sizeof("{\"per\":4294967295}") - 1
+    + PHASE_COUNT * (sizeof(",\"xxx\":[65535,65535,65535,65535]") - 1
+                     + sizeof(",\"xxxh\":\"\"") - 1 + 2 * PhaseStats::BUCKETS);
+static_assert(TIMING_SUMMARY_MAX_LENGTH <= particle::protocol::MAX_EVENT_DATA_LENGTH,
+    "waterbot/timing summary might not fit in an event");
+
+void writePhaseStats(JSONBufferWriter& writer, const char* key, const PhaseStats& stats) {
+    // "<key>":[count, min, mean, max] and "<key>h": the histogram buckets
+    // in hex (two digits each, through the last non-empty bucket)
+    // (nothing if there are no samples)
+    if (stats.count == 0) {
+        return;
+    }
+    writer.name(key).beginArray()
+        .value(static_cast<unsigned>(stats.count))
+        .value(static_cast<unsigned>(stats.min))
+        .value(static_cast<unsigned>(std::min<uint32_t>(stats.mean(), UINT16_MAX)))
+        .value(static_cast<unsigned>(stats.max))
+        .endArray();
+    char histogramKey[8];
+    snprintf(histogramKey, sizeof(histogramKey), "%sh", key);
+    char histogram[2 * PhaseStats::BUCKETS + 1] = "";
+    for (size_t b = 0; b < stats.usedBuckets(); b++) {
+        snprintf(histogram + 2 * b, 3, "%02x", stats.histogram[b]);
+    }
+    writer.name(histogramKey).value(histogram);
+}
+
+particle::Future<bool> publishTimingSummary() {
+    // Publish timingSummary, without waiting for the ack.
+    // (Runs on the publisher thread, once connected.)
+    static std::array<char, particle::protocol::MAX_EVENT_DATA_LENGTH + 1> dataBuf;
     JSONBufferWriter writer(dataBuf.data(), dataBuf.size() - 1);
     writer.beginObject();
-    {
-        writer.name("t").value(pendingPublishTime); // timestamp of meter data capture
-        writer.name("at").value(nowTime()); // actual now
-        writer.name("seq").value(publishCount);
-        writer.name("per").value(pendingPublishTime - lastPublishTime);
-        writer.name("cur").value(pendingPublishPulseCount);
-        writer.name("lst").value(lastPublishPulseCount);
-        writer.name("use").value(pendingPublishPulseCount - lastPublishPulseCount);
-        writer.name("sig").value(wifiRSSI);
-        writer.name("snr").value(wifiSNR);
-        writer.name("sgp").value(wifiStrength);
-        writer.name("sqp").value(wifiQuality);
-        writer.name("btv").value(batteryVoltage);
-        writer.name("btp").value(batteryCharge);
-        writer.name("try").value(pendingPublishFailureCount);
-        writer.name("pts").beginArray();
-        {
-            // Encode pulseTimes as deltas from previous values.
-            // First pulseTime is encoded as delta from last publish.
-            time32_t previousTime = lastPublishTime;
-            for (const auto& pulseTime: pendingPublishPulseTimes) {
-                if (pulseTime == INVALID_TIME) {
-                    break;
+    writer.name("per").value(static_cast<unsigned>(nowTime() - timingSummarySince));
+    for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+        writePhaseStats(writer, PHASE_KEYS[phase], timingSummary[phase]);
+    }
+    writer.endObject();
+    writer.buffer()[std::min(writer.bufferSize(), writer.dataSize())] = '\0';
+
+    return Particle.publish(EVENT_TIMING, dataBuf.data(), WITH_ACK);
+}
+
+void publishReports() {
+    // This runs in a separate thread, so loop() never waits on the network:
+    // it posts PublishJobs, and collects PublishResults. Connecting can take
+    // most of a minute on a bad network. Reports are published without
+    // waiting for earlier acks (checking on those every so often).
+    struct PendingAck {
+        PublishResult result;
+        particle::Future<bool> ack;
+        system_tick_t sentMsec;
+    };
+    std::array<PendingAck, PUBLISH_QUEUE_LENGTH> pendingAcks;
+    size_t pendingAckCount = 0;
+
+    while (true) {
+        PublishJob job;
+        const std::chrono::milliseconds ackPoll = 50ms;
+        system_tick_t wait = pendingAckCount > 0 ? ackPoll.count() : CONCURRENT_WAIT_FOREVER;
+        if (os_queue_take(publishJobs, &job, wait, nullptr) == 0) {
+            PublishResult result = makePublishResult(job.seq, job.kind);
+            if (job.kind == PUBLISH_VITALS) {
+                const system_tick_t startMsec = millis();
+                result.succeeded = Particle.publishVitals(particle::NOW); // blocks
+                result.phaseTimes[PHASE_VITALS] = millis() - startMsec;
+                os_queue_put(publishResults, &result, CONCURRENT_WAIT_FOREVER, nullptr);
+                loopWakeup.signal();
+            } else if (!connectToCloud(result)) {
+                os_queue_put(publishResults, &result, CONCURRENT_WAIT_FOREVER, nullptr);
+                loopWakeup.signal();
+            } else if (job.kind == PUBLISH_SYNC_TIME) {
+                result.succeeded = syncTimeFromCloud();
+                os_queue_put(publishResults, &result, CONCURRENT_WAIT_FOREVER, nullptr);
+                loopWakeup.signal();
+            } else if (job.kind == PUBLISH_TIMING) {
+                PendingAck& pending = pendingAcks[pendingAckCount++];
+                pending.result = result;
+                pending.ack = publishTimingSummary();
+                pending.sentMsec = millis();
+            } else {
+                PendingAck& pending = pendingAcks[pendingAckCount];
+                pending.result = result;
+                if (publishReport(job.seq, pending.result, pending.ack)) {
+                    pending.sentMsec = millis();
+                    pendingAckCount++;
+                } else {
+                    pending.result.unsealed = true;
+                    os_queue_put(publishResults, &pending.result, CONCURRENT_WAIT_FOREVER, nullptr);
+                    loopWakeup.signal();
                 }
-                writer.value(pulseTime - previousTime);
-                previousTime = pulseTime;
             }
         }
-        writer.endArray();
-        writer.name("v").value(WATERBOT_VERSION);
+
+        for (size_t i = 0; i < pendingAckCount; ) {
+            if (!pendingAcks[i].ack.isDone()) {
+                i++;
+                continue;
+            }
+            PublishResult result = pendingAcks[i].result;
+            result.succeeded = pendingAcks[i].ack.isSucceeded();
+            if (result.kind == PUBLISH_REPORT) {
+                result.phaseTimes[PHASE_ACK] = millis() - pendingAcks[i].sentMsec;
+            }
+            os_queue_put(publishResults, &result, CONCURRENT_WAIT_FOREVER, nullptr);
+            loopWakeup.signal();
+            pendingAcks[i] = pendingAcks[--pendingAckCount];
+        }
     }
-    writer.endObject();
-    writer.buffer()[std::min(writer.bufferSize(), writer.dataSize())] = '\0';
-    // assert(writer.dataSize() < writer.bufferSize()); // ???
+}
 
-    // Publish the event
-    if (Particle.publish(EVENT_DATA, dataBuf.data(), WITH_ACK)) {
-        ATOMIC_BLOCK() {
-            retainedData.lastPublishTime = pendingPublishTime;
-            retainedData.lastPublishPulseCount = pendingPublishPulseCount;
-            retainedData.publishCount += 1;
-            retainedData.pendingPublishTime = INVALID_TIME; // no longer pending
+void retireReport() {
+    // The oldest queued report has been acked: it's no longer needed
+    const report_t& report = queuedReports[0];
+    retainedData.lastPublishTime = report.time;
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+        const reportMeter_t& reportMeter = report.meters[channel];
+        meterState_t& meter = retainedData.meters[channel];
+        meter.lastPublishPulseCount = reportMeter.pulseCount;
+        for (uint16_t i = 0; i < reportMeter.pulseTimesCount; i++) {
+            meter.pulseTimes.shift();
         }
-        onPublishSuccess();
-        Particle.publishVitals(particle::NOW); // blocks
-    } else {
-        onPublishFailure();
+        meter.usageTiers.shift(reportMeter.usageBucketCount);
+    }
+    for (size_t i = 1; i < queuedReportCount; i++) {
+        retainedData.queuedReports[i - 1] = queuedReports[i];
     }
+    retainedData.queuedReportCount -= 1;
+    updateSentReports();
 }
 
+void takeTimingSummary() {
+    // Move the phase timings to timingSummary (for the publisher thread),
+    // and start a new summary period
+    std::copy_n(retainedData.phaseStats, PHASE_COUNT, timingSummary);
+    for (PhaseStats& stats: retainedData.phaseStats) {
+        stats.clear();
+    }
+    timingSummarySince = phaseStatsSince;
+    retainedData.phaseStatsSince = nowTime();
+}
+
+void restoreTimingSummary() {
+    // The summary wasn't published: keep its timings for the next one
+    for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+        retainedData.phaseStats[phase].merge(timingSummary[phase]);
+    }
+    retainedData.phaseStatsSince = timingSummarySince;
+}
+
+void checkPublishResults() {
+    // Collect results from the publisher thread (without blocking), and
+    // retire acked reports. (Acks may arrive out of order, but reports
+    // retire in order.)
+    PublishResult result;
+    while (os_queue_take(publishResults, &result, 0, nullptr) == 0) {
+        for (size_t phase = 0; phase < PHASE_COUNT; phase++) {
+            if (result.phaseTimes[phase] != NOT_TIMED) {
+                retainedData.phaseStats[phase].add(result.phaseTimes[phase]);
+            }
+        }
+        if (result.kind == PUBLISH_VITALS) {
+            publishingVitals = false;
+            if (result.succeeded) {
+                lastVitalsTime = nowTime();
+            }
+            continue;
+        }
+        if (result.kind == PUBLISH_TIMING) {
+            publishingTiming = false;
+            if (!result.succeeded) {
+                restoreTimingSummary();
+            }
+            continue;
+        }
+        if (result.kind == PUBLISH_SYNC_TIME) {
+            onSyncTimeResult(result.succeeded);
+            continue;
+        }
+        if (result.batteryVoltage > 0) {
+            publishPolicy->updateBattery(result.batteryCharge, result.batteryVoltage);
+        }
+        for (size_t i = 0; i < publishingCount; i++) {
+            if (publishingSeqs[i] == result.seq) {
+                publishingSeqs[i] = publishingSeqs[--publishingCount];
+                break;
+            }
+        }
+        if (result.unsealed) {
+            continue; // (neither a success nor a failure)
+        }
+        publishPolicy->recordPublish(result.succeeded);
+        WITH_LOCK(reportsLock) {
+            for (size_t r = 0; r < queuedReportCount; r++) {
+                if (queuedReports[r].seq == result.seq) {
+                    if (result.succeeded) {
+                        retainedData.queuedReports[r].acked = true;
+                        onPublishSuccess();
+                    } else {
+                        onPublishFailure(r);
+                    }
+                }
+            }
+        }
+    }
 
-// Cloud function: arg int newPulseCount
+    bool retired = false;
+    WITH_LOCK(reportsLock) {
+        while (queuedReportCount > 0 && queuedReports[0].acked) {
+            retireReport();
+            retired = true;
+        }
+    }
+    // Once caught up, follow up with vitals or the timing summary
+    // (at most one of them per wake) when due
+    if (retired && queuedReportCount == 0 && !hasPublishBacklog()
+        && !publishingVitals && !publishingTiming) {
+        if (lastVitalsTime == INVALID_TIME
+            || nowTime() >= lastVitalsTime + asTime32(PUBLISH_VITALS_INTERVAL)) {
+            PublishJob job = {0, PUBLISH_VITALS};
+            publishingVitals = os_queue_put(publishJobs, &job, 0, nullptr) == 0;
+        } else if (phaseStatsSince != INVALID_TIME
+                   && nowTime() >= phaseStatsSince + asTime32(PUBLISH_TIMING_INTERVAL)) {
+            takeTimingSummary();
+            PublishJob job = {0, PUBLISH_TIMING};
+            publishingTiming = os_queue_put(publishJobs, &job, 0, nullptr) == 0;
+            if (!publishingTiming) {
+                restoreTimingSummary();
+            }
+        }
+    }
+}
+
+void syncTime() {
+    // Until the RTC is valid, nothing can be reported (or scheduled). Have the
+    // publisher thread connect and set it, with the same backoff as publishes.
+    // (Pulses are still captured meanwhile, and get their times once it's set.)
+    if (syncingTime || Time.isValid() || static_cast<int32_t>(millis() - nextSyncTimeMsec) < 0) {
+        return;
+    }
+    PublishJob job = {0, PUBLISH_SYNC_TIME};
+    syncingTime = os_queue_put(publishJobs, &job, 0, nullptr) == 0;
+}
+
+time32_t calcSyncTimeDelay() {
+    // Returns number of seconds until syncTime tries again (0 if it's due)
+    int32_t msec = static_cast<int32_t>(nextSyncTimeMsec - millis());
+    return msec > 0 ? (msec + 999) / 1000 : 0;
+}
+
+void publishData() {
+    if (publishingCount > 0 && !Particle.connected()) {
+        // Wait for the publisher thread to finish connecting (or fail)
+        // before giving it more to publish
+        return;
+    }
+
+    // Seal a new report if one is due, once all the queued ones are in
+    // flight (while they can't be sent, keep adding to the next one instead)
+    int index = nextUnsentReport();
+    if (index < 0 && queuedReportCount < PUBLISH_QUEUE_LENGTH
+        && nowTime() >= calcNextReportTime()) {
+        WITH_LOCK(reportsLock) {
+            sealReport();
+        }
+        index = nextUnsentReport();
+    }
+    if (index < 0) {
+        return; // (nothing to publish that isn't already in flight)
+    }
+
+    if (nowTime() < earliestNextPublishTime) {
+        // Try again later. (Delay for burst control or connectivity issues.)
+        return;
+    }
+
+    // Hand it to the publisher thread
+    PublishJob job = {queuedReports[index].seq, PUBLISH_REPORT};
+    if (os_queue_put(publishJobs, &job, 0, nullptr) != 0) {
+        return;
+    }
+    publishingSeqs[publishingCount++] = job.seq;
+
+    // Publish at most every 5 seconds, except while draining a backlog
+    // (e.g., when recovering after network outage)
+    earliestNextPublishTime = nowTime() + asTime32(
+        hasPublishBacklog() ? PUBLISH_BACKLOG_INTERVAL : PUBLISH_MIN_INTERVAL);
+}
+
+
+// Cloud function: arg int newPulseCount, for meter channel 0;
+// or "channel:newPulseCount"
 int setReading(String args) {
+    long channel = 0;
+    int colon = args.indexOf(':');
+    if (colon >= 0) {
+        String channelArg = args.substring(0, colon);
+        channel = channelArg.toInt();
+        if (channel < 0 || channel >= static_cast<long>(METER_CHANNEL_COUNT)
+            || (channel == 0 && !channelArg.equals("0"))) {
+            return -1;
+        }
+        args = args.substring(colon + 1);
+    }
     long newPulseCount = args.toInt();
     if (newPulseCount < 0 || (newPulseCount == 0 && !args.equals("0"))) {
         return -1;
     }
 
-    ATOMIC_BLOCK() {
-        retainedData.currentPulseCount = newPulseCount;
-        retainedData.pulseTimes.clear();
-        publishImmediately = true;
+    retainedData.meters[channel].currentPulseCount = newPulseCount;
+    WITH_LOCK(reportsLock) {
+        clearPulseTimes(channel);
     }
+    publishImmediately = true;
+    loopWakeup.signal();
     return 0;
 }
 
 // Cloud function
 int sleepNow(String args) {
     stayAwakeUntilTime = 0;
+    loopWakeup.signal();
     return 0;
 }
 
 // Cloud function
 int publishNow(String args) {
     publishImmediately = true;
+    loopWakeup.signal();
+    return 0;
+}
+
+#if PROFILE_INTERRUPTS
+// Cloud function: publishes the interrupt profile;
+// arg "reset" also starts it over
+int publishProfile(String args) {
+    if (!Particle.connected()) {
+        return -1;
+    }
+    PhaseStats stats[PROFILE_SITE_COUNT];
+    ATOMIC_BLOCK() {
+        std::copy_n(profileStats, PROFILE_SITE_COUNT, stats);
+        if (args.equals("reset")) {
+            for (PhaseStats& site: profileStats) {
+                site.clear();
+            }
+        }
+    }
+    std::array<char, particle::protocol::MAX_EVENT_DATA_LENGTH + 1> dataBuf;
+    JSONBufferWriter writer(dataBuf.data(), dataBuf.size() - 1);
+    writer.beginObject();
+    writer.name("upt").value(static_cast<unsigned>(System.uptime()));
+    for (size_t site = 0; site < PROFILE_SITE_COUNT; site++) {
+        writePhaseStats(writer, PROFILE_KEYS[site], stats[site]);
+    }
+    writer.endObject();
+    writer.buffer()[std::min(writer.bufferSize(), writer.dataSize())] = '\0';
+    Particle.publish(EVENT_PROFILE, dataBuf.data(), NO_ACK);
     return 0;
 }
+#endif
 
 // Cloud function: arg 1=internal, 2=external, anything else=auto
 // (Antenna is restored to auto when reset button pressed)
@@ -487,7 +2198,7 @@ int selectAntenna(String args) {
 time32_t calcSleepTime() {
     // Returns number of seconds to sleep -- or zero if we shouldn't sleep yet
 
-    if (pulseDebounceTimer.isActive()) {
+    if (pollPulseDetection()) {
         return 0; // stay awake to complete pulse detection
     }
 
@@ -495,6 +2206,17 @@ time32_t calcSleepTime() {
         return 0; // stay awake to complete signaling
     }
 
+    if (publishingCount > 0 || publishingVitals || publishingTiming || syncingTime) {
+        return 0; // stay awake for the publisher thread
+    }
+
+    if (!clockStarted) {
+        // Stay awake to anchor the clock once the RTC is set;
+        // until then, sleep until time to try setting it again
+        time32_t sleepTime = Time.isValid() ? 0 : calcSyncTimeDelay();
+        return sleepTime < asTime32(MIN_SLEEP_INTERVAL) ? 0 : sleepTime;
+    }
+
     time32_t now = nowTime();
     if (now < stayAwakeUntilTime) {
         return 0; // stay awake after reset
@@ -506,24 +2228,115 @@ time32_t calcSleepTime() {
     return sleepTime < asTime32(MIN_SLEEP_INTERVAL) ? 0 : sleepTime;
 }
 
+void updateFlowEstimate() {
+    // Track the pulse rate, from new pulses seen since the last loop()
+    // (which wakes for each pulse, so sees them about when they arrive)
+    // (on all channels, since any of them wakes it)
+    uint32_t pulseCount = totalPulseCount();
+    if (pulseCount == flowSeenPulseCount) {
+        return;
+    }
+    system_tick_t now = millis();
+    if (flowLastPulseMsec != 0 && pulseCount > flowSeenPulseCount) {
+        float interval = float(now - flowLastPulseMsec) / (pulseCount - flowSeenPulseCount);
+        flowAvgIntervalMsec = flowAvgIntervalMsec == 0 || interval > 1000.0f * publishPolicy->inUseSecs()
+            ? interval // (new flow)
+            : 0.75f * flowAvgIntervalMsec + 0.25f * interval;
+    }
+    flowSeenPulseCount = pulseCount;
+    flowLastPulseMsec = now;
+}
+
+bool isFlowContinuing() {
+    // True if pulses are arriving steadily enough (more often than
+    // publishes) that more are expected soon
+    return flowAvgIntervalMsec > 0
+        && flowAvgIntervalMsec < 1000.0f * publishPolicy->inUseSecs()
+        && millis() - flowLastPulseMsec < FLOW_CONTINUES_INTERVALS * flowAvgIntervalMsec;
+}
+
+time32_t calcStandbySleepTime(time32_t sleepTime) {
+    // Returns number of seconds to sleep with the network in standby
+    // (up to sleepTime) -- or zero to power it down instead.
+    // While flow continues, there will be another publish within the
+    // in-use interval; keep the cloud session for it if standby until then
+    // costs less than reconnecting. (After that, check again.)
+    if (!Particle.connected() || !isFlowContinuing()) {
+        return 0;
+    }
+    time32_t standbyTime = std::min<time32_t>(sleepTime, publishPolicy->inUseSecs());
+    const float pulseWakeMsec = (DEBOUNCE_MSEC + SIGNAL_MSEC_ON).count();
+    float standbyCost = standbyTime * 1000.0f * NETWORK_STANDBY_COST_RATIO
+        + (standbyTime * 1000.0f / flowAvgIntervalMsec) * pulseWakeMsec * NETWORK_AWAKE_COST_RATIO;
+    if (standbyCost >= avgConnectMsec) {
+        return 0;
+    }
+    return standbyTime;
+}
+
+std::chrono::milliseconds calcLoopWait() {
+    // How long loop() can wait before it has anything to do
+    // (unless loopWakeup is signalled sooner)
+    if (pollPulseDetection()) {
+        return LOOP_DEBOUNCE_POLL_INTERVAL; // still debouncing
+    }
+
+    if (!clockStarted) {
+        if (Time.isValid()) {
+            return LOOP_CLOCK_POLL_INTERVAL; // (see updateClockAnchor)
+        }
+        // (until the next try to set it)
+        return std::chrono::seconds(constrain(calcSyncTimeDelay(), 1, asTime32(LOOP_MAX_WAIT)));
+    }
+
+    // Until the next publish (or sleep) decision. Those are all in whole
+    // seconds, so waits under a second would just find nothing to do.
+    time32_t now = nowTime();
+    time32_t nextTime = std::max(calcNextPublishTime(), earliestNextPublishTime);
+    if (now < stayAwakeUntilTime) {
+        nextTime = std::min(nextTime, stayAwakeUntilTime);
+    }
+    std::chrono::seconds wait(constrain(nextTime - now, 1, asTime32(LOOP_MAX_WAIT)));
+    if (Particle.connected()) {
+        wait = std::min(wait, LOOP_CONNECTED_MAX_WAIT);
+    }
+    return wait;
+}
+
 void disconnectCleanly() {
     // Disconnect from Particle Cloud and turn off WiFi power cleanly.
+    const system_tick_t startMsec = millis();
+    const bool wasOn = WiFi.ready();
     Particle.disconnect();  // relies on CloudDisconnectOptions.graceful (see setup)
     waitUntil(Particle.disconnected); // uses CloudDisconnectOptions.timeout (see setup)
     WiFi.off();
+    endCloudSession();
+    if (wasOn) {
+        retainedData.phaseStats[PHASE_DISCONNECT].add(millis() - startMsec);
+    }
 }
 
 
-void sleepDevice(time32_t sleepSecs) {
+void sleepDevice(time32_t sleepSecs, bool networkStandby = false) {
     // Enter ultra low power mode (after finishing any cloud communication),
-    // waking on PIN_PULSE_SWITCH or after sleepSecs secs.
+    // waking on any meter channel's pin or after sleepSecs secs.
+    // Or with networkStandby, stop mode that keeps WiFi up (and connected).
     const std::chrono::seconds sleepDuration(sleepSecs);
-    System.sleep(
-        SystemSleepConfiguration()
-            .mode(SystemSleepMode::ULTRA_LOW_POWER)
-            .gpio(PIN_PULSE_SWITCH, FALLING)
-            .duration(sleepDuration)
-    );
+    rearmPulseDetection();
+    auto config = SystemSleepConfiguration()
+        .mode(networkStandby ? SystemSleepMode::STOP : SystemSleepMode::ULTRA_LOW_POWER)
+        .duration(sleepDuration);
+    for (const MeterChannelConfig& channel: METER_CHANNEL_CONFIGS) {
+        config.gpio(channel.pin, FALLING);
+    }
+    if (networkStandby) {
+        config.network(NETWORK_INTERFACE_WIFI_STA);
+    }
+    const system_tick_t sleepMsec = millis();
+    retainedData.phaseStats[PHASE_AWAKE].add(sleepMsec - awakeSinceMsec);
+    System.sleep(config);
+    awakeSinceMsec = millis();
+    retainedData.phaseStats[PHASE_ASLEEP].add((awakeSinceMsec - sleepMsec) / 1000);
 }
 
 
@@ -532,16 +2345,15 @@ void displayPulseSignals() {
     // by long running cloud functions in the main thread.
     // (Note that delay() yields to other threads.)
     while (true) {
-        if (pulsesToSignal > 0) {
+        pulseSignalWakeup.waitForever(); // (signalled by recordPulse)
+        while (pulsesToSignal > 0) {
             digitalWrite(PIN_LED_SIGNAL, HIGH);
             delay(SIGNAL_MSEC_ON);
-            ATOMIC_BLOCK() {
-                pulsesToSignal -= 1;
+            if ((pulsesToSignal -= 1) == 0) {
+                loopWakeup.signal(); // (signalling no longer keeps it awake)
             }
             digitalWrite(PIN_LED_SIGNAL, LOW);
             delay(SIGNAL_MSEC_OFF);
-        } else {
-            delay(50ms);
         }
     }
 }
@@ -549,12 +2361,24 @@ void displayPulseSignals() {
 
 void setup() {
     validateRetainedData();
+    rebasePulseTimes();
+    loopWakeup.begin();
+    pulseSignalWakeup.begin();
 
     pinMode(PIN_LED_SIGNAL, OUTPUT);
     digitalWrite(PIN_LED_SIGNAL, LOW);
 
-    pinMode(PIN_PULSE_SWITCH, INPUT_PULLUP);
-    attachInterrupt(PIN_PULSE_SWITCH, pulseISR, FALLING);
+    // Count pulses from here on (before anything that might take a while)
+    for (size_t channel = 0; channel < METER_CHANNEL_COUNT; channel++) {
+        const pin_t pin = METER_CHANNEL_CONFIGS[channel].pin;
+        pinMode(pin, INPUT_PULLUP);
+#if PULSE_DETECTION == PULSE_DETECT_EDGES
+        pulseEdges[channel].reset(digitalRead(pin), micros());
+        attachInterrupt(pin, PULSE_ISRS[channel], CHANGE);
+#else
+        attachInterrupt(pin, PULSE_ISRS[channel], FALLING);
+#endif
+    }
 
     if (!pulseSignalThread) {
         pulseSignalThread = new Thread(
@@ -565,7 +2389,19 @@ void setup() {
         );
     }
 
+    if (!publisherThread) {
+        os_queue_create(&publishJobs, sizeof(PublishJob), PUBLISH_QUEUE_LENGTH + 1, nullptr);
+        os_queue_create(&publishResults, sizeof(PublishResult), PUBLISH_QUEUE_LENGTH + 1, nullptr);
+        publisherThread = new Thread(
+            "publisher",
+            publishReports,
+            OS_THREAD_PRIORITY_DEFAULT,
+            4096U // JSON formatting and cloud calls
+        );
+    }
+
     batteryMonitor.begin();
+    batteryMonitor.setCacheTime(BATTERY_READING_CACHE_TIME.count());
     if (System.resetReason() == RESET_REASON_POWER_DOWN) {
         batteryMonitor.quickStart();
     }
@@ -574,6 +2410,11 @@ void setup() {
     Particle.function(FUNC_PUBLISH_NOW, publishNow);
     Particle.function(FUNC_SLEEP_NOW, sleepNow);
     Particle.function(FUNC_SELECT_ANTENNA, selectAntenna);
+#if PROFILE_INTERRUPTS
+    Particle.function(FUNC_PUBLISH_PROFILE, publishProfile);
+#endif
+    Particle.variable(VAR_STANDBY_SLEEPS, standbySleepCount);
+    Particle.variable(VAR_POWER_DOWN_SLEEPS, powerDownSleepCount);
 
     if (System.resetReason() == RESET_REASON_PIN_RESET) {
         WiFi.selectAntenna(ANT_AUTO);
@@ -585,16 +2426,27 @@ void setup() {
             .timeout(CLOUD_DISCONNECT_TIMEOUT)
     );
 
-    Particle.connect();
-    waitUntil(Particle.connected);
-    ledSignalNetworkProblem.setActive(false);
+    // Don't wait for the cloud (or the clock) here: after a battery swap or
+    // brown-out, that could take minutes of radio time, or forever with
+    // WiFi down. Pulses are already being counted; loop() connects when
+    // there's something to publish (or the RTC needs setting; see startClock),
+    // with backoff if that fails.
+    if (System.resetReason() == RESET_REASON_PIN_RESET) {
+        Particle.connect(); // (in the background, for setup/diagnostics/updates)
+    }
+}
 
-    // Most of our logic depends on valid RTC.
-    // If we lost track of time while powered down, restore it now.
-    if (!Time.isValid()) {
-        Particle.syncTime();
-        waitUntil(Particle.syncTimeDone);
-        ledSignalTimeInvalid.setActive(false);
+bool startClock() {
+    // Most of our logic depends on valid RTC. Once it is (at boot, unless it
+    // was lost while powered down; then once syncTime restores it), and
+    // updateClockAnchor has anchored pulse times to it, finish the setup
+    // that needs it. Returns false until then.
+    if (clockStarted || clockAnchorTime == INVALID_TIME || nowTime() == INVALID_TIME) {
+        return clockStarted;
+    }
+    clockStarted = true;
+    if (phaseStatsSince == INVALID_TIME) {
+        retainedData.phaseStatsSince = nowTime();
     }
 
     if (lastPublishTime == INVALID_TIME) {
@@ -606,25 +2458,45 @@ void setup() {
     if (System.resetReason() == RESET_REASON_PIN_RESET) {
         stayAwakeUntilTime = nowTime() + asTime32(RESET_STAY_AWAKE_INTERVAL);
     }
+    return true;
 }
 
 
 void loop() {
-    // publish
-    if (nowTime() >= calcNextPublishTime()) {
+    updateClockAnchor();
+    updateCloudSession();
+    updateFlowEstimate();
+    expirePulseTimes();
+    makeRoomForPulseTimes();
+    checkPublishResults();
+
+    // publish (once the clock is set)
+    if (!startClock()) {
+        syncTime();
+    } else if (nowTime() >= calcNextPublishTime()) {
         publishData();
     }
 
     // sleep if appropriate
     time32_t sleepTime = calcSleepTime();
     if (sleepTime > 0) {
+        time32_t standbyTime = calcStandbySleepTime(sleepTime);
+        if (standbyTime > 0) {
+            standbySleepCount += 1;
+            sleepDevice(standbyTime, true);
+            return; // (check what woke us right away)
+        }
+        if (WiFi.ready()) {
+            powerDownSleepCount += 1;
+        }
         disconnectCleanly();
         sleepTime = calcSleepTime();  // might have changed while waiting for disconnect
         if (sleepTime > 0) {
             sleepDevice(sleepTime);
+            return; // (check what woke us right away)
         }
     }
 
-    // wait a little
-    delay(50ms);
+    // wait for something to do
+    loopWakeup.wait(calcLoopWait());
 }
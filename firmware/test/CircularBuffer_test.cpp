@@ -0,0 +1,352 @@
+// ------------
+// CircularBuffer extensions: two-phase reads (Cursor), the opt-in
+// power-of-two specialization, bulk push/shift, and a benchmark of the two
+// ------------
+
+#include <chrono>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <CircularBuffer.h>
+#include "testing.h"
+
+namespace {
+
+typedef CircularBuffer<int, 5> Buffer;
+
+std::vector<int> contents(const Buffer::Span& first, const Buffer::Span& second) {
+    std::vector<int> result(first.data, first.data + first.size);
+    result.insert(result.end(), second.data, second.data + second.size);
+    return result;
+}
+
+// The power-of-two specialization (the general template is the default)
+template<typename T, size_t S>
+using Pow2Buffer = CircularBuffer<T, S, typename CircularBuffer<T, S>::index_t, true>;
+
+template<typename T, size_t S>
+using GeneralBuffer = CircularBuffer<T, S>;
+
+// Runs the same random operations on a power-of-two buffer and the general
+// one, checking they agree after each (even what they return when empty,
+// and where read() splits)
+template<size_t S>
+void checkMatchesGeneral(uint32_t seed) {
+    // (static, so the general one's storage starts zeroed too)
+    static Pow2Buffer<int, S> pow2;
+    static GeneralBuffer<int, S> general;
+    std::mt19937 rng(seed);
+    int next = 0;
+    std::vector<int> values(S + 3), a(S + 3), b(S + 3);
+    for (int step = 0; step < 2000; step++) {
+        int op = std::uniform_int_distribution<int>(0, 7)(rng);
+        auto n = static_cast<typename CircularBuffer<int, S>::index_t>(
+            std::uniform_int_distribution<size_t>(0, S + 2)(rng));
+        switch (op) {
+        case 0:
+            CHECK_EQ(pow2.push(next), general.push(next));
+            next++;
+            break;
+        case 1:
+            CHECK_EQ(pow2.unshift(next), general.unshift(next));
+            next++;
+            break;
+        case 2:
+            CHECK_EQ(pow2.shift(), general.shift());
+            break;
+        case 3:
+            CHECK_EQ(pow2.pop(), general.pop());
+            break;
+        case 4:
+            std::iota(values.begin(), values.begin() + n, next);
+            next += n;
+            CHECK_EQ(pow2.pushN(values.data(), n), general.pushN(values.data(), n));
+            break;
+        case 5:
+            CHECK_EQ(pow2.shiftN(a.data(), n), general.shiftN(b.data(), n));
+            CHECK(std::equal(a.begin(), a.begin() + std::min<size_t>(n, general.size()), b.begin()));
+            break;
+        case 6: {
+            typename Pow2Buffer<int, S>::Cursor pow2Cursor = {0};
+            typename GeneralBuffer<int, S>::Cursor generalCursor = {0};
+            typename Pow2Buffer<int, S>::Span pow2First, pow2Second;
+            typename GeneralBuffer<int, S>::Span generalFirst, generalSecond;
+            CHECK_EQ(pow2.read(pow2Cursor, n, pow2First, pow2Second),
+                     general.read(generalCursor, n, generalFirst, generalSecond));
+            CHECK_EQ(pow2First.size, generalFirst.size);
+            CHECK(std::equal(pow2First.data, pow2First.data + pow2First.size, generalFirst.data));
+            CHECK(std::equal(pow2Second.data, pow2Second.data + pow2Second.size, generalSecond.data));
+            pow2.commit(pow2Cursor);
+            general.commit(generalCursor);
+            break;
+        }
+        case 7:
+            if (n == 0) {
+                pow2.clear();
+                general.clear();
+            }
+            break;
+        }
+        CHECK_EQ(pow2.size(), general.size());
+        for (size_t i = 0; i < general.size(); i++) {
+            CHECK_EQ(pow2[i], general[i]);
+        }
+        CHECK_EQ(pow2.first(), general.first());
+        CHECK_EQ(pow2.last(), general.last());
+        CHECK_EQ(pow2[0], general[0]);
+    }
+}
+
+// Nanoseconds per element for op, repeated over enough elements to time
+template<typename Op>
+double nsecPerElement(size_t elements, Op op) {
+    auto start = std::chrono::steady_clock::now();
+    size_t done = 0;
+    while (done < 20000000) {
+        op();
+        done += elements;
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / done;
+}
+
+// Timings for one buffer type, and a checksum of what it read
+struct BenchResult {
+    double push, shift, scan, drain;
+    long checksum;
+};
+
+template<typename Buffer>
+BenchResult bench() {
+    static Buffer buffer;
+    const size_t S = Buffer::capacity;
+    std::vector<uint32_t> values(S), out(S);
+    std::iota(values.begin(), values.end(), 1);
+    long checksum = 0;
+    BenchResult result;
+    buffer.clear();
+    buffer.push(0); // (so the data wraps around)
+    result.push = nsecPerElement(S, [&] {
+        for (size_t i = 0; i < S; i++) {
+            buffer.push(values[i]);
+        }
+    });
+    result.shift = nsecPerElement(S, [&] {
+        for (size_t i = 0; i < S; i++) {
+            buffer.push(values[i]);
+        }
+        for (size_t i = 0; i < S; i++) {
+            checksum += buffer.shift();
+        }
+    });
+    buffer.pushN(values.data(), S);
+    result.scan = nsecPerElement(S, [&] {
+        for (size_t i = 0; i < S; i++) {
+            checksum += buffer[i];
+        }
+    });
+    result.drain = nsecPerElement(S, [&] {
+        buffer.pushN(values.data(), S);
+        buffer.shiftN(out.data(), S);
+        checksum += out[S / 2];
+    });
+    result.checksum = checksum;
+    return result;
+}
+
+template<size_t S>
+void benchSize() {
+    BenchResult general = bench<GeneralBuffer<uint32_t, S>>();
+    BenchResult pow2 = bench<Pow2Buffer<uint32_t, S>>();
+    printf("  %6zu %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f\n", S,
+           general.push, pow2.push, general.shift, pow2.shift,
+           general.scan, pow2.scan, general.drain, pow2.drain);
+    // (same work on both)
+    CHECK_EQ(general.checksum, pow2.checksum);
+}
+
+} // namespace
+
+
+TEST(readsInPlaceWithoutRemoving) {
+    Buffer buffer;
+    for (int i = 1; i <= 4; i++) {
+        buffer.push(i);
+    }
+    Buffer::Cursor cursor = {0};
+    Buffer::Span first, second;
+    CHECK_EQ(buffer.read(cursor, 3, first, second), 3);
+    CHECK(contents(first, second) == std::vector<int>({1, 2, 3}));
+    CHECK_EQ(second.size, 0);
+    CHECK_EQ(buffer.size(), 4);
+    CHECK_EQ(buffer.first(), 1);
+
+    // (continues after the pending elements, up to the end)
+    CHECK_EQ(buffer.read(cursor, 3, first, second), 1);
+    CHECK_EQ(first.data[0], 4);
+    CHECK_EQ(cursor.pending, 4);
+    CHECK_EQ(buffer.read(cursor, 3, first, second), 0);
+}
+
+TEST(splitsAtWrapAround) {
+    Buffer buffer;
+    for (int i = 1; i <= 8; i++) {
+        buffer.push(i); // (overwrites 1-3)
+    }
+    Buffer::Cursor cursor = {0};
+    Buffer::Span first, second;
+    CHECK_EQ(buffer.read(cursor, 5, first, second), 5);
+    CHECK(contents(first, second) == std::vector<int>({4, 5, 6, 7, 8}));
+    // (the first element pushed goes at the second storage position)
+    CHECK_EQ(first.size, 1);
+    CHECK_EQ(second.size, 4);
+    CHECK(second.data + 4 == first.data);
+}
+
+TEST(commitRemovesReadElements) {
+    Buffer buffer;
+    for (int i = 1; i <= 7; i++) {
+        buffer.push(i);
+    }
+    Buffer::Cursor cursor = {0};
+    Buffer::Span first, second;
+    buffer.read(cursor, 2, first, second);
+    buffer.push(8); // (while the read is pending)
+    buffer.commit(cursor);
+    CHECK_EQ(cursor.pending, 0);
+    CHECK_EQ(buffer.size(), 3);
+    CHECK_EQ(buffer.first(), 6);
+    CHECK_EQ(buffer.last(), 8);
+
+    buffer.read(cursor, 10, first, second);
+    buffer.commit(cursor);
+    CHECK(buffer.isEmpty());
+    buffer.push(9);
+    CHECK_EQ(buffer.first(), 9);
+    CHECK_EQ(buffer.last(), 9);
+    CHECK_EQ(buffer.size(), 1);
+}
+
+TEST(rollbackReadsAgain) {
+    Buffer buffer;
+    for (int i = 1; i <= 3; i++) {
+        buffer.push(i);
+    }
+    Buffer::Cursor cursor = {0};
+    Buffer::Span first, second;
+    buffer.read(cursor, 2, first, second);
+    buffer.rollback(cursor);
+    CHECK_EQ(buffer.read(cursor, 2, first, second), 2);
+    CHECK(contents(first, second) == std::vector<int>({1, 2}));
+    CHECK_EQ(buffer.size(), 3);
+}
+
+TEST(matchesShiftingEachElement) {
+    // Interleaved pushes, reads and commits agree with a plain shift() copy
+    Buffer buffer, reference;
+    Buffer::Cursor cursor = {0};
+    int next = 0;
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < round % 4; i++) {
+            buffer.push(next);
+            reference.push(next);
+            next++;
+        }
+        Buffer::Span first, second;
+        int n = buffer.read(cursor, round % 3, first, second);
+        std::vector<int> expected;
+        for (int i = 0; i < n; i++) {
+            expected.push_back(reference.shift());
+        }
+        CHECK(contents(first, second) == expected);
+        buffer.commit(cursor);
+        CHECK_EQ(buffer.size(), reference.size());
+    }
+}
+
+TEST(cursorOnPowerOfTwoBuffer) {
+    Pow2Buffer<int, 4> buffer;
+    for (int i = 1; i <= 6; i++) {
+        buffer.push(i);
+    }
+    Pow2Buffer<int, 4>::Cursor cursor = {0};
+    Pow2Buffer<int, 4>::Span first, second;
+    CHECK_EQ(buffer.read(cursor, 4, first, second), 4);
+    CHECK_EQ(first.size + second.size, 4);
+    CHECK_EQ(first.data[0], 3);
+    CHECK_EQ(second.data[second.size - 1], 6);
+    buffer.commit(cursor);
+    CHECK(buffer.isEmpty());
+}
+
+TEST(powerOfTwoIsOptIn) {
+    // (smaller, without pointers)
+    CHECK(sizeof(Pow2Buffer<uint8_t, 64>) < sizeof(GeneralBuffer<uint8_t, 64>));
+    CHECK_EQ(sizeof(Pow2Buffer<uint8_t, 64>), 67u);
+    typedef Pow2Buffer<uint8_t, 64> Buffer64;
+    CHECK_EQ(Buffer64::capacity, 64);
+    // (a power-of-two capacity alone doesn't select it)
+    CHECK_EQ(sizeof(CircularBuffer<uint8_t, 64>), sizeof(GeneralBuffer<uint8_t, 64>));
+    CHECK(sizeof(CircularBuffer<uint8_t, 64>) > sizeof(Pow2Buffer<uint8_t, 64>));
+}
+
+TEST(powerOfTwoMatchesGeneralWhenEmpty) {
+    // (what the general template happens to return, which the
+    // specialization keeps)
+    static Pow2Buffer<int, 4> pow2;
+    static GeneralBuffer<int, 4> general;
+    for (int i = 1; i <= 3; i++) {
+        pow2.push(i);
+        general.push(i);
+    }
+    CHECK_EQ(pow2.pop(), 3);
+    CHECK_EQ(general.pop(), 3);
+    pow2.shift();
+    general.shift();
+    pow2.shift();
+    general.shift();
+    CHECK(pow2.isEmpty());
+    CHECK_EQ(pow2.last(), general.last());
+    CHECK_EQ(pow2.pop(), general.pop());
+    CHECK_EQ(pow2.first(), general.first());
+    CHECK_EQ(pow2.shift(), general.shift());
+    pow2.clear();
+    general.clear();
+    CHECK_EQ(pow2.last(), general.last());
+    CHECK_EQ(pow2[0], general[0]);
+}
+
+TEST(powerOfTwoMatchesGeneral) {
+    checkMatchesGeneral<1>(1);
+    checkMatchesGeneral<8>(2);
+    checkMatchesGeneral<256>(3);
+}
+
+TEST(pushNOverwritesOldest) {
+    Pow2Buffer<int, 4> buffer;
+    buffer.push(1);
+    const int values[] = {2, 3, 4, 5, 6, 7};
+    CHECK(buffer.pushN(values, 3));
+    CHECK(!buffer.pushN(values + 3, 3));
+    int out[4];
+    CHECK_EQ(buffer.shiftN(out, 10), 4);
+    CHECK(std::vector<int>(out, out + 4) == std::vector<int>({4, 5, 6, 7}));
+    CHECK(!buffer.pushN(values, 6)); // (more than fit)
+    CHECK_EQ(buffer.first(), 4);
+    CHECK_EQ(buffer.size(), 4);
+}
+
+TEST(benchmarkPowerOfTwo) {
+    // nsec per element, general template vs. power-of-two specialization
+    // (push: into a full buffer; shift: push then shift; scan: operator[];
+    // drain: pushN then shiftN)
+    printf("  %6s %15s %15s %15s %15s\n", "", "push", "shift", "scan", "drain");
+    printf("  %6s %7s %7s %7s %7s %7s %7s %7s %7s\n", "size",
+           "general", "pow2", "general", "pow2", "general", "pow2", "general", "pow2");
+    benchSize<16>();
+    benchSize<64>();
+    benchSize<256>();
+    benchSize<1024>();
+    benchSize<4096>();
+}
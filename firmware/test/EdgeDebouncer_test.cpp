@@ -0,0 +1,244 @@
+// ------------
+// EdgeDebouncer unit tests, and a bench comparing pulse detection engines
+// ------------
+
+#include <random>
+
+#include "EdgeDebouncer.h"
+#include "testing.h"
+
+namespace {
+
+// Same debounce settings as the firmware
+const uint32_t MIN_CLOSED_USEC = 8000;  // EDGE_DEBOUNCE_MIN_CLOSED
+const uint32_t MIN_OPEN_USEC = 8000;    // EDGE_DEBOUNCE_MIN_OPEN
+const uint32_t TIMER_USEC = 300000;     // DEBOUNCE_MSEC
+const uint32_t POLL_USEC = 50000;       // main loop delay
+
+struct Edge {
+    uint64_t usec;
+    int level;
+};
+
+// Count pulses the way the firmware does with PULSE_DETECT_EDGES: pulseISR
+// on every edge (reading the pin), plus pollPulseDetection from the loop
+uint32_t countWithEdges(const std::vector<Edge>& edges) {
+    EdgeDebouncer debouncer(MIN_CLOSED_USEC, MIN_OPEN_USEC);
+    debouncer.reset(HIGH, 0);
+    uint32_t count = 0;
+    uint64_t nextPoll = POLL_USEC;
+    for (const auto& edge: edges) {
+        for (; nextPoll < edge.usec; nextPoll += POLL_USEC) {
+            count += debouncer.poll(static_cast<uint32_t>(nextPoll));
+        }
+        count += debouncer.edge(static_cast<uint32_t>(edge.usec), edge.level);
+    }
+    count += debouncer.poll(static_cast<uint32_t>(edges.back().usec + POLL_USEC));
+    return count;
+}
+
+// Count pulses the way the firmware does with PULSE_DETECT_TIMER: each
+// falling edge restarts the debounce timer, which counts a pulse if the
+// switch is still closed when it fires
+uint32_t countWithTimer(const std::vector<Edge>& edges) {
+    uint32_t count = 0;
+    bool timerActive = false;
+    uint64_t timerExpires = 0;
+    int level = HIGH;
+    for (const auto& edge: edges) {
+        if (timerActive && timerExpires <= edge.usec) {
+            timerActive = false;
+            count += level == LOW;
+        }
+        if (edge.level == LOW && level == HIGH) {
+            timerActive = true;
+            timerExpires = edge.usec + TIMER_USEC;
+        }
+        level = edge.level;
+    }
+    count += timerActive && level == LOW;
+    return count;
+}
+
+// Switch input for count pulses at rate (per second), closed for half of
+// each period: contact bounce (up to 2ms) at every closing and opening,
+// and occasional noise spikes (well under 1ms) while it's open. The pin is
+// sampled the way a CHANGE interrupt sees it: edges that arrive while
+// the handler is still pending coalesce, and it reads the current level.
+std::vector<Edge> switchEdges(int count, double rate, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> bounces(0, 3);
+    std::uniform_int_distribution<uint64_t> bounceUsec(20, 300);
+    std::uniform_int_distribution<uint64_t> spikeUsec(2, 200);
+
+    const uint64_t period = static_cast<uint64_t>(1e6 / rate);
+    std::vector<Edge> levels; // actual pin transitions
+    auto settleTo = [&](uint64_t t, int level) {
+        // (bounce is complete within 2ms)
+        for (int i = bounces(rng); i > 0; i--) {
+            levels.push_back({t, level});
+            t += bounceUsec(rng);
+            levels.push_back({t, !level});
+            t += bounceUsec(rng);
+        }
+        levels.push_back({t, level});
+    };
+    auto maybeSpike = [&](uint64_t from, uint64_t until) {
+        if (rng() % 4 == 0 && until > from + 2000) {
+            uint64_t t = from + 1000 + rng() % (until - from - 2000);
+            levels.push_back({t, LOW});
+            levels.push_back({t + spikeUsec(rng), HIGH});
+        }
+    };
+
+    uint64_t t = 100000;
+    for (int i = 0; i < count; i++) {
+        settleTo(t, LOW);
+        settleTo(t + period / 2, HIGH);
+        maybeSpike(t + period / 2 + 2000, t + period);
+        t += period;
+    }
+
+    const uint64_t ISR_LATENCY_USEC = 10;
+    std::vector<Edge> edges;
+    int pin = HIGH;
+    uint64_t pendingSince = 0;
+    bool pending = false;
+    for (const auto& change: levels) {
+        if (pending && change.usec >= pendingSince + ISR_LATENCY_USEC) {
+            edges.push_back({pendingSince + ISR_LATENCY_USEC, pin});
+            pending = false;
+        }
+        if (change.level != pin) {
+            pin = change.level;
+            if (!pending) {
+                pending = true;
+                pendingSince = change.usec;
+            }
+        }
+    }
+    if (pending) {
+        edges.push_back({pendingSince + ISR_LATENCY_USEC, pin});
+    }
+    return edges;
+}
+
+} // namespace
+
+
+TEST(ignoresContactBounce) {
+    EdgeDebouncer debouncer(MIN_CLOSED_USEC, MIN_OPEN_USEC);
+    debouncer.reset(HIGH, 0);
+    // closing, with bounce
+    CHECK(!debouncer.edge(1000000, LOW));
+    CHECK(!debouncer.edge(1000300, HIGH));
+    CHECK(!debouncer.edge(1000500, LOW));
+    CHECK(!debouncer.edge(1000600, HIGH));
+    CHECK(!debouncer.edge(1001000, LOW));
+    CHECK(debouncer.isSettling());
+    // opening, with bounce: confirms the pulse (from its settled start)
+    CHECK(debouncer.edge(1200000, HIGH));
+    CHECK_EQ(debouncer.pulseStartUsec(), 1001000u);
+    CHECK(!debouncer.edge(1200200, LOW));
+    CHECK(!debouncer.edge(1200400, HIGH));
+    CHECK(!debouncer.edge(1200500, LOW));
+    CHECK(!debouncer.edge(1201000, HIGH));
+    CHECK(debouncer.isSettling());
+    CHECK(!debouncer.poll(1300000));
+    CHECK(!debouncer.isSettling());
+    CHECK_EQ(debouncer.level(), HIGH);
+}
+
+TEST(rejectsShortGlitches) {
+    EdgeDebouncer debouncer(MIN_CLOSED_USEC, MIN_OPEN_USEC);
+    debouncer.reset(HIGH, 0);
+    CHECK(!debouncer.edge(500000, LOW));
+    CHECK(!debouncer.edge(500000 + MIN_CLOSED_USEC - 1, HIGH));
+    CHECK(!debouncer.poll(900000));
+    CHECK_EQ(debouncer.level(), HIGH);
+
+    // a glitch open in the middle of a pulse doesn't split it
+    CHECK(!debouncer.edge(1000000, LOW));
+    CHECK(debouncer.edge(1050000, HIGH));
+    CHECK(!debouncer.edge(1050100, LOW));
+    CHECK(!debouncer.edge(1100000, HIGH));
+    CHECK(!debouncer.edge(1100000 + MIN_OPEN_USEC - 1, LOW));
+    CHECK(!debouncer.poll(1200000));
+    CHECK_EQ(debouncer.level(), LOW);
+    CHECK(!debouncer.isSettling());
+}
+
+TEST(pollConfirmsHeldSwitch) {
+    EdgeDebouncer debouncer(MIN_CLOSED_USEC, MIN_OPEN_USEC);
+    debouncer.reset(HIGH, 0);
+    CHECK(!debouncer.edge(1000000, LOW));
+    CHECK(!debouncer.poll(1000000 + MIN_CLOSED_USEC - 1));
+    CHECK(debouncer.poll(1000000 + MIN_CLOSED_USEC));
+    CHECK(!debouncer.poll(5000000));
+    CHECK(!debouncer.isSettling());
+    // the release doesn't count again
+    CHECK(!debouncer.edge(9000000, HIGH));
+    CHECK(!debouncer.poll(9100000));
+    CHECK(!debouncer.edge(9200000, LOW));
+    CHECK(debouncer.edge(9300000, HIGH));
+}
+
+TEST(coalescedEdgesAreGlitches) {
+    // CHANGE interrupt ran once for a fast open-close: reads LOW again
+    EdgeDebouncer debouncer(MIN_CLOSED_USEC, MIN_OPEN_USEC);
+    debouncer.reset(HIGH, 0);
+    CHECK(!debouncer.edge(1000000, LOW));
+    CHECK(!debouncer.edge(1005000, LOW));
+    CHECK(debouncer.poll(1000000 + MIN_CLOSED_USEC));
+}
+
+TEST(handlesMicrosWraparound) {
+    EdgeDebouncer debouncer(MIN_CLOSED_USEC, MIN_OPEN_USEC);
+    const uint32_t start = UINT32_MAX - 3000;
+    debouncer.reset(HIGH, start - 100000);
+    CHECK(!debouncer.edge(start, LOW));
+    CHECK(!debouncer.poll(start + MIN_CLOSED_USEC - 1));
+    CHECK(debouncer.poll(start + MIN_CLOSED_USEC));
+    CHECK_EQ(debouncer.pulseStartUsec(), start);
+}
+
+TEST(maxRateBenchmark) {
+    // Raise the pulse rate until some seed's count comes out wrong
+    const int PULSES = 400;
+    const int SEEDS = 8;
+    const double rates[] = {0.5, 1, 1.5, 2, 3, 4, 5, 7.5, 10, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80};
+    double maxEdges = 0;
+    double maxTimer = 0;
+    bool edgesOk = true;
+    bool timerOk = true;
+
+    printf("  %-10s %14s %14s\n", "pulses/sec", "edges counted", "timer counted");
+    for (double rate: rates) {
+        uint32_t worstEdges = PULSES;
+        uint32_t worstTimer = PULSES;
+        bool edgesExact = true;
+        bool timerExact = true;
+        for (uint32_t seed = 1; seed <= SEEDS; seed++) {
+            auto edges = switchEdges(PULSES, rate, seed);
+            uint32_t counted = countWithEdges(edges);
+            edgesExact = edgesExact && counted == PULSES;
+            if (counted != PULSES) worstEdges = counted;
+            counted = countWithTimer(edges);
+            timerExact = timerExact && counted == PULSES;
+            if (counted != PULSES) worstTimer = counted;
+        }
+        printf("  %-10.1f %10u/%u %10u/%u\n", rate, worstEdges, PULSES, worstTimer, PULSES);
+        edgesOk = edgesOk && edgesExact;
+        timerOk = timerOk && timerExact;
+        maxEdges = edgesOk ? rate : maxEdges;
+        maxTimer = timerOk ? rate : maxTimer;
+    }
+    printf("  max reliable rate: edges %.1f/sec, timer %.1f/sec (%d seeds of %d pulses)\n",
+           maxEdges, maxTimer, SEEDS, PULSES);
+
+    // The debounce timer needs the switch closed for its whole period
+    CHECK(maxTimer < 2);
+    // Edge intervals only need it closed (and open) past the bounce
+    // (and a noise spike restarts the open interval)
+    CHECK(maxEdges >= 20);
+}
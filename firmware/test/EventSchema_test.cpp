@@ -0,0 +1,209 @@
+// ------------
+// EventSchema unit tests
+// ------------
+//
+// Including a benchmark of bytes and time per waterbot/data event,
+// against JSONBufferWriter (as the firmware used before).
+
+#include <chrono>
+#include <string>
+
+#include "Particle.h"
+#include "EventSchema.h"
+#include "testing.h"
+
+namespace {
+
+enum { F_INT, F_NEG, F_FIXED, F_STRING, F_REST, F_COUNT };
+constexpr EventField FIELDS[F_COUNT] = {
+    numberField("i", 0, UINT32_MAX),
+    numberField("n", -128, 127),
+    numberField("f", 0, 256, 2),
+    stringField("s", 5),
+    restField("r"),
+};
+
+// The same fields as waterbot/data (see DATA_FIELDS in waterbot.cpp)
+enum {
+    D_T, D_AT, D_SEQ, D_PER, D_TRY, D_PTP, D_PTV, D_CUR, D_LST, D_USE, D_AGG, D_PTS,
+    D_SIG, D_SNR, D_SGP, D_SQP, D_BTV, D_BTP, D_CON, D_CNS, D_UPT, D_MEM, D_V,
+    D_COUNT
+};
+constexpr EventField DATA[D_COUNT] = {
+    numberField("t", 0, UINT32_MAX), numberField("at", 0, UINT32_MAX),
+    numberField("seq", 0, UINT32_MAX), numberField("per", INT32_MIN, INT32_MAX),
+    numberField("try", 0, UINT16_MAX), numberField("ptp", 0, 9),
+    numberField("ptv", 1, 2), numberField("cur", 0, UINT32_MAX),
+    numberField("lst", 0, UINT32_MAX), numberField("use", 0, UINT32_MAX),
+    restField("agg"), restField("pts"),
+    numberField("sig", -128, 127), numberField("snr", -128, 127),
+    numberField("sgp", 0, 100, 1), numberField("sqp", 0, 100, 1),
+    numberField("btv", 0, 5, 3), numberField("btp", 0, 256, 2),
+    numberField("con", 0, UINT32_MAX), numberField("cns", 0, UINT32_MAX),
+    numberField("upt", 0, UINT32_MAX), numberField("mem", 0, UINT32_MAX),
+    stringField("v", 11),
+};
+
+const char PTS[] = "[11,12,[13,40,1512,377],12,13]";
+
+std::string fixed(size_t field, float value) {
+    char buf[64];
+    EventWriter writer(FIELDS, buf, sizeof(buf) - 1);
+    writer.fixed(field, value);
+    writer.finish();
+    return buf;
+}
+
+std::string integer(size_t field, int64_t value) {
+    char buf[64];
+    EventWriter writer(FIELDS, buf, sizeof(buf) - 1);
+    writer.integer(field, value);
+    writer.finish();
+    return buf;
+}
+
+size_t writeWithEventWriter(char* buf, size_t size) {
+    EventWriter writer(DATA, buf, size);
+    writer.integer(D_T, 1658003367);
+    writer.integer(D_AT, 1658003377);
+    writer.integer(D_SEQ, 2);
+    writer.integer(D_PER, 75);
+    writer.integer(D_TRY, 3);
+    writer.integer(D_PTP, 3);
+    writer.integer(D_CUR, 37148);
+    writer.integer(D_LST, 37143);
+    writer.integer(D_USE, 5);
+    writer.rest(D_PTS, PTS, sizeof(PTS) - 1);
+    writer.fixed(D_SIG, -60);
+    writer.fixed(D_SNR, 32);
+    writer.fixed(D_SGP, 75.9991);
+    writer.fixed(D_SQP, 67.7409);
+    writer.fixed(D_BTV, 3.9597);
+    writer.fixed(D_BTP, 85.9141);
+    writer.integer(D_CON, 12);
+    writer.integer(D_CNS, 9);
+    writer.integer(D_UPT, 86517);
+    writer.integer(D_MEM, 41872);
+    writer.string(D_V, "0.3.9");
+    return writer.finish();
+}
+
+size_t writeWithJSONBufferWriter(char* buf, size_t size) {
+    JSONBufferWriter writer(buf, size);
+    writer.beginObject();
+    writer.name("t").value(1658003367);
+    writer.name("at").value(1658003377);
+    writer.name("seq").value(2);
+    writer.name("per").value(75);
+    writer.name("try").value(3);
+    writer.name("ptp").value(3);
+    writer.name("cur").value(37148);
+    writer.name("lst").value(37143);
+    writer.name("use").value(5);
+    writer.name("pts").beginArray();
+    writer.value(11).value(12);
+    writer.beginArray().value(13).value(40).value(1512).value(377).endArray();
+    writer.value(12).value(13);
+    writer.endArray();
+    writer.name("sig").value(-60.0f);
+    writer.name("snr").value(32.0f);
+    writer.name("sgp").value(75.9991f);
+    writer.name("sqp").value(67.7409f);
+    writer.name("btv").value(3.9597f);
+    writer.name("btp").value(85.9141f);
+    writer.name("con").value(12u);
+    writer.name("cns").value(9u);
+    writer.name("upt").value(86517u);
+    writer.name("mem").value(41872u);
+    writer.name("v").value("0.3.9");
+    writer.endObject();
+    buf[std::min(writer.dataSize(), size)] = '\0';
+    return writer.dataSize();
+}
+
+template<typename Write>
+double nsecPerEvent(Write write) {
+    const int EVENTS = 200000;
+    static char buf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < EVENTS; i++) {
+        total += write(buf, sizeof(buf) - 1);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    CHECK(total > 0); // (keep the work)
+    return elapsed.count() / EVENTS;
+}
+
+} // namespace
+
+
+TEST(formatsFixedPoint) {
+    CHECK_EQ(fixed(F_FIXED, 85.9141), "{\"f\":85.91}");
+    CHECK_EQ(fixed(F_FIXED, 85.9951), "{\"f\":86}");    // (drops trailing zeros)
+    CHECK_EQ(fixed(F_FIXED, 85.5), "{\"f\":85.5}");
+    CHECK_EQ(fixed(F_FIXED, 0.05), "{\"f\":0.05}");
+    CHECK_EQ(fixed(F_FIXED, 0), "{\"f\":0}");
+    CHECK_EQ(fixed(F_NEG, -60.4), "{\"n\":-60}");
+    CHECK_EQ(fixed(F_NEG, -0.4), "{\"n\":0}");
+    CHECK_EQ(integer(F_INT, 1658003367), "{\"i\":1658003367}");
+    CHECK_EQ(integer(F_NEG, -128), "{\"n\":-128}");
+}
+
+TEST(clampsToRange) {
+    CHECK_EQ(fixed(F_FIXED, 300), "{\"f\":256}");
+    CHECK_EQ(fixed(F_FIXED, -1), "{\"f\":0}");
+    CHECK_EQ(fixed(F_FIXED, NAN), "{\"f\":0}");
+    CHECK_EQ(integer(F_INT, -1), "{\"i\":0}");
+    CHECK_EQ(integer(F_INT, 1LL << 40), "{\"i\":4294967295}");
+    CHECK_EQ(integer(F_NEG, 1000), "{\"n\":127}");
+}
+
+TEST(maxObjectLengthIsLongestData) {
+    static_assert(maxFieldLength(FIELDS[F_NEG]) == sizeof("\"n\":-128") - 1, "");
+    static_assert(maxFieldLength(FIELDS[F_FIXED]) == sizeof("\"f\":256.00") - 1, "");
+
+    char buf[100];
+    EventWriter writer(FIELDS, buf, sizeof(buf) - 1);
+    writer.integer(F_INT, UINT32_MAX);
+    writer.integer(F_NEG, -128);
+    writer.fixed(F_FIXED, 255.99);
+    writer.string(F_STRING, "12345");
+    writer.rest(F_REST, "[]", 2);
+    size_t length = writer.finish();
+    CHECK(!writer.overflowed());
+    CHECK_EQ(length, maxObjectLength(FIELDS) + 2);
+    CHECK_EQ(std::string(buf), "{\"i\":4294967295,\"n\":-128,\"f\":255.99,\"s\":\"12345\",\"r\":[]}");
+}
+
+TEST(leavesOutFieldsThatDontFit) {
+    char buf[20];
+    EventWriter writer(FIELDS, buf, sizeof(buf) - 1);
+    writer.integer(F_INT, 12345);
+    writer.rest(F_REST, "[1,2,3,4,5]", 11);  // (doesn't fit)
+    writer.integer(F_NEG, 1);                 // (does)
+    writer.string(F_STRING, "123456");        // (too long for its field)
+    writer.finish();
+    CHECK(writer.overflowed());
+    CHECK_EQ(std::string(buf), "{\"i\":12345,\"n\":1}");
+}
+
+TEST(benchmarkDataEvent) {
+    char eventBuf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    char jsonBuf[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    size_t eventBytes = writeWithEventWriter(eventBuf, sizeof(eventBuf) - 1);
+    size_t jsonBytes = writeWithJSONBufferWriter(jsonBuf, sizeof(jsonBuf) - 1);
+    double eventNsec = nsecPerEvent(writeWithEventWriter);
+    double jsonNsec = nsecPerEvent(writeWithJSONBufferWriter);
+
+    printf("  %-18s %6s %9s\n", "writer", "bytes", "nsec");
+    printf("  %-18s %6zu %9.0f\n", "JSONBufferWriter", jsonBytes, jsonNsec);
+    printf("  %-18s %6zu %9.0f\n", "EventWriter", eventBytes, eventNsec);
+    printf("  (longest data: %zu + agg and pts, leaving %zu for them)\n", maxObjectLength(DATA),
+           particle::protocol::MAX_EVENT_DATA_LENGTH - maxObjectLength(DATA));
+    printf("  %s\n", eventBuf);
+
+    CHECK(eventBytes < jsonBytes);
+    CHECK(eventNsec < jsonNsec);
+    CHECK(maxObjectLength(DATA) < 360); // (the old estimate)
+}
@@ -0,0 +1,305 @@
+// ------------
+// FlowSegments unit tests: exact round trip and payload size
+// ------------
+
+#include <cmath>
+#include <random>
+
+#include "FlowSegments.h"
+#include "testing.h"
+
+namespace {
+
+const int64_t START = 1658000000000; // msec
+
+// Same limits as the firmware's waterbot/data publish
+const size_t MAX_PTS_LENGTH = 622 - 290;
+const size_t MAX_SEGMENTS = MAX_PTS_LENGTH / 2;
+const uint8_t MIN_SEGMENT_PULSES = 5;
+const uint16_t TOLERANCE_MSEC = 50;
+// (so a segment's JSON always fits, with every field at its longest)
+const uint8_t MAX_SEGMENT_PULSES = (MAX_PTS_LENGTH - 26) / 5;
+// (before flow segments, each publish had up to 20 pulse times)
+const size_t MAX_PULSE_TIMES = 20;
+
+// Captured pulse times (Unix msec) for flow at a (slowly drifting) average
+// interval (secs), with a little noise on each pulse
+std::vector<int64_t> flowTrace(size_t count, double interval, double drift, double jitter, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> noise(-jitter, jitter);
+    std::vector<int64_t> trace;
+    double t = START + std::uniform_real_distribution<double>(0, 1000)(rng);
+    while (trace.size() < count) {
+        trace.push_back(static_cast<int64_t>(std::floor(t + 1000 * noise(rng))));
+        t += 1000 * interval;
+        interval += drift;
+    }
+    return trace;
+}
+
+// A day of household use: short draws at assorted rates, hours apart
+std::vector<int64_t> householdTrace(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<int64_t> trace;
+    double t = START;
+    while (trace.size() < count) {
+        double interval = 200 + (rng() % 2000) * 10.0;
+        int pulses = 1 + rng() % 60;
+        for (int i = 0; i < pulses && trace.size() < count; i++) {
+            trace.push_back(static_cast<int64_t>(t) + rng() % 5);
+            t += interval;
+        }
+        t += 1000 * (60 + rng() % (3 * 3600));
+    }
+    return trace;
+}
+
+struct RoundTrip {
+    std::vector<int64_t> decoded; // msec
+    size_t publishes = 0;
+    size_t payloadChars = 0;    // total length of pts arrays
+    size_t maxPublishChars = 0; // longest single pts array
+};
+
+// Encode trace the way publishData does (in publishes of up to maxSegments,
+// and MAX_PTS_LENGTH), formatting the pts array and decoding the numbers
+// in it again (the way the server does).
+RoundTrip roundTrip(const std::vector<int64_t>& trace, uint8_t maxRunLength = MAX_SEGMENT_PULSES,
+                    size_t maxSegments = MAX_SEGMENTS) {
+    std::vector<FlowSegment> segments(maxSegments);
+    std::vector<int8_t> residuals(MAX_PTS_LENGTH);
+    RoundTrip result;
+    auto& decoded = result.decoded;
+    size_t next = 0;
+    int64_t previousMsec = START / 1000 * 1000;
+    while (next < trace.size()) {
+        FlowSegmentEncoder encoder(segments.data(), segments.size(), residuals.data(), residuals.size(),
+                                   TOLERANCE_MSEC, maxRunLength);
+        size_t i = next;
+        while (i < trace.size() && encoder.add(trace[i])) {
+            i += 1;
+        }
+        size_t used = encoder.finish();
+        result.publishes += 1;
+        size_t payloadChars = 1; // "["
+
+        for (size_t s = 0; s < used; s++) {
+            const auto& segment = segments[s];
+            std::string element;
+            std::vector<int64_t> times;
+            char buf[64];
+            int64_t time = previousMsec;
+            if (segment.count < MIN_SEGMENT_PULSES) {
+                for (uint32_t i = 0; i < segment.count; i++) {
+                    int64_t delta = segment.timeMsecOf(i) - time;
+                    snprintf(buf, sizeof(buf), "%lld,", (long long)delta);
+                    element += buf;
+                    time += delta;
+                    times.push_back(time);
+                }
+            } else {
+                int64_t delta = static_cast<int64_t>(segment.start) * 1000 + segment.phase - time;
+                snprintf(buf, sizeof(buf), "[%lld,%u,%u", (long long)delta, segment.count, segment.interval);
+                element = buf;
+                for (uint32_t i = 0; i < segment.count; i++) {
+                    snprintf(buf, sizeof(buf), ",%d", segment.residuals[i]);
+                    element += buf;
+                    times.push_back(time + delta + i * segment.interval + segment.residuals[i]);
+                }
+                element += "],";
+            }
+            if (payloadChars + element.size() > MAX_PTS_LENGTH) {
+                break; // rest go in the next publish
+            }
+            payloadChars += element.size();
+            decoded.insert(decoded.end(), times.begin(), times.end());
+            previousMsec = times.back();
+            next += segment.count;
+        }
+        result.payloadChars += payloadChars;
+        result.maxPublishChars = std::max(result.maxPublishChars, payloadChars);
+    }
+    return result;
+}
+
+// Every pulse time decodes to exactly its captured msec
+bool checkExact(const std::vector<int64_t>& trace, uint8_t maxRunLength = MAX_SEGMENT_PULSES) {
+    auto decoded = roundTrip(trace, maxRunLength).decoded;
+    CHECK_EQ(decoded.size(), trace.size());
+    for (size_t i = 0; i < trace.size() && i < decoded.size(); i++) {
+        if (decoded[i] != trace[i]) {
+            CHECK_EQ(decoded[i], trace[i]);
+            printf("    (at pulse %zu)\n", i);
+            return false;
+        }
+    }
+    return decoded.size() == trace.size();
+}
+
+} // namespace
+
+
+TEST(steadyFlowIsOneSegment) {
+    auto trace = flowTrace(200, 4.3, 0, 0.01, 1);
+    std::array<FlowSegment, 4> segments;
+    std::array<int8_t, 200> residuals;
+    FlowSegmentEncoder encoder(segments.data(), segments.size(), residuals.data(), residuals.size(),
+                               TOLERANCE_MSEC);
+    for (auto t: trace) {
+        CHECK(encoder.add(t));
+    }
+    CHECK_EQ(encoder.finish(), 1u);
+    CHECK_EQ(segments[0].count, 200u);
+    CHECK(std::abs(segments[0].interval - 4300) <= 1);
+    CHECK_EQ(segments[1].count, 0u);
+    for (size_t i = 0; i < trace.size(); i++) {
+        CHECK(std::abs(segments[0].residuals[i]) <= TOLERANCE_MSEC);
+        CHECK_EQ(segments[0].timeMsecOf(i), trace[i]);
+    }
+    CHECK(checkExact(trace));
+}
+
+TEST(subsecondFlowRate) {
+    // Several pulses per second (which whole-second times would lump together)
+    auto trace = flowTrace(255, 0.237, 0, 0.005, 2);
+    std::array<FlowSegment, 4> segments;
+    std::array<int8_t, 255> residuals;
+    FlowSegmentEncoder encoder(segments.data(), segments.size(), residuals.data(), residuals.size(),
+                               TOLERANCE_MSEC);
+    for (auto t: trace) {
+        CHECK(encoder.add(t));
+    }
+    CHECK_EQ(encoder.finish(), 1u);
+    CHECK_EQ(segments[0].interval, 237u);
+    CHECK(checkExact(trace));
+}
+
+TEST(recordedTraceRoundTripsExactly) {
+    // The pulses in a waterbot/data event from a deployed device (see the
+    // server dataCapture tests: "t":1658004655, "per":71, "pts":[11,12,13,12,13]),
+    // which captured whole seconds
+    std::vector<int64_t> trace;
+    int64_t t = (1658004655 - 71) * int64_t(1000);
+    for (int delta: {11, 12, 13, 12, 13}) {
+        t += 1000 * delta;
+        trace.push_back(t);
+    }
+    // (from a previous publish at START)
+    for (int64_t& time: trace) {
+        time += START - (1658004655 - 71) * int64_t(1000);
+    }
+    CHECK(checkExact(trace));
+    CHECK(checkExact(trace, 1));
+}
+
+TEST(irregularTimesRoundTripExactly) {
+    std::mt19937 rng(7);
+    std::vector<int64_t> trace;
+    int64_t t = START;
+    for (int i = 0; i < 5000; i++) {
+        // near-simultaneous pulses, steady stretches, and very long gaps
+        switch (rng() % 4) {
+        case 0: t += rng() % 10; break;
+        case 1: t += 1 + rng() % 30000; break;
+        case 2: t += 1 + rng() % 100000000; break;
+        default: t += 7000; break;
+        }
+        trace.push_back(t);
+    }
+    CHECK(checkExact(trace));
+}
+
+TEST(noisyFlowRoundTripsExactly) {
+    for (uint32_t seed = 1; seed <= 20; seed++) {
+        CHECK(checkExact(flowTrace(2000, 1 + seed * 0.9, 0.0005 * seed, 0.3, seed)));
+        CHECK(checkExact(householdTrace(2000, seed)));
+        CHECK(checkExact(flowTrace(2000, 0.2 + seed * 0.05, 0, 0.002 * seed, seed)));
+        if (testing::failures() > 0) {
+            printf("    (seed %u)\n", seed);
+            return;
+        }
+    }
+}
+
+TEST(fullSegmentsRejectPulse) {
+    std::array<FlowSegment, 2> segments;
+    std::array<int8_t, 10> residuals;
+    FlowSegmentEncoder encoder(segments.data(), segments.size(), residuals.data(), residuals.size(),
+                               TOLERANCE_MSEC);
+    CHECK(encoder.add(START));
+    CHECK(encoder.add(START + 100000000)); // too far apart for a run
+    CHECK(encoder.add(START + 100004000)); // extends second segment
+    CHECK(!encoder.add(START + 190000000));
+    CHECK_EQ(encoder.finish(), 2u);
+    CHECK_EQ(segments[0].count, 1u);
+    CHECK_EQ(segments[1].count, 2u);
+    CHECK_EQ(segments[1].lastMsec(), START + 100004000);
+}
+
+TEST(fullResidualsRejectPulse) {
+    auto trace = flowTrace(10, 2, 0, 0.01, 4);
+    std::array<FlowSegment, 4> segments;
+    std::array<int8_t, 6> residuals;
+    FlowSegmentEncoder encoder(segments.data(), segments.size(), residuals.data(), residuals.size(),
+                               TOLERANCE_MSEC);
+    size_t added = 0;
+    while (added < trace.size() && encoder.add(trace[added])) {
+        added += 1;
+    }
+    CHECK_EQ(added, residuals.size());
+    CHECK_EQ(encoder.finish(), 1u);
+    for (size_t i = 0; i < added; i++) {
+        CHECK_EQ(segments[0].timeMsecOf(i), trace[i]);
+    }
+}
+
+TEST(runLengthCanBeDisabled) {
+    auto trace = flowTrace(50, 5, 0, 0, 3);
+    std::array<FlowSegment, MAX_PULSE_TIMES> segments;
+    std::array<int8_t, MAX_PULSE_TIMES> residuals;
+    FlowSegmentEncoder encoder(segments.data(), segments.size(), residuals.data(), residuals.size(),
+                               TOLERANCE_MSEC, 1);
+    size_t added = 0;
+    while (added < trace.size() && encoder.add(trace[added])) {
+        added += 1;
+    }
+    CHECK_EQ(added, MAX_PULSE_TIMES);
+    CHECK_EQ(encoder.finish(), MAX_PULSE_TIMES);
+    for (size_t i = 0; i < added; i++) {
+        CHECK_EQ(segments[i].count, 1u);
+        CHECK_EQ(segments[i].timeMsecOf(0), trace[i]);
+    }
+    CHECK(checkExact(trace, 1));
+}
+
+TEST(payloadBenchmark) {
+    struct {
+        const char* name;
+        std::vector<int64_t> trace;
+    } traces[] = {
+        {"shower (3s)", flowTrace(10000, 3.1, 0, 0.005, 1)},
+        {"irrigation (4s)", flowTrace(10000, 4.3, 0.00001, 0.01, 2)},
+        {"hose (12s)", flowTrace(10000, 12.4, 0.0001, 0.03, 3)},
+        {"fast meter (5/s)", flowTrace(10000, 0.2, 0, 0.002, 5)},
+        {"household", householdTrace(10000, 4)},
+    };
+
+    printf("  %-16s %15s %15s %15s\n", "", "pulses/publish", "pts chars/pulse", "max pts chars");
+    printf("  %-16s %7s %7s %7s %7s %7s %7s\n", "trace", "before", "after", "before", "after", "before", "after");
+    for (const auto& trace: traces) {
+        // (without segments, the firmware publishes every MAX_PULSE_TIMES pulses)
+        auto before = roundTrip(trace.trace, 1, MAX_PULSE_TIMES);
+        auto after = roundTrip(trace.trace);
+        double n = trace.trace.size();
+        printf("  %-16s %7.1f %7.1f %7.2f %7.2f %7zu %7zu\n", trace.name,
+               n / before.publishes, n / after.publishes,
+               before.payloadChars / n, after.payloadChars / n,
+               before.maxPublishChars, after.maxPublishChars);
+
+        CHECK(after.publishes <= before.publishes);
+        CHECK(after.maxPublishChars <= MAX_PTS_LENGTH);
+    }
+    // Several times as many pulses per publish for steady flow (even in
+    // JSON, where each exact pulse's residual still takes 2-4 chars)
+    CHECK(roundTrip(traces[1].trace).publishes * 2 < traces[1].trace.size() / MAX_PULSE_TIMES);
+}
@@ -0,0 +1,268 @@
+// ------------
+// PackedPulseTimes unit tests: shared vectors, round trip, and events
+// per 1000 pulses against the JSON pts array
+// ------------
+//
+// (Reads packed_pts_vectors.txt from the current directory, as make test runs it.)
+
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <string>
+
+#include "FlowSegments.h"
+#include "PackedPulseTimes.h"
+#include "testing.h"
+
+namespace {
+
+const int64_t START = 1658000000000; // msec
+
+// Same limits as the firmware's waterbot/data publish
+const size_t MAX_PTS_LENGTH = 320;
+const uint8_t MIN_SEGMENT_PULSES = 5;
+const uint16_t TOLERANCE_MSEC = 50;
+// (so a segment's JSON always fits, with every field at its longest)
+const uint8_t MAX_SEGMENT_PULSES = (MAX_PTS_LENGTH - 26) / 5;
+
+struct Vector {
+    std::string packed;
+    std::vector<DecodedPtsItem> items;
+    std::string json;
+};
+
+// Parse a JSON pts array (just what the vectors use)
+std::vector<DecodedPtsItem> parseItems(const char* p) {
+    std::vector<DecodedPtsItem> items;
+    p += 1; // "["
+    while (*p && *p != ']') {
+        char* end;
+        if (*p == '[') {
+            std::vector<long> fields;
+            p += 1;
+            while (*p && *p != ']') {
+                fields.push_back(strtol(p, &end, 10));
+                p = (*end == ',') ? end + 1 : end;
+            }
+            p += 1; // "]"
+            items.push_back({static_cast<int32_t>(fields[0]), true, static_cast<uint32_t>(fields[1]),
+                             static_cast<uint32_t>(fields[2]),
+                             std::vector<int32_t>(fields.begin() + 3, fields.end())});
+        } else {
+            items.push_back({static_cast<int32_t>(strtol(p, &end, 10)), false, 0, 0, {}});
+            p = end;
+        }
+        p = (*p == ',') ? p + 1 : p;
+    }
+    return items;
+}
+
+std::vector<Vector> loadVectors() {
+    std::vector<Vector> vectors;
+    std::ifstream file("packed_pts_vectors.txt");
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        size_t close = line.find('"', 1);
+        Vector vector;
+        vector.packed = line.substr(1, close - 1);
+        vector.json = line.substr(close + 2);
+        vector.items = parseItems(vector.json.c_str());
+        vectors.push_back(vector);
+    }
+    return vectors;
+}
+
+// The writer's view of item (with its residuals in storage)
+PtsItem ptsItem(const DecodedPtsItem& item, std::vector<int8_t>& storage) {
+    storage.assign(item.residuals.begin(), item.residuals.end());
+    return {item.delta, item.segment, item.count, item.interval, storage.data()};
+}
+
+std::string pack(const std::vector<DecodedPtsItem>& items) {
+    std::vector<uint8_t> bytes(100000);
+    PackedPulseTimesWriter writer(bytes.data(), bytes.size());
+    std::vector<int8_t> residuals;
+    for (const auto& item: items) {
+        CHECK(writer.add(ptsItem(item, residuals)));
+    }
+    std::string text(PackedPulseTimesWriter::encodedLength(bytes.size()), '\0');
+    size_t length = writer.encode(&text[0]);
+    CHECK_EQ(length, PackedPulseTimesWriter::encodedLength(writer.size()));
+    text.resize(length);
+    return text;
+}
+
+std::string jsonItem(const DecodedPtsItem& item) {
+    char buf[64];
+    if (!item.segment) {
+        snprintf(buf, sizeof(buf), "%ld", long(item.delta));
+        return buf;
+    }
+    snprintf(buf, sizeof(buf), "[%ld,%lu,%lu", long(item.delta),
+             (unsigned long)item.count, (unsigned long)item.interval);
+    std::string json = buf;
+    for (int32_t residual: item.residuals) {
+        snprintf(buf, sizeof(buf), ",%ld", long(residual));
+        json += buf;
+    }
+    return json + "]";
+}
+
+// Captured pulse times (Unix msec) at an average interval (secs),
+// with some noise on each pulse
+std::vector<int64_t> flowTrace(size_t count, double interval, double jitter, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> noise(-jitter, jitter);
+    std::vector<int64_t> trace;
+    double t = START;
+    while (trace.size() < count) {
+        trace.push_back(static_cast<int64_t>(std::floor(t)));
+        t += 1000 * (interval + noise(rng));
+    }
+    return trace;
+}
+
+// The trace's pts items, the way the firmware formats them
+std::vector<DecodedPtsItem> itemsFor(const std::vector<int64_t>& trace, uint8_t maxRunLength) {
+    std::vector<FlowSegment> segments(trace.size() + 1);
+    std::vector<int8_t> residuals(trace.size());
+    FlowSegmentEncoder encoder(segments.data(), segments.size(), residuals.data(), residuals.size(),
+                               TOLERANCE_MSEC, maxRunLength);
+    for (int64_t t: trace) {
+        encoder.add(t);
+    }
+    std::vector<DecodedPtsItem> items;
+    int64_t previousMsec = START;
+    for (size_t s = 0; s < encoder.finish(); s++) {
+        const FlowSegment& segment = segments[s];
+        if (segment.count < MIN_SEGMENT_PULSES) {
+            for (uint32_t i = 0; i < segment.count; i++) {
+                items.push_back({static_cast<int32_t>(segment.timeMsecOf(i) - previousMsec), false, 0, 0, {}});
+                previousMsec = segment.timeMsecOf(i);
+            }
+        } else {
+            int64_t firstMsec = static_cast<int64_t>(segment.start) * 1000 + segment.phase;
+            items.push_back({static_cast<int32_t>(firstMsec - previousMsec), true, segment.count,
+                             segment.interval,
+                             std::vector<int32_t>(segment.residuals, segment.residuals + segment.count)});
+            previousMsec = segment.lastMsec();
+        }
+    }
+    return items;
+}
+
+// Events needed for items, each with at most MAX_PTS_LENGTH of pts
+size_t eventsFor(const std::vector<DecodedPtsItem>& items, bool packed) {
+    size_t events = 0;
+    size_t next = 0;
+    while (next < items.size()) {
+        events += 1;
+        if (packed) {
+            uint8_t bytes[PackedPulseTimesWriter::maxBytes(MAX_PTS_LENGTH - 2)];
+            PackedPulseTimesWriter writer(bytes, sizeof(bytes));
+            std::vector<int8_t> residuals;
+            while (next < items.size() && writer.add(ptsItem(items[next], residuals))) {
+                next++;
+            }
+        } else {
+            size_t length = 2; // "[]"
+            while (next < items.size()
+                   && length + jsonItem(items[next]).size() + 1 <= MAX_PTS_LENGTH) {
+                length += jsonItem(items[next]).size() + 1;
+                next++;
+            }
+        }
+    }
+    return events;
+}
+
+} // namespace
+
+
+TEST(encodesVectors) {
+    auto vectors = loadVectors();
+    CHECK(vectors.size() >= 10u);
+    for (const auto& vector: vectors) {
+        CHECK_EQ(pack(vector.items), vector.packed);
+    }
+}
+
+TEST(decodesVectors) {
+    for (const auto& vector: loadVectors()) {
+        std::vector<DecodedPtsItem> items;
+        CHECK(decodePackedPulseTimes(vector.packed.data(), vector.packed.size(), items));
+        CHECK(items == vector.items);
+    }
+}
+
+TEST(rejectsMalformed) {
+    std::vector<DecodedPtsItem> items;
+    CHECK(!decodePackedPulseTimes("A=", 2, items));  // (not base64)
+    CHECK(!decodePackedPulseTimes("gA", 2, items));  // (unfinished varint)
+    CHECK(!decodePackedPulseTimes("Aw", 2, items));  // (unfinished segment)
+    CHECK(!decodePackedPulseTimes("AQIB", 4, items)); // (missing residual)
+    CHECK(!decodePackedPulseTimes("AAAAA", 5, items)); // (bad length)
+}
+
+TEST(roundTripsRandomItems) {
+    std::mt19937 rng(1);
+    std::vector<DecodedPtsItem> items;
+    for (int i = 0; i < 500; i++) {
+        bool segment = rng() % 4 == 0;
+        int32_t delta = static_cast<int32_t>(rng()) >> (rng() % 32);
+        uint32_t count = rng() % 256, interval = rng() % 65536;
+        std::vector<int32_t> residuals;
+        for (uint32_t r = 0; segment && r < count; r++) {
+            residuals.push_back(static_cast<int8_t>(rng()));
+        }
+        items.push_back({delta, segment, segment ? count : 0, segment ? interval : 0, residuals});
+    }
+    std::string packed = pack(items);
+    std::vector<DecodedPtsItem> decoded;
+    CHECK(decodePackedPulseTimes(packed.data(), packed.size(), decoded));
+    CHECK(decoded == items);
+}
+
+TEST(fullWriterRejectsItem) {
+    uint8_t bytes[3];
+    PackedPulseTimesWriter writer(bytes, sizeof(bytes));
+    const int8_t residuals[] = {0, 3};
+    CHECK(writer.add({1, false, 0, 0, nullptr}));
+    CHECK(!writer.add({13, true, 2, 1512, residuals})); // (needs 7 bytes)
+    CHECK_EQ(writer.size(), 1u);
+    CHECK(writer.add({-1, false, 0, 0, nullptr}));
+    CHECK_EQ(writer.size(), 2u);
+}
+
+TEST(eventsPer1000Pulses) {
+    struct {
+        const char* name;
+        std::vector<int64_t> trace;
+    } traces[] = {
+        {"irrigation (4s)", flowTrace(10000, 4.3, 0.01, 1)},
+        {"hose (12s)", flowTrace(10000, 12.4, 0.03, 2)},
+        {"varying (4s)", flowTrace(10000, 4, 1.5, 3)},
+        {"leak (3min)", flowTrace(10000, 180, 30, 4)},
+    };
+
+    printf("  %-16s %15s %15s\n", "", "segments", "deltas only");
+    printf("  %-16s %7s %7s %7s %7s\n", "trace", "json", "packed", "json", "packed");
+    for (const auto& trace: traces) {
+        auto segmentItems = itemsFor(trace.trace, MAX_SEGMENT_PULSES);
+        auto deltaItems = itemsFor(trace.trace, 1);
+        double per1000 = 1000.0 / trace.trace.size();
+        size_t json = eventsFor(segmentItems, false);
+        size_t packed = eventsFor(segmentItems, true);
+        size_t jsonDeltas = eventsFor(deltaItems, false);
+        size_t packedDeltas = eventsFor(deltaItems, true);
+        printf("  %-16s %7.1f %7.1f %7.1f %7.1f\n", trace.name,
+               json * per1000, packed * per1000, jsonDeltas * per1000, packedDeltas * per1000);
+
+        CHECK(packed <= json);
+        // (msec deltas of a few secs take 3 bytes packed, 5 chars in JSON)
+        CHECK(packedDeltas < jsonDeltas);
+    }
+}
@@ -0,0 +1,121 @@
+// ------------
+// PhaseStats unit tests
+// ------------
+
+#include <random>
+
+#include "PhaseStats.h"
+#include "testing.h"
+
+namespace {
+
+PhaseStats cleared() {
+    PhaseStats stats;
+    stats.clear();
+    return stats;
+}
+
+uint32_t histogramTotal(const PhaseStats& stats) {
+    uint32_t total = 0;
+    for (uint8_t bucket: stats.histogram) {
+        total += bucket;
+    }
+    return total;
+}
+
+} // namespace
+
+
+TEST(fitsInRetainedMemory) {
+    CHECK_EQ(sizeof(PhaseStats), 28u);
+}
+
+TEST(summarizesSamples) {
+    PhaseStats stats = cleared();
+    CHECK_EQ(stats.count, 0u);
+    CHECK_EQ(stats.mean(), 0u);
+    CHECK_EQ(stats.usedBuckets(), 0u);
+
+    for (uint32_t msec: {3100, 2900, 3500, 12000}) {
+        stats.add(msec);
+    }
+    CHECK_EQ(stats.count, 4u);
+    CHECK_EQ(stats.min, 2900u);
+    CHECK_EQ(stats.max, 12000u);
+    CHECK_EQ(stats.mean(), 5375u);
+    CHECK_EQ(stats.histogram[12], 3u); // [2048, 4096)
+    CHECK_EQ(stats.histogram[14], 1u); // [8192, 16384)
+    CHECK_EQ(stats.usedBuckets(), 15u);
+    CHECK_EQ(histogramTotal(stats), 4u);
+}
+
+TEST(logScaleBuckets) {
+    CHECK_EQ(PhaseStats::bucketFor(0), 0u);
+    CHECK_EQ(PhaseStats::bucketFor(1), 1u);
+    CHECK_EQ(PhaseStats::bucketFor(2), 2u);
+    CHECK_EQ(PhaseStats::bucketFor(3), 2u);
+    CHECK_EQ(PhaseStats::bucketFor(4), 3u);
+    CHECK_EQ(PhaseStats::bucketFor(16383), 14u);
+    CHECK_EQ(PhaseStats::bucketFor(16384), 15u);
+    CHECK_EQ(PhaseStats::bucketFor(UINT32_MAX), 15u);
+}
+
+TEST(saturatesInsteadOfWrapping) {
+    PhaseStats stats = cleared();
+    stats.add(100000); // (longer than min/max can hold)
+    CHECK_EQ(stats.min, 65535u);
+    CHECK_EQ(stats.max, 65535u);
+    CHECK_EQ(stats.total, 100000u);
+    for (int i = 0; i < 70000; i++) {
+        stats.add(UINT32_MAX / 1000);
+    }
+    CHECK_EQ(stats.count, 65535u);
+    CHECK_EQ(stats.total, UINT32_MAX);
+}
+
+TEST(fullBucketHalvesHistogram) {
+    // A year of wakes: the histogram keeps its shape
+    PhaseStats stats = cleared();
+    std::mt19937 rng(1);
+    std::lognormal_distribution<double> connectMsec(std::log(3000), 0.3);
+    for (int i = 0; i < 20000; i++) {
+        stats.add(static_cast<uint32_t>(connectMsec(rng)));
+    }
+    CHECK_EQ(stats.count, 20000u);
+    CHECK(stats.histogram[12] > 0 && stats.histogram[12] <= 255);
+    CHECK(stats.histogram[12] > stats.histogram[11]);
+    CHECK(stats.histogram[12] > stats.histogram[13]);
+    CHECK(histogramTotal(stats) > 128);
+}
+
+TEST(mergeCombinesSamples) {
+    PhaseStats a = cleared();
+    PhaseStats b = cleared();
+    for (uint32_t msec: {10, 20, 30}) {
+        a.add(msec);
+    }
+    for (uint32_t msec: {5, 40}) {
+        b.add(msec);
+    }
+    PhaseStats empty = cleared();
+    empty.merge(a);
+    a.merge(b);
+    CHECK_EQ(a.count, 5u);
+    CHECK_EQ(a.min, 5u);
+    CHECK_EQ(a.max, 40u);
+    CHECK_EQ(a.mean(), 21u);
+    CHECK_EQ(histogramTotal(a), 5u);
+    CHECK_EQ(empty.min, 10u);
+    CHECK_EQ(empty.count, 3u);
+
+    // (a bucket that would overflow halves them all)
+    PhaseStats full = cleared();
+    for (int i = 0; i < 200; i++) {
+        full.add(10);
+        b.add(10);
+    }
+    full.merge(b);
+    CHECK_EQ(full.histogram[4], (200 + 201) / 2);
+    CHECK_EQ(full.histogram[3], 0u);
+    CHECK_EQ(full.histogram[6], 0u); // (1 / 2)
+}
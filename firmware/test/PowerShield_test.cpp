@@ -0,0 +1,176 @@
+// ------------
+// PowerShield unit tests
+// ------------
+//
+// Runs the library against a fake Wire (and millis), which records each
+// I2C transfer and can fail them, instead of the simulated device.
+
+#include "PowerShield.h"
+#include "testing.h"
+
+namespace {
+
+struct FakeFuelGauge {
+    uint8_t registers[256] = {};
+    uint8_t pointer = 0;
+    std::vector<uint8_t> tx;
+    std::vector<uint8_t> rx;
+    size_t rxPos = 0;
+
+    // Transfers seen
+    int writes = 0;   // endTransmission() calls
+    int requests = 0; // requestFrom() calls
+
+    // Faults to inject
+    bool nack = false;       // endTransmission() fails
+    int shortRead = -1;      // requestFrom() returns only this many bytes
+
+    void set(uint8_t reg, uint16_t value) {
+        registers[reg] = value >> 8;
+        registers[reg + 1] = value & 0xff;
+    }
+};
+
+FakeFuelGauge gauge;
+system_tick_t nowMsec = 1000;
+
+PowerShield begun() {
+    PowerShield shield;
+    shield.begin();
+    return shield;
+}
+
+} // namespace
+
+TwoWire Wire;
+
+system_tick_t millis() { return nowMsec; }
+
+void TwoWire::beginTransmission(uint8_t address) {
+    gauge.tx.clear();
+}
+
+size_t TwoWire::write(uint8_t data) {
+    gauge.tx.push_back(data);
+    return 1;
+}
+
+uint8_t TwoWire::endTransmission(uint8_t stop) {
+    gauge.writes++;
+    if (gauge.nack) {
+        return 2;
+    }
+    if (!gauge.tx.empty()) {
+        gauge.pointer = gauge.tx[0];
+        for (size_t i = 1; i < gauge.tx.size(); i++) {
+            gauge.registers[gauge.pointer + i - 1] = gauge.tx[i];
+        }
+    }
+    return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity, uint8_t stop) {
+    gauge.requests++;
+    gauge.rx.clear();
+    gauge.rxPos = 0;
+    size_t count = gauge.shortRead >= 0 ? gauge.shortRead : quantity;
+    for (size_t i = 0; i < count; i++) {
+        gauge.rx.push_back(gauge.registers[(gauge.pointer + i) & 0xff]);
+    }
+    return count;
+}
+
+int TwoWire::available() {
+    return gauge.rx.size() - gauge.rxPos;
+}
+
+int TwoWire::read() {
+    return gauge.rxPos < gauge.rx.size() ? gauge.rx[gauge.rxPos++] : -1;
+}
+
+
+TEST(readsVCellAndSoCInOneTransfer) {
+    gauge.set(VCELL_REGISTER, 0xcb00); // 12 bits, full scale 5V
+    gauge.set(SOC_REGISTER, 0x5580);   // 85.5%
+    PowerShield shield = begun();
+
+    PowerShieldReading reading;
+    CHECK(shield.read(reading));
+    CHECK_EQ(gauge.writes, 1);
+    CHECK_EQ(gauge.requests, 1);
+    CHECK(reading.vCell > 3.96 && reading.vCell < 3.97);
+    CHECK_EQ(reading.soC, 85.5f);
+
+    // (matches the separate accessors)
+    CHECK_EQ(shield.getVCell(), reading.vCell);
+    CHECK_EQ(shield.getSoC(), reading.soC);
+}
+
+TEST(cachesReadingsForCacheTime) {
+    gauge.set(SOC_REGISTER, 0x5000);
+    PowerShield shield = begun();
+    shield.setCacheTime(10000);
+
+    PowerShieldReading reading;
+    CHECK(shield.read(reading));
+    gauge.set(SOC_REGISTER, 0x4000);
+    nowMsec += 9999;
+    CHECK(shield.read(reading));
+    CHECK_EQ(shield.getSoC(), 80.0f);
+    CHECK_EQ(gauge.requests, 1);
+
+    nowMsec += 1;
+    CHECK(shield.read(reading));
+    CHECK_EQ(reading.soC, 64.0f);
+    CHECK_EQ(gauge.requests, 2);
+
+    shield.invalidate();
+    CHECK(shield.read(reading));
+    CHECK_EQ(gauge.requests, 3);
+}
+
+TEST(readsEveryTimeByDefault) {
+    PowerShield shield = begun();
+    shield.getVCell();
+    shield.getSoC();
+    CHECK_EQ(gauge.requests, 2);
+}
+
+TEST(reportsI2CErrors) {
+    gauge.set(SOC_REGISTER, 0x5000);
+    PowerShield shield = begun();
+    shield.setCacheTime(10000);
+    PowerShieldReading reading = {1, 2};
+
+    gauge.nack = true;
+    CHECK(!shield.read(reading));
+    CHECK_EQ(gauge.requests, 0);
+    CHECK_EQ(reading.vCell, 1.0f); // (unchanged)
+    CHECK_EQ(shield.getSoC(), 0.0f);
+
+    gauge.nack = false;
+    gauge.shortRead = 3;
+    CHECK(!shield.read(reading));
+    CHECK_EQ(reading.soC, 2.0f);
+
+    // Failures aren't cached
+    gauge.shortRead = -1;
+    CHECK(shield.read(reading));
+    CHECK_EQ(reading.soC, 80.0f);
+}
+
+TEST(cachesConfigRegister) {
+    gauge.set(CONFIG_REGISTER, 0x971c); // (power-on default: 4% alert)
+    PowerShield shield = begun();
+    shield.setCacheTime(10000);
+
+    CHECK_EQ(shield.getCompensateValue(), 0x97);
+    CHECK_EQ(shield.getAlertThreshold(), 4);
+    CHECK(!shield.getAlert());
+    CHECK_EQ(gauge.requests, 1);
+
+    shield.setAlertThreshold(10);
+    CHECK_EQ(gauge.registers[CONFIG_REGISTER + 1], 0x16);
+    CHECK_EQ(shield.getAlertThreshold(), 10);
+    CHECK_EQ(gauge.requests, 1);
+}
@@ -0,0 +1,155 @@
+// ------------
+// PublishPolicy unit tests, against synthetic battery charge curves
+// ------------
+
+#include <cmath>
+#include <random>
+
+#include "PublishPolicy.h"
+#include "testing.h"
+
+namespace {
+
+// Same settings as the firmware
+const BatteryAwarePublishPolicy::Settings SETTINGS = {
+    60,         // PUBLISH_IN_USE_INTERVAL
+    4 * 3600,   // PUBLISH_HEARTBEAT_INTERVAL
+    240,        // PUBLISH_MAX_PULSE_TIMES
+    3,          // PUBLISH_MAX_STRETCH_SHIFT
+    60,         // PUBLISH_FULL_RATE_CHARGE
+    20,         // PUBLISH_MIN_RATE_CHARGE
+    3.5,        // PUBLISH_MIN_RATE_VOLTAGE
+    5,          // PUBLISH_CHARGE_HYSTERESIS
+};
+const float VOLTS = 3.9;
+
+// Fuel gauge readings every hour for days: a LiPo on a small solar cell,
+// charging through the middle of each day (less when cloudy) and running
+// down overnight, with some gauge noise
+std::vector<float> solarCharge(int days, float start, float dailyGain, float hourlyUse,
+                               float noise, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> jitter(-noise, noise);
+    std::vector<float> readings;
+    float charge = start;
+    for (int hour = 0; hour < days * 24; hour++) {
+        int hourOfDay = hour % 24;
+        if (hourOfDay >= 9 && hourOfDay < 17) {
+            charge += dailyGain / 8;
+        }
+        charge = std::min(100.0f, std::max(0.0f, charge - hourlyUse));
+        readings.push_back(charge + jitter(rng));
+    }
+    return readings;
+}
+
+} // namespace
+
+
+TEST(fixedPolicyIgnoresConditions) {
+    FixedPublishPolicy policy(60, 3600, 20);
+    PublishPolicy& generic = policy;
+    generic.updateBattery(5, 3.3);
+    generic.recordPublish(false);
+    CHECK_EQ(generic.inUseSecs(), 60u);
+    CHECK_EQ(generic.heartbeatSecs(), 3600u);
+    CHECK_EQ(generic.maxPulseTimes(), 20u);
+}
+
+TEST(fullRateUntilLowCharge) {
+    BatteryAwarePublishPolicy policy(SETTINGS);
+    CHECK_EQ(policy.shift(), 0); // (no reading yet)
+    policy.updateBattery(104, 4.2); // gauge can read over 100%
+    CHECK_EQ(policy.inUseSecs(), 60u);
+    CHECK_EQ(policy.heartbeatSecs(), 4u * 3600);
+    CHECK_EQ(policy.maxPulseTimes(), 240u);
+
+    const float steps[][2] = {{60, 0}, {50, 0}, {46, 1}, {34, 1}, {33, 2}, {21, 2}, {20, 3}, {1, 3}};
+    for (auto step: steps) {
+        policy.updateBattery(step[0], VOLTS);
+        CHECK_EQ(policy.shift(), static_cast<uint8_t>(step[1]));
+    }
+    CHECK_EQ(policy.inUseSecs(), 8u * 60);
+    CHECK_EQ(policy.heartbeatSecs(), 32u * 3600);
+    CHECK_EQ(policy.maxPulseTimes(), 8u * 240);
+}
+
+TEST(lowVoltageCountsAsLowCharge) {
+    BatteryAwarePublishPolicy policy(SETTINGS);
+    policy.updateBattery(80, 3.45); // (uncalibrated gauge)
+    CHECK_EQ(policy.shift(), 3);
+}
+
+TEST(stretchesSteadilyAsBatteryDrains) {
+    // Cloudy week: the panel doesn't keep up. The stretch only grows
+    // (despite the gauge noise) and reaches its maximum.
+    BatteryAwarePublishPolicy policy(SETTINGS);
+    auto readings = solarCharge(7, 90, 4, 0.6, 1.5, 1);
+    CHECK(readings.back() < SETTINGS.minRateCharge);
+    uint8_t shift = 0;
+    for (float charge: readings) {
+        policy.updateBattery(charge, VOLTS);
+        CHECK(policy.shift() >= shift);
+        shift = policy.shift();
+    }
+    CHECK_EQ(shift, 3);
+}
+
+TEST(tightensAgainWhenRecharged) {
+    // Sunny days after the battery ran down
+    BatteryAwarePublishPolicy policy(SETTINGS);
+    policy.updateBattery(10, VOLTS);
+    CHECK_EQ(policy.shift(), 3);
+    auto readings = solarCharge(5, 10, 40, 0.6, 1.5, 2);
+    CHECK(readings.back() > 90);
+    int fullRateHour = -1;
+    for (size_t hour = 0; hour < readings.size(); hour++) {
+        policy.updateBattery(readings[hour], VOLTS);
+        if (policy.shift() == 0 && fullRateHour < 0) {
+            fullRateHour = static_cast<int>(hour);
+        }
+    }
+    CHECK_EQ(policy.shift(), 0);
+    CHECK(fullRateHour > 0);
+    // (the 1x step goes down to 46.7%; plus hysteresis, less gauge noise)
+    CHECK(readings[fullRateHour] > 46.7 + SETTINGS.hysteresis - 1.5);
+}
+
+TEST(noisyGaugeDoesntFlap) {
+    // Hovering right at a step boundary, with noise
+    BatteryAwarePublishPolicy policy(SETTINGS);
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> jitter(-2, 2);
+    int changes = 0;
+    uint8_t shift = 0;
+    for (int i = 0; i < 1000; i++) {
+        policy.updateBattery(46.7f + jitter(rng), VOLTS);
+        changes += policy.shift() != shift;
+        shift = policy.shift();
+    }
+    CHECK(changes <= 2);
+}
+
+TEST(stretchesAfterPublishFailures) {
+    BatteryAwarePublishPolicy policy(SETTINGS);
+    policy.updateBattery(90, VOLTS);
+    policy.recordPublish(false);
+    CHECK_EQ(policy.shift(), 1);
+    for (int i = 0; i < 5; i++) {
+        policy.recordPublish(false);
+    }
+    CHECK_EQ(policy.shift(), 2);
+    // recovers as publishes succeed again
+    policy.recordPublish(true); // 3
+    CHECK_EQ(policy.shift(), 1);
+    policy.recordPublish(true); // 1
+    policy.recordPublish(true); // 0
+    CHECK_EQ(policy.shift(), 0);
+
+    // and never past the maximum
+    policy.updateBattery(30, VOLTS);
+    for (int i = 0; i < 300; i++) {
+        policy.recordPublish(false);
+    }
+    CHECK_EQ(policy.shift(), 3);
+}
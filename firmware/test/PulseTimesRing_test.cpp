@@ -0,0 +1,388 @@
+// ------------
+// PulseTimesRing unit tests and capacity benchmark
+// ------------
+
+#include <deque>
+#include <random>
+#include <thread>
+
+#include <CircularBuffer.h>
+#include "PulseTimesRing.h"
+#include "testing.h"
+
+namespace {
+
+typedef uint32_t Msec; // msec
+const Msec START = 123456789;
+
+// Same storage budget as the CircularBuffer<time32_t, 700> it replaced
+// (less the ring's 32-byte header)
+typedef PulseTimesRing<2800 - 32> Ring;
+const size_t OLD_CAPACITY = 700;
+
+// Pulse timestamp traces (in msec, as captured by the firmware): flow at
+// an average interval (secs), with some variation in each pulse interval
+std::vector<Msec> flowTrace(size_t count, double interval, double jitter, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> noise(-jitter, jitter);
+    std::vector<Msec> trace;
+    double t = START;
+    while (trace.size() < count) {
+        trace.push_back(static_cast<Msec>(t));
+        t += 1000 * (interval + noise(rng));
+    }
+    return trace;
+}
+
+// A garden day: two long irrigation runs and several shorter hose runs,
+// separated by hours of no flow. The flow rate drifts a little during
+// each run, and pulses are captured to within a few msec.
+std::vector<Msec> gardenTrace(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<Msec> trace;
+    double t = START;
+    while (trace.size() < count) {
+        bool irrigation = rng() % 3 == 0;
+        int pulses = irrigation ? 120 + rng() % 60 : 5 + rng() % 40;
+        double interval = irrigation ? 4000 : 12000;
+        for (int i = 0; i < pulses && trace.size() < count; i++) {
+            trace.push_back(static_cast<Msec>(t) + rng() % 5);
+            t += interval;
+            interval += static_cast<int>(rng() % 21) - 10;
+        }
+        t += 1000 * (600 + rng() % (4 * 3600));
+    }
+    return trace;
+}
+
+// How many of the most recent pulses the ring holds after replaying trace
+size_t capacityFor(const std::vector<Msec>& trace) {
+    static Ring ring;
+    ring.clear();
+    size_t held = 0;
+    for (auto t: trace) {
+        if (!ring.push(t)) {
+            return held;
+        }
+        held = ring.size();
+    }
+    return held;
+}
+
+} // namespace
+
+
+TEST(pushShiftRoundTrip) {
+    Ring ring;
+    ring.clear();
+    CHECK(ring.isEmpty());
+    CHECK(ring.isValid());
+
+    std::vector<Msec> times = {START, START, START + 1, START + 127, START + 128 + 127,
+                               START + 100000, START + 100000, START + 400000000,
+                               START + 400004000, START + 400008000, START + 400012031,
+                               START + 400016000, 2500000000, UINT32_MAX, 3 /* wrapped around */};
+    for (auto t: times) {
+        CHECK(ring.push(t));
+    }
+    CHECK_EQ(ring.size(), times.size());
+    CHECK_EQ(ring.first(), START);
+    CHECK_EQ(ring.last(), 3u);
+    CHECK(ring.isValid());
+    for (auto t: times) {
+        CHECK_EQ(ring.first(), t);
+        CHECK_EQ(ring.shift(), t);
+    }
+    CHECK(ring.isEmpty());
+    CHECK_EQ(ring.bytesUsed(), 0u);
+}
+
+TEST(matchesReferenceFifo) {
+    // Random interleaved push/shift across many wraparounds
+    PulseTimesRing<64> ring;
+    ring.clear();
+    std::deque<Msec> reference;
+    std::mt19937 rng(42);
+    Msec t = START;
+    Msec interval = 4000;
+    for (int i = 0; i < 30000; i++) {
+        if (rng() % 3 != 0) {
+            // mostly steady deltas, occasionally huge or tiny ones
+            switch (rng() % 50) {
+            case 0: t += rng() % 1000000000; break;
+            case 1: t += rng() % 200; break;
+            case 2: interval = rng() % 20000; break;
+            default: t += interval + rng() % 64 - 32; break;
+            }
+            if (ring.push(t)) {
+                reference.push_back(t);
+            } else {
+                // full: not added
+                CHECK(ring.bytesAvailable() < PulseTimesRing<64>::MAX_DELTA_BYTES);
+                t = reference.empty() ? t : reference.back();
+            }
+        } else if (!reference.empty()) {
+            CHECK_EQ(ring.shift(), reference.front());
+            reference.pop_front();
+        }
+        CHECK_EQ(ring.size(), reference.size());
+        if (!reference.empty()) {
+            CHECK_EQ(ring.first(), reference.front());
+            CHECK_EQ(ring.last(), reference.back());
+        }
+        if (i % 7 == 0) {
+            // cursor reads everything without consuming it
+            auto cursor = ring.cursor();
+            auto expected = reference.begin();
+            for (; !cursor.done() && expected != reference.end(); cursor.next(), ++expected) {
+                CHECK_EQ(cursor.time(), *expected);
+            }
+            CHECK(cursor.done() && expected == reference.end());
+        }
+        if (testing::failures() > 0) {
+            return;
+        }
+    }
+    CHECK(ring.isValid());
+}
+
+TEST(encodedSizes) {
+    PulseTimesRing<64> ring;
+    ring.clear();
+    auto bytesFor = [&](Msec time) {
+        size_t before = ring.bytesUsed();
+        ring.push(time);
+        return ring.bytesUsed() - before;
+    };
+    CHECK_EQ(bytesFor(START), 4u);           // first, from 0
+    CHECK_EQ(bytesFor(START + 4300), 2u);    // new interval
+    CHECK_EQ(bytesFor(START + 8600), 1u);    // same interval
+    CHECK_EQ(bytesFor(START + 12931), 1u);   // +31 msec
+    CHECK_EQ(bytesFor(START + 17200), 2u);   // -62 msec
+    CHECK_EQ(bytesFor(START + 17200), 1u);   // stopped
+    CHECK_EQ(bytesFor(START + 17200 + 3600000), 4u); // an hour later
+    CHECK_EQ(bytesFor(START + 17200 + 3604000), 2u); // (not -3596 secs)
+}
+
+TEST(overflowRejectsNewest) {
+    PulseTimesRing<16> ring;
+    ring.clear();
+    CHECK(ring.push(START)); // 4 bytes from 0
+    CHECK(ring.push(START + 100)); // 2 bytes
+    for (int i = 2; i <= 10; i++) {
+        CHECK(ring.push(START + i * 100)); // 1 byte each
+    }
+    CHECK(ring.isFull());
+    CHECK(!ring.push(START + 1100));
+    CHECK_EQ(ring.size(), 11u);
+    CHECK_EQ(ring.first(), START);
+
+    // Consumer makes room
+    CHECK_EQ(ring.shift(), START); // frees four bytes
+    CHECK(ring.push(START + 20000)); // 3 bytes
+    CHECK(ring.push(START + 20000)); // 1 byte
+    CHECK(!ring.push(START + 20001));
+    CHECK_EQ(ring.size(), 12u);
+    CHECK_EQ(ring.first(), START + 100);
+    CHECK(ring.isValid());
+}
+
+TEST(rebaseMovesAllTimes) {
+    Ring ring;
+    ring.clear();
+    for (Msec t = 5000; t < 50000; t += 4321) {
+        ring.push(t);
+    }
+    ring.shift();
+    ring.rebase(0 - 40000); // e.g., captured before a reset
+    CHECK_EQ(ring.first(), Msec(9321 - 40000));
+    ring.push(10000);
+    Msec expected = 9321 - 40000;
+    for (auto cursor = ring.cursor(); cursor.remaining() > 1; cursor.next()) {
+        CHECK_EQ(cursor.time(), expected);
+        expected += 4321;
+    }
+    while (ring.size() > 1) {
+        ring.shift();
+    }
+    CHECK_EQ(ring.shift(), 10000u);
+    CHECK(ring.isValid());
+}
+
+TEST(truncateKeepsOldest) {
+    Ring ring;
+    ring.clear();
+    for (Msec t = START; t < START + 10 * 4321; t += 4321) {
+        ring.push(t);
+    }
+    ring.shift();
+    ring.truncate(3);
+    CHECK_EQ(ring.size(), 3u);
+    CHECK_EQ(ring.last(), START + 3 * 4321);
+    CHECK(ring.isValid());
+    ring.truncate(5); // (keeps them all)
+    CHECK_EQ(ring.size(), 3u);
+    ring.push(START + 100000);
+    CHECK_EQ(ring.shift(), START + 4321);
+    CHECK_EQ(ring.shift(), START + 2 * 4321);
+    CHECK_EQ(ring.shift(), START + 3 * 4321);
+    CHECK_EQ(ring.shift(), START + 100000);
+    ring.truncate(0);
+    CHECK(ring.isEmpty());
+    CHECK(ring.isValid());
+}
+
+TEST(clampsBackwardTime) {
+    Ring ring;
+    ring.clear();
+    ring.push(START + 10);
+    ring.push(START + 5); // e.g., RTC adjusted backwards
+    ring.push(START + 12);
+    CHECK_EQ(ring.shift(), START + 10);
+    CHECK_EQ(ring.shift(), START + 10);
+    CHECK_EQ(ring.shift(), START + 12);
+}
+
+TEST(concurrentProducerConsumer) {
+    // Producer and consumer on separate threads, with no locking.
+    // A small ring keeps the producer bumping into a full buffer.
+    static PulseTimesRing<32> ring;
+    ring.clear();
+    const uint32_t COUNT = 2000000;
+    auto timeOf = [](uint32_t i) {
+        // mix of one-, two- and three-byte deltas
+        return START + i * 13 + (i / 7) * 200 + (i / 1000) * 100000;
+    };
+
+    std::thread producer([&] {
+        for (uint32_t i = 0; i < COUNT; i++) {
+            while (!ring.push(timeOf(i))) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t received = 0;
+    uint32_t mismatches = 0;
+    uint32_t cursorChecks = 0;
+    while (received < COUNT) {
+        if (ring.isEmpty()) {
+            std::this_thread::yield();
+            continue;
+        }
+        if (received % 64 == 0) {
+            // Cursor snapshot stays consistent while the producer keeps pushing
+            uint32_t i = received;
+            for (auto cursor = ring.cursor(); !cursor.done(); cursor.next(), i++) {
+                mismatches += cursor.time() != timeOf(i);
+            }
+            cursorChecks += 1;
+        }
+        mismatches += ring.first() != timeOf(received);
+        mismatches += ring.shift() != timeOf(received);
+        received += 1;
+    }
+    producer.join();
+
+    CHECK_EQ(mismatches, 0u);
+    CHECK(ring.isEmpty());
+    CHECK(ring.isValid());
+    CHECK(cursorChecks > 0u);
+}
+
+TEST(detectsCorruptState) {
+    Ring ring;
+    memset(static_cast<void*>(&ring), 0xa5, sizeof(ring));
+    CHECK(!ring.isValid());
+    ring.clear();
+    CHECK(ring.isValid());
+}
+
+TEST(detectsCorruptByte) {
+    // Any byte of the state, or of the times stored so far, changed
+    // (e.g., by a reset partway through a push) makes it invalid
+    Ring ring;
+    ring.clear();
+    CHECK(ring.push(START));
+    const size_t shifted = ring.bytesUsed();
+    CHECK_EQ(ring.shift(), START);
+    for (Msec t = START + 1000; t < START + 60000; t += 1250 + t % 7) {
+        CHECK(ring.push(t));
+    }
+    const size_t header = sizeof(ring) - (2800 - 32);
+    std::vector<size_t> offsets;
+    for (size_t i = 0; i < header; i++) {
+        offsets.push_back(i);
+    }
+    for (size_t i = 0; i < ring.bytesUsed(); i++) {
+        offsets.push_back(header + shifted + i);
+    }
+    auto bytes = reinterpret_cast<uint8_t*>(&ring);
+    size_t detected = 0;
+    for (size_t offset: offsets) {
+        bytes[offset] ^= 0xff;
+        detected += !ring.isValid();
+        bytes[offset] ^= 0xff;
+    }
+    CHECK_EQ(detected, offsets.size());
+    CHECK(ring.isValid());
+
+    // (but the unused bytes don't matter)
+    bytes[header + shifted + ring.bytesUsed()] ^= 0xff;
+    CHECK(ring.isValid());
+}
+
+TEST(survivesRelocation) {
+    // No pointers, so a byte copy (e.g., retained memory moved by a
+    // firmware update) is the same ring
+    Ring ring;
+    ring.clear();
+    for (Msec t = START; t < START + 5000; t += 250) {
+        CHECK(ring.push(t));
+    }
+    Ring* moved = static_cast<Ring*>(malloc(sizeof(Ring)));
+    memcpy(static_cast<void*>(moved), &ring, sizeof(Ring));
+    CHECK(moved->isValid());
+    CHECK_EQ(moved->size(), ring.size());
+    CHECK_EQ(moved->first(), START);
+    CHECK_EQ(moved->shift(), START);
+    CHECK_EQ(moved->shift(), START + 250);
+    free(moved);
+
+    // but a ring of another size (say, from older firmware) isn't
+    PulseTimesRing<2000> smaller;
+    smaller.clear();
+    memcpy(static_cast<void*>(&ring), &smaller, sizeof(smaller));
+    CHECK(!ring.isValid());
+}
+
+TEST(capacityBenchmark) {
+    struct {
+        const char* name;
+        std::vector<Msec> trace;
+    } traces[] = {
+        {"irrigation (4s)", flowTrace(20000, 4, 0.015, 1)},
+        {"hose (12s)", flowTrace(20000, 12, 0.03, 2)},
+        {"varying (4s)", flowTrace(20000, 4, 0.5, 3)},
+        {"leak (3min)", flowTrace(20000, 180, 30, 4)},
+        {"garden days", gardenTrace(20000, 5)},
+    };
+
+    printf("  %-18s %8s %8s %7s\n", "trace", "before", "after", "ratio");
+    for (const auto& trace: traces) {
+        size_t capacity = capacityFor(trace.trace);
+        printf("  %-18s %8zu %8zu %6.1fx\n", trace.name, OLD_CAPACITY, capacity,
+               double(capacity) / OLD_CAPACITY);
+    }
+    printf("  (in %zu bytes of retained memory)\n", sizeof(Ring));
+
+    // Steady flow fits in one byte per pulse
+    CHECK(capacityFor(traces[0].trace) >= 3 * OLD_CAPACITY);
+    CHECK(capacityFor(traces[1].trace) >= 3 * OLD_CAPACITY);
+    CHECK(capacityFor(traces[4].trace) >= 3 * OLD_CAPACITY);
+    // and even varying flow and slow leaks (at msec resolution)
+    // are better than before
+    CHECK(capacityFor(traces[2].trace) >= OLD_CAPACITY);
+    CHECK(capacityFor(traces[3].trace) >= OLD_CAPACITY);
+    CHECK(sizeof(Ring) <= sizeof(CircularBuffer<Msec, OLD_CAPACITY>));
+}
@@ -0,0 +1,222 @@
+// ------------
+// UsageTiers unit tests and outage timing benchmark
+// ------------
+
+#include <algorithm>
+#include <random>
+
+#include "PulseTimesRing.h"
+#include "UsageTiers.h"
+#include "testing.h"
+
+namespace {
+
+typedef uint32_t Msec;
+const Msec START = 123456789;
+const Msec MINUTE = 60 * 1000;
+const Msec HOUR = 60 * MINUTE;
+const Msec DAY = 24 * HOUR;
+
+// Same sizes as the firmware's retained data
+typedef UsageTiers<24> Tiers;
+typedef PulseTimesRing<2360> Ring;
+
+// Busy garden days (see PulseTimesRing_test): irrigation and hose runs,
+// separated by up to an hour of no flow, for the given duration
+std::vector<Msec> gardenTrace(Msec duration, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<Msec> trace;
+    double t = START;
+    while (t < START + duration) {
+        bool irrigation = rng() % 3 == 0;
+        int pulses = irrigation ? 120 + rng() % 60 : 5 + rng() % 40;
+        double interval = irrigation ? 4000 : 12000;
+        for (int i = 0; i < pulses; i++) {
+            trace.push_back(static_cast<Msec>(t) + rng() % 5);
+            t += interval;
+            interval += static_cast<int>(rng() % 21) - 10;
+        }
+        t += 1000 * (600 + rng() % 3000);
+    }
+    return trace;
+}
+
+struct TimingError {
+    Msec worst;
+    double mean;
+};
+
+// Replay trace through an outage (nothing reported), shifting the oldest
+// pulse time out of the ring to make room for each new one, then measure
+// how far each pulse's reported time could be off: zero in the ring, the
+// bucket's span if folded into tiers, or the time since the outage
+// started (until the first remaining time) if dropped.
+TimingError outageError(const std::vector<Msec>& trace, bool fold) {
+    static Ring ring;
+    static Tiers tiers;
+    ring.clear();
+    tiers.clear();
+    uint32_t dropped = 0;
+    for (Msec t: trace) {
+        while (!ring.push(t)) {
+            Msec oldest = ring.shift();
+            if (!fold || !tiers.add(oldest, 0)) {
+                dropped += 1;
+            }
+        }
+    }
+
+    TimingError error = {0, 0};
+    double total = 0;
+    for (size_t i = 0; i < tiers.size(); i++) {
+        error.worst = std::max(error.worst, tiers[i].spanMsec());
+        total += double(tiers[i].spanMsec()) * tiers[i].count;
+    }
+    if (dropped > 0) {
+        Msec unknown = (tiers.isEmpty() ? ring.first() : tiers[0].first) - START;
+        error.worst = std::max(error.worst, unknown);
+        total += double(unknown) * dropped;
+    }
+    error.mean = total / trace.size();
+    return error;
+}
+
+} // namespace
+
+
+TEST(foldsPulsesIntoMinuteBuckets) {
+    Tiers tiers;
+    tiers.clear();
+    CHECK(tiers.add(START, 0));
+    CHECK(tiers.add(START + 20000, 0));
+    CHECK(tiers.add(START + MINUTE - 1, 0));
+    CHECK(tiers.add(START + MINUTE, 0)); // (starts a new bucket)
+    CHECK_EQ(tiers.size(), 2u);
+    CHECK_EQ(tiers[0].first, START);
+    CHECK_EQ(tiers[0].last, START + MINUTE - 1);
+    CHECK_EQ(tiers[0].count, 3u);
+    CHECK_EQ(tiers[1].count, 1u);
+    CHECK_EQ(tiers.pulseCount(0, 2), 4u);
+    CHECK_EQ(tiers.pulseCount(1, 99), 1u);
+}
+
+TEST(mergesFinestTierFirst) {
+    // Full of buckets, hourly at first, then every 10 minutes: a merge
+    // joins the oldest pair that fits within an hour
+    Tiers tiers;
+    tiers.clear();
+    for (size_t i = 0; i < 12; i++) {
+        tiers.add(START + i * 2 * HOUR, 0);
+    }
+    for (size_t i = 0; i < 12; i++) {
+        tiers.add(START + DAY + i * 10 * MINUTE, 0);
+    }
+    CHECK_EQ(tiers.size(), 24u);
+    CHECK(tiers.add(START + 2 * DAY, 0));
+    CHECK_EQ(tiers.size(), 24u);
+    CHECK_EQ(tiers[12].first, START + DAY);
+    CHECK_EQ(tiers[12].last, START + DAY + 10 * MINUTE);
+    CHECK_EQ(tiers[12].count, 2u);
+    CHECK_EQ(tiers[23].first, START + 2 * DAY);
+    CHECK_EQ(tiers.pulseCount(0, 24), 25u);
+}
+
+TEST(mergesOldestWhenNothingFits) {
+    // Daily buckets can only merge beyond a day: the oldest pair goes
+    Tiers tiers;
+    tiers.clear();
+    for (size_t i = 0; i < 25; i++) {
+        CHECK(tiers.add(START + i * 2 * DAY, 0));
+    }
+    CHECK_EQ(tiers.size(), 24u);
+    CHECK_EQ(tiers[0].first, START);
+    CHECK_EQ(tiers[0].last, START + 2 * DAY);
+    CHECK_EQ(tiers[0].count, 2u);
+    CHECK_EQ(tiers[1].first, START + 4 * DAY);
+}
+
+TEST(keepsFrozenBuckets) {
+    Tiers tiers;
+    tiers.clear();
+    tiers.add(START, 0);
+    tiers.add(START + 2 * MINUTE, 0);
+    // Frozen newest bucket doesn't take more pulses
+    CHECK(tiers.add(START + 2 * MINUTE + 1, 2));
+    CHECK_EQ(tiers.size(), 3u);
+    CHECK_EQ(tiers[1].count, 1u);
+
+    for (size_t i = 3; i < 24; i++) {
+        tiers.add(START + i * 2 * MINUTE, 2);
+    }
+    CHECK(tiers.add(START + HOUR, 2));
+    CHECK_EQ(tiers[0].count, 1u); // (unmerged)
+    CHECK_EQ(tiers[1].count, 1u);
+    CHECK_EQ(tiers[2].count, 2u); // (oldest unfrozen pair)
+
+    // With everything frozen, a pulse has nowhere to go
+    CHECK(!tiers.add(START + DAY, tiers.size()));
+    CHECK_EQ(tiers.pulseCount(0, 24), 25u);
+
+    tiers.shift(2);
+    CHECK_EQ(tiers.size(), 22u);
+    CHECK_EQ(tiers[0].first, START + 2 * MINUTE + 1);
+    tiers.truncate(20);
+    CHECK_EQ(tiers.size(), 20u);
+    CHECK_EQ(tiers[0].first, START + 2 * MINUTE + 1);
+    CHECK(tiers.isValid());
+}
+
+TEST(rebaseAndValidity) {
+    Tiers tiers;
+    memset(static_cast<void*>(&tiers), 0x5a, sizeof(tiers));
+    CHECK(!tiers.isValid());
+    tiers.clear();
+    CHECK(tiers.isValid());
+    CHECK(!reinterpret_cast<const UsageTiers<23>&>(tiers).isValid());
+
+    tiers.add(10000, 0);
+    tiers.add(90000, 0);
+    tiers.rebase(0 - 5000);
+    CHECK_EQ(tiers[0].first, 5000u);
+    CHECK_EQ(tiers[1].last, 85000u);
+}
+
+TEST(detectsCorruptByte) {
+    Tiers tiers;
+    tiers.clear();
+    for (Msec t = START; t < START + 5 * MINUTE; t += 20000) {
+        tiers.add(t, 0);
+    }
+    // The checksum and count, then the buckets in use
+    auto bytes = reinterpret_cast<uint8_t*>(&tiers);
+    const size_t bucketsStart = sizeof(tiers) - 24 * sizeof(UsageBucket);
+    std::vector<size_t> offsets = {0, 1, 2, 3, 4};
+    for (size_t i = 0; i < tiers.size() * sizeof(UsageBucket); i++) {
+        offsets.push_back(bucketsStart + i);
+    }
+    for (size_t offset: offsets) {
+        bytes[offset] ^= 0xff;
+        CHECK(!tiers.isValid());
+        bytes[offset] ^= 0xff;
+    }
+    CHECK(tiers.isValid());
+}
+
+TEST(outageTimingBenchmark) {
+    printf("  %-8s %8s %17s %17s\n", "", "", "worst error (h)", "mean error (min)");
+    printf("  %-8s %8s %8s %8s %8s %8s\n", "outage", "pulses", "dropped", "folded", "dropped", "folded");
+    for (int days: {1, 3, 7}) {
+        auto trace = gardenTrace(days * DAY, days);
+        TimingError dropped = outageError(trace, false);
+        TimingError folded = outageError(trace, true);
+        printf("  %-8s %8zu %8.1f %8.1f %8.1f %8.1f\n",
+               (std::to_string(days) + " day").c_str(), trace.size(),
+               dropped.worst / double(HOUR), folded.worst / double(HOUR),
+               dropped.mean / MINUTE, folded.mean / MINUTE);
+
+        // Nothing's lost; even a week out, times are to within a day
+        CHECK(folded.worst <= DAY);
+        CHECK(folded.mean * 5 < dropped.mean);
+    }
+    printf("  (%zu bytes of tiers with %zu bytes of ring)\n", sizeof(Tiers), sizeof(Ring));
+}
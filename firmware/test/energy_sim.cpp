@@ -0,0 +1,345 @@
+// ------------
+// Trace-driven energy and radio-time simulator
+// ------------
+//
+// Replays a meter pulse trace (and optionally a network availability
+// trace) through the complete firmware on the simulated device, and
+// reports how often it woke, how long it stayed awake with the radio on,
+// what it published, and an estimate of the battery charge that used.
+//
+//   ./build/energy_sim --pulses=usage.csv [--network=outages.csv] [options]
+//
+// The pulse trace is a CSV with a header row naming its columns, e.g. an
+// export of the server's usage_data table. It needs a time_start column;
+// if it also has usage_meter_units (and time_end), each row spreads that
+// many pulses evenly from time_start to time_end. (Without a header, the
+// first column of each row is one pulse time.)
+//
+// The network trace has rows of time,available (1 or 0). The network is
+// available until the first row that says otherwise.
+//
+// Times can be Unix seconds or "YYYY-MM-DD HH:MM:SS" (UTC). A year of
+// traces replays in a few seconds, so parameter sweeps can just loop:
+//
+//   for ack in 100 300 1000 3000; do
+//       ./build/energy_sim --pulses=usage.csv --ack-ms=$ack --csv
+//   done
+//
+// (The firmware's own scheduling constants are compile-time, so sweeping
+// those means rebuilding with a different waterbot.cpp.)
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "payload.h"
+#include "sim.h"
+
+namespace {
+
+const pin_t PULSE_PIN = D2;
+const uint64_t MAX_PULSE_WIDTH_USEC = 400000;
+const uint64_t USEC_PER_SEC = 1000000;
+
+// Average current draw (in mA) in each state
+struct PowerModel {
+    double sleepMa = 1.0;   // System.sleep (stop mode)
+    double awakeMa = 30.0;  // running, radio off
+    double radioMa = 50.0;  // additional, while WiFi is on
+    double standbyMa = 3.0; // additional, while asleep with WiFi in standby
+};
+
+struct Options {
+    const char* pulsesFile = nullptr;
+    const char* networkFile = nullptr;
+    PowerModel power;
+    double batteryMah = 0;
+    bool csv = false;
+    sim::Config config;
+};
+
+struct NetworkChange {
+    double time;
+    bool available;
+};
+
+// Parse Unix seconds, or a UTC "YYYY-MM-DD HH:MM:SS[.fff]" timestamp
+// (with an optional 'T' separator and trailing zone, which is ignored)
+bool parseTime(const std::string& text, double& time) {
+    const char* s = text.c_str();
+    while (*s == ' ' || *s == '"') {
+        s++;
+    }
+    struct tm tm = {};
+    int consumed = 0;
+    if (sscanf(s, "%d-%d-%d%*1[ T]%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) == 6) {
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        time = static_cast<double>(timegm(&tm));
+        if (s[consumed] == '.') {
+            time += strtod(s + consumed, nullptr);
+        }
+        return true;
+    }
+    char* end;
+    time = strtod(s, &end);
+    return end != s;
+}
+
+std::vector<std::string> splitCsv(const std::string& line) {
+    std::vector<std::string> fields;
+    std::stringstream stream(line);
+    std::string field;
+    while (std::getline(stream, field, ',')) {
+        if (!field.empty() && field.back() == '\r') {
+            field.pop_back();
+        }
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+int columnIndex(const std::vector<std::string>& header, const char* name) {
+    for (size_t i = 0; i < header.size(); i++) {
+        if (header[i].find(name) != std::string::npos) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+bool readPulses(const char* filename, std::vector<double>& pulses) {
+    std::ifstream file(filename);
+    if (!file) {
+        fprintf(stderr, "Can't read %s\n", filename);
+        return false;
+    }
+    std::string line;
+    int startColumn = 0;
+    int endColumn = -1;
+    int unitsColumn = -1;
+    bool first = true;
+    while (std::getline(file, line)) {
+        auto fields = splitCsv(line);
+        if (fields.empty()) {
+            continue;
+        }
+        if (first) {
+            first = false;
+            double ignored;
+            if (!parseTime(fields[0], ignored)) {
+                startColumn = columnIndex(fields, "time_start");
+                endColumn = columnIndex(fields, "time_end");
+                unitsColumn = columnIndex(fields, "usage_meter_units");
+                if (startColumn < 0) {
+                    fprintf(stderr, "%s: no time_start column\n", filename);
+                    return false;
+                }
+                continue;
+            }
+        }
+        double start;
+        if (static_cast<int>(fields.size()) <= startColumn || !parseTime(fields[startColumn], start)) {
+            continue;
+        }
+        long units = 1;
+        if (unitsColumn >= 0 && unitsColumn < static_cast<int>(fields.size())) {
+            units = lround(strtod(fields[unitsColumn].c_str(), nullptr));
+        }
+        double end = start;
+        if (endColumn >= 0 && endColumn < static_cast<int>(fields.size())) {
+            parseTime(fields[endColumn], end);
+        }
+        for (long i = 0; i < units; i++) {
+            pulses.push_back(start + (end - start) * i / units);
+        }
+    }
+    std::sort(pulses.begin(), pulses.end());
+    return true;
+}
+
+bool readNetwork(const char* filename, std::vector<NetworkChange>& changes) {
+    std::ifstream file(filename);
+    if (!file) {
+        fprintf(stderr, "Can't read %s\n", filename);
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        auto fields = splitCsv(line);
+        double time;
+        if (fields.size() < 2 || !parseTime(fields[0], time)) {
+            continue; // (header)
+        }
+        changes.push_back({time, atoi(fields[1].c_str()) != 0});
+    }
+    return true;
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = strchr(arg, '=');
+        value = value ? value + 1 : "";
+        auto is = [&](const char* name) {
+            return strncmp(arg, name, strlen(name)) == 0;
+        };
+        auto msec = [&]() {
+            return std::chrono::milliseconds(atol(value));
+        };
+        if (is("--pulses=")) options.pulsesFile = value;
+        else if (is("--network=")) options.networkFile = value;
+        else if (is("--sleep-ma=")) options.power.sleepMa = atof(value);
+        else if (is("--awake-ma=")) options.power.awakeMa = atof(value);
+        else if (is("--radio-ma=")) options.power.radioMa = atof(value);
+        else if (is("--standby-ma=")) options.power.standbyMa = atof(value);
+        else if (is("--battery-mah=")) options.batteryMah = atof(value);
+        else if (is("--wifi-connect-ms=")) options.config.wifiConnectTime = msec();
+        else if (is("--cloud-connect-ms=")) options.config.cloudConnectTime = msec();
+        else if (is("--ack-ms=")) options.config.publishAckTime = msec();
+        else if (is("--loss=")) options.config.publishLossRate = atof(value);
+        else if (is("--charge=")) options.config.batteryCharge = atof(value);
+        else if (is("--no-standby")) options.config.sleepNetworkStandby = false;
+        else if (is("--seed=")) options.config.randomSeed = atoi(value);
+        else if (is("--csv")) options.csv = true;
+        else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return false;
+        }
+    }
+    if (!options.pulsesFile) {
+        fprintf(stderr,
+                "usage: %s --pulses=FILE [--network=FILE]\n"
+                "    [--sleep-ma=N] [--awake-ma=N] [--radio-ma=N] [--standby-ma=N] [--battery-mah=N]\n"
+                "    [--wifi-connect-ms=N] [--cloud-connect-ms=N] [--ack-ms=N]\n"
+                "    [--loss=FRACTION] [--charge=PERCENT] [--no-standby] [--seed=N] [--csv]\n",
+                argv[0]);
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        return 2;
+    }
+    std::vector<double> pulses;
+    std::vector<NetworkChange> network;
+    if (!readPulses(options.pulsesFile, pulses)
+        || (options.networkFile && !readNetwork(options.networkFile, network))) {
+        return 1;
+    }
+    if (pulses.empty()) {
+        fprintf(stderr, "%s: no pulses\n", options.pulsesFile);
+        return 1;
+    }
+
+    // Boot at midnight before the first pulse, and keep running a day
+    // past the last one (or the network trace), so everything publishes
+    double traceEnd = pulses.back();
+    if (!network.empty()) {
+        traceEnd = std::max(traceEnd, network.back().time);
+    }
+    const time32_t bootTime = static_cast<time32_t>(pulses.front()) / 86400 * 86400;
+    auto usecAt = [&](double time) {
+        return static_cast<uint64_t>(std::max(0.0, time - bootTime) * USEC_PER_SEC);
+    };
+    options.config.rtcStartTime = bootTime;
+
+    auto hostStart = std::chrono::steady_clock::now();
+    sim::boot(options.config);
+    for (size_t i = 0; i < pulses.size(); i++) {
+        uint64_t start = usecAt(pulses[i]);
+        uint64_t width = MAX_PULSE_WIDTH_USEC;
+        if (i + 1 < pulses.size()) {
+            width = std::min(width, (usecAt(pulses[i + 1]) - start) / 2);
+        }
+        if (width > 0 && start > sim::nowUsec()) {
+            sim::addPulse(PULSE_PIN, start, std::chrono::microseconds(width));
+        }
+    }
+    for (const auto& change: network) {
+        bool available = change.available;
+        sim::at(usecAt(change.time), [available] { sim::setNetworkAvailable(available); });
+    }
+    sim::runUntil(usecAt(traceEnd + 86400));
+    double hostSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - hostStart).count();
+
+    // What reached the server: reports whose pulse times were dropped
+    // (the buffer overflowed during a long outage) count as data loss
+    long reportedPulses = 0;
+    uint32_t lossEvents = 0;
+    long lostPulseTimes = 0;
+    auto reports = payload::acked();
+    for (const auto& event: reports) {
+        long use = static_cast<long>(payload::number(event.data, "use"));
+        long times = static_cast<long>(payload::pulseTimes(event.data).size());
+        reportedPulses += use;
+        if (use > times) {
+            lossEvents += 1;
+            lostPulseTimes += use - times;
+        }
+    }
+
+    const auto stats = sim::stats();
+    const double hours = 1.0 / (3600.0 * USEC_PER_SEC);
+    const double sleepHours = stats.sleepUsec * hours;
+    const double awakeHours = stats.awakeUsec * hours;
+    const double radioHours = (stats.wifiOnUsec - stats.wifiStandbyUsec) * hours;
+    const double standbyHours = stats.wifiStandbyUsec * hours;
+    const double mah = options.power.sleepMa * sleepHours + options.power.awakeMa * awakeHours
+                       + options.power.radioMa * radioHours + options.power.standbyMa * standbyHours;
+    // (every successful connect takes the configured time in the simulator)
+    const double connectSecs = stats.wifiConnects * (options.config.wifiConnectTime.count() / 1000.0)
+                               + stats.cloudConnects * (options.config.cloudConnectTime.count() / 1000.0);
+    const double days = (sleepHours + awakeHours) / 24;
+    const double batteryDays = options.batteryMah > 0 ? options.batteryMah / (mah / days) : 0;
+
+    if (options.csv) {
+        printf("days,pulses,reported,wakes,awake_s,radio_s,standby_s,connect_s,publishes,acks,"
+               "loss_events,lost_times,mah,battery_days,host_s\n");
+        printf("%.2f,%zu,%ld,%u,%.1f,%.1f,%.1f,%.1f,%u,%u,%u,%ld,%.2f,%.1f,%.3f\n",
+               days, pulses.size(), reportedPulses, stats.wakeCount,
+               stats.awakeUsec / double(USEC_PER_SEC), stats.wifiOnUsec / double(USEC_PER_SEC),
+               stats.wifiStandbyUsec / double(USEC_PER_SEC), connectSecs,
+               stats.publishAttempts, stats.publishAcks, lossEvents, lostPulseTimes,
+               mah, batteryDays, hostSecs);
+        return 0;
+    }
+
+    printf("Simulated %.1f days: %zu pulses (%ld reported in %zu waterbot/data events)\n",
+           days, pulses.size(), reportedPulses, reports.size());
+    printf("  wakes            %10u\n", stats.wakeCount);
+    printf("  awake            %10.1f s  (%.3f%%)\n",
+           stats.awakeUsec / double(USEC_PER_SEC), 100 * awakeHours / (24 * days));
+    printf("  radio on         %10.1f s  (%.1f s of it asleep in standby)\n",
+           stats.wifiOnUsec / double(USEC_PER_SEC), stats.wifiStandbyUsec / double(USEC_PER_SEC));
+    printf("  connecting       %10.1f s  (%u WiFi connects, %u cloud sessions)\n",
+           connectSecs, stats.wifiConnects, stats.cloudConnects);
+    printf("  sleeps           %10d with network standby, %d powered down\n",
+           sim::variable("standbySleep"), sim::variable("offSleep"));
+    printf("  publishes        %10u  (%u acked, %u vitals)\n",
+           stats.publishAttempts, stats.publishAcks, stats.vitalsPublishes);
+    printf("  data loss        %10u reports  (%ld pulse times dropped)\n", lossEvents, lostPulseTimes);
+    printf("  charge used      %10.2f mAh  (%.2f mAh/day at %.2g/%.2g/+%.2g/+%.2g mA sleep/awake/radio/standby)\n",
+           mah, mah / days, options.power.sleepMa, options.power.awakeMa, options.power.radioMa,
+           options.power.standbyMa);
+    if (batteryDays > 0) {
+        printf("  battery life     %10.0f days  (%.0f mAh)\n", batteryDays, options.batteryMah);
+    }
+    printf("  (replayed in %.2f s)\n", hostSecs);
+    return 0;
+}
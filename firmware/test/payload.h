@@ -0,0 +1,201 @@
+// ------------
+// Helpers for inspecting published waterbot/data events in tests
+// ------------
+//
+// (Just enough JSON scraping for our own flat payload format.)
+
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "PackedPulseTimes.h"
+#include "sim.h"
+
+namespace payload {
+
+// Return the numeric value of "key", or `missing` if not present
+inline double number(const std::string& data, const char* key, double missing = 0) {
+    std::string needle = std::string("\"") + key + "\":";
+    auto pos = data.find(needle);
+    if (pos == std::string::npos) {
+        return missing;
+    }
+    return strtod(data.c_str() + pos + needle.size(), nullptr);
+}
+
+inline bool has(const std::string& data, const char* key) {
+    return data.find(std::string("\"") + key + "\":") != std::string::npos;
+}
+
+// Return the string value of "key" (empty if not present)
+inline std::string text(const std::string& data, const char* key) {
+    std::string needle = std::string("\"") + key + "\":\"";
+    auto pos = data.find(needle);
+    if (pos == std::string::npos) {
+        return std::string();
+    }
+    pos += needle.size();
+    return data.substr(pos, data.find('"', pos) - pos);
+}
+
+// Return the integer array value of "key" (empty if not present)
+inline std::vector<long> array(const std::string& data, const char* key) {
+    std::vector<long> result;
+    std::string needle = std::string("\"") + key + "\":[";
+    auto pos = data.find(needle);
+    if (pos == std::string::npos) {
+        return result;
+    }
+    const char* p = data.c_str() + pos + needle.size();
+    while (*p && *p != ']') {
+        char* end;
+        result.push_back(strtol(p, &end, 10));
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return result;
+}
+
+// Parse the "pts" items: a JSON array of deltas and [delta, count,
+// interval, residual...] flow segments, or (with "ptv" 2) a string of them packed
+inline std::vector<DecodedPtsItem> ptsItems(const std::string& data) {
+    std::vector<DecodedPtsItem> result;
+    if (number(data, "ptv", 1) == 2) {
+        std::string packed = text(data, "pts");
+        decodePackedPulseTimes(packed.data(), packed.size(), result);
+        return result;
+    }
+    std::string needle = "\"pts\":[";
+    auto pos = data.find(needle);
+    if (pos == std::string::npos) {
+        return result;
+    }
+    const char* p = data.c_str() + pos + needle.size();
+    while (*p && *p != ']') {
+        char* end;
+        if (*p == '[') {
+            std::vector<long> fields;
+            p += 1;
+            while (*p && *p != ']') {
+                fields.push_back(strtol(p, &end, 10));
+                p = (*end == ',') ? end + 1 : end;
+            }
+            p = (*p == ']') ? p + 1 : p;
+            fields.resize(std::max<size_t>(fields.size(), 3));
+            result.push_back({static_cast<int32_t>(fields[0]), true, static_cast<uint32_t>(fields[1]),
+                              static_cast<uint32_t>(fields[2]),
+                              std::vector<int32_t>(fields.begin() + 3, fields.end())});
+        } else {
+            result.push_back({static_cast<int32_t>(strtol(p, &end, 10)), false, 0, 0, {}});
+            p = end;
+        }
+        p = (*p == ',') ? p + 1 : p;
+    }
+    return result;
+}
+
+struct UsageAggregate {
+    long first; // absolute times (secs)
+    long last;
+    long count;
+};
+
+// Decode the "agg" usage buckets: a JSON array of [delta, secs, count],
+// each delta from the previous bucket's last time (or from the previous
+// publish, for the first)
+inline std::vector<UsageAggregate> usageAggregates(const std::string& data) {
+    std::vector<UsageAggregate> result;
+    std::string needle = "\"agg\":[";
+    auto pos = data.find(needle);
+    if (pos == std::string::npos) {
+        return result;
+    }
+    long previousTime = number(data, "t") - number(data, "per");
+    const char* p = data.c_str() + pos + needle.size();
+    while (*p == '[') {
+        char* end;
+        long delta = strtol(p + 1, &end, 10);
+        long secs = strtol(end + 1, &end, 10);
+        long count = strtol(end + 1, &end, 10);
+        result.push_back({previousTime + delta, previousTime + delta + secs, count});
+        previousTime += delta + secs;
+        p = end + 1; // (past "]")
+        p = (*p == ',') ? p + 1 : p;
+    }
+    return result;
+}
+
+// Decode the "pts" items into absolute pulse times, in msec. Each is
+// either a delta from the previous pulse (or from the previous publish or
+// usage aggregate, for the first), or a flow segment. With "ptp"
+// (precision) 3, they're in msec; otherwise whole seconds.
+inline std::vector<int64_t> pulseTimesMsec(const std::string& data) {
+    std::vector<int64_t> result;
+    const int64_t scale = number(data, "ptp") == 3 ? 1 : 1000;
+    auto aggregates = usageAggregates(data);
+    int64_t previousMsec = 1000 * (aggregates.empty()
+        ? long(number(data, "t") - number(data, "per"))
+        : aggregates.back().last);
+    for (const DecodedPtsItem& item: ptsItems(data)) {
+        if (item.segment) {
+            int64_t steadyMsec = previousMsec + scale * item.delta;
+            for (uint32_t i = 0; i < item.count; i++) {
+                int32_t residual = i < item.residuals.size() ? item.residuals[i] : 0;
+                previousMsec = steadyMsec + scale * (int64_t(i) * item.interval + residual);
+                result.push_back(previousMsec);
+            }
+        } else {
+            previousMsec += scale * item.delta;
+            result.push_back(previousMsec);
+        }
+    }
+    return result;
+}
+
+// (in whole seconds)
+inline std::vector<long> pulseTimes(const std::string& data) {
+    std::vector<long> result;
+    for (int64_t msec: pulseTimesMsec(data)) {
+        result.push_back(static_cast<long>(msec / 1000));
+    }
+    return result;
+}
+
+// The data as if the meter channel were the only one: its fields ("cur1",
+// "pts1", ... for channel 1) under the usual keys (and channel 0's dropped)
+inline std::string meterChannel(const std::string& data, int channel) {
+    if (channel == 0) {
+        return data;
+    }
+    std::string result = data;
+    std::string suffix = std::to_string(channel);
+    for (const char* key: {"cur", "lst", "use", "agg", "pts"}) {
+        std::string plain = std::string("\"") + key + "\":";
+        std::string suffixed = std::string("\"") + key + suffix + "\":";
+        auto pos = result.find(plain);
+        if (pos != std::string::npos) {
+            result.replace(pos, plain.size(), std::string("\"_") + key + "\":");
+        }
+        pos = result.find(suffixed);
+        if (pos != std::string::npos) {
+            result.replace(pos, suffixed.size(), plain);
+        }
+    }
+    return result;
+}
+
+// All acknowledged events with the given name
+inline std::vector<sim::PublishedEvent> acked(const char* name = "waterbot/data") {
+    std::vector<sim::PublishedEvent> result;
+    for (const auto& event: sim::published()) {
+        if (event.acked && event.name == name) {
+            result.push_back(event);
+        }
+    }
+    return result;
+}
+
+} // namespace payload
@@ -0,0 +1,579 @@
+// ------------
+// Simulated Particle Device OS (host build only)
+// ------------
+//
+// Just enough of the Device OS 2.x wiring API to compile and run the
+// waterbot firmware natively on a development machine. Everything runs
+// against a virtual clock (see sim.h), so days of metering can be
+// simulated in seconds.
+//
+// This is *not* a faithful emulation of Device OS. In particular:
+//   * Threads are cooperative: they only switch in delay(), waitFor(),
+//     and other blocking calls. ATOMIC_BLOCK() is therefore a no-op.
+//   * Timer callbacks and interrupt handlers run in the scheduler,
+//     between threads (never preempting a thread).
+//   * Networking is a simple latency/availability model.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+typedef int32_t time32_t;
+typedef uint16_t pin_t;
+typedef uint32_t system_tick_t;
+typedef uint8_t byte;
+
+
+//
+// Startup and system configuration macros
+//
+
+namespace sim {
+    void registerStartup(void (*fn)());
+    void atomicEnter();
+    void atomicExit();
+}
+
+#define SIM_CONCAT_(a, b) a##b
+#define SIM_CONCAT(a, b) SIM_CONCAT_(a, b)
+
+#define STARTUP(code) \
+    static const bool SIM_CONCAT(simStartup_, __LINE__) = \
+        (sim::registerStartup([]{ code; }), true)
+
+enum System_Mode_TypeDef { DEFAULT, AUTOMATIC, SEMI_AUTOMATIC, MANUAL, SAFE_MODE };
+#define SYSTEM_MODE(mode) static const System_Mode_TypeDef simSystemMode = (mode)
+#define SYSTEM_THREAD(state) static const bool simSystemThread = true
+
+// Backup RAM is just ordinary (zero-initialized) static storage
+#define retained
+
+
+//
+// Interrupts and atomic sections
+//
+
+class AtomicSection {
+public:
+    AtomicSection() { sim::atomicEnter(); }
+    ~AtomicSection() { sim::atomicExit(); }
+    bool end() { bool first = !done_; done_ = true; return first; }
+private:
+    bool done_ = false;
+};
+
+#define ATOMIC_BLOCK() for (AtomicSection simAtomic; simAtomic.end(); )
+#define SINGLE_THREADED_BLOCK() ATOMIC_BLOCK()
+
+
+//
+// Time
+//
+
+system_tick_t millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+template<class Rep, class Period>
+inline void delay(std::chrono::duration<Rep, Period> duration) {
+    delay(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+}
+
+class TimeClass {
+public:
+    static time32_t now();
+    static bool isValid();
+};
+extern TimeClass Time;
+
+
+//
+// Math helpers
+//
+
+template<typename T, typename L, typename H>
+constexpr T constrain(T amt, L low, H high) {
+    return amt < low ? T(low) : (amt > high ? T(high) : amt);
+}
+
+inline long map(long value, long fromStart, long fromEnd, long toStart, long toEnd) {
+    if (fromEnd == fromStart) {
+        return toStart;
+    }
+    return (value - fromStart) * (toEnd - toStart) / (fromEnd - fromStart) + toStart;
+}
+
+
+//
+// GPIO
+//
+
+const pin_t D0 = 0, D1 = 1, D2 = 2, D3 = 3, D4 = 4, D5 = 5, D6 = 6, D7 = 7;
+const pin_t A0 = 10, A1 = 11, A2 = 12, A3 = 13, A4 = 14, A5 = 15, WKP = 17;
+const pin_t TOTAL_PINS = 24;
+
+#define LOW 0
+#define HIGH 1
+
+enum PinMode { INPUT, OUTPUT, INPUT_PULLUP, INPUT_PULLDOWN };
+enum InterruptMode { CHANGE, RISING, FALLING };
+
+typedef void (*wiring_interrupt_handler_t)(void);
+
+void pinMode(pin_t pin, PinMode mode);
+int32_t digitalRead(pin_t pin);
+void digitalWrite(pin_t pin, uint8_t value);
+bool attachInterrupt(pin_t pin, wiring_interrupt_handler_t handler,
+                     InterruptMode mode, int8_t priority = -1, uint8_t subpriority = 0);
+void detachInterrupt(pin_t pin);
+
+
+//
+// Software timers and threads
+//
+
+typedef std::function<void(void)> timer_callback_fn;
+
+class Timer {
+public:
+    Timer(unsigned period, timer_callback_fn callback, bool one_shot = false);
+    virtual ~Timer();
+
+    bool start(unsigned block = 0);
+    bool stop(unsigned block = 0);
+    bool reset(unsigned block = 0);
+    bool changePeriod(unsigned period, unsigned block = 0);
+    bool startFromISR() { return start(); }
+    bool stopFromISR() { return stop(); }
+    bool resetFromISR() { return reset(); }
+    bool changePeriodFromISR(unsigned period) { return changePeriod(period); }
+    bool isActive() const { return active_; }
+
+    // (sim internals)
+    uint64_t expiresAtUsec() const { return expiresAt_; }
+    void fire();
+
+private:
+    unsigned period_;
+    timer_callback_fn callback_;
+    bool oneShot_;
+    bool active_ = false;
+    uint64_t expiresAt_ = 0;
+};
+
+typedef int os_thread_prio_t;
+const os_thread_prio_t OS_THREAD_PRIORITY_DEFAULT = 2;
+const size_t OS_THREAD_STACK_SIZE_DEFAULT = 3 * 1024;
+
+typedef void (*wiring_thread_fn_t)(void);
+
+class Thread {
+public:
+    Thread(const char* name, wiring_thread_fn_t function,
+           os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT,
+           size_t stack_size = OS_THREAD_STACK_SIZE_DEFAULT);
+};
+
+typedef int os_result_t;
+inline os_result_t os_thread_yield() {
+    delay(0);
+    return 0;
+}
+
+// Queues and mutexes block (and wake) simulated threads. Queues may
+// also be put to (without waiting) from interrupt handlers and timers.
+typedef void* os_queue_t;
+const system_tick_t CONCURRENT_WAIT_FOREVER = static_cast<system_tick_t>(-1);
+int os_queue_create(os_queue_t* queue, size_t item_size, size_t item_count, void* reserved);
+int os_queue_put(os_queue_t queue, const void* item, system_tick_t delay, void* reserved);
+int os_queue_take(os_queue_t queue, void* item, system_tick_t delay, void* reserved);
+
+class Mutex {
+public:
+    void lock();
+    bool trylock();
+    bool try_lock() { return trylock(); }
+    void unlock();
+private:
+    bool locked_ = false;
+    std::vector<void*> waiters_;
+};
+
+#define WITH_LOCK(lock) \
+    for (std::unique_lock<std::remove_reference<decltype(lock)>::type> simLock(lock); \
+         simLock; simLock.unlock())
+
+
+//
+// String (only what the firmware uses)
+//
+
+class String {
+public:
+    String(const char* value = "") : value_(value) {}
+    long toInt() const { return atol(value_.c_str()); }
+    bool equals(const char* other) const { return value_ == other; }
+    const char* c_str() const { return value_.c_str(); }
+    unsigned length() const { return value_.length(); }
+    int indexOf(char ch) const {
+        size_t i = value_.find(ch);
+        return i == std::string::npos ? -1 : static_cast<int>(i);
+    }
+    String substring(unsigned from) const { return substring(from, length()); }
+    String substring(unsigned from, unsigned to) const {
+        return String(value_.substr(from, to > from ? to - from : 0).c_str());
+    }
+private:
+    std::string value_;
+};
+
+
+//
+// JSON
+//
+
+class JSONBufferWriter {
+public:
+    JSONBufferWriter(char* buf, size_t size) : buf_(buf), bufSize_(size) {}
+
+    JSONBufferWriter& beginObject() { separate(); write("{"); needSep_ = false; return *this; }
+    JSONBufferWriter& endObject() { write("}"); needSep_ = true; return *this; }
+    JSONBufferWriter& beginArray() { separate(); write("["); needSep_ = false; return *this; }
+    JSONBufferWriter& endArray() { write("]"); needSep_ = true; return *this; }
+    JSONBufferWriter& name(const char* name);
+
+    JSONBufferWriter& value(bool val) { return printValue("%s", val ? "true" : "false"); }
+    JSONBufferWriter& value(int val) { return printValue("%d", val); }
+    JSONBufferWriter& value(unsigned val) { return printValue("%u", val); }
+    JSONBufferWriter& value(long val) { return printValue("%ld", val); }
+    JSONBufferWriter& value(unsigned long val) { return printValue("%lu", val); }
+    JSONBufferWriter& value(double val, int precision) { return printValue("%.*f", precision, val); }
+    JSONBufferWriter& value(double val) { return printValue("%g", val); }
+    JSONBufferWriter& value(float val) { return value(static_cast<double>(val)); }
+    JSONBufferWriter& value(const char* val);
+    JSONBufferWriter& nullValue() { return printValue("%s", "null"); }
+
+    char* buffer() const { return buf_; }
+    size_t bufferSize() const { return bufSize_; }
+    size_t dataSize() const { return n_; } // may exceed bufferSize() if truncated
+
+private:
+    template<typename... Args>
+    JSONBufferWriter& printValue(const char* fmt, Args... args) {
+        separate();
+        char tmp[64];
+        snprintf(tmp, sizeof(tmp), fmt, args...);
+        write(tmp);
+        needSep_ = true;
+        return *this;
+    }
+    void separate() { if (needSep_) write(","); needSep_ = false; }
+    void write(const char* s);
+
+    char* buf_;
+    size_t bufSize_;
+    size_t n_ = 0;
+    bool needSep_ = false;
+};
+
+// (inline, so unit tests can use it without the simulated device)
+inline JSONBufferWriter& JSONBufferWriter::name(const char* name) {
+    separate();
+    value(name);
+    write(":");
+    needSep_ = false;
+    return *this;
+}
+
+inline JSONBufferWriter& JSONBufferWriter::value(const char* val) {
+    separate();
+    write("\"");
+    for (const char* p = val; *p; p++) {
+        char c[3] = {*p, 0, 0};
+        if (*p == '"' || *p == '\\') {
+            c[0] = '\\';
+            c[1] = *p;
+        }
+        write(c);
+    }
+    write("\"");
+    needSep_ = true;
+    return *this;
+}
+
+inline void JSONBufferWriter::write(const char* s) {
+    for (; *s; s++, n_++) {
+        if (n_ < bufSize_) {
+            buf_[n_] = *s;
+        }
+    }
+}
+
+
+//
+// LED status
+//
+
+#define RGB_COLOR_BLUE   0x000000ff
+#define RGB_COLOR_GREEN  0x0000ff00
+#define RGB_COLOR_CYAN   0x0000ffff
+#define RGB_COLOR_RED    0x00ff0000
+#define RGB_COLOR_ORANGE 0x00ff6000
+#define RGB_COLOR_YELLOW 0x00ffff00
+#define RGB_COLOR_WHITE  0x00ffffff
+
+enum LEDPattern { LED_PATTERN_SOLID, LED_PATTERN_BLINK, LED_PATTERN_FADE };
+enum LEDSpeed { LED_SPEED_SLOW, LED_SPEED_NORMAL, LED_SPEED_FAST };
+enum LEDPriority { LED_PRIORITY_BACKGROUND, LED_PRIORITY_NORMAL, LED_PRIORITY_IMPORTANT, LED_PRIORITY_CRITICAL };
+
+class LEDStatus {
+public:
+    LEDStatus(uint32_t color = RGB_COLOR_WHITE, LEDPattern pattern = LED_PATTERN_SOLID,
+              LEDSpeed speed = LED_SPEED_NORMAL, LEDPriority priority = LED_PRIORITY_NORMAL) {}
+    void setActive(bool active = true) { active_ = active; }
+    bool isActive() const { return active_; }
+private:
+    bool active_ = false;
+};
+
+
+//
+// WiFi
+//
+
+enum WLanSelectAntenna_TypeDef { ANT_INTERNAL = 0, ANT_EXTERNAL = 1, ANT_AUTO = 3 };
+
+class WiFiSignal {
+public:
+    WiFiSignal(float rssi = -60, float snr = 30) : rssi_(rssi), snr_(snr) {}
+    float getStrength() const { return constrain((rssi_ + 90) * 100 / 60, 0, 100); }
+    float getStrengthValue() const { return rssi_; }
+    float getQuality() const { return constrain(snr_ * 100 / 90, 0, 100); }
+    float getQualityValue() const { return snr_; }
+private:
+    float rssi_;
+    float snr_;
+};
+
+class WiFiClass {
+public:
+    void on();
+    void off();
+    void connect();
+    void disconnect();
+    bool ready();
+    bool connecting();
+    bool isOn();
+    WiFiSignal RSSI();
+    int selectAntenna(WLanSelectAntenna_TypeDef antenna) { return 0; }
+};
+extern WiFiClass WiFi;
+
+
+//
+// Particle Cloud
+//
+
+namespace sim {
+    struct PublishState {
+        bool done = false;
+        bool succeeded = false;
+        uint64_t completeAt = 0; // virtual time the ack (or failure) arrives
+    };
+    void waitForPublish(const PublishState& publish);
+}
+
+namespace particle {
+    const system_tick_t NOW = 0xffffffff;
+    namespace protocol {
+        const size_t MAX_EVENT_DATA_LENGTH = 622; // Photon, Device OS 2.x
+    }
+
+    // Result of an asynchronous operation (just enough for Particle.publish).
+    // Converting to bool waits for it to complete.
+    template<typename ResultT> class Future;
+
+    template<>
+    class Future<bool> {
+    public:
+        Future() : state_(std::make_shared<sim::PublishState>()) {
+            state_->done = true;
+        }
+        explicit Future(std::shared_ptr<sim::PublishState> state) : state_(std::move(state)) {}
+
+        bool isDone() const { return state_->done; }
+        bool isSucceeded() const { return state_->done && state_->succeeded; }
+        bool isFailed() const { return state_->done && !state_->succeeded; }
+        Future& wait() { sim::waitForPublish(*state_); return *this; }
+        bool result() const { sim::waitForPublish(*state_); return state_->succeeded; }
+        operator bool() const { return result(); }
+    private:
+        std::shared_ptr<sim::PublishState> state_;
+    };
+}
+
+enum PublishFlag { PUBLIC = 0x00, PRIVATE = 0x01, NO_ACK = 0x02, WITH_ACK = 0x08 };
+
+class CloudDisconnectOptions {
+public:
+    CloudDisconnectOptions& graceful(bool enabled) { graceful_ = enabled; return *this; }
+    CloudDisconnectOptions& timeout(system_tick_t timeout) { timeout_ = timeout; return *this; }
+    CloudDisconnectOptions& timeout(std::chrono::milliseconds timeout) { return this->timeout(timeout.count()); }
+    bool isGraceful() const { return graceful_; }
+    system_tick_t timeout() const { return timeout_; }
+private:
+    bool graceful_ = false;
+    system_tick_t timeout_ = 30000;
+};
+
+typedef int (*cloud_function_t)(String);
+
+class CloudClass {
+public:
+    bool connect();
+    void disconnect();
+    bool connected();
+    bool disconnected() { return !connected(); }
+    void process() {}
+    particle::Future<bool> publish(const char* name, const char* data, int flags = PUBLIC);
+    bool publishVitals(system_tick_t period = particle::NOW);
+    bool function(const char* name, cloud_function_t fn);
+    bool variable(const char* name, const int& var);
+    void syncTime();
+    bool syncTimeDone();
+    bool syncTimePending() { return !syncTimeDone(); }
+    void setDisconnectOptions(const CloudDisconnectOptions& options) { disconnectOptions_ = options; }
+    const CloudDisconnectOptions& disconnectOptions() const { return disconnectOptions_; }
+private:
+    CloudDisconnectOptions disconnectOptions_;
+};
+extern CloudClass Particle;
+
+
+//
+// System: sleep, reset reasons, waiting
+//
+
+enum class SystemSleepMode : uint8_t { NONE, STOP, ULTRA_LOW_POWER, HIBERNATE };
+enum class SystemSleepWakeupReason : uint16_t { UNKNOWN, BY_GPIO, BY_RTC };
+
+typedef uint8_t network_interface_t;
+const network_interface_t NETWORK_INTERFACE_WIFI_STA = 4;
+
+class SystemSleepConfiguration {
+public:
+    SystemSleepConfiguration& mode(SystemSleepMode mode) { mode_ = mode; return *this; }
+    // (may be called for several pins; any of them wakes)
+    SystemSleepConfiguration& gpio(pin_t pin, InterruptMode edge) {
+        if (wakePinCount_ < MAX_WAKE_PINS) {
+            wakePins_[wakePinCount_] = pin;
+            wakeEdges_[wakePinCount_] = edge;
+            wakePinCount_ += 1;
+        }
+        return *this;
+    }
+    SystemSleepConfiguration& duration(system_tick_t ms) { durationMsec_ = ms; return *this; }
+    SystemSleepConfiguration& duration(std::chrono::milliseconds ms) { return duration(ms.count()); }
+    // (keep the network interface up through STOP mode sleep)
+    SystemSleepConfiguration& network(network_interface_t netif) { keepsNetwork_ = true; return *this; }
+
+    SystemSleepMode sleepMode() const { return mode_; }
+    size_t wakePinCount() const { return wakePinCount_; }
+    pin_t wakePin(size_t i) const { return wakePins_[i]; }
+    InterruptMode wakeEdge(size_t i) const { return wakeEdges_[i]; }
+    system_tick_t durationMsec() const { return durationMsec_; }
+    bool keepsNetwork() const { return keepsNetwork_ && mode_ == SystemSleepMode::STOP; }
+private:
+    SystemSleepMode mode_ = SystemSleepMode::NONE;
+    static const size_t MAX_WAKE_PINS = 4;
+    size_t wakePinCount_ = 0;
+    pin_t wakePins_[MAX_WAKE_PINS] = {};
+    InterruptMode wakeEdges_[MAX_WAKE_PINS] = {};
+    system_tick_t durationMsec_ = 0;
+    bool keepsNetwork_ = false;
+};
+
+class SystemSleepResult {
+public:
+    SystemSleepResult(SystemSleepWakeupReason reason = SystemSleepWakeupReason::UNKNOWN, pin_t pin = 0)
+        : reason_(reason), pin_(pin) {}
+    SystemSleepWakeupReason wakeupReason() const { return reason_; }
+    pin_t wakeupPin() const { return pin_; }
+private:
+    SystemSleepWakeupReason reason_;
+    pin_t pin_;
+};
+
+enum HAL_Feature { FEATURE_RETAINED_MEMORY = 1 };
+
+enum System_Reset_Reason {
+    RESET_REASON_NONE = 0,
+    RESET_REASON_UNKNOWN = 10,
+    RESET_REASON_PIN_RESET = 20,
+    RESET_REASON_POWER_MANAGEMENT = 30,
+    RESET_REASON_POWER_DOWN = 40,
+    RESET_REASON_POWER_BROWNOUT = 50,
+    RESET_REASON_WATCHDOG = 60,
+    RESET_REASON_UPDATE = 70,
+    RESET_REASON_USER = 140,
+};
+
+class SystemClass {
+public:
+    SystemSleepResult sleep(const SystemSleepConfiguration& config);
+    int resetReason();
+    int enableFeature(HAL_Feature feature) { return 0; }
+    uint32_t freeMemory() { return 40000; }
+    system_tick_t uptime() { return millis() / 1000; }
+
+    template<typename Condition>
+    bool waitCondition(Condition condition, system_tick_t timeout = 0) {
+        const system_tick_t start = millis();
+        while (!condition()) {
+            if (timeout > 0 && millis() - start >= timeout) {
+                return false;
+            }
+            delay(WAIT_POLL_MSEC);
+        }
+        return true;
+    }
+
+    static const system_tick_t WAIT_POLL_MSEC = 10;
+};
+extern SystemClass System;
+
+#define waitFor(condition, timeout) System.waitCondition([]{ return (condition)(); }, (timeout))
+#define waitUntil(condition) System.waitCondition([]{ return (condition)(); })
+
+
+//
+// I2C (see sim.h for the simulated MAX17043 fuel gauge)
+//
+
+class TwoWire {
+public:
+    void begin() {}
+    void beginTransmission(uint8_t address);
+    size_t write(uint8_t data);
+    uint8_t endTransmission(uint8_t stop = true);
+    uint8_t requestFrom(uint8_t address, uint8_t quantity, uint8_t stop = true);
+    int available();
+    int read();
+};
+extern TwoWire Wire;
@@ -0,0 +1,3 @@
+// Device OS compatibility header (used by older libraries like PowerShield)
+#pragma once
+#include "Particle.h"
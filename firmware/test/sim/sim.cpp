@@ -0,0 +1,1006 @@
+// ------------
+// Simulated Particle Device OS (host build only)
+// ------------
+//
+// A small discrete-event simulator. Each Device OS thread (the application
+// thread running setup()/loop(), plus any Thread the firmware creates) is a
+// cooperative ucontext coroutine. The scheduler repeatedly picks the
+// earliest pending event -- pin transition, scripted action, timer expiry,
+// or thread wakeup -- advances the virtual clock to it, and dispatches it.
+
+#include "sim.h"
+
+#include <ucontext.h>
+
+#include <array>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+
+// Provided by the firmware under test
+void setup();
+void loop();
+
+TimeClass Time;
+WiFiClass WiFi;
+CloudClass Particle;
+SystemClass System;
+TwoWire Wire;
+
+namespace sim {
+namespace {
+
+const uint64_t NEVER = std::numeric_limits<uint64_t>::max();
+const size_t TASK_STACK_SIZE = 256 * 1024;
+const uint8_t MAX17043_ADDRESS = 0x36;
+
+struct Task {
+    std::string name;
+    std::function<void()> fn;
+    ucontext_t context;
+    std::unique_ptr<char[]> stack;
+    uint64_t wakeAt = 0;
+    uint64_t wakeSeq = 0; // FIFO among tasks waking at the same time
+    uint64_t queueWaitUsec = 0; // time spent waiting in os_queue_take
+};
+
+struct PinEvent {
+    pin_t pin;
+    int level;
+};
+
+struct InFlightPublish {
+    std::shared_ptr<PublishState> state;
+    std::string name;
+    std::string data;
+    uint64_t sentUsec;
+};
+
+struct PinState {
+    int level = HIGH;
+    wiring_interrupt_handler_t handler = nullptr;
+    InterruptMode edge = FALLING;
+};
+
+struct State {
+    Config config;
+    Stats stats;
+    std::vector<PublishedEvent> published;
+    std::vector<InFlightPublish> inFlight; // awaiting acks
+    std::mt19937 rng;
+    uint64_t now = 0;
+    bool booted = false;
+
+    // scheduler
+    ucontext_t schedulerContext;
+    std::vector<std::unique_ptr<Task>> tasks;
+    Task* current = nullptr;
+    uint64_t seq = 0;
+    std::vector<Timer*> timers;
+    std::multimap<uint64_t, PinEvent> pinEvents;
+    std::multimap<uint64_t, std::function<void()>> actions;
+    std::array<PinState, TOTAL_PINS> pins;
+    std::map<std::string, cloud_function_t> functions;
+    std::map<std::string, const int*> variables;
+
+    // sleep
+    bool asleep = false;
+    Task* sleeper = nullptr;
+    SystemSleepConfiguration sleepConfig;
+    SystemSleepWakeupReason wakeReason = SystemSleepWakeupReason::UNKNOWN;
+    pin_t wakePin = 0; // (if BY_GPIO)
+    uint64_t sleepStart = 0;
+    uint64_t sleepEnd = NEVER;
+    uint64_t awakeSince = 0;
+
+    // network
+    bool networkAvailable = true;
+    bool wifiOn = false;
+    bool wifiConnecting = false;
+    bool wifiReady = false;
+    uint64_t wifiReadyAt = 0;
+    uint64_t wifiOnSince = 0;
+    bool cloudWanted = false;
+    bool cloudConnected = false;
+    uint64_t cloudReadyAt = 0;
+    uint64_t cloudConnectedSince = 0;
+    bool cloudDisconnecting = false;
+    uint64_t cloudDisconnectedAt = 0;
+
+    // RTC
+    bool rtcValid = true;
+    bool syncPending = false;
+    uint64_t syncDoneAt = 0;
+
+    // I2C
+    uint8_t i2cAddress = 0;
+    std::vector<uint8_t> i2cTx;
+    std::vector<uint8_t> i2cRx;
+    size_t i2cRxPos = 0;
+    uint8_t fuelGaugeRegister = 0;
+    uint16_t fuelGaugeConfig = 0x971c;
+};
+
+State& state() {
+    static State s;
+    return s;
+}
+
+std::vector<void (*)()>& startupHooks() {
+    static std::vector<void (*)()> hooks;
+    return hooks;
+}
+
+uint64_t toUsec(std::chrono::microseconds duration) {
+    return duration.count();
+}
+
+
+//
+// Threads
+//
+
+void taskEntry() {
+    State& S = state();
+    S.current->fn();
+    fprintf(stderr, "sim: thread '%s' returned\n", S.current->name.c_str());
+    abort();
+}
+
+Task* spawn(const char* name, std::function<void()> fn) {
+    State& S = state();
+    auto task = std::make_unique<Task>();
+    task->name = name;
+    task->fn = std::move(fn);
+    task->stack.reset(new char[TASK_STACK_SIZE]);
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = task->stack.get();
+    task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+    task->context.uc_link = nullptr;
+    makecontext(&task->context, taskEntry, 0);
+    task->wakeAt = S.now;
+    task->wakeSeq = ++S.seq;
+    S.tasks.push_back(std::move(task));
+    return S.tasks.back().get();
+}
+
+// Suspend the calling thread until the virtual clock reaches wakeAt.
+void block(uint64_t wakeAt) {
+    State& S = state();
+    Task* task = S.current;
+    if (!task) {
+        fprintf(stderr, "sim: blocking call outside of a thread (in an ISR or timer callback?)\n");
+        abort();
+    }
+    task->wakeAt = wakeAt;
+    task->wakeSeq = ++S.seq;
+    S.current = nullptr;
+    swapcontext(&task->context, &S.schedulerContext);
+}
+
+
+// Block the calling thread until notify(waiters) or deadline.
+// Returns false on timeout.
+bool waitOn(std::vector<void*>& waiters, uint64_t deadline) {
+    State& S = state();
+    Task* task = S.current;
+    waiters.push_back(task);
+    block(deadline);
+    auto found = std::find(waiters.begin(), waiters.end(), task);
+    if (found == waiters.end()) {
+        return true; // (notify removed it)
+    }
+    waiters.erase(found);
+    return false;
+}
+
+void notify(std::vector<void*>& waiters) {
+    State& S = state();
+    for (auto waiter: waiters) {
+        Task* task = static_cast<Task*>(waiter);
+        task->wakeAt = S.now;
+        task->wakeSeq = ++S.seq;
+    }
+    waiters.clear();
+}
+
+uint64_t deadlineFor(system_tick_t delay) {
+    return delay == CONCURRENT_WAIT_FOREVER ? NEVER : state().now + uint64_t(delay) * 1000;
+}
+
+struct Queue {
+    size_t itemSize;
+    size_t capacity;
+    std::deque<std::vector<uint8_t>> items;
+    std::vector<void*> takers; // threads waiting for an item
+    std::vector<void*> putters; // threads waiting for room
+};
+
+
+//
+// Network model (state is updated lazily, whenever it's observed)
+//
+
+void completePublish(const std::shared_ptr<PublishState>& publish, bool acked) {
+    State& S = state();
+    for (auto it = S.inFlight.begin(); it != S.inFlight.end(); ++it) {
+        if (it->state == publish) {
+            publish->done = true;
+            publish->succeeded = acked;
+            S.published.push_back({S.now, it->sentUsec, it->name, it->data, acked});
+            if (acked) {
+                S.stats.publishAcks += 1;
+            }
+            S.inFlight.erase(it);
+            return;
+        }
+    }
+}
+
+void setCloudConnected(bool connected) {
+    State& S = state();
+    if (connected == S.cloudConnected) {
+        return;
+    }
+    if (connected) {
+        S.cloudConnectedSince = std::min(S.now, S.cloudReadyAt);
+        S.stats.cloudConnects += 1;
+    } else {
+        S.stats.cloudConnectedUsec += S.now - S.cloudConnectedSince;
+        S.cloudReadyAt = 0;
+        S.cloudDisconnecting = false;
+        // Publishes still awaiting acks fail with the session
+        while (!S.inFlight.empty()) {
+            completePublish(S.inFlight.front().state, false);
+        }
+    }
+    S.cloudConnected = connected;
+}
+
+void updateNetwork() {
+    State& S = state();
+    if (S.wifiOn && S.wifiConnecting && !S.wifiReady) {
+        if (S.networkAvailable) {
+            if (!S.wifiReadyAt) {
+                S.wifiReadyAt = S.now + toUsec(S.config.wifiConnectTime);
+            }
+            if (S.now >= S.wifiReadyAt) {
+                S.wifiReady = true;
+            }
+        } else {
+            S.wifiReadyAt = 0;
+        }
+    }
+    if (S.wifiReady && !S.networkAvailable) {
+        S.wifiReady = false;
+        S.wifiReadyAt = 0;
+        setCloudConnected(false);
+    }
+    if (S.cloudWanted && !S.cloudConnected) {
+        if (S.wifiReady) {
+            if (!S.cloudReadyAt) {
+                S.cloudReadyAt = S.now + toUsec(S.config.cloudConnectTime);
+            }
+            if (S.now >= S.cloudReadyAt) {
+                setCloudConnected(true);
+            }
+        } else {
+            S.cloudReadyAt = 0;
+        }
+    }
+    if (S.cloudDisconnecting && S.now >= S.cloudDisconnectedAt) {
+        setCloudConnected(false);
+    }
+    if (S.syncPending && S.cloudConnected) {
+        if (!S.syncDoneAt) {
+            S.syncDoneAt = S.now + toUsec(S.config.syncTimeTime);
+        }
+        if (S.now >= S.syncDoneAt) {
+            S.syncPending = false;
+            S.rtcValid = true;
+        }
+    }
+}
+
+void wifiPowerOff() {
+    State& S = state();
+    if (S.wifiOn) {
+        S.stats.wifiOnUsec += S.now - S.wifiOnSince;
+    }
+    setCloudConnected(false);
+    S.cloudWanted = false;
+    S.wifiOn = S.wifiConnecting = S.wifiReady = false;
+    S.wifiReadyAt = 0;
+}
+
+
+//
+// Sleep
+//
+
+bool edgeMatches(InterruptMode mode, int oldLevel, int newLevel) {
+    switch (mode) {
+        case FALLING: return oldLevel == HIGH && newLevel == LOW;
+        case RISING: return oldLevel == LOW && newLevel == HIGH;
+        default: return oldLevel != newLevel;
+    }
+}
+
+void wake(SystemSleepWakeupReason reason) {
+    State& S = state();
+    S.asleep = false;
+    S.wakeReason = reason;
+    S.stats.wakeCount += 1;
+    S.stats.sleepUsec += S.now - S.sleepStart;
+    if (S.wifiOn) {
+        S.stats.wifiStandbyUsec += S.now - S.sleepStart;
+    }
+    S.awakeSince = S.now;
+    S.sleeper->wakeAt = S.now;
+    S.sleeper->wakeSeq = ++S.seq;
+}
+
+
+//
+// Dispatch
+//
+
+void processPinEvent(const PinEvent& event) {
+    State& S = state();
+    PinState& pin = S.pins[event.pin];
+    int oldLevel = pin.level;
+    pin.level = event.level;
+    if (S.asleep) {
+        // Only the configured wake pins can do anything while asleep
+        bool wakes = false;
+        for (size_t i = 0; i < S.sleepConfig.wakePinCount(); i++) {
+            wakes = wakes || (event.pin == S.sleepConfig.wakePin(i)
+                              && edgeMatches(S.sleepConfig.wakeEdge(i), oldLevel, event.level));
+        }
+        if (!wakes) {
+            return;
+        }
+        S.wakePin = event.pin;
+        wake(SystemSleepWakeupReason::BY_GPIO);
+    }
+    if (pin.handler && edgeMatches(pin.edge, oldLevel, event.level)) {
+        S.stats.isrCalls += 1;
+        pin.handler();
+    }
+}
+
+void runTask(Task* task) {
+    State& S = state();
+    S.stats.threadWakeups[task->name] += 1;
+    S.current = task;
+    swapcontext(&S.schedulerContext, &task->context);
+    S.current = nullptr;
+}
+
+} // namespace
+
+
+void registerStartup(void (*fn)()) {
+    startupHooks().push_back(fn);
+}
+
+void atomicEnter() {}
+void atomicExit() {}
+
+
+void boot(const Config& config) {
+    State& S = state();
+    if (S.booted) {
+        fprintf(stderr, "sim: already booted (run each test in its own process)\n");
+        abort();
+    }
+    S.booted = true;
+    S.config = config;
+    S.rtcValid = config.rtcValid;
+    S.rng.seed(config.randomSeed);
+    for (auto hook: startupHooks()) {
+        hook();
+    }
+    spawn("app", [] {
+        setup();
+        State& S = state();
+        Task* app = S.current;
+        while (true) {
+            uint64_t start = S.now;
+            uint64_t idle = S.stats.sleepUsec + app->queueWaitUsec;
+            loop();
+            S.stats.loopCount += 1;
+            S.stats.maxLoopUsec = std::max(S.stats.maxLoopUsec,
+                (S.now - start) - (S.stats.sleepUsec + app->queueWaitUsec - idle));
+        }
+    });
+}
+
+void runUntil(uint64_t until) {
+    State& S = state();
+    while (true) {
+        enum { NONE, PIN, ACTION, TIMER, TASK, WAKE } kind = NONE;
+        uint64_t next = NEVER;
+        Timer* nextTimer = nullptr;
+        Task* nextTask = nullptr;
+
+        // Candidates in priority order (earlier wins ties)
+        if (!S.pinEvents.empty() && S.pinEvents.begin()->first < next) {
+            next = S.pinEvents.begin()->first;
+            kind = PIN;
+        }
+        if (!S.actions.empty() && S.actions.begin()->first < next) {
+            next = S.actions.begin()->first;
+            kind = ACTION;
+        }
+        if (S.asleep) {
+            if (S.sleepEnd < next) {
+                next = S.sleepEnd;
+                kind = WAKE;
+            }
+        } else {
+            for (auto timer: S.timers) {
+                if (timer->isActive() && timer->expiresAtUsec() < next) {
+                    next = timer->expiresAtUsec();
+                    nextTimer = timer;
+                    kind = TIMER;
+                }
+            }
+            for (auto& task: S.tasks) {
+                if (task->wakeAt < next || (kind == TASK && task->wakeAt == next && task->wakeSeq < nextTask->wakeSeq)) {
+                    next = task->wakeAt;
+                    nextTask = task.get();
+                    kind = TASK;
+                }
+            }
+        }
+
+        if (kind == NONE || next > until) {
+            S.now = std::max(S.now, until);
+            return;
+        }
+        S.now = std::max(S.now, next);
+
+        switch (kind) {
+            case PIN: {
+                PinEvent event = S.pinEvents.begin()->second;
+                S.pinEvents.erase(S.pinEvents.begin());
+                processPinEvent(event);
+                break;
+            }
+            case ACTION: {
+                auto action = std::move(S.actions.begin()->second);
+                S.actions.erase(S.actions.begin());
+                action();
+                break;
+            }
+            case TIMER:
+                S.stats.timerCallbacks += 1;
+                nextTimer->fire();
+                break;
+            case TASK:
+                runTask(nextTask);
+                break;
+            case WAKE:
+                wake(SystemSleepWakeupReason::BY_RTC);
+                break;
+            case NONE:
+                break;
+        }
+    }
+}
+
+void runFor(std::chrono::microseconds duration) {
+    runUntil(state().now + toUsec(duration));
+}
+
+uint64_t nowUsec() {
+    return state().now;
+}
+
+void setPinLevel(pin_t pin, uint64_t atUsec, int level) {
+    state().pinEvents.emplace(atUsec, PinEvent{pin, level});
+}
+
+void addPulse(pin_t pin, uint64_t startUsec, std::chrono::microseconds width) {
+    setPinLevel(pin, startUsec, LOW);
+    setPinLevel(pin, startUsec + toUsec(width), HIGH);
+}
+
+void setNetworkAvailable(bool available) {
+    state().networkAvailable = available;
+    updateNetwork();
+}
+
+void setBattery(float voltage, float charge) {
+    state().config.batteryVoltage = voltage;
+    state().config.batteryCharge = charge;
+}
+
+void at(uint64_t atUsec, std::function<void()> action) {
+    state().actions.emplace(atUsec, std::move(action));
+}
+
+int callFunction(const char* name, const char* arg) {
+    State& S = state();
+    auto found = S.functions.find(name);
+    if (found == S.functions.end()) {
+        return -1;
+    }
+    return found->second(String(arg));
+}
+
+int variable(const char* name) {
+    State& S = state();
+    auto found = S.variables.find(name);
+    return found == S.variables.end() ? -1 : *found->second;
+}
+
+const Config& config() {
+    return state().config;
+}
+
+Stats stats() {
+    State& S = state();
+    Stats result = S.stats;
+    if (S.asleep) {
+        result.sleepUsec += S.now - S.sleepStart;
+        if (S.wifiOn) {
+            result.wifiStandbyUsec += S.now - S.sleepStart;
+        }
+    } else {
+        result.awakeUsec += S.now - S.awakeSince;
+    }
+    if (S.wifiOn) {
+        result.wifiOnUsec += S.now - S.wifiOnSince;
+    }
+    if (S.cloudConnected) {
+        result.cloudConnectedUsec += S.now - S.cloudConnectedSince;
+    }
+    return result;
+}
+
+const std::vector<PublishedEvent>& published() {
+    return state().published;
+}
+
+int pinLevel(pin_t pin) {
+    return state().pins[pin].level;
+}
+
+void waitForPublish(const PublishState& publish) {
+    while (!publish.done) {
+        block(publish.completeAt);
+    }
+}
+
+} // namespace sim
+
+
+using sim::state;
+
+
+//
+// Time
+//
+
+system_tick_t millis() {
+    return state().now / 1000;
+}
+
+unsigned long micros() {
+    // (wraps around like the device's 32-bit micros())
+    return static_cast<uint32_t>(state().now);
+}
+
+void delay(unsigned long ms) {
+    sim::block(state().now + ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    sim::block(state().now + us);
+}
+
+time32_t TimeClass::now() {
+    auto& S = state();
+    time32_t uptime = S.now / 1000000;
+    return S.rtcValid ? S.config.rtcStartTime + uptime : uptime;
+}
+
+bool TimeClass::isValid() {
+    return state().rtcValid;
+}
+
+
+//
+// GPIO
+//
+
+void pinMode(pin_t pin, PinMode mode) {
+    if (mode == INPUT_PULLUP) {
+        state().pins[pin].level = HIGH;
+    }
+}
+
+int32_t digitalRead(pin_t pin) {
+    return state().pins[pin].level;
+}
+
+void digitalWrite(pin_t pin, uint8_t value) {
+    state().pins[pin].level = value ? HIGH : LOW;
+}
+
+bool attachInterrupt(pin_t pin, wiring_interrupt_handler_t handler,
+                     InterruptMode mode, int8_t priority, uint8_t subpriority) {
+    state().pins[pin].handler = handler;
+    state().pins[pin].edge = mode;
+    return true;
+}
+
+void detachInterrupt(pin_t pin) {
+    state().pins[pin].handler = nullptr;
+}
+
+
+//
+// Timers and threads
+//
+
+Timer::Timer(unsigned period, timer_callback_fn callback, bool one_shot)
+    : period_(period), callback_(std::move(callback)), oneShot_(one_shot) {
+    state().timers.push_back(this);
+}
+
+Timer::~Timer() {
+    auto& timers = state().timers;
+    timers.erase(std::remove(timers.begin(), timers.end(), this), timers.end());
+}
+
+bool Timer::start(unsigned block) {
+    active_ = true;
+    expiresAt_ = state().now + period_ * 1000ull;
+    return true;
+}
+
+bool Timer::stop(unsigned block) {
+    active_ = false;
+    return true;
+}
+
+bool Timer::reset(unsigned block) {
+    return start(block);
+}
+
+bool Timer::changePeriod(unsigned period, unsigned block) {
+    period_ = period;
+    return start(block);
+}
+
+void Timer::fire() {
+    if (oneShot_) {
+        active_ = false;
+    } else {
+        expiresAt_ += period_ * 1000ull;
+    }
+    callback_();
+}
+
+Thread::Thread(const char* name, wiring_thread_fn_t function,
+               os_thread_prio_t priority, size_t stack_size) {
+    sim::spawn(name, function);
+}
+
+
+//
+// Queues and mutexes
+//
+
+int os_queue_create(os_queue_t* queue, size_t item_size, size_t item_count, void* reserved) {
+    // (never freed: the firmware creates its queues once)
+    *queue = new sim::Queue{item_size, item_count, {}, {}, {}};
+    return 0;
+}
+
+int os_queue_put(os_queue_t queue, const void* item, system_tick_t delay, void* reserved) {
+    auto q = static_cast<sim::Queue*>(queue);
+    uint64_t deadline = sim::deadlineFor(delay);
+    while (q->items.size() >= q->capacity) {
+        if (delay == 0 || !state().current || !sim::waitOn(q->putters, deadline)) {
+            return -1;
+        }
+    }
+    auto bytes = static_cast<const uint8_t*>(item);
+    q->items.emplace_back(bytes, bytes + q->itemSize);
+    sim::notify(q->takers);
+    return 0;
+}
+
+int os_queue_take(os_queue_t queue, void* item, system_tick_t delay, void* reserved) {
+    auto q = static_cast<sim::Queue*>(queue);
+    uint64_t deadline = sim::deadlineFor(delay);
+    while (q->items.empty()) {
+        if (delay == 0) {
+            return -1;
+        }
+        uint64_t start = state().now;
+        bool woken = sim::waitOn(q->takers, deadline);
+        state().current->queueWaitUsec += state().now - start;
+        if (!woken) {
+            return -1;
+        }
+    }
+    memcpy(item, q->items.front().data(), q->itemSize);
+    q->items.pop_front();
+    sim::notify(q->putters);
+    return 0;
+}
+
+void Mutex::lock() {
+    while (locked_) {
+        sim::waitOn(waiters_, sim::NEVER);
+    }
+    locked_ = true;
+}
+
+bool Mutex::trylock() {
+    if (locked_) {
+        return false;
+    }
+    locked_ = true;
+    return true;
+}
+
+void Mutex::unlock() {
+    locked_ = false;
+    sim::notify(waiters_);
+}
+
+
+//
+// WiFi
+//
+
+void WiFiClass::on() {
+    auto& S = state();
+    if (!S.wifiOn) {
+        S.wifiOn = true;
+        S.wifiOnSince = S.now;
+    }
+}
+
+void WiFiClass::off() {
+    sim::wifiPowerOff();
+}
+
+void WiFiClass::connect() {
+    auto& S = state();
+    on();
+    if (!S.wifiConnecting) {
+        S.wifiConnecting = true;
+        S.stats.wifiConnects += 1;
+    }
+    sim::updateNetwork();
+}
+
+void WiFiClass::disconnect() {
+    auto& S = state();
+    sim::setCloudConnected(false);
+    S.cloudWanted = false;
+    S.wifiConnecting = S.wifiReady = false;
+    S.wifiReadyAt = 0;
+}
+
+bool WiFiClass::ready() {
+    sim::updateNetwork();
+    return state().wifiReady;
+}
+
+bool WiFiClass::connecting() {
+    sim::updateNetwork();
+    return state().wifiConnecting && !state().wifiReady;
+}
+
+bool WiFiClass::isOn() {
+    return state().wifiOn;
+}
+
+WiFiSignal WiFiClass::RSSI() {
+    auto& S = state();
+    return S.wifiReady ? WiFiSignal(S.config.wifiRSSI, S.config.wifiSNR) : WiFiSignal(0, 0);
+}
+
+
+//
+// Particle Cloud
+//
+
+bool CloudClass::connect() {
+    auto& S = state();
+    S.cloudWanted = true;
+    WiFi.connect();
+    return true;
+}
+
+void CloudClass::disconnect() {
+    auto& S = state();
+    S.cloudWanted = false;
+    sim::updateNetwork();
+    if (!S.cloudConnected) {
+        S.cloudReadyAt = 0;
+    } else if (disconnectOptions_.isGraceful()) {
+        S.cloudDisconnecting = true;
+        S.cloudDisconnectedAt = S.now + sim::toUsec(S.config.cloudDisconnectTime);
+    } else {
+        sim::setCloudConnected(false);
+    }
+}
+
+bool CloudClass::connected() {
+    sim::updateNetwork();
+    return state().cloudConnected;
+}
+
+particle::Future<bool> CloudClass::publish(const char* name, const char* data, int flags) {
+    auto& S = state();
+    S.stats.publishAttempts += 1;
+    auto publish = std::make_shared<sim::PublishState>();
+    publish->completeAt = S.now;
+    if (!connected()) {
+        publish->done = true;
+        return particle::Future<bool>(publish);
+    }
+    S.inFlight.push_back({publish, name, data, S.now});
+    if (!(flags & WITH_ACK)) {
+        sim::completePublish(publish, true);
+        return particle::Future<bool>(publish);
+    }
+    S.stats.maxPublishesInFlight = std::max(S.stats.maxPublishesInFlight, uint32_t(S.inFlight.size()));
+
+    // The ack arrives after publishAckTime, unless it's lost
+    // (or the cloud session ends first)
+    bool lost = std::uniform_real_distribution<double>(0, 1)(S.rng) < S.config.publishLossRate;
+    publish->completeAt = S.now + sim::toUsec(lost ? S.config.publishTimeout : S.config.publishAckTime);
+    sim::at(publish->completeAt, [publish, lost] {
+        if (!publish->done) {
+            sim::updateNetwork();
+            sim::completePublish(publish, !lost && state().cloudConnected);
+        }
+    });
+    return particle::Future<bool>(publish);
+}
+
+bool CloudClass::publishVitals(system_tick_t period) {
+    auto& S = state();
+    if (!connected()) {
+        return false;
+    }
+    sim::block(S.now + sim::toUsec(S.config.publishAckTime));
+    S.stats.vitalsPublishes += 1;
+    return true;
+}
+
+bool CloudClass::function(const char* name, cloud_function_t fn) {
+    state().functions[name] = fn;
+    return true;
+}
+
+bool CloudClass::variable(const char* name, const int& var) {
+    state().variables[name] = &var;
+    return true;
+}
+
+void CloudClass::syncTime() {
+    auto& S = state();
+    S.syncPending = true;
+    S.syncDoneAt = 0;
+    sim::updateNetwork();
+}
+
+bool CloudClass::syncTimeDone() {
+    sim::updateNetwork();
+    return !state().syncPending;
+}
+
+
+//
+// System
+//
+
+SystemSleepResult SystemClass::sleep(const SystemSleepConfiguration& config) {
+    auto& S = state();
+    // Ultra low power (and deeper) modes power down the radio
+    if (!(config.keepsNetwork() && S.config.sleepNetworkStandby)) {
+        sim::wifiPowerOff();
+    }
+    S.stats.awakeUsec += S.now - S.awakeSince;
+    S.asleep = true;
+    S.sleeper = S.current;
+    S.sleepConfig = config;
+    S.sleepStart = S.now;
+    S.sleepEnd = config.durationMsec() > 0 ? S.now + config.durationMsec() * 1000ull : sim::NEVER;
+    sim::block(sim::NEVER); // until wake()
+    return SystemSleepResult(S.wakeReason,
+        S.wakeReason == SystemSleepWakeupReason::BY_GPIO ? S.wakePin : 0);
+}
+
+int SystemClass::resetReason() {
+    return state().config.resetReason;
+}
+
+
+//
+// I2C: a MAX17043 fuel gauge at its usual address
+//
+
+namespace {
+
+uint16_t fuelGaugeRegisterValue(uint8_t reg) {
+    auto& S = state();
+    switch (reg) {
+        case 0x02: // VCELL: 12 bits, 1.25mV units, left-justified
+            return static_cast<uint16_t>(S.config.batteryVoltage * 4095 / 5 + 0.5) << 4;
+        case 0x04: // SOC: percent, 1/256% units
+            return static_cast<uint16_t>(S.config.batteryCharge * 256);
+        case 0x08: // VERSION
+            return 0x0003;
+        case 0x0c: // CONFIG
+            return S.fuelGaugeConfig;
+        default:
+            return 0;
+    }
+}
+
+} // namespace
+
+void TwoWire::beginTransmission(uint8_t address) {
+    auto& S = state();
+    S.i2cAddress = address;
+    S.i2cTx.clear();
+}
+
+size_t TwoWire::write(uint8_t data) {
+    state().i2cTx.push_back(data);
+    return 1;
+}
+
+uint8_t TwoWire::endTransmission(uint8_t stop) {
+    auto& S = state();
+    if (S.i2cAddress != sim::MAX17043_ADDRESS) {
+        return 2; // address NACK
+    }
+    if (!S.i2cTx.empty()) {
+        S.fuelGaugeRegister = S.i2cTx[0];
+        if (S.i2cTx.size() >= 3 && S.fuelGaugeRegister == 0x0c) {
+            S.fuelGaugeConfig = (S.i2cTx[1] << 8) | S.i2cTx[2];
+        }
+    }
+    return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity, uint8_t stop) {
+    auto& S = state();
+    S.i2cRx.clear();
+    S.i2cRxPos = 0;
+    if (address != sim::MAX17043_ADDRESS) {
+        return 0;
+    }
+    for (uint8_t i = 0; i < quantity; i++) {
+        // 16-bit registers, MSB first, auto-incrementing
+        uint8_t byteAddress = S.fuelGaugeRegister + i;
+        uint16_t value = fuelGaugeRegisterValue(byteAddress & ~1);
+        S.i2cRx.push_back((byteAddress & 1) ? (value & 0xff) : (value >> 8));
+    }
+    return quantity;
+}
+
+int TwoWire::available() {
+    auto& S = state();
+    return S.i2cRx.size() - S.i2cRxPos;
+}
+
+int TwoWire::read() {
+    auto& S = state();
+    return S.i2cRxPos < S.i2cRx.size() ? S.i2cRx[S.i2cRxPos++] : -1;
+}
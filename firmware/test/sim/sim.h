@@ -0,0 +1,113 @@
+// ------------
+// Simulation control (host build only)
+// ------------
+//
+// Tests drive the simulated device through this interface:
+// configure it, boot() it (which runs STARTUP code and setup()),
+// script inputs (meter pulses, network outages), then runFor()
+// some amount of virtual time and inspect what happened.
+//
+// The virtual clock has microsecond resolution and starts at zero
+// at boot. It only advances when every simulated thread is blocked
+// (in delay(), a waitFor(), a publish, or sleep).
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Particle.h"
+
+namespace sim {
+
+struct Config {
+    // Unix time at boot, and whether the RTC knows it yet.
+    // (If not, it becomes valid after Particle.syncTime() completes.)
+    time32_t rtcStartTime = 1658000000;
+    bool rtcValid = true;
+
+    int resetReason = RESET_REASON_POWER_MANAGEMENT;
+
+    // Network model latencies
+    std::chrono::milliseconds wifiConnectTime = 3s;
+    std::chrono::milliseconds cloudConnectTime = 2s;
+    std::chrono::milliseconds cloudDisconnectTime = 200ms;
+    std::chrono::milliseconds publishAckTime = 300ms;
+    // Fraction of publishes whose ack never arrives (the publish fails
+    // after publishTimeout), chosen pseudo-randomly from randomSeed
+    double publishLossRate = 0;
+    std::chrono::milliseconds publishTimeout = 20s;
+    std::chrono::milliseconds syncTimeTime = 500ms;
+    // Whether STOP mode sleep with .network() keeps WiFi (and the cloud
+    // session) up in standby; if not, it powers down the radio like
+    // ULTRA_LOW_POWER does
+    bool sleepNetworkStandby = true;
+
+    // Reported WiFi signal
+    float wifiRSSI = -60;
+    float wifiSNR = 30;
+
+    // MAX17043 fuel gauge readings
+    float batteryVoltage = 3.95;
+    float batteryCharge = 85.5;
+
+    uint32_t randomSeed = 1;
+};
+
+struct Stats {
+    uint32_t wakeCount = 0;          // wakes from System.sleep
+    uint64_t awakeUsec = 0;          // time not in System.sleep
+    uint64_t sleepUsec = 0;
+    uint64_t wifiOnUsec = 0;         // radio powered
+    uint64_t wifiStandbyUsec = 0;    // (the part of that spent asleep, in network standby)
+    uint64_t cloudConnectedUsec = 0;
+    uint32_t wifiConnects = 0;       // WiFi.connect() from off/disconnected
+    uint32_t cloudConnects = 0;      // successful cloud sessions established
+    uint32_t publishAttempts = 0;
+    uint32_t publishAcks = 0;
+    uint32_t maxPublishesInFlight = 0; // most WITH_ACK publishes awaiting acks at once
+    uint32_t vitalsPublishes = 0;
+    uint32_t isrCalls = 0;
+    uint32_t timerCallbacks = 0;
+    std::map<std::string, uint32_t> threadWakeups; // times each thread resumed, by name
+    uint32_t loopCount = 0;          // calls to loop()
+    uint64_t maxLoopUsec = 0;        // longest loop() (not counting time asleep or in os_queue_take)
+};
+
+struct PublishedEvent {
+    uint64_t usec;      // virtual time when the publish was acknowledged (or failed)
+    uint64_t sentUsec;  // virtual time when it was published
+    std::string name;
+    std::string data;
+    bool acked;
+};
+
+// Lifecycle
+void boot(const Config& config = Config());
+void runUntil(uint64_t usec);
+void runFor(std::chrono::microseconds duration);
+
+// Virtual clock
+uint64_t nowUsec();
+inline uint64_t usec(std::chrono::microseconds duration) { return duration.count(); }
+
+// Inputs
+void setPinLevel(pin_t pin, uint64_t atUsec, int level);
+void addPulse(pin_t pin, uint64_t startUsec, std::chrono::microseconds width);
+void setNetworkAvailable(bool available);
+void setBattery(float voltage, float charge); // (the fuel gauge's next readings)
+void at(uint64_t atUsec, std::function<void()> action);
+int callFunction(const char* name, const char* arg);
+int variable(const char* name); // (-1 if not registered)
+
+// Observations
+const Config& config();
+Stats stats();
+const std::vector<PublishedEvent>& published();
+int pinLevel(pin_t pin);
+
+} // namespace sim
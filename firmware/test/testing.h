@@ -0,0 +1,142 @@
+// ------------
+// Minimal test harness for the host-built firmware tests
+// ------------
+//
+// Each TEST runs in its own forked process, so the firmware's globals
+// (and the simulated device) start out fresh every time.
+//
+//   ./build/waterbot_test            run all tests
+//   ./build/waterbot_test outage     run tests whose names contain "outage"
+
+#pragma once
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace testing {
+
+struct TestCase {
+    const char* name;
+    void (*fn)();
+};
+
+inline std::vector<TestCase>& registry() {
+    static std::vector<TestCase> tests;
+    return tests;
+}
+
+struct Registrar {
+    Registrar(const char* name, void (*fn)()) {
+        registry().push_back({name, fn});
+    }
+};
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+template<typename T>
+std::string describe(const T& value) {
+    if constexpr (std::is_arithmetic_v<T>) {
+        return std::to_string(value);
+    } else if constexpr (std::is_enum_v<T>) {
+        return std::to_string(static_cast<long long>(value));
+    } else {
+        return std::string("\"") + std::string(value) + "\"";
+    }
+}
+
+inline void fail(const char* file, int line, const char* expr, const std::string& detail = "") {
+    fprintf(stderr, "%s:%d: FAILED: %s%s%s\n", file, line, expr,
+            detail.empty() ? "" : "\n    ", detail.c_str());
+    failures() += 1;
+}
+
+// Run fn in a child process, and return its result (which must be
+// trivially copyable). E.g., to boot the simulated device more than once
+// in a test, to compare settings. Failed CHECKs in fn count as failures.
+template<typename Fn>
+auto isolated(Fn fn) -> decltype(fn()) {
+    typedef decltype(fn()) Result;
+    static_assert(std::is_trivially_copyable<Result>::value, "isolated() result must be trivially copyable");
+    int fds[2];
+    if (pipe(fds) != 0) {
+        fail(__FILE__, __LINE__, "pipe()");
+        return Result();
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        Result result = fn();
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        fflush(stdout);
+        _exit(failures() > 0 || written != sizeof(result) ? 1 : 0);
+    }
+    close(fds[1]);
+    Result result{};
+    ssize_t got = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (got != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fail(__FILE__, __LINE__, "isolated()");
+    }
+    return result;
+}
+
+inline int runAll(int argc, char** argv) {
+    const char* filter = argc > 1 ? argv[1] : "";
+    int ran = 0, failed = 0;
+    for (const auto& test: registry()) {
+        if (!strstr(test.name, filter)) {
+            continue;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            test.fn();
+            fflush(stdout);
+            _exit(failures() > 0 ? 1 : 0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        printf("%s %s\n", ok ? "PASS" : "FAIL", test.name);
+        ran += 1;
+        failed += ok ? 0 : 1;
+    }
+    printf("%d tests, %d failed\n", ran, failed);
+    return failed > 0 ? 1 : 0;
+}
+
+} // namespace testing
+
+#define TEST(name) \
+    static void name(); \
+    static testing::Registrar name##Registrar(#name, name); \
+    static void name()
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) testing::fail(__FILE__, __LINE__, #expr); \
+    } while (0)
+
+#define CHECK_EQ(actual, expected) \
+    do { \
+        const auto& a_ = (actual); \
+        const auto& e_ = (expected); \
+        if (!(a_ == e_)) testing::fail(__FILE__, __LINE__, #actual " == " #expected, \
+            "actual: " + testing::describe(a_) + ", expected: " + testing::describe(e_)); \
+    } while (0)
+
+int main(int argc, char** argv) {
+    return testing::runAll(argc, argv);
+}
@@ -0,0 +1,151 @@
+// ------------
+// Whole-firmware scenarios for a device counting two meters
+// (built with -DMETER_CHANNELS=2), run on the simulated device
+// ------------
+
+#include <random>
+
+#include "payload.h"
+#include "sim.h"
+#include "testing.h"
+
+namespace {
+
+const pin_t METERS[] = {D2, D4};
+const auto PULSE_WIDTH = 400ms;
+
+// A run of pulses on a meter at (roughly) fixed intervals.
+// Returns the start time of each pulse.
+std::vector<uint64_t> addFlow(int channel, uint64_t start, int count,
+                              std::chrono::milliseconds interval,
+                              std::chrono::milliseconds jitter = 0ms,
+                              std::mt19937* rng = nullptr) {
+    std::vector<uint64_t> pulses;
+    uint64_t t = start;
+    for (int i = 0; i < count; i++) {
+        pulses.push_back(t);
+        sim::addPulse(METERS[channel], t, PULSE_WIDTH);
+        auto next = interval;
+        if (rng && jitter.count() > 0) {
+            next += std::chrono::milliseconds(
+                std::uniform_int_distribution<long>(-jitter.count(), jitter.count())(*rng));
+        }
+        t += sim::usec(next);
+    }
+    return pulses;
+}
+
+long unixTime(uint64_t usec) {
+    return sim::config().rtcStartTime + usec / 1000000;
+}
+
+} // namespace
+
+
+TEST(reportsBothMetersInOneEvent) {
+    sim::boot();
+    sim::runFor(1min);
+    uint64_t start = sim::nowUsec();
+    auto first = addFlow(0, start, 5, 10s);
+    auto second = addFlow(1, start + sim::usec(3s), 3, 15s);
+    sim::runFor(5min);
+
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 1u);
+    const auto& data = events[0].data;
+    CHECK_EQ(payload::number(data, "cur"), 5);
+    CHECK_EQ(payload::number(data, "use"), 5);
+    CHECK_EQ(payload::number(data, "cur1"), 3);
+    CHECK_EQ(payload::number(data, "use1"), 3);
+
+    auto times = payload::pulseTimes(data);
+    CHECK_EQ(times.size(), first.size());
+    for (size_t i = 0; i < times.size() && i < first.size(); i++) {
+        CHECK(std::abs(times[i] - unixTime(first[i])) <= 1);
+    }
+    times = payload::pulseTimes(payload::meterChannel(data, 1));
+    CHECK_EQ(times.size(), second.size());
+    for (size_t i = 0; i < times.size() && i < second.size(); i++) {
+        CHECK(std::abs(times[i] - unixTime(second[i])) <= 1);
+    }
+}
+
+TEST(wakesOnEitherMeter) {
+    sim::boot();
+    sim::runFor(10min);
+    const uint32_t wakes = sim::stats().wakeCount;
+    uint64_t start = sim::nowUsec();
+    addFlow(1, start, 2, 20s);
+    sim::runFor(5min);
+
+    CHECK(sim::stats().wakeCount > wakes);
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 1u);
+    CHECK_EQ(payload::number(events[0].data, "cur"), 0);
+    CHECK_EQ(payload::number(events[0].data, "cur1"), 2);
+    CHECK_EQ(payload::pulseTimes(payload::meterChannel(events[0].data, 1)).size(), 2u);
+    // Reported after PUBLISH_IN_USE_INTERVAL, like the first meter
+    CHECK(events[0].usec >= start + sim::usec(1min));
+}
+
+TEST(setReadingForEachMeter) {
+    sim::boot();
+    sim::runFor(1min);
+    CHECK_EQ(sim::callFunction("setReading", "1:500"), 0);
+    CHECK_EQ(sim::callFunction("setReading", "2:5"), -1);
+    CHECK_EQ(sim::callFunction("setReading", "x:5"), -1);
+    CHECK_EQ(sim::callFunction("setReading", "1:"), -1);
+    addFlow(0, sim::nowUsec() + sim::usec(1s), 1, 1s);
+    sim::runFor(30s);
+
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 1u);
+    CHECK_EQ(payload::number(events[0].data, "cur1"), 500);
+    CHECK_EQ(payload::number(events[0].data, "use1"), 500);
+    CHECK_EQ(payload::number(events[0].data, "cur"), 0);
+
+    CHECK_EQ(sim::callFunction("setReading", "0:1234"), 0);
+    sim::runFor(1min);
+    events = payload::acked();
+    CHECK_EQ(payload::number(events.back().data, "cur"), 1234);
+    CHECK_EQ(payload::number(events.back().data, "cur1"), 500);
+}
+
+TEST(metersShareOutageBacklog) {
+    // Both meters' pulses through a day's outage drain in events that fit,
+    // with every pulse counted on the right meter
+    std::mt19937 rng(11);
+    sim::boot();
+    sim::at(sim::usec(1h), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(25h), [] { sim::setNetworkAvailable(true); });
+    long totals[2] = {0, 0};
+    for (int run = 0; run < 8; run++) {
+        totals[0] += addFlow(0, sim::usec(2h) + run * sim::usec(3h), 200, 5s, 2s, &rng).size();
+        totals[1] += addFlow(1, sim::usec(2h + 20min) + run * sim::usec(3h), 120, 8s, 3s, &rng).size();
+    }
+    sim::runFor(27h);
+
+    auto events = payload::acked();
+    for (int channel = 0; channel < 2; channel++) {
+        long used = 0;
+        long timed = 0;
+        long aggregated = 0;
+        for (const auto& event: events) {
+            CHECK(event.data.size() < particle::protocol::MAX_EVENT_DATA_LENGTH);
+            std::string data = payload::meterChannel(event.data, channel);
+            used += payload::number(data, "use");
+            timed += payload::pulseTimes(data).size();
+            for (const auto& aggregate: payload::usageAggregates(data)) {
+                aggregated += aggregate.count;
+            }
+        }
+        CHECK_EQ(used, totals[channel]);
+        CHECK(timed + aggregated <= totals[channel]);
+        CHECK(timed + aggregated >= totals[channel] - 20);
+        printf("  meter %d: %ld pulse times, %ld pulses in usage aggregates\n",
+               channel, timed, aggregated);
+    }
+    for (size_t i = 1; i < events.size(); i++) {
+        CHECK_EQ(payload::number(events[i].data, "lst1"), payload::number(events[i - 1].data, "cur1"));
+    }
+}
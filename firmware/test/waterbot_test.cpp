@@ -0,0 +1,952 @@
+// ------------
+// Whole-firmware scenarios, run on the simulated device
+// ------------
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+#include "payload.h"
+#include "sim.h"
+#include "testing.h"
+
+namespace {
+
+const pin_t METER = D2;
+const auto PULSE_WIDTH = 400ms;
+
+// Built with -DPULSE_DETECTION=2 (PULSE_DETECT_EDGES) for the *_edges tests
+#if defined(PULSE_DETECTION) && PULSE_DETECTION == 2
+const bool EDGE_DETECTION = true;
+#else
+const bool EDGE_DETECTION = false;
+#endif
+
+// A run of pulses at (roughly) fixed intervals.
+// Returns the start time of each pulse.
+std::vector<uint64_t> addFlow(uint64_t start, int count,
+                              std::chrono::milliseconds interval,
+                              std::chrono::milliseconds jitter = 0ms,
+                              std::mt19937* rng = nullptr) {
+    std::vector<uint64_t> pulses;
+    uint64_t t = start;
+    for (int i = 0; i < count; i++) {
+        pulses.push_back(t);
+        sim::addPulse(METER, t, PULSE_WIDTH);
+        auto next = interval;
+        if (rng && jitter.count() > 0) {
+            next += std::chrono::milliseconds(
+                std::uniform_int_distribution<long>(-jitter.count(), jitter.count())(*rng));
+        }
+        t += sim::usec(next);
+    }
+    return pulses;
+}
+
+// A meter pulse with contact bounce when the switch closes and opens
+void addBouncyPulse(uint64_t start, std::chrono::microseconds width) {
+    for (uint64_t t = start; t < start + 1000; t += 250) {
+        sim::setPinLevel(METER, t, LOW);
+        sim::setPinLevel(METER, t + 100, HIGH);
+    }
+    sim::setPinLevel(METER, start + 1000, LOW);
+    uint64_t end = start + sim::usec(width);
+    for (uint64_t t = end; t < end + 1000; t += 250) {
+        sim::setPinLevel(METER, t, HIGH);
+        sim::setPinLevel(METER, t + 100, LOW);
+    }
+    sim::setPinLevel(METER, end + 1000, HIGH);
+}
+
+// Rebuild absolute pulse times (Unix seconds) from a series of data events
+std::vector<long> reportedPulseTimes(const std::vector<sim::PublishedEvent>& events) {
+    std::vector<long> times;
+    for (const auto& event: events) {
+        auto pulseTimes = payload::pulseTimes(event.data);
+        times.insert(times.end(), pulseTimes.begin(), pulseTimes.end());
+    }
+    return times;
+}
+
+long unixTime(uint64_t usec) {
+    return sim::config().rtcStartTime + usec / 1000000;
+}
+
+// Same, in Unix msec
+std::vector<int64_t> reportedPulseTimesMsec(const std::vector<sim::PublishedEvent>& events) {
+    std::vector<int64_t> times;
+    for (const auto& event: events) {
+        auto pulseTimes = payload::pulseTimesMsec(event.data);
+        times.insert(times.end(), pulseTimes.begin(), pulseTimes.end());
+    }
+    return times;
+}
+
+int64_t unixTimeMsec(uint64_t usec) {
+    return sim::config().rtcStartTime * int64_t(1000) + usec / 1000;
+}
+
+void printStats(const char* label) {
+    auto stats = sim::stats();
+    printf("  %s: %u publishes, %u wakes, awake %.0fs, radio on %.0fs, cloud connected %.0fs\n",
+           label, stats.publishAcks, stats.wakeCount,
+           stats.awakeUsec / 1e6, stats.wifiOnUsec / 1e6, stats.cloudConnectedUsec / 1e6);
+}
+
+} // namespace
+
+
+TEST(reportsPulsesAfterInUseInterval) {
+    sim::boot();
+    sim::runFor(1min);
+    uint64_t start = sim::nowUsec();
+    addFlow(start, 5, 10s);
+    sim::runFor(5min);
+
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 1u);
+    const auto& data = events[0].data;
+    CHECK_EQ(payload::number(data, "use"), 5);
+    CHECK_EQ(payload::number(data, "cur"), 5);
+    auto times = payload::pulseTimes(data);
+    CHECK_EQ(times.size(), 5u);
+    for (size_t i = 1; i < times.size(); i++) {
+        CHECK_EQ(times[i] - times[i - 1], 10);
+    }
+    // Held for PUBLISH_IN_USE_INTERVAL after the first pulse (plus connect time)
+    CHECK(events[0].usec >= start + sim::usec(1min));
+    CHECK(events[0].usec < start + sim::usec(75s));
+}
+
+TEST(steadyFlowPacksIntoSegments) {
+    // Ten minutes of fast, steady flow: per-pulse deltas would need
+    // a publish every 20 pulses; flow segments fit a full in-use interval
+    sim::boot();
+    sim::runFor(1min);
+    uint64_t start = sim::nowUsec();
+    auto pulses = addFlow(start, 600, 1100ms);
+    sim::runFor(15min);
+
+    auto events = payload::acked();
+    CHECK(events.size() <= 12u);
+    auto items = payload::ptsItems(events[0].data);
+    CHECK(std::any_of(items.begin(), items.end(), [](const DecodedPtsItem& item) { return item.segment; }));
+    // Every pulse at the msec it was captured
+    auto times = reportedPulseTimesMsec(events);
+    CHECK_EQ(times.size(), pulses.size());
+    for (size_t i = 0; i < times.size() && i < pulses.size(); i++) {
+        if (times[i] != unixTimeMsec(pulses[i])) {
+            CHECK_EQ(times[i], unixTimeMsec(pulses[i]));
+            break;
+        }
+    }
+    printStats("steady flow");
+}
+
+TEST(heartbeatWithoutUsage) {
+    sim::boot();
+    sim::runFor(9h);
+
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 2u);
+    for (const auto& event: events) {
+        CHECK_EQ(payload::number(event.data, "use"), 0);
+        CHECK_EQ(payload::number(event.data, "per"), 4 * 60 * 60);
+        CHECK(payload::pulseTimes(event.data).empty());
+    }
+    // Mostly asleep
+    CHECK_EQ(sim::stats().wakeCount, 2u);
+    CHECK(sim::stats().awakeUsec < sim::usec(1min));
+}
+
+TEST(daysOfMetering) {
+    // Three days of a garden: morning and evening irrigation,
+    // plus a few randomly timed hose runs.
+    std::mt19937 rng(20221017);
+    sim::boot();
+    std::vector<uint64_t> pulses;
+    for (int day = 0; day < 3; day++) {
+        uint64_t midnight = sim::usec(1h) + day * sim::usec(24h);
+        for (auto hour: {6h, 19h}) {
+            auto flow = addFlow(midnight + sim::usec(hour), 120, 4s, 500ms, &rng);
+            pulses.insert(pulses.end(), flow.begin(), flow.end());
+        }
+        for (int i = 0; i < 4; i++) {
+            // (one per 2.5 hour slot, so flows never overlap)
+            uint64_t start = midnight + sim::usec(8h) + i * sim::usec(150min) + rng() % sim::usec(2h);
+            int count = 5 + rng() % 40;
+            auto flow = addFlow(start, count, 12s, 2s, &rng);
+            pulses.insert(pulses.end(), flow.begin(), flow.end());
+        }
+    }
+    std::sort(pulses.begin(), pulses.end());
+    sim::runFor(24h * 3 + 6h);
+
+    auto events = payload::acked();
+    long used = 0;
+    for (const auto& event: events) {
+        used += payload::number(event.data, "use");
+    }
+    CHECK_EQ(used, (long)pulses.size());
+
+    // Every pulse reported with the exact msec it started
+    auto reported = reportedPulseTimesMsec(events);
+    CHECK_EQ(reported.size(), pulses.size());
+    for (size_t i = 0; i < std::min(reported.size(), pulses.size()); i++) {
+        if (reported[i] != unixTimeMsec(pulses[i])) {
+            CHECK_EQ(reported[i], unixTimeMsec(pulses[i]));
+            break;
+        }
+    }
+
+    auto stats = sim::stats();
+    CHECK_EQ(stats.publishAcks, stats.publishAttempts);
+    CHECK(stats.awakeUsec < stats.sleepUsec / 20);
+    printStats("3 days");
+}
+
+TEST(recoversAfterNetworkOutage) {
+    sim::boot();
+    sim::at(sim::usec(1h), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(4h), [] { sim::setNetworkAvailable(true); });
+    addFlow(sim::usec(2h), 150, 5s);
+    sim::runFor(6h);
+
+    auto events = payload::acked();
+    long used = 0;
+    size_t timed = 0;
+    double maxTries = 0;
+    for (const auto& event: events) {
+        used += payload::number(event.data, "use");
+        timed += payload::pulseTimes(event.data).size();
+        maxTries = std::max(maxTries, payload::number(event.data, "try"));
+    }
+    CHECK_EQ(used, 150);
+    CHECK_EQ(timed, 150u);
+    CHECK(maxTries > 0);
+    printStats("3h outage");
+}
+
+TEST(resetButtonStaysAwake) {
+    sim::Config config;
+    config.resetReason = RESET_REASON_PIN_RESET;
+    sim::boot(config);
+    sim::runFor(9min);
+    CHECK_EQ(sim::stats().sleepUsec, 0u);
+
+    sim::callFunction("sleepNow", "");
+    sim::runFor(1min);
+    CHECK(sim::stats().sleepUsec > 0);
+}
+
+TEST(setReadingPublishesImmediately) {
+    sim::boot();
+    sim::runFor(1min);
+    sim::callFunction("setReading", "1234");
+    // (device is asleep; wake it with a pulse, which gets reported later)
+    addFlow(sim::nowUsec() + sim::usec(1s), 1, 1s);
+    sim::runFor(30s);
+
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 1u);
+    CHECK_EQ(payload::number(events[0].data, "cur"), 1234);
+    CHECK_EQ(payload::number(events[0].data, "use"), 1234);
+}
+
+TEST(restoresTimeAtBoot) {
+    sim::Config config;
+    config.rtcValid = false;
+    sim::boot(config);
+    addFlow(sim::usec(1min), 3, 10s);
+    sim::runFor(5min);
+
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 1u);
+    CHECK(payload::number(events[0].data, "t") > config.rtcStartTime);
+    CHECK_EQ(payload::pulseTimes(events[0].data).size(), 3u);
+}
+
+TEST(timesPulsesBeforeClockSync) {
+    // RTC lost while powered down, and no network to restore it for a while:
+    // pulses in the meantime still get their (sub-second) times
+    sim::Config config;
+    config.rtcValid = false;
+    sim::setNetworkAvailable(false);
+    sim::boot(config);
+    sim::at(sim::usec(20min), [] { sim::setNetworkAvailable(true); });
+    auto pulses = addFlow(sim::usec(1min), 600, 700ms);
+    sim::runFor(40min); // (the next try to set the clock after 20min, with backoff)
+
+    auto events = payload::acked();
+    long used = 0;
+    std::vector<int64_t> times;
+    for (const auto& event: events) {
+        used += payload::number(event.data, "use");
+        auto exact = payload::pulseTimesMsec(event.data);
+        times.insert(times.end(), exact.begin(), exact.end());
+    }
+    CHECK_EQ(used, 600);
+    CHECK_EQ(times.size(), pulses.size());
+    size_t accurate = 0;
+    for (size_t i = 0; i < std::min(times.size(), pulses.size()); i++) {
+        double actual = sim::config().rtcStartTime + pulses[i] / 1e6;
+        accurate += std::abs(times[i] / 1e3 - actual) < 0.2;
+    }
+    CHECK_EQ(accurate, pulses.size());
+    CHECK(std::abs((times.back() - times.front()) / 1e3 / (times.size() - 1) - 0.7) < 0.001);
+}
+
+TEST(coldBootCountsPulsesBeforeConnecting) {
+    // Battery swap (RTC lost) with WiFi down: setup() doesn't wait on the
+    // network, so a pulse right after boot counts at once, and the device
+    // sleeps between (backed off) tries to set the clock
+    sim::Config config;
+    config.rtcValid = false;
+    config.resetReason = RESET_REASON_POWER_DOWN;
+    sim::setNetworkAvailable(false);
+    sim::boot(config);
+    sim::at(sim::usec(2h), [] { sim::setNetworkAvailable(true); });
+    const uint64_t pulseUsec = sim::usec(100ms);
+    addFlow(pulseUsec, 1, 1s);
+
+    // (the signal LED lights as soon as the pulse is counted)
+    sim::runUntil(pulseUsec);
+    while (sim::pinLevel(D7) == LOW && sim::nowUsec() < sim::usec(5s)) {
+        sim::runFor(1ms);
+    }
+    const uint64_t countedUsec = sim::nowUsec() - pulseUsec;
+    while (sim::stats().sleepUsec == 0 && sim::nowUsec() < sim::usec(10min)) {
+        sim::runFor(100ms);
+    }
+    auto stats = sim::stats();
+    // (30mA awake, plus 50mA with the radio on; see energy_sim)
+    double mAh = (stats.awakeUsec * 30.0 + stats.wifiOnUsec * 50.0) / 3.6e9;
+    printf("  first pulse counted after %.0fms; first sleep after %.1fs"
+           " (radio on %.1fs, %.3f mAh)\n",
+           countedUsec / 1e3, stats.awakeUsec / 1e6, stats.wifiOnUsec / 1e6, mAh);
+    CHECK(countedUsec < sim::usec(1s));
+    CHECK(stats.sleepUsec > 0);
+    CHECK(stats.awakeUsec < sim::usec(1min));
+
+    sim::runFor(3h);
+    auto events = payload::acked();
+    CHECK(!events.empty());
+    CHECK_EQ(payload::number(events[0].data, "use"), 1);
+    auto times = reportedPulseTimes(events);
+    CHECK_EQ(times.size(), 1u);
+    CHECK_EQ(times.empty() ? 0 : times[0], unixTime(pulseUsec));
+    CHECK(sim::stats().wifiOnUsec < sim::usec(10min));
+    printStats("2h outage at boot");
+}
+
+TEST(longOutageKeepsPulseTimes) {
+    // More pulses than the old 700-timestamp buffer could hold
+    sim::boot();
+    sim::at(sim::usec(1h), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(25h), [] { sim::setNetworkAvailable(true); });
+    for (int run = 0; run < 8; run++) {
+        addFlow(sim::usec(2h) + run * sim::usec(2h), 250, 4s);
+    }
+    sim::runFor(28h);
+
+    auto events = payload::acked();
+    size_t timed = 0;
+    for (const auto& event: events) {
+        timed += payload::pulseTimes(event.data).size();
+    }
+    CHECK_EQ(timed, 2000u);
+    printStats("24h outage");
+}
+
+TEST(monthOutageDropsExpiredPulseTimes) {
+    // Pulse times older than PULSE_TIMES_MAX_AGE (which the millis() clock
+    // can't place) are dropped, but still counted; newer ones are exact
+    sim::boot();
+    sim::at(sim::usec(1h), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(26 * 24h), [] { sim::setNetworkAvailable(true); });
+    auto old = addFlow(sim::usec(2h), 100, 4s);
+    auto recent = addFlow(sim::usec(10 * 24h), 100, 4s);
+    sim::runFor(26 * 24h + 2h);
+
+    auto events = payload::acked();
+    long used = 0;
+    for (const auto& event: events) {
+        used += payload::number(event.data, "use");
+    }
+    CHECK_EQ(used, 200);
+    auto times = reportedPulseTimesMsec(events);
+    CHECK_EQ(times.size(), recent.size());
+    for (size_t i = 0; i < std::min(times.size(), recent.size()); i++) {
+        if (times[i] != unixTimeMsec(recent[i])) {
+            CHECK_EQ(times[i], unixTimeMsec(recent[i]));
+            break;
+        }
+    }
+    printStats("26 day outage");
+}
+
+TEST(backlogDrainsInOneSession) {
+    // Irregular flow over a day-and-a-half outage overfills the pulseTimes buffer
+    std::mt19937 rng(4);
+    sim::boot();
+    sim::at(sim::usec(1h), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(37h), [] { sim::setNetworkAvailable(true); });
+    int total = 0;
+    for (int run = 0; run < 12; run++) {
+        total += 250;
+        addFlow(sim::usec(2h) + run * sim::usec(3h), 250, 5s, 2s, &rng);
+    }
+    sim::runFor(39h);
+
+    auto events = payload::acked();
+    long used = 0;
+    size_t timed = 0;
+    long aggregated = 0;
+    for (const auto& event: events) {
+        CHECK(event.data.size() < particle::protocol::MAX_EVENT_DATA_LENGTH);
+        used += payload::number(event.data, "use");
+        timed += payload::pulseTimes(event.data).size();
+        for (const auto& aggregate: payload::usageAggregates(event.data)) {
+            aggregated += aggregate.count;
+        }
+    }
+    CHECK_EQ(used, total);
+    // (erratic pulse intervals take two bytes each, at msec resolution)
+    CHECK(timed >= 1100u);
+    // The rest are counted in usage aggregates, rather than lost (except
+    // a few times already sealed into queued reports, which only count in use)
+    printf("  %zu pulse times, %ld pulses in usage aggregates\n", timed, aggregated);
+    CHECK(long(timed) + aggregated <= total);
+    CHECK(long(timed) + aggregated >= total - 20);
+
+    // All in a quick series of events, once the network is back
+    std::vector<sim::PublishedEvent> drain;
+    for (const auto& event: events) {
+        if (event.usec > sim::usec(37h)) {
+            drain.push_back(event);
+        }
+    }
+    CHECK(drain.size() > 5u);
+    double drainSecs = (drain.back().usec - drain.front().usec) / 1e6;
+    CHECK(drainSecs < drain.size() * 2.0);
+    for (size_t i = 1; i < drain.size(); i++) {
+        CHECK_EQ(payload::number(drain[i].data, "seq"), payload::number(drain[i - 1].data, "seq") + 1);
+        CHECK_EQ(payload::number(drain[i].data, "lst"), payload::number(drain[i - 1].data, "cur"));
+    }
+    printf("  drained %zu pulse times in %zu events over %.1fs\n", timed, drain.size(), drainSecs);
+    printStats("36h outage");
+}
+
+TEST(multiDayOutageAggregatesOldestUsage) {
+    // Three days of irregular flow is far more than pulseTimes holds:
+    // the oldest pulses are reported as usage aggregates, in time order
+    std::mt19937 rng(7);
+    sim::boot();
+    sim::at(sim::usec(1h), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(73h), [] { sim::setNetworkAvailable(true); });
+    std::vector<uint64_t> pulses;
+    for (int run = 0; run < 24; run++) {
+        auto flow = addFlow(sim::usec(2h) + run * sim::usec(3h), 250, 5s, 2s, &rng);
+        pulses.insert(pulses.end(), flow.begin(), flow.end());
+    }
+    sim::runFor(75h);
+
+    long used = 0;
+    long aggregated = 0;
+    size_t timed = 0;
+    long previousTime = 0;
+    for (const auto& event: payload::acked()) {
+        CHECK(event.data.size() < particle::protocol::MAX_EVENT_DATA_LENGTH);
+        used += payload::number(event.data, "use");
+        timed += payload::pulseTimes(event.data).size();
+        for (const auto& aggregate: payload::usageAggregates(event.data)) {
+            CHECK(aggregate.count > 0);
+            CHECK(aggregate.first >= previousTime);
+            CHECK(aggregate.last >= aggregate.first);
+            CHECK(aggregate.first >= unixTime(pulses.front()) - 1);
+            CHECK(aggregate.last <= unixTime(pulses.back()) + 1);
+            aggregated += aggregate.count;
+            previousTime = aggregate.last;
+        }
+    }
+    CHECK_EQ(used, long(pulses.size()));
+    CHECK(aggregated > 0);
+    CHECK(long(timed) + aggregated <= long(pulses.size()));
+    CHECK(long(timed) + aggregated >= long(pulses.size()) - 20);
+    printf("  %zu pulse times, %ld pulses in usage aggregates\n", timed, aggregated);
+    printStats("72h outage");
+}
+
+TEST(pipelinesPublishesOnSlowAcks) {
+    // Flaky WiFi: acks take 3s, and 1 in 5 is lost (failing after 20s)
+    sim::Config config;
+    config.publishAckTime = 3s;
+    config.publishLossRate = 0.2;
+    std::mt19937 rng(6);
+    sim::boot(config);
+    sim::at(sim::usec(1h), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(13h), [] { sim::setNetworkAvailable(true); });
+    int total = 0;
+    for (int run = 0; run < 4; run++) {
+        total += 250;
+        addFlow(sim::usec(2h) + run * sim::usec(3h), 250, 5s, 2s, &rng);
+    }
+    sim::runFor(15h);
+
+    auto events = payload::acked();
+    long used = 0;
+    std::vector<long> seqs;
+    std::vector<sim::PublishedEvent> drain;
+    for (const auto& event: events) {
+        used += payload::number(event.data, "use");
+        seqs.push_back(payload::number(event.data, "seq"));
+        if (event.sentUsec > sim::usec(13h)) {
+            drain.push_back(event);
+        }
+    }
+    CHECK_EQ(used, total);
+    std::sort(seqs.begin(), seqs.end());
+    CHECK(std::adjacent_find(seqs.begin(), seqs.end()) == seqs.end()); // (each acked once)
+
+    // Publishes overlap, rather than each waiting out its ack
+    auto stats = sim::stats();
+    CHECK(stats.maxPublishesInFlight > 1u);
+    CHECK(stats.publishAttempts > stats.publishAcks); // (some were lost)
+    CHECK(drain.size() > 5u);
+    // (waiting for each ack or timeout, then PUBLISH_BACKLOG_INTERVAL)
+    double drainSecs = (drain.back().usec - drain.front().sentUsec) / 1e6;
+    double sequentialSecs = 0;
+    for (const auto& event: sim::published()) {
+        if (event.sentUsec > sim::usec(13h)) {
+            sequentialSecs += (event.usec - event.sentUsec) / 1e6 + 1;
+        }
+    }
+    CHECK(drainSecs < sequentialSecs);
+    printf("  drained %zu events in %.1fs (one at a time: %.0fs), up to %u in flight\n",
+           drain.size(), drainSecs, sequentialSecs, stats.maxPublishesInFlight);
+    printStats("slow acks");
+}
+
+TEST(retriesRepeatTheSealedReport) {
+    // The network drops while a report awaits its ack, for long enough to
+    // overfill pulseTimes: every attempt at a report carries the same
+    // metering data (so the server can take any one of them), and no pulse
+    // is counted twice
+    sim::Config config;
+    config.publishAckTime = 10s;
+    std::mt19937 rng(9);
+    sim::boot(config);
+    // (a few seconds after the second report is sent)
+    sim::at(sim::usec(2525s), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(31h), [] { sim::setNetworkAvailable(true); });
+    int total = 0;
+    for (int run = 0; run < 10; run++) {
+        total += 250;
+        addFlow(sim::usec(40min) + run * sim::usec(3h), 250, 5s, 2s, &rng);
+    }
+    sim::runFor(33h);
+
+    // (the event less its attempt count and device status)
+    auto meteringData = [](const std::string& data) {
+        std::string result = data.substr(0, data.find(",\"sig\""));
+        auto tries = result.find(",\"try\":");
+        if (tries != std::string::npos) {
+            result.erase(tries, result.find(',', tries + 1) - tries);
+        }
+        auto at = result.find(",\"at\":");
+        if (at != std::string::npos) {
+            result.erase(at, result.find(',', at + 1) - at);
+        }
+        return result;
+    };
+    std::map<long, std::string> sent;
+    size_t retries = 0;
+    for (const auto& event: sim::published()) {
+        if (event.name != "waterbot/data") {
+            continue;
+        }
+        long seq = payload::number(event.data, "seq");
+        auto found = sent.find(seq);
+        if (found == sent.end()) {
+            sent[seq] = meteringData(event.data);
+        } else {
+            CHECK_EQ(meteringData(event.data), found->second);
+            retries += 1;
+        }
+    }
+    CHECK(retries > 0u);
+
+    long used = 0;
+    long timed = 0;
+    long aggregated = 0;
+    for (const auto& event: payload::acked()) {
+        used += payload::number(event.data, "use");
+        timed += payload::pulseTimes(event.data).size();
+        for (const auto& aggregate: payload::usageAggregates(event.data)) {
+            aggregated += aggregate.count;
+        }
+    }
+    CHECK_EQ(used, total);
+    CHECK(timed + aggregated <= total);
+    printf("  %zu retries; %ld pulse times, %ld pulses in usage aggregates (of %d)\n",
+           retries, timed, aggregated, total);
+}
+
+TEST(setReadingKeepsSentReports) {
+    // A new reading clears pulse times, while a report that carries some
+    // awaits its ack: its retries still carry the same pulse times
+    sim::Config config;
+    config.publishAckTime = 10s;
+    std::mt19937 rng(9);
+    sim::boot(config);
+    // (a few seconds after the second report is sent)
+    sim::at(sim::usec(2525s), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(2h), [] { sim::callFunction("setReading", "5000"); });
+    sim::at(sim::usec(3h), [] { sim::setNetworkAvailable(true); });
+    addFlow(sim::usec(40min), 250, 5s, 2s, &rng);
+    sim::runFor(4h);
+
+    std::map<long, std::vector<long>> sent;
+    size_t retries = 0;
+    for (const auto& event: sim::published()) {
+        if (event.name != "waterbot/data") {
+            continue;
+        }
+        long seq = payload::number(event.data, "seq");
+        auto pulseTimes = payload::pulseTimes(event.data);
+        auto found = sent.find(seq);
+        if (found == sent.end()) {
+            sent[seq] = pulseTimes;
+        } else {
+            CHECK_EQ(pulseTimes.size(), found->second.size());
+            CHECK(pulseTimes == found->second);
+            retries += pulseTimes.empty() ? 0 : 1;
+        }
+    }
+    CHECK(retries > 0u);
+    auto events = payload::acked();
+    CHECK_EQ(payload::number(events.back().data, "cur"), 5000);
+}
+
+TEST(loopNeverWaitsOnNetwork) {
+    // Connecting to a missing network takes NETWORK_CONNECT_TIMEOUT (15s),
+    // but on the publisher thread: loop() keeps its usual pace meanwhile
+    sim::boot();
+    sim::at(sim::usec(10min), [] { sim::setNetworkAvailable(false); });
+    sim::at(sim::usec(3h), [] { sim::setNetworkAvailable(true); });
+    addFlow(sim::usec(20min), 100, 4s);
+    sim::at(sim::usec(90min), [] { sim::callFunction("publishNow", ""); });
+    sim::runFor(4h);
+
+    long used = 0;
+    for (const auto& event: payload::acked()) {
+        used += payload::number(event.data, "use");
+    }
+    CHECK_EQ(used, 100);
+    auto stats = sim::stats();
+    CHECK(stats.maxLoopUsec < sim::usec(1s));
+    printf("  %u loops, longest %.0fms\n", stats.loopCount, stats.maxLoopUsec / 1e3);
+    printStats("outage");
+}
+
+TEST(threadsWakeOnlyForWork) {
+    // Awake for RESET_STAY_AWAKE_INTERVAL (and connected), with some flow
+    sim::Config config;
+    config.resetReason = RESET_REASON_PIN_RESET;
+    sim::boot(config);
+    addFlow(sim::usec(2min), 60, 5s);
+    sim::runFor(1h);
+
+    auto stats = sim::stats();
+    double awakeHours = stats.awakeUsec / 3.6e9;
+    printf("  wakeups per awake hour:");
+    for (const auto& thread: stats.threadWakeups) {
+        printf(" %s %.0f", thread.first.c_str(), thread.second / awakeHours);
+    }
+    printf("\n");
+    printStats("stay awake");
+
+    // (polling every 50ms was over 72000 per hour, for each)
+    CHECK(stats.threadWakeups["app"] / awakeHours < 10000);
+    // pulseSignal: just its waits to light each pulse (on, then off)
+    CHECK(stats.threadWakeups["pulseSignal"] <= 60u * 3 + 1);
+}
+
+TEST(countsFastMeterPulses) {
+    // A higher-resolution meter: 20 pulses/sec, closed for 20ms each
+    sim::boot();
+    sim::runFor(1min);
+    const int count = 600;
+    constexpr auto interval = 50ms;
+    for (int i = 0; i < count; i++) {
+        addBouncyPulse(sim::nowUsec() + sim::usec(1s) + i * sim::usec(interval), 20ms);
+    }
+    sim::runFor(10min);
+
+    auto events = payload::acked();
+    long used = 0;
+    for (const auto& event: events) {
+        used += payload::number(event.data, "use");
+    }
+    if (EDGE_DETECTION) {
+        CHECK_EQ(used, count);
+        CHECK_EQ(reportedPulseTimes(events).size(), size_t(count));
+        CHECK_EQ(sim::stats().timerCallbacks, 0u);
+    } else {
+        // (beyond the debounce timer's limits: each pulse restarts the
+        // timer before it fires, so it only fires after the last one,
+        // with the switch open again)
+        constexpr auto debounce = 300ms; // (DEBOUNCE_MSEC)
+        static_assert(interval < debounce, "pulses should outpace the debounce timer");
+        CHECK_EQ(used, 0);
+        CHECK_EQ(sim::stats().timerCallbacks, 1u);
+    }
+    printf("  counted %ld of %d pulses, in %u ISR calls\n", used, count, sim::stats().isrCalls);
+}
+
+TEST(lowBatteryStretchesPublishing) {
+    sim::Config config;
+    config.batteryCharge = 15;
+    sim::boot(config);
+    sim::runFor(40h);
+    // Heartbeats stretch to 32 hours (after the first fuel gauge reading)
+    auto events = payload::acked();
+    CHECK_EQ(events.size(), 2u);
+
+    // In-use batching stretches to 8 minutes
+    uint64_t start = sim::nowUsec();
+    addFlow(start, 5, 10s);
+    sim::runFor(30min);
+    events = payload::acked();
+    CHECK_EQ(events.size(), 3u);
+    CHECK(events.back().usec >= start + sim::usec(8min));
+
+    // Irregular flow fills the (bigger) batches quickly,
+    // but no pulse times are lost
+    std::mt19937 rng(15);
+    start = sim::nowUsec();
+    auto pulses = addFlow(start, 3000, 1500ms, 700ms, &rng);
+    sim::runFor(2h);
+    auto flowEvents = payload::acked();
+    flowEvents.erase(flowEvents.begin(), flowEvents.begin() + 3);
+    CHECK_EQ(reportedPulseTimes(flowEvents).size(), pulses.size());
+    printStats("low battery");
+
+    // Back to the normal cadence once recharged
+    sim::setBattery(4.1, 90);
+    sim::runFor(40h);
+    size_t before = payload::acked().size();
+    start = sim::nowUsec();
+    addFlow(start, 5, 10s);
+    sim::runFor(5min);
+    events = payload::acked();
+    CHECK_EQ(events.size(), before + 1);
+    CHECK(events.back().usec < start + sim::usec(75s));
+}
+
+TEST(diagnosticsRideAlongWithData) {
+    // Several wakes a day: the data events carry the diagnostics,
+    // and full vitals go out only after boot and then daily
+    sim::boot();
+    for (int hour = 1; hour < 72; hour += 3) {
+        addFlow(sim::usec(std::chrono::hours(hour)), 10, 5s);
+    }
+    sim::runFor(72h);
+
+    auto events = payload::acked();
+    CHECK(events.size() >= 24u);
+    CHECK(sim::stats().vitalsPublishes <= 4u);
+    double connects = 0;
+    double connectedSecs = 0;
+    for (const auto& event: events) {
+        CHECK(payload::has(event.data, "mem"));
+        CHECK(payload::number(event.data, "upt") >= payload::number(event.data, "t")
+                                                    - sim::config().rtcStartTime - 1);
+        CHECK(payload::number(event.data, "con") >= connects);
+        CHECK(payload::number(event.data, "cns") >= connectedSecs);
+        connects = payload::number(event.data, "con");
+        connectedSecs = payload::number(event.data, "cns");
+    }
+    // (one session per wake, and the device's count of connected time
+    // agrees with the simulated radio)
+    CHECK(connects >= events.size() - 1);
+    CHECK(std::abs(connectedSecs - sim::stats().cloudConnectedUsec / 1e6) < 2);
+    printf("  %.0f cloud sessions, %.1fs connected per session (device counters), %u vitals\n",
+           connects, connectedSecs / connects, sim::stats().vitalsPublishes);
+    printStats("diagnostics");
+}
+
+TEST(keepsSessionDuringSustainedFlow) {
+    // Two hours of hose flow at a site with slow WiFi, then none. With
+    // network standby, the session carries over between publishes; without
+    // it (e.g., on a Device OS that doesn't support it), every publish
+    // reconnects. Either way, it's powered down once the flow stops.
+    struct Result {
+        uint32_t wifiConnects;
+        uint32_t publishes;
+        double connectSecs;
+        double radioSecs;
+        double radioSecsAfterFlow;
+        int standbySleeps;
+        int powerDownSleeps;
+        size_t timed;
+    };
+    auto run = [](bool sleepNetworkStandby) {
+        sim::Config config;
+        config.wifiConnectTime = 8s;
+        config.cloudConnectTime = 4s;
+        config.sleepNetworkStandby = sleepNetworkStandby;
+        sim::boot(config);
+        auto pulses = addFlow(sim::usec(10min), 600, 12s);
+        sim::runFor(3h);
+        double radioSecs = sim::stats().wifiOnUsec / 1e6;
+        sim::runFor(6h);
+        auto stats = sim::stats();
+        return Result{
+            stats.wifiConnects, stats.publishAcks,
+            stats.wifiConnects * 8.0 + stats.cloudConnects * 4.0,
+            stats.wifiOnUsec / 1e6, stats.wifiOnUsec / 1e6 - radioSecs,
+            sim::variable("standbySleep"), sim::variable("offSleep"),
+            reportedPulseTimes(payload::acked()).size(),
+        };
+    };
+    Result standby = testing::isolated([&] { return run(true); });
+    Result reconnect = testing::isolated([&] { return run(false); });
+
+    printf("  %-10s %9s %9s %11s %9s %15s\n", "", "publishes", "connects", "connecting", "radio on", "standby/off");
+    for (auto result: {std::make_pair("standby", standby), std::make_pair("reconnect", reconnect)}) {
+        printf("  %-10s %9u %9u %10.0fs %8.0fs %7d/%d\n", result.first,
+               result.second.publishes, result.second.wifiConnects, result.second.connectSecs,
+               result.second.radioSecs, result.second.standbySleeps, result.second.powerDownSleeps);
+    }
+    CHECK_EQ(standby.timed, 600u);
+    CHECK_EQ(reconnect.timed, 600u);
+    CHECK(standby.standbySleeps > 0);
+    CHECK(standby.connectSecs < reconnect.connectSecs / 4);
+    // (just the heartbeat publishes, once the flow stops)
+    CHECK(standby.radioSecsAfterFlow <= reconnect.radioSecsAfterFlow + 1);
+}
+
+TEST(publishesTimingSummaryDaily) {
+    sim::Config config;
+    config.wifiConnectTime = 4s;
+    config.cloudConnectTime = 1500ms;
+    sim::boot(config);
+    for (int hour = 1; hour < 72; hour += 2) {
+        addFlow(sim::usec(std::chrono::hours(hour)), 10, 5s);
+    }
+    sim::runFor(72h);
+
+    auto summaries = payload::acked("waterbot/timing");
+    CHECK(summaries.size() >= 2u && summaries.size() <= 3u);
+    for (const auto& summary: summaries) {
+        const std::string& data = summary.data;
+        printf("  %s\n", data.c_str());
+        CHECK(payload::number(data, "per") >= 24 * 3600);
+        CHECK(payload::number(data, "per") < 28 * 3600); // (vitals go first)
+        // [count, min, mean, max]
+        auto wifi = payload::array(data, "wfi");
+        auto cloud = payload::array(data, "cld");
+        auto awake = payload::array(data, "awk");
+        auto asleep = payload::array(data, "slp");
+        CHECK_EQ(wifi.size(), 4u);
+        CHECK(wifi[0] >= 12);
+        CHECK(wifi[1] >= 4000 && wifi[3] < 4100);
+        CHECK(cloud[1] >= 1500 && cloud[3] < 1600);
+        CHECK(payload::array(data, "fmt")[0] >= wifi[0]);
+        CHECK(payload::array(data, "ack")[2] >= 300);
+        CHECK(payload::array(data, "dsc")[0] >= 12);
+        CHECK(awake[0] >= asleep[0] && awake[0] <= asleep[0] + 1);
+        // (most of the day is spent asleep)
+        CHECK(awake[0] * awake[2] / 1000 < asleep[0] * asleep[2] / 10);
+        // histogram: all the WiFi connects fall in [2048, 4096) msec
+        std::string histogram = payload::text(data, "wfih");
+        CHECK_EQ(histogram.size(), 26u);
+        CHECK_EQ(strtol(histogram.substr(24).c_str(), nullptr, 16), wifi[0]);
+        CHECK(data.size() <= 622);
+    }
+}
+
+#if PROFILE_INTERRUPTS
+bool publishProfile(const char* arg) {
+    // (cloud functions only arrive while connected)
+    for (int i = 0; i < 2000; i++) {
+        if (sim::callFunction("publishProfile", arg) == 0) {
+            return true;
+        }
+        sim::runFor(100ms);
+    }
+    return false;
+}
+
+TEST(profilesPulseDetection) {
+    // Pulses are counted soon after they could be: right away by the
+    // debounce timer. Edge detection counts them within a loop poll
+    // interval -- except the pulse that wakes it from sleep, which it
+    // doesn't see until the switch opens.
+    sim::boot();
+    sim::runFor(1min);
+    addFlow(sim::nowUsec(), 40, 3s);
+    sim::runFor(2min);
+    CHECK(publishProfile("reset"));
+    addFlow(sim::nowUsec(), 10, 5s);
+    sim::runFor(50s);
+    CHECK(publishProfile(""));
+
+    auto profiles = payload::acked("waterbot/profile");
+    for (const auto& profile: profiles) {
+        printf("  %s\n", profile.data.c_str());
+    }
+    CHECK_EQ(profiles.size(), 2u);
+    if (profiles.size() != 2) {
+        return;
+    }
+    auto latency = payload::array(profiles[0].data, "lat"); // [count, min, mean, max]
+    CHECK_EQ(latency.size(), 4u);
+    CHECK_EQ(latency[0], 40);
+    CHECK(latency[3] <= (EDGE_DETECTION ? PULSE_WIDTH.count() : 1)); // msec
+    CHECK(payload::array(profiles[0].data, "isr")[0] >= 40);
+    if (EDGE_DETECTION) {
+        CHECK(payload::array(profiles[0].data, "pol")[0] > 0);
+        CHECK(payload::array(profiles[0].data, "arm")[0] > 0);
+    }
+    // (reset after the first)
+    long laterCount = payload::array(profiles[1].data, "lat")[0];
+    CHECK_EQ(laterCount, 10);
+}
+
+TEST(profilesLatencyFromFirstEdge) {
+    // A switch that bounces for a while: the debounce timer restarts on
+    // each bounce, so the pulse is counted that much later than its first
+    // edge (not its last)
+    if (EDGE_DETECTION) {
+        return;
+    }
+    sim::boot();
+    sim::runFor(1min);
+    addFlow(sim::nowUsec(), 40, 3s); // (to get connected)
+    sim::runFor(2min);
+    CHECK(publishProfile("reset"));
+    uint64_t start = sim::nowUsec() + sim::usec(1s);
+    for (int i = 0; i < 5; i++, start += sim::usec(5s)) {
+        for (uint64_t t = start; t < start + sim::usec(100ms); t += sim::usec(20ms)) {
+            sim::setPinLevel(METER, t, LOW);
+            sim::setPinLevel(METER, t + sim::usec(10ms), HIGH);
+        }
+        sim::addPulse(METER, start + sim::usec(100ms), 600ms);
+    }
+    sim::runFor(30s);
+    CHECK(publishProfile(""));
+
+    auto profiles = payload::acked("waterbot/profile");
+    CHECK_EQ(profiles.size(), 2u);
+    if (profiles.size() != 2) {
+        return;
+    }
+    auto latency = payload::array(profiles[1].data, "lat"); // [count, min, mean, max]
+    CHECK_EQ(latency.size(), 4u);
+    CHECK_EQ(latency[0], 5);
+    CHECK(latency[1] >= 90); // msec
+    CHECK(latency[3] <= 101);
+}
+#endif
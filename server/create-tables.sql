@@ -5,8 +5,9 @@ CREATE TABLE IF NOT EXISTS `waterbot.device_site_info`
   device_id STRING NOT NULL OPTIONS(description="Particle device identifier"),
   site_id STRING NOT NULL OPTIONS(description="Identifier for this installation/location"),
   liters_per_meter_pulse FLOAT64 NOT NULL OPTIONS(description="Meter conversion factor"),
+  meter_channel INT64 OPTIONS(description="Which of the device's meters (waterbot/data cur1, pts1, etc. for 1; NULL for 0)"),
 ) OPTIONS (
-  description = 'Site resolution from device IDs',
+  description = 'Site resolution from device IDs (a row for each meter)',
   labels = [('project', 'waterbot')]
 );
 
@@ -41,6 +42,10 @@ CREATE TABLE IF NOT EXISTS `waterbot.device_data`
   wifi_signal_dbm INT64 OPTIONS(description="WiFi RSSI level at time_sent (dBm, -90 - 0)"),
   wifi_snr_db INT64 OPTIONS(description="WiFi signal/noise ratio at time_sent (db, 0 - 90)"),
   network_retry_count INT64 OPTIONS(description="Number of previous failed attempts to send this report"),
+  cloud_connect_count INT64 OPTIONS(description="Cloud sessions since device boot"),
+  cloud_connected_secs INT64 OPTIONS(description="Total time connected to the cloud since device boot (seconds)"),
+  uptime_secs INT64 OPTIONS(description="Time since device boot at time_sent (seconds)"),
+  free_memory_bytes INT64 OPTIONS(description="Free heap memory at time_sent (bytes)"),
   firmware_version STRING OPTIONS(description="Waterbot firmware version")
 ) OPTIONS (
   description = 'Device status data',
@@ -1,6 +1,10 @@
+import {readFileSync} from 'fs';
+import {join} from 'path';
 import {bigquery} from './bigquery';
 import {datasetId, deviceTableId, usageTableId} from './config';
-import {dataCapture, extractDeviceData, extractUsageData} from './dataCapture';
+import {
+  dataCapture, decodePackedPulseTimes, extractDeviceData, extractUsageData, meterChannelData,
+} from './dataCapture';
 
 
 const mockDeviceInfo: DeviceSiteInfoRow = {
@@ -47,6 +51,127 @@ describe(`extractUsageData`, () => {
     ]);
   });
 
+  test(`flow segments`, () => {
+    const extracted = extractUsageData(mockDeviceInfo, {
+      "t": 10100,
+      "at": 10110,
+      "seq": 16,
+      "per": 75,
+      "cur": 2010,
+      "lst": 2003,
+      "use": 7,
+      "ptp": 3,
+      "pts": [15000, [2000, 5, 4300, 0, 3, -2, 1, 0], 1000],
+    });
+    const times = [10040, 10042, 10046.303, 10050.598, 10054.901, 10059.2, 10060.2];
+    expect(extracted).toEqual(times.map((time, index) => ({
+      insertId: `DEVICE:10100:16:${index}`, site_id: "SITE",
+      time_start: time, time_end: time,
+      usage_liters: 1.5, usage_meter_units: 1, meter_reading: 2004 + index,
+    })));
+  });
+
+  test(`msec precision`, () => {
+    const extracted = extractUsageData(mockDeviceInfo, {
+      "t": 10100,
+      "at": 10110,
+      "seq": 16,
+      "per": 75,
+      "cur": 2010,
+      "lst": 2007,
+      "use": 3,
+      "ptp": 3,
+      "pts": [15250, 1999, 751],
+    });
+    expect(extracted.map(row => row.time_start)).toEqual([10040.25, 10042.249, 10043]);
+  });
+
+  test(`malformed flow segment`, () => {
+    // (missing residuals) records the usage, without pulse times
+    const error = jest.spyOn(console, "error").mockImplementation(doNothing);
+    const extracted = extractUsageData(mockDeviceInfo, {
+      "t": 10100,
+      "at": 10110,
+      "seq": 16,
+      "per": 75,
+      "cur": 2010,
+      "lst": 2007,
+      "use": 3,
+      "ptp": 3,
+      "pts": [[17000, 3, 4300, 0]],
+    });
+    expect(error).toHaveBeenCalled();
+    error.mockRestore();
+    expect(extracted).toHaveLength(1);
+    expect(extracted[0].usage_meter_units).toEqual(3);
+  });
+
+  test(`packed pts`, () => {
+    const event = {
+      "t": 10100,
+      "at": 10110,
+      "seq": 16,
+      "per": 75,
+      "cur": 2010,
+      "lst": 2003,
+      "use": 7,
+      "ptp": 3,
+    };
+    const packed = extractUsageData(mockDeviceInfo, {...event, "ptv": 2, "pts": "4NQDwT4FzCEABgMCAKAf"});
+    const array = extractUsageData(mockDeviceInfo, {...event, "pts": [15000, [2000, 5, 4300, 0, 3, -2, 1, 0], 1000]});
+    expect(packed).toHaveLength(7);
+    expect(packed).toEqual(array);
+  });
+
+  test(`mixed fleet`, () => {
+    // devices on older firmware (whole-second pts array, no ptp or ptv)
+    // report alongside newer ones
+    const newDeviceInfo = {...mockDeviceInfo, device_id: "NEWER"};
+    const event = {
+      "t": 10100,
+      "at": 10110,
+      "per": 75,
+      "cur": 2010,
+      "lst": 2003,
+      "use": 7,
+    };
+    const older = extractUsageData(mockDeviceInfo, {...event, "seq": 16, "pts": [15, 2, 4, 4, 4, 4, 1]});
+    const newer = extractUsageData(newDeviceInfo,
+      {...event, "seq": 3, "ptp": 3, "ptv": 2, "pts": "4NQDwT4FzCEABgMCAKAf"});
+    const rows = (deviceId: string, sequence: number, times: Array<number>) =>
+      times.map((time, index) => ({
+        insertId: `${deviceId}:10100:${sequence}:${index}`, site_id: "SITE",
+        time_start: time, time_end: time,
+        usage_liters: 1.5, usage_meter_units: 1, meter_reading: 2004 + index,
+      }));
+    expect(older).toEqual(rows("DEVICE", 16, [10040, 10042, 10046, 10050, 10054, 10058, 10059]));
+    expect(newer).toEqual(rows("NEWER", 3,
+      [10040, 10042, 10046.303, 10050.598, 10054.901, 10059.2, 10060.2]));
+  });
+
+  test(`undecodable pts`, () => {
+    // records the usage, without pulse times
+    const error = jest.spyOn(console, "error").mockImplementation(doNothing);
+    const extracted = extractUsageData(mockDeviceInfo, {
+      "t": 10100,
+      "at": 10110,
+      "seq": 16,
+      "per": 75,
+      "cur": 2010,
+      "lst": 2007,
+      "use": 3,
+      "ptv": 2,
+      "pts": "PAk",
+    });
+    expect(error).toHaveBeenCalled();
+    error.mockRestore();
+    expect(extracted).toEqual([
+      { insertId: "DEVICE:10100:16", site_id: "SITE",
+        time_start: 10025, time_end: 10100,
+        usage_liters: 4.5, usage_meter_units: 3, meter_reading: 2010 },
+    ]);
+  });
+
   test(`zero usage`, () => {
     // e.g., heartbeat event
     const extracted = extractUsageData(mockDeviceInfo, {
@@ -89,6 +214,67 @@ describe(`extractUsageData`, () => {
     ]);
   });
 
+  test(`usage aggregates`, () => {
+    const extracted = extractUsageData(mockDeviceInfo, {
+      "t": 10100,
+      "at": 10110,
+      "seq": 16,
+      "per": 75,
+      "cur": 2014,
+      "lst": 2004,
+      "use": 10,
+      "agg": [[5, 20, 4], [30, 0, 2]],
+      "pts": [3, 1],
+    });
+    expect(extracted).toEqual([
+      { insertId: "DEVICE:10100:16", site_id: "SITE",
+        time_start: 10025, time_end: 10030,
+        usage_liters: 3.0, usage_meter_units: 2, meter_reading: 2006 },
+      { insertId: "DEVICE:10100:16:a0", site_id: "SITE",
+        time_start: 10030, time_end: 10050,
+        usage_liters: 6.0, usage_meter_units: 4, meter_reading: 2010 },
+      { insertId: "DEVICE:10100:16:a1", site_id: "SITE",
+        time_start: 10080, time_end: 10080,
+        usage_liters: 3.0, usage_meter_units: 2, meter_reading: 2012 },
+      { insertId: "DEVICE:10100:16:0", site_id: "SITE",
+        time_start: 10083, time_end: 10083,
+        usage_liters: 1.5, usage_meter_units: 1, meter_reading: 2013 },
+      { insertId: "DEVICE:10100:16:1", site_id: "SITE",
+        time_start: 10084, time_end: 10084,
+        usage_liters: 1.5, usage_meter_units: 1, meter_reading: 2014 },
+    ]);
+  });
+
+  test(`second meter channel`, () => {
+    const eventData = {
+      "t": 10100,
+      "at": 10110,
+      "seq": 16,
+      "per": 75,
+      "cur": 2014,
+      "lst": 2004,
+      "use": 10,
+      "pts": [5, 10, 10, 10, 10, 10, 10, 5, 1, 1],
+      "cur1": 503,
+      "lst1": 501,
+      "use1": 2,
+      "pts1": [30, 15],
+    };
+    const meterData = meterChannelData(eventData, 1);
+    expect(meterData).toBeDefined();
+    const extracted = extractUsageData({...mockDeviceInfo, meter_channel: 1}, meterData!);
+    expect(extracted).toEqual([
+      { insertId: "DEVICE/1:10100:16:0", site_id: "SITE",
+        time_start: 10055, time_end: 10055,
+        usage_liters: 1.5, usage_meter_units: 1, meter_reading: 502 },
+      { insertId: "DEVICE/1:10100:16:1", site_id: "SITE",
+        time_start: 10070, time_end: 10070,
+        usage_liters: 1.5, usage_meter_units: 1, meter_reading: 503 },
+    ]);
+    expect(meterChannelData(eventData, 0)).toBe(eventData);
+    expect(meterChannelData(eventData, 2)).toBeUndefined();
+  });
+
   test(`completely missing pulse timestamps`, () => {
     // e.g., positive meter correction
     const extracted = extractUsageData(mockDeviceInfo, {
@@ -143,6 +329,29 @@ describe(`extractUsageData`, () => {
 });
 
 
+describe(`decodePackedPulseTimes`, () => {
+  // (the same vectors the firmware's encoder is tested against)
+  const vectors = readFileSync(join(__dirname, "../../firmware/test/packed_pts_vectors.txt"), "utf-8")
+    .split("\n")
+    .filter(line => line && !line.startsWith("#"))
+    .map(line => {
+      const close = line.indexOf('"', 1);
+      return [line.slice(1, close), JSON.parse(line.slice(close + 2))];
+    });
+
+  test.each(vectors)(`decodes "%s"`, (packed, items) => {
+    expect(decodePackedPulseTimes(packed)).toEqual(items);
+  });
+
+  test(`rejects malformed`, () => {
+    expect(() => decodePackedPulseTimes("A=")).toThrow();
+    expect(() => decodePackedPulseTimes("gA")).toThrow(); // unfinished varint
+    expect(() => decodePackedPulseTimes("Aw")).toThrow(); // unfinished segment
+    expect(() => decodePackedPulseTimes("AQIB")).toThrow(); // missing residual
+  });
+});
+
+
 describe(`extractDeviceData`, () => {
   beforeEach(() => {
     jest.useFakeTimers({
@@ -169,6 +378,10 @@ describe(`extractDeviceData`, () => {
       "btv": 3.9597,
       "btp": 85.9141,
       "try": 3,
+      "con": 12,
+      "cns": 9,
+      "upt": 86517,
+      "mem": 41872,
       "pts": [15, 12, 13, 12, 13],
       "v": "0.3.9"
     });
@@ -188,6 +401,10 @@ describe(`extractDeviceData`, () => {
       wifi_signal_dbm: -60,
       wifi_snr_db: 32,
       network_retry_count: 3,
+      cloud_connect_count: 12,
+      cloud_connected_secs: 9,
+      uptime_secs: 86517,
+      free_memory_bytes: 41872,
       firmware_version: "0.3.9",
     });
   });
@@ -31,13 +31,15 @@ export const dataCapture: EventFunction = async (data) => {
 
   const dataset = bigquery.dataset(datasetId);
 
-  const deviceInfo = await getDeviceSiteInfo(deviceId);
-  if (!deviceInfo) {
+  const deviceInfos = await getDeviceSiteInfo(deviceId);
+  if (deviceInfos.length < 1) {
     console.error(`Unrecognized deviceId ${deviceId}`);
     return;
   }
-  // console.log('Using device site info:', deviceInfo);
+  // console.log('Using device site info:', deviceInfos);
 
+  // (device data goes with its first meter's site)
+  const deviceInfo = deviceInfos.find(({meter_channel}) => !meter_channel) ?? deviceInfos[0];
   const deviceData = extractDeviceData(deviceInfo, eventData);
   try {
     await dataset.table(deviceTableId).insert(deviceData);
@@ -46,7 +48,15 @@ export const dataCapture: EventFunction = async (data) => {
     reportInsertError(err);
   }
 
-  const usageData = extractUsageData(deviceInfo, eventData);
+  const usageData = deviceInfos.flatMap((meterInfo) => {
+    const channel = meterInfo.meter_channel ?? 0;
+    const meterData = meterChannelData(eventData, channel);
+    if (!meterData) {
+      console.error(`No meter channel ${channel} in data from deviceId ${deviceId}`);
+      return [];
+    }
+    return extractUsageData(meterInfo, meterData);
+  });
   if (usageData.length > 0) {
     try {
       await dataset.table(usageTableId).insert(usageData);
@@ -61,9 +71,9 @@ export const dataCapture: EventFunction = async (data) => {
 
 
 /**
- * Load site info for a particular device ID.
+ * Load site info for a particular device ID: a row for each of its meters.
  */
-async function getDeviceSiteInfo(deviceId: string): Promise<DeviceSiteInfoRow | undefined> {
+async function getDeviceSiteInfo(deviceId: string): Promise<Array<DeviceSiteInfoRow>> {
   const [result] = await bigquery.query({
     query: `SELECT * FROM \`${deviceSiteInfoTableId}\` WHERE device_id = @device_id`,
     params: {device_id: deviceId},
@@ -73,14 +83,43 @@ async function getDeviceSiteInfo(deviceId: string): Promise<DeviceSiteInfoRow |
       datasetId,
     },
   });
-  if (result.length < 1) {
-    return undefined;
+  // (one row for each meter channel; if devices need to change, keep the last)
+  const byChannel = new Map<number, DeviceSiteInfoRow>();
+  result.forEach((row: DeviceSiteInfoRow) => {
+    const channel = row.meter_channel ?? 0;
+    if (byChannel.has(channel)) {
+      console.warn(`Duplicate device ID '${deviceId}' (meter channel ${channel})`);
+    }
+    byChannel.set(channel, row);
+  });
+  return Array.from(byChannel.values());
+}
+
+/**
+ * Return the waterbot/data fields for one of the device's meters
+ * under the usual (channel 0) keys, or undefined if it doesn't have
+ * that channel.
+ */
+export function meterChannelData(
+  eventData: WaterbotDataPayload, channel: number
+): WaterbotDataPayload | undefined {
+  if (channel === 0) {
+    return eventData;
   }
-  if (result.length > 1) {
-    // If devices need to change
-    console.warn(`Duplicate device ID '${deviceId}'`);
+  const cur = eventData[`cur${channel}`];
+  const lst = eventData[`lst${channel}`];
+  const use = eventData[`use${channel}`];
+  if (cur === undefined || lst === undefined || use === undefined) {
+    return undefined;
   }
-  return result.pop();
+  return {
+    ...eventData,
+    cur,
+    lst,
+    use,
+    agg: eventData[`agg${channel}`],
+    pts: eventData[`pts${channel}`],
+  };
 }
 
 /**
@@ -98,29 +137,42 @@ export function extractUsageData(deviceInfo: DeviceSiteInfoRow, eventData: Water
     cur: currentMeterReading,
     lst: previousMeterReading,
     use: reportedUsagePulses,
-    pts: pulseTimestamps = [],
+    agg: usageAggregates = [],
+    pts: encodedPulseTimes = [],
+    ptp: pulseTimePrecision = 0,
+    ptv: pulseTimesVersion = 1,
   } = eventData;
   const {
     device_id: deviceId,
     site_id: siteId,
     liters_per_meter_pulse: litersPerMeterPulse,
+    meter_channel: meterChannel,
   } = deviceInfo;
+  // (keep each meter's insertIds distinct)
+  const insertIdPrefix = meterChannel ? `${deviceId}/${meterChannel}` : deviceId;
 
   // If 'lst' is 0, device has been reinitialized and 'use' must be ignored.
   const usagePulses = previousMeterReading > 0 ? reportedUsagePulses : 0;
-  let timeStart = timeOfReading - readingPeriod;
-  let meterReading = currentMeterReading - pulseTimestamps.length;
+  const timeStart = timeOfReading - readingPeriod;
+  const aggregates = decodeUsageAggregates(timeStart, usageAggregates);
+  const aggregatedPulses = aggregates.reduce((total, {count}) => total + count, 0);
+  const pulseTimestamps = decodePulseTimes(
+    aggregates.length > 0 ? aggregates[aggregates.length - 1].timeEnd : timeStart,
+    pulseTimeItems(encodedPulseTimes, pulseTimesVersion), pulseTimePrecision);
+  let meterReading = currentMeterReading - aggregatedPulses - pulseTimestamps.length;
 
-  const missingPulses = usagePulses - pulseTimestamps.length;
+  const missingPulses = usagePulses - aggregatedPulses - pulseTimestamps.length;
   if (missingPulses !== 0) {
     // Individual timestamps lost at beginning of period
     // OR meter correction (positive or negative).
     // Add a single UsageDataRow capturing this.
-    const timeEnd = pulseTimestamps.length > 0
-      ? timeStart + pulseTimestamps[0]
+    const timeEnd = aggregates.length > 0
+      ? aggregates[0].timeStart
+      : pulseTimestamps.length > 0
+      ? pulseTimestamps[0]
       : timeOfReading;
     usageData.push({
-      insertId: `${deviceId}:${timeOfReading}:${sequence}`,
+      insertId: `${insertIdPrefix}:${timeOfReading}:${sequence}`,
       site_id: siteId,
       time_start: timeStart,
       time_end: timeEnd,
@@ -129,14 +181,25 @@ export function extractUsageData(deviceInfo: DeviceSiteInfoRow, eventData: Water
       meter_reading: meterReading,
     });
   }
-  pulseTimestamps.forEach((timestampDelta, pulseIndex) => {
-    timeStart += timestampDelta; // pulseTimestamps are delta encoded
-    meterReading += 1;
+  aggregates.forEach(({timeStart, timeEnd, count}, aggregateIndex) => {
+    meterReading += count;
     usageData.push({
-      insertId: `${deviceId}:${timeOfReading}:${sequence}:${pulseIndex}`,
+      insertId: `${insertIdPrefix}:${timeOfReading}:${sequence}:a${aggregateIndex}`,
       site_id: siteId,
       time_start: timeStart,
-      time_end: timeStart, // single pulse occupies 0 time
+      time_end: timeEnd,
+      usage_liters: count * litersPerMeterPulse,
+      usage_meter_units: count,
+      meter_reading: meterReading,
+    });
+  });
+  pulseTimestamps.forEach((pulseTime, pulseIndex) => {
+    meterReading += 1;
+    usageData.push({
+      insertId: `${insertIdPrefix}:${timeOfReading}:${sequence}:${pulseIndex}`,
+      site_id: siteId,
+      time_start: pulseTime,
+      time_end: pulseTime, // single pulse occupies 0 time
       usage_liters: litersPerMeterPulse, // exactly one pulse's worth
       usage_meter_units: 1,
       meter_reading: meterReading,
@@ -146,6 +209,131 @@ export function extractUsageData(deviceInfo: DeviceSiteInfoRow, eventData: Water
   return usageData;
 }
 
+/**
+ * Convert a waterbot/data agg array to absolute time ranges.
+ *
+ * Each UsageAggregate's delta is from the previous one's end
+ * (or from timeStart, for the first).
+ */
+export function decodeUsageAggregates(
+  timeStart: number, encoded: Array<UsageAggregate>
+): Array<{timeStart: number, timeEnd: number, count: number}> {
+  let previousTime = timeStart;
+  return encoded.map(([delta, secs, count]) => {
+    const start = previousTime + delta;
+    previousTime = start + secs;
+    return {timeStart: start, timeEnd: previousTime, count};
+  });
+}
+
+/**
+ * Return the items of a waterbot/data pts, by its version (ptv):
+ * 1 is a JSON array, 2 a string of packed items.
+ *
+ * If pts can't be decoded, logs an error and returns no items
+ * (so the event's usage is still recorded, just without pulse times).
+ */
+function pulseTimeItems(
+  encoded: Array<number | FlowSegment> | string, version: number
+): Array<number | FlowSegment> {
+  try {
+    if (version === 1 && Array.isArray(encoded)) {
+      const malformed = encoded.find(item => Array.isArray(item) && item.length !== item[1] + 3);
+      if (malformed) {
+        throw new Error(`flow segment ${JSON.stringify(malformed)} needs a residual for each pulse`);
+      }
+      return encoded;
+    }
+    if (version === 2 && typeof encoded === "string") {
+      return decodePackedPulseTimes(encoded);
+    }
+    throw new Error(`unsupported pts for ptv ${version}`);
+  } catch (err) {
+    console.error(`Can't decode pts ${JSON.stringify(encoded)}:`, err);
+    return [];
+  }
+}
+
+/**
+ * Decode a waterbot/data ptv 2 pts string into the same items as a ptv 1
+ * pts array. It's base64 (unpadded) of LEB128 varints: each item starts
+ * with zigzag(delta) * 2, plus 1 for a FlowSegment, which continues with
+ * its count, interval, and zigzag(residual) for each of its pulses.
+ * (See firmware/src/PackedPulseTimes.h;
+ * firmware/test/packed_pts_vectors.txt has examples.)
+ */
+export function decodePackedPulseTimes(packed: string): Array<number | FlowSegment> {
+  if (!/^[A-Za-z0-9+/]*$/.test(packed) || packed.length % 4 === 1) {
+    throw new Error(`invalid base64`);
+  }
+  const bytes = Buffer.from(packed, "base64");
+  let pos = 0;
+  // (without bitwise ops, which would truncate to 32 bits)
+  const varint = (): number => {
+    let value = 0;
+    for (let scale = 1; pos < bytes.length; scale *= 128) {
+      const byte = bytes[pos++];
+      value += (byte % 128) * scale;
+      if (byte < 128) {
+        return value;
+      }
+    }
+    throw new Error(`truncated varint`);
+  };
+
+  const unzigzag = (zigzagged: number): number =>
+    zigzagged % 2 === 0 ? zigzagged / 2 : -(zigzagged + 1) / 2;
+
+  const items: Array<number | FlowSegment> = [];
+  while (pos < bytes.length) {
+    const header = varint();
+    if (header % 2 === 0) {
+      items.push(unzigzag(Math.floor(header / 2)));
+    } else {
+      const segment: FlowSegment = [unzigzag(Math.floor(header / 2)), varint(), varint()];
+      for (let i = 0; i < segment[1]; i++) {
+        segment.push(unzigzag(varint()));
+      }
+      items.push(segment);
+    }
+  }
+  return items;
+}
+
+/**
+ * Convert a waterbot/data pts array to absolute pulse timestamps.
+ *
+ * Each element is either a single pulse time, delta encoded from the
+ * previous pulse (or from timeStart, for the first), or a FlowSegment
+ * covering a run of pulses at a steady rate.
+ *
+ * All the numbers in it are in units of 10^-precision secs (the payload's
+ * ptp: msec with 3, which is what firmware sends), and decode exactly.
+ * (The arithmetic is done in those integer units, so msec don't pick up
+ * floating point error on the way.)
+ */
+export function decodePulseTimes(
+  timeStart: number, encoded: Array<number | FlowSegment>, precision = 0
+): Array<number> {
+  const scale = 10 ** precision;
+  const pulseTimes: Array<number> = [];
+  let previous = timeStart * scale;
+  for (const item of encoded) {
+    if (Array.isArray(item)) {
+      const [delta, count, interval, ...residuals] = item;
+      const first = previous + delta;
+      for (let i = 0; i < count; i++) {
+        previous = first + i * interval + residuals[i];
+        pulseTimes.push(previous / scale);
+      }
+    } else {
+      previous += item;
+      pulseTimes.push(previous / scale);
+    }
+  }
+  return pulseTimes;
+}
+
 /**
  * Generate a single row to record in the device data table
  * for the given waterbot/data event.
@@ -163,6 +351,10 @@ export function extractDeviceData(deviceInfo: DeviceSiteInfoRow, eventData: Wate
     btv: battery_v,
     btp: battery_pct,
     try: network_retry_count = 0,
+    con: cloud_connect_count,
+    cns: cloud_connected_secs,
+    upt: uptime_secs,
+    mem: free_memory_bytes,
     v: firmware_version = "unknown",
   } = eventData;
   // Could also (instead?) track Message.publishTime or ParticleMessageAttributes.published_at
@@ -185,6 +377,10 @@ export function extractDeviceData(deviceInfo: DeviceSiteInfoRow, eventData: Wate
     wifi_signal_dbm,
     wifi_snr_db,
     network_retry_count,
+    cloud_connect_count,
+    cloud_connected_secs,
+    uptime_secs,
+    free_memory_bytes,
     firmware_version,
   };
 }
@@ -12,7 +12,7 @@ interface ParticleMessageAttributes {
  * waterbot/data event schema
  * (see firmware)
  */
-interface WaterbotDataPayload {
+interface WaterbotDataPayload extends MeterChannelFields {
   t: number;
   at: number;
   seq: number;
@@ -27,10 +27,46 @@ interface WaterbotDataPayload {
   btv?: number;
   btp?: number;
   try?: number;
-  pts?: Array<number>;
+  con?: number;
+  cns?: number;
+  upt?: number;
+  mem?: number;
+  agg?: Array<UsageAggregate>;
+  pts?: Array<number | FlowSegment> | string;
+  ptp?: number;
+  ptv?: number; // pts version: 1 (default) array, 2 packed string
   v?: string;
 }
 
+/**
+ * The other meters' fields, from firmware counting more than one
+ * (METER_CHANNELS): cur1, lst1, use1, agg1 and pts1 for channel 1, and so on.
+ * (Channel 0's are the unsuffixed ones.)
+ */
+type MeterChannelFields = {
+  [key: `${"cur" | "lst" | "use"}${number}`]: number | undefined;
+  [key: `agg${number}`]: Array<UsageAggregate> | undefined;
+  [key: `pts${number}`]: Array<number | FlowSegment> | string | undefined;
+};
+
+/**
+ * Run of pulses at a steady rate, in a waterbot/data pts array:
+ * [delta to first pulse, pulse count, interval, residual...], in pts
+ * units (msec with ptp 3). Pulse i is at (first + i * interval +
+ * residual i), exactly, and whatever follows is delta encoded from the
+ * last pulse.
+ */
+type FlowSegment = [number, number, number, ...number[]];
+
+/**
+ * Pulses whose individual times didn't fit in the device's buffer,
+ * in a waterbot/data agg array: [delta to first pulse, secs from first
+ * to last pulse, pulse count]. Each delta is from the previous aggregate's
+ * last pulse (or the previous publish, for the first), and the pts that
+ * follow are from the last aggregate's last pulse.
+ */
+type UsageAggregate = [number, number, number];
+
 /**
  * device_site_info BigQuery table schema
  */
@@ -38,6 +74,7 @@ interface DeviceSiteInfoRow {
   device_id: string;
   site_id: string;
   liters_per_meter_pulse: number;
+  meter_channel?: number | null; // which of the device's meters (0 if null)
   // FUTURE: time_valid_start, time_valid_end
 }
 
@@ -73,5 +110,9 @@ interface DeviceDataRow {
   wifi_signal_dbm?: number;
   wifi_snr_db?: number;
   network_retry_count?: number;
+  cloud_connect_count?: number;
+  cloud_connected_secs?: number;
+  uptime_secs?: number;
+  free_memory_bytes?: number;
   firmware_version?: string;
 }